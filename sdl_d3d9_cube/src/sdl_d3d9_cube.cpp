@@ -64,13 +64,108 @@ D3DMATRIX* MatrixPerspectiveFovLH(D3DMATRIX* pout, float fovy, float aspect, flo
 #else
 #include <unordered_map>
 #ifdef UseTexture
+#include <algorithm>
+#include <thread>
+#include <vector>
 #include <gli/gli.hpp>
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define UPLOAD_STREAM
+#endif
 
 const std::unordered_map<gli::format, D3DFORMAT> gli_format_map{
 	{ gli::FORMAT_RGBA_DXT1_UNORM_BLOCK8, D3DFMT_DXT1 },
 	{ gli::FORMAT_RGBA_DXT5_UNORM_BLOCK16, D3DFMT_DXT5 },
 	{ gli::FORMAT_RGBA_DXT5_SRGB_BLOCK16, D3DFMT_DXT5 },
 };
+
+// usage is D3DUSAGE_AUTOGENMIPMAP, D3DOK_NOAUTOGEN means the format works but its mips are not generated
+static bool IsTextureUsageSupported(IDirect3DDevice9 *device, DWORD usage, D3DRESOURCETYPE type, D3DFORMAT fmt)
+{
+	IDirect3D9* d3d;
+	D3DDEVICE_CREATION_PARAMETERS params;
+	D3DDISPLAYMODE mode;
+
+	if (FAILED(device->GetDirect3D(&d3d)))
+		return false;
+	device->GetCreationParameters(&params);
+	device->GetDisplayMode(0, &mode);
+	HRESULT hr = d3d->CheckDeviceFormat(params.AdapterOrdinal, params.DeviceType, mode.Format,
+		usage, type, fmt);
+	d3d->Release();
+	return hr == D3D_OK;
+}
+
+// levels stored in the file, at most max_levels unless it is 0
+static UINT GetFileLevelCount(const gli::texture& tex, UINT max_levels)
+{
+	const UINT levels = static_cast<UINT>(tex.levels());
+	return max_levels && max_levels < levels ? max_levels : levels;
+}
+
+// levels from this size are written with streaming stores, the CPU does not read them back
+#define UPLOAD_STREAM_MIN_BYTES (256 * 1024)
+// and are split across threads from this size
+#define UPLOAD_THREAD_MIN_BYTES (8 * 1024 * 1024)
+#define UPLOAD_MAX_THREADS 8
+
+static void CopyRow(char* dest, const char* src, size_t size, bool stream)
+{
+#ifdef UPLOAD_STREAM
+	if (stream)
+	{
+		const size_t head = std::min(size, static_cast<size_t>(-reinterpret_cast<uintptr_t>(dest) & 15));
+
+		memcpy(dest, src, head);
+		for (dest += head, src += head, size -= head; size >= 16; size -= 16, dest += 16, src += 16)
+			_mm_stream_si128(reinterpret_cast<__m128i*>(dest), _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)));
+	}
+#endif
+	memcpy(dest, src, size);
+}
+
+// copies rows to a locked surface with its pitch, big surfaces are copied by several threads
+static void CopyRows(char* dest, INT pitch, const char* src, size_t row_size, int rows)
+{
+	const size_t total = row_size * rows;
+	const bool stream = total >= UPLOAD_STREAM_MIN_BYTES;
+	const auto copy = [=](int first, int last)
+	{
+		for (int y = first; y < last; ++y)
+			CopyRow(dest + y * pitch, src + y * row_size, row_size, stream);
+#ifdef UPLOAD_STREAM
+		if (stream)
+			_mm_sfence();
+#endif
+	};
+
+	const int workers = total < UPLOAD_THREAD_MIN_BYTES ? 1 :
+		std::min({ static_cast<int>(std::thread::hardware_concurrency()), UPLOAD_MAX_THREADS, rows });
+	if (workers <= 1)
+	{
+		copy(0, rows);
+		return;
+	}
+
+	std::vector<std::thread> threads;
+	const int band = (rows + workers - 1) / workers;
+	for (int first = band; first < rows; first += band)
+		threads.emplace_back(copy, first, std::min(first + band, rows));
+	copy(0, band);
+	for (auto& thread : threads)
+		thread.join();
+}
+
+// copies a level of a face by rows of blocks, the locked pitch may be wider than the rows in the file
+static void CopyLevel(const gli::texture& tex, size_t face, size_t level, const D3DLOCKED_RECT& rect)
+{
+	const auto extent = tex.extent(level);
+	const auto block = gli::block_extent(tex.format());
+	const size_t row_size = gli::block_size(tex.format()) * ((extent.x + block.x - 1) / block.x);
+	const int rows = (extent.y + block.y - 1) / block.y;
+
+	CopyRows(static_cast<char*>(rect.pBits), rect.Pitch, static_cast<const char*>(tex.data(0, face, level)), row_size, rows);
+}
 #endif // UseTexture
 
 #include <glm/glm.hpp>
@@ -92,20 +187,30 @@ inline D3DMATRIX Matrix4GlmToD3d(const glm::mat4& mat)
 static float cameraAngle  = (3.0f * M_PI) / 2.0f;
 static float cameraHeight = 2.0f;
 
+// The textures get every level stored in the file, up to max_levels unless it is 0.
+// Files without mips get a generated chain where the device supports it.
 HRESULT CreateTextureFromFile(
 	IDirect3DDevice9 *device,
 	const char *srcfile,
-	IDirect3DTexture9 **texture)
+	IDirect3DTexture9 **texture,
+	UINT max_levels = 0)
 {
 #ifdef _WIN32
-	return D3DXCreateTextureFromFile(device, srcfile, texture);
+	return D3DXCreateTextureFromFileEx(device, srcfile, D3DX_DEFAULT, D3DX_DEFAULT, max_levels ? max_levels : D3DX_DEFAULT,
+		0, D3DFMT_UNKNOWN, D3DPOOL_MANAGED, D3DX_DEFAULT, D3DX_DEFAULT, 0, nullptr, nullptr, texture);
 #elif defined(UseTexture)
 
 	gli::texture tex = gli::load(srcfile);
 	const auto dimensions = tex.extent();
 	HRESULT hr;
 
-	hr = Device->CreateTexture(dimensions.x, dimensions.y, 1, 0, gli_format_map.at(tex.format()), D3DPOOL_MANAGED, texture, nullptr);
+	const D3DFORMAT fmt = gli_format_map.at(tex.format());
+	const UINT levels = GetFileLevelCount(tex, max_levels);
+	// files without mips get their chain from the device where it can, unless a single level was asked for
+	const DWORD usage = levels == 1 && max_levels != 1
+		&& IsTextureUsageSupported(Device, D3DUSAGE_AUTOGENMIPMAP, D3DRTYPE_TEXTURE, fmt) ? D3DUSAGE_AUTOGENMIPMAP : 0;
+
+	hr = Device->CreateTexture(dimensions.x, dimensions.y, usage ? 0 : levels, usage, fmt, D3DPOOL_MANAGED, texture, nullptr);
 	if (FAILED(hr))
 	{
 		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "LockRect failed", nullptr);
@@ -113,15 +218,23 @@ HRESULT CreateTextureFromFile(
 	}
 
 	D3DLOCKED_RECT rect;
-	hr = (*texture)->LockRect( 0, &rect, 0, D3DLOCK_DISCARD );
-	if (FAILED(hr))
+	for (UINT level = 0; level < levels && SUCCEEDED(hr); ++level)
 	{
-		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "LockRect failed", nullptr);
-		return hr;
+		hr = (*texture)->LockRect( level, &rect, 0, D3DLOCK_DISCARD );
+		if (FAILED(hr))
+		{
+			SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "LockRect failed", nullptr);
+			return hr;
+		}
+		CopyLevel(tex, 0, level, rect);
+		hr = (*texture)->UnlockRect(level);
+	}
+
+	if (SUCCEEDED(hr) && usage)
+	{
+		(*texture)->SetAutoGenFilterType(D3DTEXF_LINEAR);
+		(*texture)->GenerateMipSubLevels();
 	}
-	char* dest = static_cast<char*>(rect.pBits);
-	memcpy(dest, tex.data(), tex.size());
-	hr = (*texture)->UnlockRect(0);
 
 	return hr;
 #endif
@@ -130,17 +243,24 @@ HRESULT CreateTextureFromFile(
 HRESULT CreateCubeTextureFromFile(
 	IDirect3DDevice9 *device,
 	const char *srcfile,
-	IDirect3DCubeTexture9 **texture)
+	IDirect3DCubeTexture9 **texture,
+	UINT max_levels = 0)
 {
 #ifdef _WIN32
-	return D3DXCreateCubeTextureFromFile(device, srcfile, texture);
+	return D3DXCreateCubeTextureFromFileEx(device, srcfile, D3DX_DEFAULT, max_levels ? max_levels : D3DX_DEFAULT,
+		0, D3DFMT_UNKNOWN, D3DPOOL_MANAGED, D3DX_DEFAULT, D3DX_DEFAULT, 0, nullptr, nullptr, texture);
 #elif defined(UseTexture)
 
 	gli::texture_cube tex = gli::texture_cube(gli::load(srcfile));
 	const auto dimensions = tex.extent();
 	HRESULT hr;
 
-	hr = Device->CreateCubeTexture(dimensions.x, 1, 0, gli_format_map.at(tex.format()), D3DPOOL_MANAGED, texture, nullptr);
+	const D3DFORMAT fmt = gli_format_map.at(tex.format());
+	const UINT levels = GetFileLevelCount(tex, max_levels);
+	const DWORD usage = levels == 1 && max_levels != 1
+		&& IsTextureUsageSupported(Device, D3DUSAGE_AUTOGENMIPMAP, D3DRTYPE_CUBETEXTURE, fmt) ? D3DUSAGE_AUTOGENMIPMAP : 0;
+
+	hr = Device->CreateCubeTexture(dimensions.x, usage ? 0 : levels, usage, fmt, D3DPOOL_MANAGED, texture, nullptr);
 	if (FAILED(hr))
 	{
 		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "LockRect failed", nullptr);
@@ -148,21 +268,26 @@ HRESULT CreateCubeTextureFromFile(
 	}
 
 	D3DLOCKED_RECT rect;
-	char* dest;
 	auto maxface = tex.max_face();
-	for (int i = 0; i <= maxface; ++i)
+	for (int i = 0; i <= maxface && SUCCEEDED(hr); ++i)
 	{
-		hr = (*texture)->LockRect( (D3DCUBEMAP_FACES)i, 0, &rect, 0, D3DLOCK_DISCARD );
-		if (FAILED(hr))
+		for (UINT level = 0; level < levels && SUCCEEDED(hr); ++level)
 		{
-			SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "LockRect failed", nullptr);
-			return hr;
+			hr = (*texture)->LockRect( (D3DCUBEMAP_FACES)i, level, &rect, 0, D3DLOCK_DISCARD );
+			if (FAILED(hr))
+			{
+				SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "LockRect failed", nullptr);
+				return hr;
+			}
+			CopyLevel(tex, i, level, rect);
+			hr = (*texture)->UnlockRect( (D3DCUBEMAP_FACES)i, level );
 		}
-		dest = static_cast<char*>(rect.pBits);
-		memcpy(dest, tex[i].data(), tex[i].size());
-		hr = (*texture)->UnlockRect( (D3DCUBEMAP_FACES)i, 0 );
-		if (FAILED(hr))
-			break;
+	}
+
+	if (SUCCEEDED(hr) && usage)
+	{
+		(*texture)->SetAutoGenFilterType(D3DTEXF_LINEAR);
+		(*texture)->GenerateMipSubLevels();
 	}
 
 	return hr;
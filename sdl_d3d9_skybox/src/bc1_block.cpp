@@ -0,0 +1,134 @@
+#include "bc1_block.h"
+
+#include <string.h>
+
+static int red(uint32_t c)   { return (c >> 16) & 0xff; }
+static int green(uint32_t c) { return (c >> 8) & 0xff; }
+static int blue(uint32_t c)  { return c & 0xff; }
+
+static uint16_t to_565(int r, int g, int b)
+{
+	return (uint16_t)(((r * 31 + 127) / 255) << 11 | ((g * 63 + 127) / 255) << 5 | ((b * 31 + 127) / 255));
+}
+
+// the colour the decoder gets back from a 565 endpoint
+static void from_565(uint16_t c, int rgb[3])
+{
+	const int r = c >> 11, g = (c >> 5) & 63, b = c & 31;
+
+	rgb[0] = (r << 3) | (r >> 2);
+	rgb[1] = (g << 2) | (g >> 4);
+	rgb[2] = (b << 3) | (b >> 2);
+}
+
+void bc1_encode_block(const uint32_t pixels[16], uint8_t block[BC1_BLOCK_SIZE])
+{
+	int min[3] = { 255, 255, 255 };
+	int max[3] = { 0, 0, 0 };
+	int mean[3] = { 0, 0, 0 };
+
+	for (int i = 0; i < 16; ++i)
+	{
+		const int c[3] = { red(pixels[i]), green(pixels[i]), blue(pixels[i]) };
+		for (int k = 0; k < 3; ++k)
+		{
+			min[k] = c[k] < min[k] ? c[k] : min[k];
+			max[k] = c[k] > max[k] ? c[k] : max[k];
+			mean[k] += c[k];
+		}
+	}
+
+	// take the diagonal of the box the colours run along, red and blue
+	// are flipped when they fall as green rises
+	int cov_rg = 0, cov_bg = 0;
+	for (int i = 0; i < 16; ++i)
+	{
+		const int g = green(pixels[i]) * 16 - mean[1];
+		cov_rg += (red(pixels[i]) * 16 - mean[0]) * g;
+		cov_bg += (blue(pixels[i]) * 16 - mean[2]) * g;
+	}
+	if (cov_rg < 0)
+	{
+		const int t = min[0]; min[0] = max[0]; max[0] = t;
+	}
+	if (cov_bg < 0)
+	{
+		const int t = min[2]; min[2] = max[2]; max[2] = t;
+	}
+
+	// inset the ends by a sixteenth of the range
+	for (int k = 0; k < 3; ++k)
+	{
+		const int inset = (max[k] - min[k]) / 16;
+		min[k] += inset;
+		max[k] -= inset;
+	}
+
+	uint16_t c0 = to_565(max[0], max[1], max[2]);
+	uint16_t c1 = to_565(min[0], min[1], min[2]);
+	uint32_t indices = 0;
+
+	// c0 > c1 selects the four colour palette, equal ends need no indices
+	if (c0 < c1)
+	{
+		const uint16_t t = c0; c0 = c1; c1 = t;
+	}
+	if (c0 != c1)
+	{
+		int palette[4][3];
+		from_565(c0, palette[0]);
+		from_565(c1, palette[1]);
+		for (int k = 0; k < 3; ++k)
+		{
+			palette[2][k] = (2 * palette[0][k] + palette[1][k]) / 3;
+			palette[3][k] = (palette[0][k] + 2 * palette[1][k]) / 3;
+		}
+
+		for (int i = 15; i >= 0; --i)
+		{
+			const int c[3] = { red(pixels[i]), green(pixels[i]), blue(pixels[i]) };
+			int best = 0, best_error = 0x7fffffff;
+			for (int j = 0; j < 4; ++j)
+			{
+				const int dr = c[0] - palette[j][0], dg = c[1] - palette[j][1], db = c[2] - palette[j][2];
+				const int error = dr * dr + dg * dg + db * db;
+				if (error < best_error)
+				{
+					best = j;
+					best_error = error;
+				}
+			}
+			indices = indices << 2 | best;
+		}
+	}
+
+	block[0] = (uint8_t)c0;
+	block[1] = (uint8_t)(c0 >> 8);
+	block[2] = (uint8_t)c1;
+	block[3] = (uint8_t)(c1 >> 8);
+	block[4] = (uint8_t)indices;
+	block[5] = (uint8_t)(indices >> 8);
+	block[6] = (uint8_t)(indices >> 16);
+	block[7] = (uint8_t)(indices >> 24);
+}
+
+void bc1_encode_image(const void* pixels, size_t pitch, unsigned width, unsigned height, void* blocks)
+{
+	const char* src = static_cast<const char*>(pixels);
+	uint8_t* dst = static_cast<uint8_t*>(blocks);
+
+	for (unsigned by = 0; by < height; by += 4)
+	{
+		for (unsigned bx = 0; bx < width; bx += 4, dst += BC1_BLOCK_SIZE)
+		{
+			uint32_t block[16];
+			for (unsigned y = 0; y < 4; ++y)
+			{
+				const char* row = src + (by + y < height ? by + y : height - 1) * pitch;
+				for (unsigned x = 0; x < 4; ++x)
+					memcpy(&block[y * 4 + x], row + (bx + x < width ? bx + x : width - 1) * 4, 4);
+			}
+			bc1_encode_block(block, dst);
+		}
+	}
+}
@@ -0,0 +1,25 @@
+/*
+ * BC1 (DXT1) block encoder for textures compressed at load time
+ *
+ * A fast bounding box encoder: the endpoints are the corners of the colour
+ * box of a block, on the diagonal that follows the block's colours, pulled
+ * in a little to spend the palette on the colours in between. Its quality
+ * is below an offline compressor, the point is to keep the load time low.
+ */
+
+#ifndef __bc1_blockH__
+#define __bc1_blockH__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define BC1_BLOCK_SIZE 8
+
+// pixels are 16 D3DFMT_X8R8G8B8 values of a 4x4 block, row by row
+void bc1_encode_block(const uint32_t pixels[16], uint8_t block[BC1_BLOCK_SIZE]);
+
+// encodes a D3DFMT_X8R8G8B8 image with its pitch into rows of blocks,
+// the edge pixels are repeated to fill the blocks of odd sizes
+void bc1_encode_image(const void* pixels, size_t pitch, unsigned width, unsigned height, void* blocks);
+
+#endif //__bc1_blockH__
@@ -1,21 +1,250 @@
 
 #include "d3d_utility.h"
+#include "texture_staging.h"
 
 #include <SDL2/SDL_syswm.h>
+#include <filesystem>
 
 #ifdef _WIN32
 #include <d3dx9.h>
+#include <fstream>
+#include <iterator>
+#include <vector>
+
+struct d3d::TextureImage
+{
+	std::vector<char> data;     // D3DX parses the file when the texture is created
+	std::vector<char> faces[6]; // or the files of a cube map's faces
+	std::string       cache;
+};
+
+static bool ReadWholeFile(const char* srcfile, std::vector<char>* data)
+{
+	std::ifstream file(srcfile, std::ios::binary);
+	if (!file)
+		return false;
+	data->assign(std::istreambuf_iterator<char>(file), std::istreambuf_iterator<char>());
+	return true;
+}
 #else
+#include <algorithm>
+#include <thread>
 #include <unordered_map>
+#include <vector>
 #include <gli/gli.hpp>
+#ifdef UseJpegSkybox
+#include <setjmp.h>
+#include <stdio.h>
+#include <jpeglib.h>
+#include "bc1_block.h"
+#endif
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define UPLOAD_STREAM
+#endif
 
+// D3D9 has no sRGB formats, sRGB files are read through D3DSAMP_SRGBTEXTURE
 const std::unordered_map<gli::format, D3DFORMAT> gli_format_map{
 	{ gli::FORMAT_RGBA_DXT1_UNORM_BLOCK8, D3DFMT_DXT1 },
+	{ gli::FORMAT_RGBA_DXT1_SRGB_BLOCK8, D3DFMT_DXT1 },
 	{ gli::FORMAT_RGBA_DXT5_UNORM_BLOCK16, D3DFMT_DXT5 },
 	{ gli::FORMAT_RGBA_DXT5_SRGB_BLOCK16, D3DFMT_DXT5 },
+	{ gli::FORMAT_BGR8_UNORM_PACK32, D3DFMT_X8R8G8B8 },
+};
+
+struct d3d::TextureImage
+{
+	gli::texture tex;
+};
+
+// levels stored in the file, at most max_levels unless it is 0
+static UINT GetFileLevelCount(const gli::texture& tex, UINT max_levels)
+{
+	const UINT levels = static_cast<UINT>(tex.levels());
+	return max_levels && max_levels < levels ? max_levels : levels;
+}
+
+// levels from this size are written with streaming stores, the CPU does not read them back
+#define UPLOAD_STREAM_MIN_BYTES (256 * 1024)
+// and are split across threads from this size
+#define UPLOAD_THREAD_MIN_BYTES (8 * 1024 * 1024)
+#define UPLOAD_MAX_THREADS 8
+
+static void CopyRow(char* dest, const char* src, size_t size, bool stream)
+{
+#ifdef UPLOAD_STREAM
+	if (stream)
+	{
+		const size_t head = std::min(size, static_cast<size_t>(-reinterpret_cast<uintptr_t>(dest) & 15));
+
+		memcpy(dest, src, head);
+		for (dest += head, src += head, size -= head; size >= 16; size -= 16, dest += 16, src += 16)
+			_mm_stream_si128(reinterpret_cast<__m128i*>(dest), _mm_loadu_si128(reinterpret_cast<const __m128i*>(src)));
+	}
+#endif
+	memcpy(dest, src, size);
+}
+
+// copies rows to a locked surface with its pitch, big surfaces are copied by several threads
+static void CopyRows(char* dest, INT pitch, const char* src, size_t row_size, int rows)
+{
+	const size_t total = row_size * rows;
+	const bool stream = total >= UPLOAD_STREAM_MIN_BYTES;
+	const auto copy = [=](int first, int last)
+	{
+		for (int y = first; y < last; ++y)
+			CopyRow(dest + y * pitch, src + y * row_size, row_size, stream);
+#ifdef UPLOAD_STREAM
+		if (stream)
+			_mm_sfence();
+#endif
+	};
+
+	const int workers = total < UPLOAD_THREAD_MIN_BYTES ? 1 :
+		std::min({ static_cast<int>(std::thread::hardware_concurrency()), UPLOAD_MAX_THREADS, rows });
+	if (workers <= 1)
+	{
+		copy(0, rows);
+		return;
+	}
+
+	std::vector<std::thread> threads;
+	const int band = (rows + workers - 1) / workers;
+	for (int first = band; first < rows; first += band)
+		threads.emplace_back(copy, first, std::min(first + band, rows));
+	copy(0, band);
+	for (auto& thread : threads)
+		thread.join();
+}
+
+// copies a level by rows of blocks, the locked pitch may be wider than the rows in the file
+static void CopyLevel(const gli::texture& tex, size_t face, size_t level, void* dest, INT row_pitch, INT slice_pitch)
+{
+	const auto extent = tex.extent(level);
+	const auto block = gli::block_extent(tex.format());
+	const size_t row_size = gli::block_size(tex.format()) * ((extent.x + block.x - 1) / block.x);
+	const int rows = (extent.y + block.y - 1) / block.y;
+	const char* src = static_cast<const char*>(tex.data(0, face, level));
+
+	for (int z = 0; z < extent.z; ++z, src += row_size * rows)
+		CopyRows(static_cast<char*>(dest) + z * slice_pitch, row_pitch, src, row_size, rows);
+}
+
+#ifdef UseJpegSkybox
+// libjpeg exits the process on errors unless error_exit jumps back
+struct JpegError
+{
+	jpeg_error_mgr mgr;
+	jmp_buf        jump;
 };
+
+static void JpegErrorExit(j_common_ptr cinfo)
+{
+	longjmp(reinterpret_cast<JpegError*>(cinfo->err)->jump, 1);
+}
+
+// decodes a JPEG file to X8R8G8B8 pixels
+static bool DecodeJpeg(const char* srcfile, std::vector<uint32_t>* pixels, UINT* width, UINT* height)
+{
+	FILE* file = fopen(srcfile, "rb");
+	if (!file)
+		return false;
+
+	jpeg_decompress_struct cinfo;
+	JpegError error;
+	cinfo.err = jpeg_std_error(&error.mgr);
+	error.mgr.error_exit = JpegErrorExit;
+	if (setjmp(error.jump))
+	{
+		jpeg_destroy_decompress(&cinfo);
+		fclose(file);
+		return false;
+	}
+
+	jpeg_create_decompress(&cinfo);
+	jpeg_stdio_src(&cinfo, file);
+	jpeg_read_header(&cinfo, TRUE);
+	cinfo.out_color_space = JCS_RGB;
+	jpeg_start_decompress(&cinfo);
+
+	*width = cinfo.output_width;
+	*height = cinfo.output_height;
+	pixels->resize(size_t(*width) * *height);
+	JSAMPARRAY row = (*cinfo.mem->alloc_sarray)(reinterpret_cast<j_common_ptr>(&cinfo), JPOOL_IMAGE, *width * 3, 1);
+	while (cinfo.output_scanline < cinfo.output_height)
+	{
+		uint32_t* dest = pixels->data() + size_t(cinfo.output_scanline) * *width;
+		jpeg_read_scanlines(&cinfo, row, 1);
+		for (UINT x = 0; x < *width; ++x)
+			dest[x] = 0xff000000 | row[0][x * 3] << 16 | row[0][x * 3 + 1] << 8 | row[0][x * 3 + 2];
+	}
+
+	jpeg_finish_decompress(&cinfo);
+	jpeg_destroy_decompress(&cinfo);
+	fclose(file);
+	return true;
+}
+
+// box filters each level of an X8R8G8B8 face from the one above it
+static void GenerateMips(gli::texture_cube& tex, size_t face)
+{
+	for (size_t level = 1; level < tex.levels(); ++level)
+	{
+		const auto src_extent = tex.extent(level - 1);
+		const auto extent = tex.extent(level);
+		const uint8_t* src = static_cast<const uint8_t*>(tex.data(0, face, level - 1));
+		uint8_t* dest = static_cast<uint8_t*>(tex.data(0, face, level));
+
+		for (int y = 0; y < extent.y; ++y)
+		{
+			const uint8_t* row0 = src + size_t(std::min(y * 2, src_extent.y - 1)) * src_extent.x * 4;
+			const uint8_t* row1 = src + size_t(std::min(y * 2 + 1, src_extent.y - 1)) * src_extent.x * 4;
+			for (int x = 0; x < extent.x; ++x, dest += 4)
+			{
+				const int x0 = std::min(x * 2, src_extent.x - 1) * 4;
+				const int x1 = std::min(x * 2 + 1, src_extent.x - 1) * 4;
+				for (int c = 0; c < 4; ++c)
+					dest[c] = (row0[x0 + c] + row0[x1 + c] + row1[x0 + c] + row1[x1 + c] + 2) / 4;
+			}
+		}
+	}
+}
+#endif // UseJpegSkybox
 #endif
 
+// the cache holds while no face was written after it
+static bool IsCacheFresh(const char* cachefile, const char *const srcfiles[6])
+{
+	std::error_code ec;
+	const auto cached = std::filesystem::last_write_time(cachefile, ec);
+	if (ec)
+		return false;
+	for (int face = 0; face < 6; ++face)
+	{
+		const auto written = std::filesystem::last_write_time(srcfiles[face], ec);
+		if (ec || written > cached)
+			return false;
+	}
+	return true;
+}
+
+// D3DOK_NOAUTOGEN means the format works but its mips are not generated
+bool d3d::IsTextureUsageSupported(IDirect3DDevice9 *device, DWORD usage, D3DRESOURCETYPE type, D3DFORMAT fmt)
+{
+	IDirect3D9* d3d;
+	D3DDEVICE_CREATION_PARAMETERS params;
+	D3DDISPLAYMODE mode;
+
+	if (FAILED(device->GetDirect3D(&d3d)))
+		return false;
+	device->GetCreationParameters(&params);
+	device->GetDisplayMode(0, &mode);
+	HRESULT hr = d3d->CheckDeviceFormat(params.AdapterOrdinal, params.DeviceType, mode.Format,
+		usage, type, fmt);
+	d3d->Release();
+	return hr == D3D_OK;
+}
+
 void* d3d::OSHandle(SDL_Window* Window)
 {
 	if (!Window)
@@ -36,7 +265,8 @@ bool d3d::InitD3D(
 	int width, int height,
 	bool windowed,
 	D3DDEVTYPE deviceType,
-	IDirect3DDevice9** device)
+	IDirect3DDevice9** device,
+	D3DPRESENT_PARAMETERS* presentParams)
 {
 	// Init D3D:
 
@@ -116,23 +346,239 @@ bool d3d::InitD3D(
 
 	d3d9->Release(); // done with d3d9 object
 
+	if( presentParams )
+		*presentParams = d3dpp;
+
 	return true;
 }
 
+HRESULT d3d::LoadTextureImage(
+	const char *srcfile,
+	TextureImage **image)
+{
+#ifdef _WIN32
+	std::vector<char> data;
+	if (!ReadWholeFile(srcfile, &data))
+		return D3DERR_NOTAVAILABLE;
+
+	*image = new TextureImage;
+	(*image)->data.swap(data);
+	return D3D_OK;
+#else
+	gli::texture tex = gli::load(srcfile);
+	if (tex.empty())
+		return D3DERR_NOTAVAILABLE;
+	if (!gli_format_map.count(tex.format()))
+		return D3DERR_WRONGTEXTUREFORMAT;
+
+	*image = new TextureImage{ std::move(tex) };
+	return D3D_OK;
+#endif
+}
+
+void d3d::FreeTextureImage(TextureImage *image)
+{
+	delete image;
+}
+
+void d3d::GetTextureImageInfo(
+	const TextureImage *image,
+	UINT *width,
+	UINT *height,
+	UINT *levels)
+{
+#ifdef _WIN32
+	D3DXIMAGE_INFO info = {};
+	const std::vector<char>& data = image->faces[0].empty() ? image->data : image->faces[0];
+	D3DXGetImageInfoFromFileInMemory(data.data(), data.size(), &info);
+	*width = info.Width;
+	*height = info.Height;
+	*levels = image->faces[0].empty() ? info.MipLevels : 1;
+#else
+	const auto extent = image->tex.extent();
+	*width = extent.x;
+	*height = extent.y;
+	*levels = static_cast<UINT>(image->tex.levels());
+#endif
+}
+
+HRESULT d3d::UploadImageLevel(
+	IDirect3DBaseTexture9 *texture,
+	const TextureImage *image,
+	UINT level)
+{
+#ifdef _WIN32
+	// D3DX filled every level when it created the texture
+	return D3D_OK;
+#else
+	const bool cube = texture->GetType() == D3DRTYPE_CUBETEXTURE;
+	D3DLOCKED_RECT rect;
+	HRESULT hr = D3D_OK;
+
+	for (int face = 0; face < (cube ? 6 : 1) && SUCCEEDED(hr); ++face)
+	{
+		hr = cube ? static_cast<IDirect3DCubeTexture9*>(texture)->LockRect((D3DCUBEMAP_FACES)face, level, &rect, 0, 0)
+			: static_cast<IDirect3DTexture9*>(texture)->LockRect(level, &rect, 0, 0);
+		if (FAILED(hr))
+			break;
+		CopyLevel(image->tex, face, level, rect.pBits, rect.Pitch, 0);
+		hr = cube ? static_cast<IDirect3DCubeTexture9*>(texture)->UnlockRect((D3DCUBEMAP_FACES)face, level)
+			: static_cast<IDirect3DTexture9*>(texture)->UnlockRect(level);
+	}
+	return hr;
+#endif
+}
+
+HRESULT d3d::LoadCubeFacesImage(
+	const char *const srcfiles[6],
+	const char *cachefile,
+	TextureImage **image)
+{
+	if (cachefile && IsCacheFresh(cachefile, srcfiles) && SUCCEEDED(LoadTextureImage(cachefile, image)))
+		return D3D_OK;
+
+#ifdef _WIN32
+	// D3DX decodes the faces when the texture is created, and saves the cache then
+	*image = new TextureImage;
+	for (int face = 0; face < 6; ++face)
+	{
+		if (!ReadWholeFile(srcfiles[face], &(*image)->faces[face]))
+		{
+			delete *image;
+			return D3DERR_NOTAVAILABLE;
+		}
+	}
+	if (cachefile)
+		(*image)->cache = cachefile;
+	return D3D_OK;
+#elif !defined(UseJpegSkybox)
+	// built without libjpeg, see USE_JPEG_SKYBOX
+	return D3DERR_NOTAVAILABLE;
+#else
+	std::vector<uint32_t> pixels[6];
+	UINT width[6], height[6];
+	bool decoded[6];
+	std::vector<std::thread> threads;
+
+	for (int face = 0; face < 6; ++face)
+		threads.emplace_back([&, face] { decoded[face] = DecodeJpeg(srcfiles[face], &pixels[face], &width[face], &height[face]); });
+	for (auto& thread : threads)
+		thread.join();
+	threads.clear();
+
+	// cube faces are square and all the same size
+	for (int face = 0; face < 6; ++face)
+	{
+		if (!decoded[face])
+			return D3DERR_NOTAVAILABLE;
+		if (width[face] != height[face] || width[face] != width[0])
+			return D3DERR_INVALIDCALL;
+	}
+
+	const UINT size = width[0];
+	UINT levels = 1;
+	while (size >> levels)
+		++levels;
+	gli::texture_cube faces(gli::FORMAT_BGR8_UNORM_PACK32, gli::texture_cube::extent_type(size, size), levels);
+	gli::texture_cube compressed;
+	if (cachefile)
+		compressed = gli::texture_cube(gli::FORMAT_RGBA_DXT1_UNORM_BLOCK8, gli::texture_cube::extent_type(size, size), levels);
+
+	for (int face = 0; face < 6; ++face)
+	{
+		threads.emplace_back([&, face]
+		{
+			memcpy(faces.data(0, face, 0), pixels[face].data(), pixels[face].size() * sizeof(uint32_t));
+			std::vector<uint32_t>().swap(pixels[face]);
+			GenerateMips(faces, face);
+			if (!cachefile)
+				return;
+			for (size_t level = 0; level < levels; ++level)
+			{
+				const auto extent = faces.extent(level);
+				bc1_encode_image(faces.data(0, face, level), extent.x * 4, extent.x, extent.y, compressed.data(0, face, level));
+			}
+		});
+	}
+	for (auto& thread : threads)
+		thread.join();
+
+	if (cachefile)
+	{
+		// written aside and renamed so a cache is never read half written
+		const std::string temp = std::string(cachefile) + ".tmp";
+		std::error_code ec;
+		if (gli::save_dds(compressed, temp.c_str()))
+			std::filesystem::rename(temp, cachefile, ec);
+		*image = new TextureImage{ std::move(compressed) };
+	}
+	else
+		*image = new TextureImage{ std::move(faces) };
+	return D3D_OK;
+#endif
+}
+
 HRESULT d3d::CreateTextureFromFile(
 	IDirect3DDevice9 *device,
 	const char *srcfile,
-	IDirect3DTexture9 **texture)
+	IDirect3DTexture9 **texture,
+	UINT max_levels,
+	bool *srgb)
 {
 #ifdef _WIN32
-	return D3DXCreateTextureFromFile(device, srcfile, texture);
+	// D3DX reads no sRGB formats
+	if (srgb)
+		*srgb = false;
+	return D3DXCreateTextureFromFileEx(device, srcfile, D3DX_DEFAULT, D3DX_DEFAULT, max_levels ? max_levels : D3DX_DEFAULT,
+		0, D3DFMT_UNKNOWN, D3DPOOL_MANAGED, D3DX_DEFAULT, D3DX_DEFAULT, 0, nullptr, nullptr, texture);
 #else
+	TextureImage* image;
+	HRESULT hr = LoadTextureImage(srcfile, &image);
+	if (FAILED(hr))
+		return hr;
+	hr = CreateTextureFromImage(device, image, texture, max_levels, 0, nullptr, srgb);
+	FreeTextureImage(image);
+	return hr;
+#endif
+}
 
-	gli::texture tex = gli::load(srcfile);
+HRESULT d3d::CreateTextureFromImage(
+	IDirect3DDevice9 *device,
+	const TextureImage *image,
+	IDirect3DTexture9 **texture,
+	UINT max_levels,
+	UINT lod,
+	TextureStaging *staging,
+	bool *srgb)
+{
+	// SetLOD only clamps managed textures, the default pool needs every level filled
+	if (lod && staging)
+		return D3DERR_INVALIDCALL;
+#ifdef _WIN32
+	if (srgb)
+		*srgb = false;
+	// D3DX fills every level, SetLOD keeps the ones above lod of the managed texture out of video memory.
+	// It fills default pool textures through a system memory texture of its own.
+	HRESULT hr = D3DXCreateTextureFromFileInMemoryEx(device, image->data.data(), image->data.size(), D3DX_DEFAULT,
+		D3DX_DEFAULT, max_levels ? max_levels : D3DX_DEFAULT, 0, D3DFMT_UNKNOWN,
+		staging ? D3DPOOL_DEFAULT : D3DPOOL_MANAGED, D3DX_DEFAULT, D3DX_DEFAULT, 0, nullptr, nullptr, texture);
+	if (SUCCEEDED(hr) && lod)
+		(*texture)->SetLOD(lod);
+	return hr;
+#else
+
+	const gli::texture& tex = image->tex;
 	const auto dimensions = tex.extent();
 	HRESULT hr;
 
-	hr = device->CreateTexture(dimensions.x, dimensions.y, 1, 0, gli_format_map.at(tex.format()), D3DPOOL_MANAGED, texture, nullptr);
+	const D3DFORMAT fmt = gli_format_map.at(tex.format());
+	const UINT levels = GetFileLevelCount(tex, max_levels);
+	// files without mips get their chain from the device where it can, unless a single level was asked for
+	const DWORD usage = levels == 1 && max_levels != 1
+		&& IsTextureUsageSupported(device, D3DUSAGE_AUTOGENMIPMAP, D3DRTYPE_TEXTURE, fmt) ? D3DUSAGE_AUTOGENMIPMAP : 0;
+
+	hr = staging ? staging->CreateTexture(dimensions.x, dimensions.y, levels, fmt, texture)
+		: device->CreateTexture(dimensions.x, dimensions.y, usage ? 0 : levels, usage, fmt, D3DPOOL_MANAGED, texture, nullptr);
 	if (FAILED(hr))
 	{
 		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "LockRect failed", nullptr);
@@ -140,15 +586,39 @@ HRESULT d3d::CreateTextureFromFile(
 	}
 
 	D3DLOCKED_RECT rect;
-	hr = (*texture)->LockRect( 0, &rect, 0, D3DLOCK_DISCARD );
-	if (FAILED(hr))
+	for (UINT level = lod; level < levels && SUCCEEDED(hr); ++level)
 	{
-		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "LockRect failed", nullptr);
-		return hr;
+		hr = (*texture)->LockRect( level, &rect, 0, D3DLOCK_DISCARD );
+		if (FAILED(hr))
+		{
+			SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "LockRect failed", nullptr);
+			return hr;
+		}
+		CopyLevel(tex, 0, level, rect.pBits, rect.Pitch, 0);
+		hr = (*texture)->UnlockRect(level);
 	}
-	char* dest = static_cast<char*>(rect.pBits);
-	memcpy(dest, tex.data(), tex.size());
-	hr = (*texture)->UnlockRect(0);
+
+	if (SUCCEEDED(hr) && usage && !staging)
+	{
+		(*texture)->SetAutoGenFilterType(D3DTEXF_LINEAR);
+		(*texture)->GenerateMipSubLevels();
+	}
+	if (staging)
+	{
+		// the levels went to a staging texture, it is copied to the default pool
+		IDirect3DBaseTexture9* filled = *texture;
+		IDirect3DBaseTexture9* uploaded = nullptr;
+		if (SUCCEEDED(hr))
+			hr = staging->Upload(filled, usage, &uploaded);
+		else
+			filled->Release();
+		*texture = static_cast<IDirect3DTexture9*>(uploaded);
+	}
+	if (SUCCEEDED(hr) && lod)
+		(*texture)->SetLOD(lod);
+
+	if (srgb)
+		*srgb = gli::is_srgb(tex.format()) && IsTextureUsageSupported(device, D3DUSAGE_QUERY_SRGBREAD, D3DRTYPE_TEXTURE, fmt);
 
 	return hr;
 #endif
@@ -157,17 +627,106 @@ HRESULT d3d::CreateTextureFromFile(
 HRESULT d3d::CreateCubeTextureFromFile(
 	IDirect3DDevice9 *device,
 	const char *srcfile,
-	IDirect3DCubeTexture9 **texture)
+	IDirect3DCubeTexture9 **texture,
+	UINT max_levels,
+	bool *srgb)
 {
 #ifdef _WIN32
-	return D3DXCreateCubeTextureFromFile(device, srcfile, texture);
+	if (srgb)
+		*srgb = false;
+	return D3DXCreateCubeTextureFromFileEx(device, srcfile, D3DX_DEFAULT, max_levels ? max_levels : D3DX_DEFAULT,
+		0, D3DFMT_UNKNOWN, D3DPOOL_MANAGED, D3DX_DEFAULT, D3DX_DEFAULT, 0, nullptr, nullptr, texture);
 #else
+	TextureImage* image;
+	HRESULT hr = LoadTextureImage(srcfile, &image);
+	if (FAILED(hr))
+		return hr;
+	hr = CreateCubeTextureFromImage(device, image, texture, max_levels, 0, nullptr, srgb);
+	FreeTextureImage(image);
+	return hr;
+#endif
+}
+
+HRESULT d3d::CreateCubeTextureFromImage(
+	IDirect3DDevice9 *device,
+	const TextureImage *image,
+	IDirect3DCubeTexture9 **texture,
+	UINT max_levels,
+	UINT lod,
+	TextureStaging *staging,
+	bool *srgb)
+{
+	// SetLOD only clamps managed textures, the default pool needs every level filled
+	if (lod && staging)
+		return D3DERR_INVALIDCALL;
+#ifdef _WIN32
+	if (srgb)
+		*srgb = false;
+	if (image->faces[0].empty())
+	{
+		HRESULT hr = D3DXCreateCubeTextureFromFileInMemoryEx(device, image->data.data(), image->data.size(), D3DX_DEFAULT,
+			max_levels ? max_levels : D3DX_DEFAULT, 0, D3DFMT_UNKNOWN, staging ? D3DPOOL_DEFAULT : D3DPOOL_MANAGED,
+			D3DX_DEFAULT, D3DX_DEFAULT, 0, nullptr, nullptr, texture);
+		if (SUCCEEDED(hr) && lod)
+			(*texture)->SetLOD(lod);
+		return hr;
+	}
 
-	gli::texture_cube tex = gli::texture_cube(gli::load(srcfile));
+	// a cube map of separate faces, D3DX compresses them when they load into DXT1 surfaces
+	D3DXIMAGE_INFO info;
+	HRESULT hr = D3DXGetImageInfoFromFileInMemory(image->faces[0].data(), image->faces[0].size(), &info);
+	if (FAILED(hr))
+		return hr;
+	const D3DFORMAT fmt = image->cache.empty() ? D3DFMT_X8R8G8B8 : D3DFMT_DXT1;
+	UINT levels = 1;
+	while (info.Width >> levels && levels != max_levels)
+		++levels;
+	hr = staging ? staging->CreateCubeTexture(info.Width, levels, fmt, texture)
+		: D3DXCreateCubeTexture(device, info.Width, levels, 0, fmt, D3DPOOL_MANAGED, texture);
+	if (FAILED(hr))
+		return hr;
+
+	for (int face = 0; face < 6 && SUCCEEDED(hr); ++face)
+	{
+		IDirect3DSurface9* surface;
+		hr = (*texture)->GetCubeMapSurface((D3DCUBEMAP_FACES)face, 0, &surface);
+		if (FAILED(hr))
+			break;
+		hr = D3DXLoadSurfaceFromFileInMemory(surface, nullptr, nullptr, image->faces[face].data(), image->faces[face].size(),
+			nullptr, D3DX_DEFAULT, 0, nullptr);
+		surface->Release();
+	}
+	if (SUCCEEDED(hr))
+		hr = D3DXFilterTexture(*texture, nullptr, 0, D3DX_DEFAULT);
+	if (SUCCEEDED(hr) && !image->cache.empty())
+		D3DXSaveTextureToFileA(image->cache.c_str(), D3DXIFF_DDS, *texture, nullptr);
+	if (SUCCEEDED(hr) && staging)
+	{
+		IDirect3DBaseTexture9* uploaded;
+		hr = staging->Upload(*texture, 0, &uploaded);
+		*texture = static_cast<IDirect3DCubeTexture9*>(uploaded);
+	}
+	if (SUCCEEDED(hr) && lod)
+		(*texture)->SetLOD(lod);
+	if (FAILED(hr) && *texture)
+	{
+		(*texture)->Release();
+		*texture = nullptr;
+	}
+	return hr;
+#else
+
+	gli::texture_cube tex = gli::texture_cube(image->tex);
 	const auto dimensions = tex.extent();
 	HRESULT hr;
 
-	hr = device->CreateCubeTexture(dimensions.x, 1, 0, gli_format_map.at(tex.format()), D3DPOOL_MANAGED, texture, nullptr);
+	const D3DFORMAT fmt = gli_format_map.at(tex.format());
+	const UINT levels = GetFileLevelCount(tex, max_levels);
+	const DWORD usage = levels == 1 && max_levels != 1
+		&& IsTextureUsageSupported(device, D3DUSAGE_AUTOGENMIPMAP, D3DRTYPE_CUBETEXTURE, fmt) ? D3DUSAGE_AUTOGENMIPMAP : 0;
+
+	hr = staging ? staging->CreateCubeTexture(dimensions.x, levels, fmt, texture)
+		: device->CreateCubeTexture(dimensions.x, usage ? 0 : levels, usage, fmt, D3DPOOL_MANAGED, texture, nullptr);
 	if (FAILED(hr))
 	{
 		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "LockRect failed", nullptr);
@@ -175,23 +734,117 @@ HRESULT d3d::CreateCubeTextureFromFile(
 	}
 
 	D3DLOCKED_RECT rect;
-	char* dest;
 	auto maxface = tex.max_face();
-	for (int i = 0; i <= maxface; ++i)
+	for (int i = 0; i <= maxface && SUCCEEDED(hr); ++i)
 	{
-		hr = (*texture)->LockRect( (D3DCUBEMAP_FACES)i, 0, &rect, 0, D3DLOCK_DISCARD );
+		for (UINT level = lod; level < levels && SUCCEEDED(hr); ++level)
+		{
+			hr = (*texture)->LockRect( (D3DCUBEMAP_FACES)i, level, &rect, 0, D3DLOCK_DISCARD );
+			if (FAILED(hr))
+			{
+				SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "LockRect failed", nullptr);
+				return hr;
+			}
+			CopyLevel(tex, i, level, rect.pBits, rect.Pitch, 0);
+			hr = (*texture)->UnlockRect( (D3DCUBEMAP_FACES)i, level );
+		}
+	}
+
+	if (SUCCEEDED(hr) && usage && !staging)
+	{
+		(*texture)->SetAutoGenFilterType(D3DTEXF_LINEAR);
+		(*texture)->GenerateMipSubLevels();
+	}
+	if (staging)
+	{
+		IDirect3DBaseTexture9* filled = *texture;
+		IDirect3DBaseTexture9* uploaded = nullptr;
+		if (SUCCEEDED(hr))
+			hr = staging->Upload(filled, usage, &uploaded);
+		else
+			filled->Release();
+		*texture = static_cast<IDirect3DCubeTexture9*>(uploaded);
+	}
+	if (SUCCEEDED(hr) && lod)
+		(*texture)->SetLOD(lod);
+
+	if (srgb)
+		*srgb = gli::is_srgb(tex.format()) && IsTextureUsageSupported(device, D3DUSAGE_QUERY_SRGBREAD, D3DRTYPE_CUBETEXTURE, fmt);
+
+	return hr;
+#endif
+}
+
+HRESULT d3d::CreateVolumeTextureFromFile(
+	IDirect3DDevice9 *device,
+	const char *srcfile,
+	IDirect3DVolumeTexture9 **texture,
+	UINT max_levels,
+	bool *srgb)
+{
+#ifdef _WIN32
+	if (srgb)
+		*srgb = false;
+	return D3DXCreateVolumeTextureFromFileEx(device, srcfile, D3DX_DEFAULT, D3DX_DEFAULT, D3DX_DEFAULT,
+		max_levels ? max_levels : D3DX_DEFAULT, 0, D3DFMT_UNKNOWN, D3DPOOL_MANAGED, D3DX_DEFAULT, D3DX_DEFAULT, 0,
+		nullptr, nullptr, texture);
+#else
+	TextureImage* image;
+	HRESULT hr = LoadTextureImage(srcfile, &image);
+	if (FAILED(hr))
+		return hr;
+	hr = CreateVolumeTextureFromImage(device, image, texture, max_levels, srgb);
+	FreeTextureImage(image);
+	return hr;
+#endif
+}
+
+HRESULT d3d::CreateVolumeTextureFromImage(
+	IDirect3DDevice9 *device,
+	const TextureImage *image,
+	IDirect3DVolumeTexture9 **texture,
+	UINT max_levels,
+	bool *srgb)
+{
+#ifdef _WIN32
+	if (srgb)
+		*srgb = false;
+	return D3DXCreateVolumeTextureFromFileInMemoryEx(device, image->data.data(), image->data.size(), D3DX_DEFAULT,
+		D3DX_DEFAULT, D3DX_DEFAULT, max_levels ? max_levels : D3DX_DEFAULT, 0, D3DFMT_UNKNOWN, D3DPOOL_MANAGED,
+		D3DX_DEFAULT, D3DX_DEFAULT, 0, nullptr, nullptr, texture);
+#else
+
+	const gli::texture& tex = image->tex;
+	const auto dimensions = tex.extent();
+	HRESULT hr;
+
+	// D3D9 can't generate the mips of volume textures, they have the levels of the file
+	const D3DFORMAT fmt = gli_format_map.at(tex.format());
+	const UINT levels = GetFileLevelCount(tex, max_levels);
+
+	hr = device->CreateVolumeTexture(dimensions.x, dimensions.y, dimensions.z, levels, 0, fmt, D3DPOOL_MANAGED, texture, nullptr);
+	if (FAILED(hr))
+	{
+		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "CreateVolumeTexture failed", nullptr);
+		return hr;
+	}
+
+	D3DLOCKED_BOX box;
+	for (UINT level = 0; level < levels && SUCCEEDED(hr); ++level)
+	{
+		hr = (*texture)->LockBox( level, &box, 0, 0 );
 		if (FAILED(hr))
 		{
-			SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "LockRect failed", nullptr);
+			SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "LockBox failed", nullptr);
 			return hr;
 		}
-		dest = static_cast<char*>(rect.pBits);
-		memcpy(dest, tex[i].data(), tex[i].size());
-		hr = (*texture)->UnlockRect( (D3DCUBEMAP_FACES)i, 0 );
-		if (FAILED(hr))
-			break;
+		CopyLevel(tex, 0, level, box.pBits, box.RowPitch, box.SlicePitch);
+		hr = (*texture)->UnlockBox(level);
 	}
 
+	if (srgb)
+		*srgb = gli::is_srgb(tex.format()) && IsTextureUsageSupported(device, D3DUSAGE_QUERY_SRGBREAD, D3DRTYPE_VOLUMETEXTURE, fmt);
+
 	return hr;
 #endif
 }
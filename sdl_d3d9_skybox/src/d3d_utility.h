@@ -6,6 +6,8 @@
 #include <SDL2/SDL.h>
 #include <string>
 
+class TextureStaging;
+
 namespace d3d
 {
 	void* OSHandle(SDL_Window* Window);
@@ -14,17 +16,102 @@ namespace d3d
 		int width, int height,     // [in] Backbuffer dimensions.
 		bool windowed,             // [in] Windowed (true)or full screen (false).
 		D3DDEVTYPE deviceType,     // [in] HAL or REF
-		IDirect3DDevice9** device);// [out]The created device.
+		IDirect3DDevice9** device, // [out]The created device.
+		D3DPRESENT_PARAMETERS* presentParams = 0); // [out]What to Reset the device with, can be null.
+
+	// Whether fmt takes usage, D3DUSAGE_AUTOGENMIPMAP or one of the D3DUSAGE_QUERY flags,
+	// for a resource of the given type on the adapter and display mode of the device.
+	bool IsTextureUsageSupported(
+		IDirect3DDevice9 *device,
+		DWORD usage,
+		D3DRESOURCETYPE type,
+		D3DFORMAT fmt);
 
+	// The textures get every level stored in the file, up to max_levels unless it is 0.
+	// Files without mips get a generated chain where the device supports it.
+	// srgb tells whether the texture is sampled with D3DSAMP_SRGBTEXTURE, the
+	// sampler state is set by whoever binds it.
 	HRESULT CreateTextureFromFile(
 		IDirect3DDevice9 *device,
 		const char *srcfile,
-		IDirect3DTexture9 **texture);
+		IDirect3DTexture9 **texture,
+		UINT max_levels = 0,
+		bool *srgb = nullptr);
 
 	HRESULT CreateCubeTextureFromFile(
 		IDirect3DDevice9 *device,
 		const char *srcfile,
-		IDirect3DCubeTexture9 **texture);
+		IDirect3DCubeTexture9 **texture,
+		UINT max_levels = 0,
+		bool *srgb = nullptr);
+
+	HRESULT CreateVolumeTextureFromFile(
+		IDirect3DDevice9 *device,
+		const char *srcfile,
+		IDirect3DVolumeTexture9 **texture,
+		UINT max_levels = 0,
+		bool *srgb = nullptr);
+
+	// A texture file read and parsed without the device, so it can be loaded on any thread.
+	// The Create*FromImage functions create its texture on the device thread.
+	struct TextureImage;
+
+	HRESULT LoadTextureImage(
+		const char *srcfile,
+		TextureImage **image);
+
+	void FreeTextureImage(TextureImage *image);
+
+	// Decodes the six JPEG faces of a cube map, each on a thread of its own. The faces
+	// are in D3DCUBEMAP_FACES order, the order SkyBox::Render draws: right, left, up,
+	// down, front and back. With a cachefile the faces are BC1 compressed and saved
+	// there as a DDS cube map, which is read instead while it is newer than the faces.
+	// Off Windows the faces are only decoded when built with USE_JPEG_SKYBOX.
+	HRESULT LoadCubeFacesImage(
+		const char *const srcfiles[6],
+		const char *cachefile,
+		TextureImage **image);
+
+	// the size of the largest level and the levels stored in the image
+	void GetTextureImageInfo(
+		const TextureImage *image,
+		UINT *width,
+		UINT *height,
+		UINT *levels);
+
+	// Levels above lod are left for UploadImageLevel, the texture is clamped
+	// to lod with SetLOD until they are in. With staging the texture goes to
+	// the default pool, filled through it, and lod has to be 0.
+	HRESULT CreateTextureFromImage(
+		IDirect3DDevice9 *device,
+		const TextureImage *image,
+		IDirect3DTexture9 **texture,
+		UINT max_levels = 0,
+		UINT lod = 0,
+		TextureStaging *staging = nullptr,
+		bool *srgb = nullptr);
+
+	HRESULT CreateCubeTextureFromImage(
+		IDirect3DDevice9 *device,
+		const TextureImage *image,
+		IDirect3DCubeTexture9 **texture,
+		UINT max_levels = 0,
+		UINT lod = 0,
+		TextureStaging *staging = nullptr,
+		bool *srgb = nullptr);
+
+	// fills a level of every face of a 2D or cube texture created from the image
+	HRESULT UploadImageLevel(
+		IDirect3DBaseTexture9 *texture,
+		const TextureImage *image,
+		UINT level);
+
+	HRESULT CreateVolumeTextureFromImage(
+		IDirect3DDevice9 *device,
+		const TextureImage *image,
+		IDirect3DVolumeTexture9 **texture,
+		UINT max_levels = 0,
+		bool *srgb = nullptr);
 
 	template<class T> void Release(T t)
 	{
@@ -0,0 +1,168 @@
+#include "lz4_block.h"
+
+#include <stdint.h>
+#include <string.h>
+
+#define LZ4_MIN_MATCH     4
+#define LZ4_LAST_LITERALS 5  // a block ends with at least this many literals
+#define LZ4_MF_LIMIT      12 // and its last match starts at least this far from the end
+#define LZ4_MAX_OFFSET    65535
+#define LZ4_HASH_BITS     12
+
+static uint32_t read32(const uint8_t* p)
+{
+	uint32_t v;
+	memcpy(&v, p, sizeof(v));
+	return v;
+}
+
+static uint32_t hash4(uint32_t v)
+{
+	return (v * 2654435761u) >> (32 - LZ4_HASH_BITS);
+}
+
+// the bytes of a length beyond the 15 of its token
+static uint8_t* write_length(uint8_t* op, size_t length)
+{
+	for (; length >= 255; length -= 255)
+		*op++ = 255;
+	*op++ = (uint8_t)length;
+	return op;
+}
+
+static bool read_length(const uint8_t** ip, const uint8_t* iend, size_t* length)
+{
+	uint8_t b;
+
+	do
+	{
+		if (*ip >= iend)
+			return false;
+		b = *(*ip)++;
+		*length += b;
+	} while (b == 255);
+	return true;
+}
+
+static uint8_t* write_sequence(uint8_t* op, uint8_t* oend, const uint8_t* literals, size_t literal_length,
+	size_t offset, size_t match_length)
+{
+	const size_t match_extra = match_length ? match_length - LZ4_MIN_MATCH : 0;
+
+	// token, literals with their length bytes, offset and match length bytes
+	if ((size_t)(oend - op) < 1 + literal_length + literal_length / 255 + 1 + 2 + match_extra / 255 + 1)
+		return nullptr;
+
+	uint8_t* token = op++;
+	*token = (uint8_t)((literal_length < 15 ? literal_length : 15) << 4);
+	if (literal_length >= 15)
+		op = write_length(op, literal_length - 15);
+	if (literal_length)
+		memcpy(op, literals, literal_length);
+	op += literal_length;
+
+	if (!match_length)
+		return op;
+	*op++ = (uint8_t)offset;
+	*op++ = (uint8_t)(offset >> 8);
+	*token |= (uint8_t)(match_extra < 15 ? match_extra : 15);
+	if (match_extra >= 15)
+		op = write_length(op, match_extra - 15);
+	return op;
+}
+
+size_t lz4_compress_block(const void* src, size_t size, void* dst, size_t capacity)
+{
+	const uint8_t* base = static_cast<const uint8_t*>(src);
+	const uint8_t* ip = base;
+	const uint8_t* anchor = base;
+	const uint8_t* iend = base + size;
+	uint8_t* op = static_cast<uint8_t*>(dst);
+	uint8_t* oend = op + capacity;
+	uint32_t table[1 << LZ4_HASH_BITS]; // positions + 1, 0 is empty
+
+	memset(table, 0, sizeof(table));
+	if (size > LZ4_MF_LIMIT)
+	{
+		const uint8_t* mflimit = iend - LZ4_MF_LIMIT;
+		const uint8_t* matchlimit = iend - LZ4_LAST_LITERALS;
+
+		while (ip <= mflimit)
+		{
+			const uint32_t seq = read32(ip);
+			const uint32_t h = hash4(seq);
+			const uint32_t prev = table[h];
+			table[h] = (uint32_t)(ip - base) + 1;
+
+			const uint8_t* ref = base + prev - 1;
+			if (!prev || ip - ref > LZ4_MAX_OFFSET || read32(ref) != seq)
+			{
+				++ip;
+				continue;
+			}
+
+			const uint8_t* end = ip + LZ4_MIN_MATCH;
+			for (const uint8_t* r = ref + LZ4_MIN_MATCH; end < matchlimit && *end == *r; ++end, ++r)
+				;
+			op = write_sequence(op, oend, anchor, ip - anchor, ip - ref, end - ip);
+			if (!op)
+				return 0;
+			ip = anchor = end;
+		}
+	}
+
+	op = write_sequence(op, oend, anchor, iend - anchor, 0, 0);
+	return op ? op - static_cast<uint8_t*>(dst) : 0;
+}
+
+bool lz4_decompress_block(const void* src, size_t size, void* dst, size_t raw_size)
+{
+	const uint8_t* ip = static_cast<const uint8_t*>(src);
+	const uint8_t* iend = ip + size;
+	uint8_t* const ostart = static_cast<uint8_t*>(dst);
+	uint8_t* op = ostart;
+	uint8_t* oend = op + raw_size;
+
+	while (ip < iend)
+	{
+		const uint8_t token = *ip++;
+
+		size_t literal_length = token >> 4;
+		if (literal_length == 15 && !read_length(&ip, iend, &literal_length))
+			return false;
+		if (literal_length > (size_t)(iend - ip) || literal_length > (size_t)(oend - op))
+			return false;
+		if (literal_length)
+			memcpy(op, ip, literal_length);
+		op += literal_length;
+		ip += literal_length;
+
+		// the last sequence has no match
+		if (ip == iend)
+			break;
+
+		if (iend - ip < 2)
+			return false;
+		const size_t offset = ip[0] | (ip[1] << 8);
+		ip += 2;
+		if (!offset || offset > (size_t)(op - ostart))
+			return false;
+
+		size_t match_length = token & 15;
+		if (match_length == 15 && !read_length(&ip, iend, &match_length))
+			return false;
+		match_length += LZ4_MIN_MATCH;
+		if (match_length > (size_t)(oend - op))
+			return false;
+
+		// the match may overlap the bytes it produces
+		const uint8_t* match = op - offset;
+		if (offset >= match_length)
+			memcpy(op, match, match_length);
+		else
+			for (size_t i = 0; i < match_length; ++i)
+				op[i] = match[i];
+		op += match_length;
+	}
+	return op == oend;
+}
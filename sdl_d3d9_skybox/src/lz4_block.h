@@ -0,0 +1,23 @@
+/*
+ * LZ4 block format codec for the chunks of compressed texture packs
+ *
+ * The blocks follow the LZ4 block format, without the frame, so any LZ4
+ * implementation can read them. The compressor is a plain greedy one, the
+ * packs are built once and the decompressor is what the samples run.
+ */
+
+#ifndef __lz4_blockH__
+#define __lz4_blockH__
+
+#include <stddef.h>
+
+// worst case size of a compressed block
+#define LZ4_COMPRESS_BOUND(size) ((size) + (size) / 255 + 16)
+
+// returns the compressed size, 0 if it doesn't fit in capacity
+size_t lz4_compress_block(const void* src, size_t size, void* dst, size_t capacity);
+
+// fails unless the block decompresses to exactly raw_size bytes
+bool lz4_decompress_block(const void* src, size_t size, void* dst, size_t raw_size);
+
+#endif //__lz4_blockH__
@@ -2,6 +2,7 @@
 #include "d3d_utility.h"
 #include "cube.h"
 #include "skybox.h"
+#include "texture_manager.h"
 #include "vertex.h"
 
 #include <string.h>
@@ -10,12 +11,16 @@
 // Globals
 
 IDirect3DDevice9* Device = 0;
+D3DPRESENT_PARAMETERS PresentParams;
+bool DeviceLost = false;
 const int Width = 640;
 const int Height = 480;
 
-Cube*              Box = 0;
-SkyBox*            Sky = 0;
-IDirect3DTexture9* Tex = 0;
+Cube*           Box      = 0;
+SkyBox*         Sky      = 0;
+TexturePack*    Pack     = 0;
+TextureManager* Textures = 0;
+TextureHandle   Tex;
 
 // Additional math functions
 
@@ -81,12 +86,23 @@ bool CreateSkyBox()
 {
 	if (Device)
 	{
-		Sky = new SkyBox(Device);
+		Sky = new SkyBox(Device, Textures);
 		if (!Sky->InitSkyBox(300))
 		{
 			SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "SkyBox init failed", nullptr);
 		}
-#ifdef UseCubeTexture
+#if defined(UseCubeTexture) && defined(UseJpegSkybox)
+		// decoded the first time, the cache is read on the next start
+		static const char* const faces[6] = {
+			"textures/skybox/right.jpg",
+			"textures/skybox/left.jpg",
+			"textures/skybox/top.jpg",
+			"textures/skybox/bottom.jpg",
+			"textures/skybox/front.jpg",
+			"textures/skybox/back.jpg",
+		};
+		Sky->SetCubeFaces(faces, "textures/skybox/skybox.dds");
+#elif defined(UseCubeTexture)
 		Sky->SetTexture("textures/earth-cubemap.dds", 0);
 #else
 		Sky->SetTexture("textures/skybox-dds/right.dds",  0);
@@ -105,13 +121,9 @@ bool CreateSkyBox()
 	}
 }
 
-bool Setup()
+// the states Reset sets back to their defaults
+void SetStates()
 {
-	// Create the cube and skybox.
-
-	Box = new Cube(Device);
-	CreateSkyBox();
-
 	// Set a directional light.
 
 	D3DLIGHT9 light;
@@ -127,13 +139,6 @@ bool Setup()
 	Device->SetRenderState(D3DRS_NORMALIZENORMALS, true);
 	Device->SetRenderState(D3DRS_SPECULARENABLE, true);
 
-	// Create texture.
-
-	d3d::CreateTextureFromFile(
-		Device,
-		"textures/cursor.dds",
-		&Tex);
-
 	// Set Texture Filter States.
 
 	Device->SetSamplerState(0, D3DSAMP_MAGFILTER, D3DTEXF_LINEAR);
@@ -150,6 +155,31 @@ bool Setup()
 		1.0f,                         // near plane
 		1000.0f);                     // far plane
 	Device->SetTransform(D3DTS_PROJECTION, &proj);
+}
+
+bool Setup()
+{
+	// Create the cube and skybox.
+
+	Textures = new TextureManager(Device);
+	// textures in the pack are mapped instead of read and parsed
+	Pack = new TexturePack;
+	if (Pack->Open("textures.pak", "textures"))
+		Textures->SetPack(Pack);
+	// the skybox starts with its small levels and streams the others in
+	Textures->SetStreaming(true);
+	Box = new Cube(Device);
+	CreateSkyBox();
+
+	// Create texture, it is read in the background while the scene is drawn.
+	// Nothing changes it, so it goes to the default pool without a copy in system memory.
+
+	Textures->SetPool(D3DPOOL_DEFAULT);
+	Tex = Textures->LoadAsync(
+		"textures/cursor.dds",
+		TEXTURE_2D);
+
+	SetStates();
 
 	return true;
 }
@@ -158,7 +188,9 @@ void Cleanup()
 {
 	d3d::Delete<Cube*>(Box);
 	d3d::Delete<SkyBox*>(Sky);
-	d3d::Release<IDirect3DTexture9*>(Tex);
+	Tex.Reset();
+	d3d::Delete<TextureManager*>(Textures);
+	d3d::Delete<TexturePack*>(Pack);
 }
 
 void ShowPrimitive()
@@ -189,16 +221,39 @@ void ShowPrimitive()
 		Device->BeginScene();
 
 		Device->SetMaterial(&d3d::WHITE_MTRL);
-		Device->SetTexture(0, Tex);
+		// sRGB is a sampler state, it goes with the texture bound
+		Device->SetSamplerState(0, D3DSAMP_SRGBTEXTURE, Tex.IsSrgb());
+		Device->SetTexture(0, Tex.Get());
 
 		Box->draw(0, 0, 0);
 		Sky->Render();
 
 		Device->EndScene();
-		Device->Present(0, 0, 0, 0);
+
+		// the default pool textures go with the device until it is reset
+		if (Device->Present(0, 0, 0, 0) == D3DERR_DEVICELOST)
+		{
+			Textures->OnLostDevice();
+			DeviceLost = true;
+		}
 	}
 }
 
+// the device comes back once the application has the screen again
+bool ResetDevice()
+{
+	HRESULT hr = Device->TestCooperativeLevel();
+	if (hr == D3DERR_DEVICELOST)
+		return false;
+	if (hr == D3DERR_DEVICENOTRESET && FAILED(Device->Reset(&PresentParams)))
+		return false;
+
+	Textures->OnResetDevice();
+	SetStates();
+	DeviceLost = false;
+	return true;
+}
+
 // init ... The init function, it calls the SDL init function.
 int initSDL() {
 	if (SDL_Init(SDL_INIT_EVERYTHING) != 0) {
@@ -236,7 +291,7 @@ int main(int argc, char* argv[]) {
 	SDL_Window* Window = createWindowContext("Hello skybox!");
 
 	if (!d3d::InitD3D(Window,
-		Width, Height, true, D3DDEVTYPE_HAL, &Device))
+		Width, Height, true, D3DDEVTYPE_HAL, &Device, &PresentParams))
 	{
 		SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "InitD3D() - FAILED", nullptr);
 		return 0;
@@ -279,6 +334,13 @@ int main(int argc, char* argv[]) {
 		deltaTime = currentFrame - lastFrame;
 		lastFrame = currentFrame;
 
+		if (DeviceLost && !ResetDevice())
+		{
+			SDL_Delay(50);
+			continue;
+		}
+
+		Textures->Update();
 		ShowPrimitive();
 	}
 
@@ -5,16 +5,12 @@
 
 #include <SDL2/SDL.h>
 
-SkyBox::SkyBox(IDirect3DDevice9* device)
+SkyBox::SkyBox(IDirect3DDevice9* device, TextureManager* textures)
 {
     _device = device;
     _vb = nullptr;
     _ib = nullptr;
-#ifdef UseCubeTexture
-    _cubetexture = nullptr;
-#else
-    memset(_texture, 0, sizeof(_texture));
-#endif
+    _textures = textures;
 }
 
 SkyBox::~SkyBox()
@@ -177,26 +173,38 @@ bool SkyBox::InitSkyBox(int scale)
     return true;
 }
 
+// reports a face that failed to load once the manager is done with it
+static AsyncTask ReportFailure(TextureHandle texture)
+{
+    if (FAILED(co_await texture))
+        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "SkyBox::SetTexture failed", nullptr);
+}
+
+// the faces load in the background, a placeholder is drawn until they are ready
 bool SkyBox::SetTexture(const char* TextureFile, int flag)
 {
 #ifdef UseCubeTexture
-    if (FAILED(d3d::CreateCubeTextureFromFile(
-        _device,
-        TextureFile,
-        &_cubetexture)))
+    _cubetexture = _textures->LoadAsync(TextureFile, TEXTURE_CUBE);
+    ReportFailure(_cubetexture);
 #else
-    if (FAILED(d3d::CreateTextureFromFile(
-        _device,
-        TextureFile,
-        &_texture[flag])))
+    _texture[flag] = _textures->LoadAsync(TextureFile, TEXTURE_2D);
+    ReportFailure(_texture[flag]);
 #endif
-    {
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "SkyBox::SetTexture failed", nullptr);
-        return false;
-    }
     return true;
 }
 
+// only the cube map is made of separate faces, the six textures are set one by one
+bool SkyBox::SetCubeFaces(const char* const textureFiles[6], const char* cacheFile)
+{
+#ifdef UseCubeTexture
+    _cubetexture = _textures->LoadCubeAsync(textureFiles, cacheFile);
+    ReportFailure(_cubetexture);
+    return true;
+#else
+    return false;
+#endif
+}
+
 void SkyBox::Render()
 {
     // set filter
@@ -208,6 +216,11 @@ void SkyBox::Render()
     _device->SetSamplerState(0, D3DSAMP_ADDRESSU, D3DTADDRESS_CLAMP);
     _device->SetSamplerState(0, D3DSAMP_ADDRESSV, D3DTADDRESS_CLAMP);
 
+    // with the 90 degree field of view a face spans about the height of the
+    // viewport, streaming textures load the levels for that size
+    D3DVIEWPORT9 viewport;
+    _device->GetViewport(&viewport);
+
     // do not turn off the light
     /*uint32_t lightState;
     _device->GetRenderState(D3DRS_LIGHTING, &lightState);
@@ -217,7 +230,10 @@ void SkyBox::Render()
 #ifdef UseCubeTexture
     _device->SetStreamSource(0, _vb, 0, sizeof(VertexCube));
     _device->SetFVF(FVF_VERTEXCUBE);
-    _device->SetTexture(0, _cubetexture);
+    _cubetexture.RequestSize(viewport.Height);
+    _device->SetSamplerState(0, D3DSAMP_MAXMIPLEVEL, _cubetexture.GetLOD());
+    _device->SetSamplerState(0, D3DSAMP_SRGBTEXTURE, _cubetexture.IsSrgb());
+    _device->SetTexture(0, _cubetexture.Get());
     _device->DrawIndexedPrimitive(
         D3DPT_TRIANGLELIST,
         0,
@@ -231,7 +247,10 @@ void SkyBox::Render()
     // order is: Right->Left->Up->Down->Front->Back
     for (int i = 0; i < 6; ++i)
     {
-        _device->SetTexture(0, _texture[i]);
+        _texture[i].RequestSize(viewport.Height);
+        _device->SetSamplerState(0, D3DSAMP_MAXMIPLEVEL, _texture[i].GetLOD());
+        _device->SetSamplerState(0, D3DSAMP_SRGBTEXTURE, _texture[i].IsSrgb());
+        _device->SetTexture(0, _texture[i].Get());
         _device->DrawIndexedPrimitive(
             D3DPT_TRIANGLELIST,
             0,     // starting address of the index buffer that will be drawn
@@ -241,6 +260,8 @@ void SkyBox::Render()
             2);    // number of primitives drawn
     }
 #endif
+    _device->SetSamplerState(0, D3DSAMP_MAXMIPLEVEL, 0);
+    _device->SetSamplerState(0, D3DSAMP_SRGBTEXTURE, FALSE);
 
     //_device->SetRenderState(D3DRS_LIGHTING, lightState);
 }
@@ -6,28 +6,32 @@
 #define __skyboxH__
 
 #include <d3d9.h>
+#include "texture_manager.h"
 
 //#undef UseCubeTexture
 
 class SkyBox
 {
 public:
-    SkyBox(IDirect3DDevice9* device);
+    SkyBox(IDirect3DDevice9* device, TextureManager* textures);
     ~SkyBox();
 
     bool InitSkyBox(int scale);
 
     void Render();
     bool SetTexture(const char* textureFile, int flag);
+    // the faces in the order Render draws them, cached as a BC1 cube map when cacheFile is set
+    bool SetCubeFaces(const char* const textureFiles[6], const char* cacheFile);
 
 private:
     IDirect3DDevice9*       _device;
     IDirect3DVertexBuffer9* _vb;
     IDirect3DIndexBuffer9*  _ib;
+    TextureManager*         _textures;
 #ifdef UseCubeTexture
-    IDirect3DCubeTexture9* _cubetexture;
+    TextureHandle           _cubetexture;
 #else
-    IDirect3DTexture9*      _texture[6];
+    TextureHandle           _texture[6];
 #endif
 };
 #endif __skyboxH__
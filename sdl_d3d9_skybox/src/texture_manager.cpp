@@ -0,0 +1,808 @@
+#include "texture_manager.h"
+#include "d3d_utility.h"
+
+#include <algorithm>
+#include <climits>
+#include <filesystem>
+#include <string.h>
+
+// streaming textures are created with their levels up to this size
+#define STREAM_TAIL_SIZE 64
+// system memory kept in staging textures for the next default pool textures
+#define STAGING_BUDGET (64 * 1024 * 1024)
+
+// bytes of one level, the pools of a managed texture each hold this much
+static UINT64 GetLevelBytes(D3DFORMAT format, UINT width, UINT height, UINT depth)
+{
+	switch (format)
+	{
+	case D3DFMT_DXT1:
+		return UINT64((width + 3) / 4) * ((height + 3) / 4) * depth * 8;
+	case D3DFMT_DXT2:
+	case D3DFMT_DXT3:
+	case D3DFMT_DXT4:
+	case D3DFMT_DXT5:
+		return UINT64((width + 3) / 4) * ((height + 3) / 4) * depth * 16;
+	default:
+		break;
+	}
+
+	UINT bits;
+	switch (format)
+	{
+	case D3DFMT_A8:
+	case D3DFMT_L8:
+	case D3DFMT_P8:
+	case D3DFMT_A4L4:
+		bits = 8;
+		break;
+	case D3DFMT_R5G6B5:
+	case D3DFMT_X1R5G5B5:
+	case D3DFMT_A1R5G5B5:
+	case D3DFMT_A4R4G4B4:
+	case D3DFMT_X4R4G4B4:
+	case D3DFMT_A8L8:
+	case D3DFMT_L16:
+	case D3DFMT_R16F:
+		bits = 16;
+		break;
+	case D3DFMT_R8G8B8:
+		bits = 24;
+		break;
+	case D3DFMT_A16B16G16R16:
+	case D3DFMT_A16B16G16R16F:
+	case D3DFMT_G32R32F:
+		bits = 64;
+		break;
+	case D3DFMT_A32B32G32R32F:
+		bits = 128;
+		break;
+	default:
+		bits = 32;
+		break;
+	}
+	return UINT64(width) * height * depth * bits / 8;
+}
+
+static void GetTextureSize(IDirect3DBaseTexture9* texture, TextureType type, D3DPOOL* pool, UINT64* bytes)
+{
+	const DWORD levels = texture->GetLevelCount();
+
+	*bytes = 0;
+	for (DWORD level = 0; level < levels; ++level)
+	{
+		if (type == TEXTURE_VOLUME)
+		{
+			D3DVOLUME_DESC desc;
+			static_cast<IDirect3DVolumeTexture9*>(texture)->GetLevelDesc(level, &desc);
+			*bytes += GetLevelBytes(desc.Format, desc.Width, desc.Height, desc.Depth);
+			*pool = desc.Pool;
+		}
+		else
+		{
+			D3DSURFACE_DESC desc;
+			if (type == TEXTURE_CUBE)
+				static_cast<IDirect3DCubeTexture9*>(texture)->GetLevelDesc(level, &desc);
+			else
+				static_cast<IDirect3DTexture9*>(texture)->GetLevelDesc(level, &desc);
+			*bytes += GetLevelBytes(desc.Format, desc.Width, desc.Height, 1) * (type == TEXTURE_CUBE ? 6 : 1);
+			*pool = desc.Pool;
+		}
+	}
+}
+
+static HRESULT CreateTexture(IDirect3DDevice9* device, const char* file, const d3d::TextureImage* image,
+	TextureType type, UINT max_levels, IDirect3DBaseTexture9** texture, UINT lod = 0, TextureStaging* staging = nullptr,
+	bool* srgb = nullptr)
+{
+	HRESULT hr;
+
+	// staging textures are filled from an image, volume textures stay managed
+	if (!image && staging && type != TEXTURE_VOLUME)
+	{
+		d3d::TextureImage* read;
+		hr = d3d::LoadTextureImage(file, &read);
+		if (FAILED(hr))
+			return hr;
+		hr = CreateTexture(device, nullptr, read, type, max_levels, texture, lod, staging, srgb);
+		d3d::FreeTextureImage(read);
+		return hr;
+	}
+
+	// the file is read here unless a worker thread already did
+	switch (type)
+	{
+	case TEXTURE_CUBE:
+	{
+		IDirect3DCubeTexture9* cube = nullptr;
+		hr = image ? d3d::CreateCubeTextureFromImage(device, image, &cube, max_levels, lod, staging, srgb)
+			: d3d::CreateCubeTextureFromFile(device, file, &cube, max_levels, srgb);
+		*texture = cube;
+		break;
+	}
+	case TEXTURE_VOLUME:
+	{
+		IDirect3DVolumeTexture9* volume = nullptr;
+		hr = image ? d3d::CreateVolumeTextureFromImage(device, image, &volume, max_levels, srgb)
+			: d3d::CreateVolumeTextureFromFile(device, file, &volume, max_levels, srgb);
+		*texture = volume;
+		break;
+	}
+	default:
+	{
+		IDirect3DTexture9* tex = nullptr;
+		hr = image ? d3d::CreateTextureFromImage(device, image, &tex, max_levels, lod, staging, srgb)
+			: d3d::CreateTextureFromFile(device, file, &tex, max_levels, srgb);
+		*texture = tex;
+		break;
+	}
+	}
+	return hr;
+}
+
+// TextureHandle
+
+TextureHandle::TextureHandle(TextureEntry* entry) : _entry(entry)
+{
+	_entry->manager->AddRef(_entry);
+}
+
+TextureHandle::TextureHandle(const TextureHandle& other) : _entry(other._entry)
+{
+	if (_entry)
+		_entry->manager->AddRef(_entry);
+}
+
+TextureHandle::TextureHandle(TextureHandle&& other) noexcept : _entry(other._entry)
+{
+	other._entry = nullptr;
+}
+
+TextureHandle::~TextureHandle()
+{
+	Reset();
+}
+
+TextureHandle& TextureHandle::operator=(TextureHandle other) noexcept
+{
+	std::swap(_entry, other._entry);
+	return *this;
+}
+
+void TextureHandle::Reset()
+{
+	if (_entry)
+	{
+		_entry->manager->Release(_entry);
+		_entry = nullptr;
+	}
+}
+
+IDirect3DTexture9* TextureHandle::Texture() const
+{
+	return _entry && _entry->type == TEXTURE_2D ? static_cast<IDirect3DTexture9*>(_entry->texture) : nullptr;
+}
+
+IDirect3DCubeTexture9* TextureHandle::CubeTexture() const
+{
+	return _entry && _entry->type == TEXTURE_CUBE ? static_cast<IDirect3DCubeTexture9*>(_entry->texture) : nullptr;
+}
+
+IDirect3DVolumeTexture9* TextureHandle::VolumeTexture() const
+{
+	return _entry && _entry->type == TEXTURE_VOLUME ? static_cast<IDirect3DVolumeTexture9*>(_entry->texture) : nullptr;
+}
+
+void TextureHandle::RequestSize(UINT pixels) const
+{
+	if (!_entry || !_entry->streaming)
+		return;
+
+	// the smallest level still as large as the texture is on the screen
+	UINT lod = 0;
+	while (lod < _entry->tail && (_entry->width >> (lod + 1)) >= std::max(pixels, 1u))
+		++lod;
+	_entry->wanted = std::min(_entry->wanted, lod);
+}
+
+// TextureManager
+
+TextureManager::TextureManager(IDirect3DDevice9* device, UINT64 budget, UINT threads)
+{
+	_device = device;
+	_device->AddRef();
+	_pack = nullptr;
+	_streaming = false;
+	_pool = D3DPOOL_MANAGED;
+	_staging = nullptr;
+	memset(_placeholder, 0, sizeof(_placeholder));
+	memset(_resident, 0, sizeof(_resident));
+	SetBudget(budget);
+
+	if (!threads)
+		threads = std::clamp(std::thread::hardware_concurrency(), 1u, 4u);
+	_stop = false;
+	for (UINT i = 0; i < threads; ++i)
+		_workers.emplace_back(&TextureManager::WorkerMain, this);
+}
+
+TextureManager::~TextureManager()
+{
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_stop = true;
+	}
+	_wake.notify_all();
+	for (auto& worker : _workers)
+		worker.join();
+	for (auto& job : _queue)
+		d3d::FreeTextureImage(job.image);
+	for (auto& job : _done)
+		d3d::FreeTextureImage(job.image);
+
+	// a texture still referenced by a handle is released all the same
+	for (auto& [key, entry] : _textures)
+	{
+		if (entry.texture)
+			entry.texture->Release();
+		d3d::FreeTextureImage(entry.image);
+	}
+	for (auto* placeholder : _placeholder)
+	{
+		if (placeholder)
+			placeholder->Release();
+	}
+	delete _staging;
+	_device->Release();
+}
+
+HRESULT TextureManager::Load(const char* file, TextureType type, UINT max_levels, TextureHandle* handle)
+{
+	const std::string key = GetKey(file, type, max_levels);
+
+	auto it = _textures.find(key);
+	if (it != _textures.end())
+	{
+		// a texture still loading keeps its placeholder
+		*handle = TextureHandle(&it->second);
+		return it->second.pending ? D3D_OK : it->second.status;
+	}
+
+	// a packed texture streams its levels from the mapping
+	const TexturePackEntry* packed = FindInPack(file, type);
+	const UINT tail = packed ? GetStreamTail(type, max_levels, _pool, packed->width, packed->height, packed->levels) : 0;
+	TextureStaging* staging = GetStaging(_pool);
+	IDirect3DBaseTexture9* texture = nullptr;
+	bool srgb = false;
+	HRESULT hr = packed ? _pack->CreateTexture(_device, packed, max_levels, &texture, tail, staging, &srgb)
+		: CreateTexture(_device, file, nullptr, type, max_levels, &texture, 0, staging, &srgb);
+	if (hr == D3DERR_OUTOFVIDEOMEMORY || hr == E_OUTOFMEMORY)
+	{
+		// make room with the textures nobody uses and try once more
+		Purge();
+		hr = packed ? _pack->CreateTexture(_device, packed, max_levels, &texture, tail, staging, &srgb)
+			: CreateTexture(_device, file, nullptr, type, max_levels, &texture, 0, staging, &srgb);
+	}
+	if (FAILED(hr))
+		return hr;
+
+	TextureEntry* entry = AddEntry(key, type, max_levels);
+	entry->files.assign(1, file);
+	entry->texture = texture;
+	entry->srgb = srgb;
+	GetTextureSize(texture, type, &entry->pool, &entry->bytes);
+	_resident[entry->pool] += entry->bytes;
+	if (tail)
+	{
+		entry->packed = packed;
+		StartStreaming(entry, std::max(packed->width, packed->height), tail);
+	}
+
+	*handle = TextureHandle(entry);
+	Trim();
+	return D3D_OK;
+}
+
+TextureHandle TextureManager::LoadAsync(const char* file, TextureType type, UINT max_levels)
+{
+	const std::string key = GetKey(file, type, max_levels);
+
+	auto it = _textures.find(key);
+	if (it != _textures.end())
+		return TextureHandle(&it->second);
+
+	if (FindInPack(file, type))
+	{
+		TextureHandle handle;
+		Load(file, type, max_levels, &handle);
+		return handle;
+	}
+
+	TextureEntry* entry = AddEntry(key, type, max_levels);
+	entry->files.assign(1, file);
+	return QueueJob({ entry, file, nullptr, D3D_OK });
+}
+
+TextureHandle TextureManager::LoadCubeAsync(const char* const files[6], const char* cache_file)
+{
+	std::string key;
+	for (int face = 0; face < 6; ++face)
+		key += GetKey(files[face], TEXTURE_CUBE, 0) + ';';
+
+	auto it = _textures.find(key);
+	if (it != _textures.end())
+		return TextureHandle(&it->second);
+
+	LoadJob job = { AddEntry(key, TEXTURE_CUBE, 0), std::string(), nullptr, D3D_OK };
+	job.faces.assign(files, files + 6);
+	if (cache_file)
+		job.cache = cache_file;
+	job.entry->files = job.faces;
+	job.entry->cache = job.cache;
+	return QueueJob(std::move(job));
+}
+
+void TextureManager::Update()
+{
+	std::vector<LoadJob> done;
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		done.swap(_done);
+	}
+	for (auto& job : done)
+	{
+		if (job.stream)
+			CompleteLevel(job);
+		else
+			Complete(job);
+	}
+	for (TextureEntry* entry : _streamed)
+		Stream(entry);
+}
+
+void TextureManager::SetPool(D3DPOOL pool)
+{
+	// the staging stays for the default pool textures still loading or lost with the device
+	if (pool == D3DPOOL_DEFAULT && !_staging)
+		_staging = new TextureStaging(_device, STAGING_BUDGET);
+	else if (pool != D3DPOOL_DEFAULT && _staging)
+		_staging->Purge();
+	_pool = pool;
+}
+
+void TextureManager::OnLostDevice()
+{
+	// a bound texture keeps a reference the device holds, Reset fails while any is left
+	D3DCAPS9 caps;
+	if (SUCCEEDED(_device->GetDeviceCaps(&caps)))
+	{
+		for (DWORD stage = 0; stage < caps.MaxSimultaneousTextures; ++stage)
+			_device->SetTexture(stage, nullptr);
+	}
+
+	for (auto it = _unused.begin(); it != _unused.end();)
+	{
+		TextureEntry* entry = *it++;
+		if (entry->pool == D3DPOOL_DEFAULT)
+			Evict(entry);
+	}
+
+	// a texture still loading is created once the device is back
+	for (auto& [key, entry] : _textures)
+	{
+		if (entry.pool != D3DPOOL_DEFAULT || entry.pending || !entry.texture)
+			continue;
+		entry.texture->Release();
+		entry.texture = nullptr;
+		_resident[entry.pool] -= entry.bytes;
+		entry.bytes = 0;
+		entry.lost = true;
+	}
+}
+
+void TextureManager::OnResetDevice()
+{
+	for (auto& [key, entry] : _textures)
+	{
+		if (entry.lost)
+			Reload(&entry);
+	}
+}
+
+void TextureManager::SetBudget(UINT64 budget)
+{
+	_budget = budget ? budget : _device->GetAvailableTextureMem() / 2;
+	Trim();
+}
+
+UINT64 TextureManager::GetResidentBytes() const
+{
+	UINT64 bytes = 0;
+	for (UINT64 pool_bytes : _resident)
+		bytes += pool_bytes;
+	return bytes;
+}
+
+UINT64 TextureManager::GetResidentBytes(D3DPOOL pool) const
+{
+	return pool <= D3DPOOL_SCRATCH ? _resident[pool] : 0;
+}
+
+void TextureManager::Trim()
+{
+	while (!_unused.empty() && GetResidentBytes() > _budget)
+		Evict(_unused.back());
+}
+
+void TextureManager::Purge()
+{
+	while (!_unused.empty())
+		Evict(_unused.back());
+}
+
+std::string TextureManager::GetKey(const char* file, TextureType type, UINT max_levels) const
+{
+	std::error_code ec;
+	std::string key = std::filesystem::weakly_canonical(std::filesystem::absolute(file, ec), ec).string();
+	if (ec)
+		key = file;
+	return key + '|' + std::to_string(type) + '|' + std::to_string(max_levels);
+}
+
+const TexturePackEntry* TextureManager::FindInPack(const char* file, TextureType type) const
+{
+	static const uint32_t pack_types[] = { TEXTURE_PACK_2D, TEXTURE_PACK_CUBE, TEXTURE_PACK_VOLUME };
+	const TexturePackEntry* entry = _pack ? _pack->Find(file) : nullptr;
+
+	return entry && entry->type == pack_types[type] ? entry : nullptr;
+}
+
+// the entry waits in the unused list for its first handle
+TextureEntry* TextureManager::AddEntry(const std::string& key, TextureType type, UINT max_levels)
+{
+	TextureEntry& entry = _textures[key];
+	entry.manager = this;
+	entry.key = key;
+	entry.texture = nullptr;
+	entry.type = type;
+	entry.max_levels = max_levels;
+	entry.pool = D3DPOOL_MANAGED;
+	entry.load_pool = _pool;
+	entry.bytes = 0;
+	entry.refs = 0;
+	entry.pending = false;
+	entry.status = D3D_OK;
+	entry.lost = false;
+	entry.srgb = false;
+	entry.streaming = false;
+	entry.width = 0;
+	entry.tail = 0;
+	entry.filled = 0;
+	entry.lod = 0;
+	entry.wanted = UINT_MAX;
+	entry.reading = false;
+	entry.packed = nullptr;
+	entry.image = nullptr;
+	_unused.push_front(&entry);
+	entry.unused = _unused.begin();
+	return &entry;
+}
+
+// the entry of the job shows a placeholder until Update creates its texture
+TextureHandle TextureManager::QueueJob(LoadJob job)
+{
+	TextureEntry* entry = job.entry;
+	entry->texture = GetPlaceholder(entry->type);
+	if (entry->texture)
+		entry->texture->AddRef();
+	entry->pending = true;
+
+	TextureHandle handle(entry);
+	// the job holds a reference until Update is done with it
+	AddRef(entry);
+	{
+		std::lock_guard<std::mutex> lock(_mutex);
+		_queue.push_back(std::move(job));
+	}
+	_wake.notify_one();
+	return handle;
+}
+
+// 1x1 grey textures shown while the files load
+IDirect3DBaseTexture9* TextureManager::GetPlaceholder(TextureType type)
+{
+	const DWORD grey = 0xff808080;
+	HRESULT hr;
+
+	if (_placeholder[type])
+		return _placeholder[type];
+
+	switch (type)
+	{
+	case TEXTURE_CUBE:
+	{
+		IDirect3DCubeTexture9* cube;
+		hr = _device->CreateCubeTexture(1, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &cube, nullptr);
+		for (int face = 0; face < 6 && SUCCEEDED(hr); ++face)
+		{
+			D3DLOCKED_RECT rect;
+			if (SUCCEEDED(cube->LockRect((D3DCUBEMAP_FACES)face, 0, &rect, nullptr, 0)))
+			{
+				*static_cast<DWORD*>(rect.pBits) = grey;
+				cube->UnlockRect((D3DCUBEMAP_FACES)face, 0);
+			}
+		}
+		if (SUCCEEDED(hr))
+			_placeholder[type] = cube;
+		break;
+	}
+	case TEXTURE_VOLUME:
+	{
+		IDirect3DVolumeTexture9* volume;
+		hr = _device->CreateVolumeTexture(1, 1, 1, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &volume, nullptr);
+		if (SUCCEEDED(hr))
+		{
+			D3DLOCKED_BOX box;
+			if (SUCCEEDED(volume->LockBox(0, &box, nullptr, 0)))
+			{
+				*static_cast<DWORD*>(box.pBits) = grey;
+				volume->UnlockBox(0);
+			}
+			_placeholder[type] = volume;
+		}
+		break;
+	}
+	default:
+	{
+		IDirect3DTexture9* tex;
+		hr = _device->CreateTexture(1, 1, 1, 0, D3DFMT_A8R8G8B8, D3DPOOL_MANAGED, &tex, nullptr);
+		if (SUCCEEDED(hr))
+		{
+			D3DLOCKED_RECT rect;
+			if (SUCCEEDED(tex->LockRect(0, &rect, nullptr, 0)))
+			{
+				*static_cast<DWORD*>(rect.pBits) = grey;
+				tex->UnlockRect(0);
+			}
+			_placeholder[type] = tex;
+		}
+		break;
+	}
+	}
+	return _placeholder[type];
+}
+
+// runs on the device thread, the worker did the file I/O and parsing
+void TextureManager::Complete(LoadJob& job)
+{
+	TextureEntry* entry = job.entry;
+	IDirect3DBaseTexture9* texture = nullptr;
+	HRESULT hr = job.hr;
+	UINT tail = 0, width = 0;
+	bool srgb = false;
+
+	if (SUCCEEDED(hr))
+	{
+		UINT height, levels;
+		d3d::GetTextureImageInfo(job.image, &width, &height, &levels);
+		tail = GetStreamTail(entry->type, entry->max_levels, entry->load_pool, width, height, levels);
+		width = std::max(width, height);
+
+		hr = CreateTexture(_device, nullptr, job.image, entry->type, entry->max_levels, &texture, tail, GetStaging(entry->load_pool), &srgb);
+		if (hr == D3DERR_OUTOFVIDEOMEMORY || hr == E_OUTOFMEMORY)
+		{
+			Purge();
+			hr = CreateTexture(_device, nullptr, job.image, entry->type, entry->max_levels, &texture, tail, GetStaging(entry->load_pool), &srgb);
+		}
+	}
+
+	// a failed load keeps its placeholder
+	if (SUCCEEDED(hr))
+	{
+		if (entry->texture)
+			entry->texture->Release();
+		entry->texture = texture;
+		entry->srgb = srgb;
+		GetTextureSize(texture, entry->type, &entry->pool, &entry->bytes);
+		_resident[entry->pool] += entry->bytes;
+	}
+	if (SUCCEEDED(hr) && tail)
+	{
+		// the image has the levels still to upload
+		entry->image = job.image;
+		StartStreaming(entry, width, tail);
+	}
+	else
+		d3d::FreeTextureImage(job.image);
+	entry->pending = false;
+	entry->status = hr;
+
+	std::vector<std::coroutine_handle<>> waiters;
+	waiters.swap(entry->waiters);
+	for (auto waiter : waiters)
+		waiter.resume();
+	Release(entry);
+}
+
+void TextureManager::WorkerMain()
+{
+	for (;;)
+	{
+		LoadJob job;
+		{
+			std::unique_lock<std::mutex> lock(_mutex);
+			_wake.wait(lock, [this] { return _stop || !_queue.empty(); });
+			if (_stop)
+				return;
+			job = std::move(_queue.front());
+			_queue.pop_front();
+		}
+
+		if (job.stream)
+			job.hr = _pack->ReadLevel(job.entry->packed, job.level, &job.data);
+		else if (job.faces.empty())
+			job.hr = d3d::LoadTextureImage(job.file.c_str(), &job.image);
+		else
+		{
+			const char* faces[6];
+			for (int face = 0; face < 6; ++face)
+				faces[face] = job.faces[face].c_str();
+			job.hr = d3d::LoadCubeFacesImage(faces, job.cache.empty() ? nullptr : job.cache.c_str(), &job.image);
+		}
+		if (FAILED(job.hr))
+			job.image = nullptr;
+
+		std::lock_guard<std::mutex> lock(_mutex);
+		_done.push_back(std::move(job));
+	}
+}
+
+// levels of textures up to STREAM_TAIL_SIZE, 0 for the ones that don't stream
+UINT TextureManager::GetStreamTail(TextureType type, UINT max_levels, D3DPOOL pool, UINT width, UINT height, UINT levels) const
+{
+	UINT tail = 0;
+
+	// SetLOD only clamps managed textures
+	if (!_streaming || pool == D3DPOOL_DEFAULT || type == TEXTURE_VOLUME || max_levels)
+		return 0;
+	while (tail + 1 < levels && std::max(width >> tail, height >> tail) > STREAM_TAIL_SIZE)
+		++tail;
+	return tail;
+}
+
+void TextureManager::StartStreaming(TextureEntry* entry, UINT width, UINT tail)
+{
+	entry->streaming = true;
+	entry->width = width;
+	entry->tail = tail;
+	entry->filled = tail;
+	entry->lod = tail;
+	_streamed.push_back(entry);
+}
+
+// Called by Update for the textures streaming their levels. The next level goes
+// in once the renderer asks for it, and the texture is clamped with SetLOD to
+// the levels asked for, so the managed pool keeps the others out of video memory.
+void TextureManager::Stream(TextureEntry* entry)
+{
+	const UINT wanted = entry->wanted;
+
+	// not drawn since the last Update
+	entry->wanted = UINT_MAX;
+	if (wanted == UINT_MAX)
+		return;
+
+	if (wanted < entry->filled && !entry->reading)
+	{
+		const UINT level = entry->filled - 1;
+		if (entry->packed)
+		{
+			// the job holds a reference until Update is done with it
+			LoadJob job = { entry, std::string(), nullptr, D3D_OK };
+			job.stream = true;
+			job.level = level;
+			entry->reading = true;
+			AddRef(entry);
+			{
+				std::lock_guard<std::mutex> lock(_mutex);
+				_queue.push_back(std::move(job));
+			}
+			_wake.notify_one();
+		}
+		else
+		{
+			if (SUCCEEDED(d3d::UploadImageLevel(entry->texture, entry->image, level)))
+				entry->filled = level;
+			else
+				entry->tail = entry->filled;
+			if (!entry->filled || entry->tail == entry->filled)
+			{
+				d3d::FreeTextureImage(entry->image);
+				entry->image = nullptr;
+			}
+		}
+	}
+
+	const UINT lod = std::max(std::min(wanted, entry->tail), entry->filled);
+	if (lod != entry->lod)
+	{
+		entry->texture->SetLOD(lod);
+		entry->lod = lod;
+	}
+}
+
+// runs on the device thread, the worker read the level from the pack
+void TextureManager::CompleteLevel(LoadJob& job)
+{
+	TextureEntry* entry = job.entry;
+
+	// a level that fails stops the streaming at the levels already in
+	entry->reading = false;
+	if (SUCCEEDED(job.hr) && SUCCEEDED(_pack->WriteLevel(entry->texture, entry->packed, job.level, job.data)))
+		entry->filled = job.level;
+	else
+		entry->tail = entry->filled;
+	Release(entry);
+}
+
+// a lost texture comes back from the pack right away, or from its files like LoadAsync
+void TextureManager::Reload(TextureEntry* entry)
+{
+	const TexturePackEntry* packed = entry->files.size() == 1 ? FindInPack(entry->files[0].c_str(), entry->type) : nullptr;
+
+	entry->lost = false;
+	if (!packed)
+	{
+		LoadJob job = { entry, entry->files.size() == 1 ? entry->files[0] : std::string(), nullptr, D3D_OK };
+		if (entry->files.size() == 6)
+			job.faces = entry->files;
+		job.cache = entry->cache;
+		QueueJob(std::move(job));
+		return;
+	}
+
+	IDirect3DBaseTexture9* texture = nullptr;
+	entry->status = _pack->CreateTexture(_device, packed, entry->max_levels, &texture, 0, GetStaging(entry->load_pool), &entry->srgb);
+	if (FAILED(entry->status))
+	{
+		entry->srgb = false;
+		texture = GetPlaceholder(entry->type);
+		if (texture)
+			texture->AddRef();
+	}
+	entry->texture = texture;
+	if (SUCCEEDED(entry->status))
+	{
+		GetTextureSize(texture, entry->type, &entry->pool, &entry->bytes);
+		_resident[entry->pool] += entry->bytes;
+	}
+}
+
+void TextureManager::AddRef(TextureEntry* entry)
+{
+	if (!entry->refs++)
+		_unused.erase(entry->unused);
+}
+
+void TextureManager::Release(TextureEntry* entry)
+{
+	if (--entry->refs)
+		return;
+	_unused.push_front(entry);
+	entry->unused = _unused.begin();
+	Trim();
+}
+
+void TextureManager::Evict(TextureEntry* entry)
+{
+	_unused.erase(entry->unused);
+	_resident[entry->pool] -= entry->bytes;
+	if (entry->texture)
+		entry->texture->Release();
+	d3d::FreeTextureImage(entry->image);
+	if (entry->streaming)
+		_streamed.erase(std::find(_streamed.begin(), _streamed.end(), entry));
+
+	const std::string key = entry->key;
+	_textures.erase(key);
+}
@@ -0,0 +1,249 @@
+/*
+ * texture manager, shares the textures loaded from files and evicts the unused ones
+ */
+
+#ifndef __texture_managerH__
+#define __texture_managerH__
+
+#include "d3d_utility.h"
+#include "texture_pack.h"
+#include "texture_staging.h"
+
+#include <d3d9.h>
+#include <condition_variable>
+#include <coroutine>
+#include <deque>
+#include <exception>
+#include <list>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class TextureManager;
+
+enum TextureType
+{
+	TEXTURE_2D,
+	TEXTURE_CUBE,
+	TEXTURE_VOLUME
+};
+
+struct TextureEntry
+{
+	TextureManager*        manager;
+	std::string            key;
+	IDirect3DBaseTexture9* texture;
+	TextureType            type;
+	UINT                   max_levels;
+	D3DPOOL                pool;
+	D3DPOOL                load_pool;         // of SetPool when it was asked for, Reload uses it again
+	UINT64                 bytes;
+	UINT                   refs;
+	std::list<TextureEntry*>::iterator unused; // valid while refs is 0
+	bool                   pending;           // texture is a placeholder until the load is done
+	HRESULT                status;            // result of the load once it is done
+	std::vector<std::coroutine_handle<>> waiters;
+	std::vector<std::string> files;           // the file or the six faces, to load again after a reset
+	std::string            cache;
+	bool                   lost;              // a default pool texture released with the device
+	bool                   srgb;              // sampled with D3DSAMP_SRGBTEXTURE
+
+	// streaming, see TextureManager::SetStreaming
+	bool                    streaming;
+	UINT                    width;            // of level 0
+	UINT                    tail;             // least detailed lod, its levels were filled at creation
+	UINT                    filled;           // most detailed level with data
+	UINT                    lod;              // level the texture is clamped to with SetLOD
+	UINT                    wanted;           // most detailed level asked for since the last Update
+	bool                    reading;          // a worker reads the level above filled
+	const TexturePackEntry* packed;           // the levels are read from the pack
+	d3d::TextureImage*      image;            // or kept from the file until every level is in
+};
+
+// Suspends a coroutine until the texture of a handle is loaded,
+// co_await gives the HRESULT of the load.
+class TextureAwaiter
+{
+public:
+	explicit TextureAwaiter(TextureEntry* entry) : _entry(entry) {}
+
+	bool await_ready() const { return !_entry || !_entry->pending; }
+	void await_suspend(std::coroutine_handle<> coroutine) { _entry->waiters.push_back(coroutine); }
+	HRESULT await_resume() const { return _entry ? _entry->status : D3DERR_INVALIDCALL; }
+
+private:
+	TextureEntry* _entry;
+};
+
+// Return type of coroutines nobody waits for, they run until their first
+// co_await and are resumed by TextureManager::Update.
+struct AsyncTask
+{
+	struct promise_type
+	{
+		AsyncTask get_return_object() { return {}; }
+		std::suspend_never initial_suspend() { return {}; }
+		std::suspend_never final_suspend() noexcept { return {}; }
+		void return_void() {}
+		void unhandled_exception() { std::terminate(); }
+	};
+};
+
+// A counted reference to a managed texture, the texture is not evicted
+// while a handle refers to it. Handles must not outlive their manager.
+class TextureHandle
+{
+public:
+	TextureHandle() : _entry(nullptr) {}
+	TextureHandle(const TextureHandle& other);
+	TextureHandle(TextureHandle&& other) noexcept;
+	~TextureHandle();
+
+	TextureHandle& operator=(TextureHandle other) noexcept;
+
+	void Reset();
+
+	IDirect3DBaseTexture9*   Get() const { return _entry ? _entry->texture : nullptr; }
+	IDirect3DTexture9*       Texture() const;
+	IDirect3DCubeTexture9*   CubeTexture() const;
+	IDirect3DVolumeTexture9* VolumeTexture() const;
+
+	explicit operator bool() const { return _entry != nullptr; }
+
+	// false while a placeholder stands in for the texture
+	bool IsReady() const { return _entry && !_entry->pending; }
+	// D3DSAMP_SRGBTEXTURE for the sampler the texture is bound to
+	bool IsSrgb() const { return _entry && _entry->srgb; }
+
+	// The renderer gives about how many pixels the texture spans on the screen
+	// each frame it is drawn, a streaming texture loads the levels that needs.
+	void RequestSize(UINT pixels) const;
+	// the most detailed level loaded, for D3DSAMP_MAXMIPLEVEL
+	DWORD GetLOD() const { return _entry ? _entry->lod : 0; }
+
+	// the handle must stay alive while a coroutine waits on it
+	TextureAwaiter operator co_await() const { return TextureAwaiter(_entry); }
+
+private:
+	friend class TextureManager;
+	explicit TextureHandle(TextureEntry* entry);
+
+	TextureEntry* _entry;
+};
+
+class TextureManager
+{
+public:
+	// budget is in bytes for the textures of every pool,
+	// 0 takes half of what GetAvailableTextureMem reports.
+	// threads read the files of LoadAsync, 0 picks one per core up to 4.
+	TextureManager(IDirect3DDevice9* device, UINT64 budget = 0, UINT threads = 0);
+	~TextureManager();
+
+	// Files are keyed by their canonical path, type and max_levels,
+	// loading the same key again shares the texture already loaded.
+	HRESULT Load(const char* file, TextureType type, UINT max_levels, TextureHandle* handle);
+
+	// Reads and parses the file on a worker thread, the handle is bound to a
+	// 1x1 placeholder until Update creates the texture.
+	TextureHandle LoadAsync(const char* file, TextureType type, UINT max_levels = 0);
+
+	// A cube map of six JPEG faces decoded on a worker thread, see
+	// d3d::LoadCubeFacesImage for the order of the faces and the cache file.
+	TextureHandle LoadCubeAsync(const char* const files[6], const char* cache_file = nullptr);
+
+	// Files found in the pack are created from its mapping, on the calling
+	// thread even with LoadAsync since there is nothing left to read or parse.
+	void SetPack(const TexturePack* pack) { _pack = pack; }
+
+	// Textures with mips loaded from now on are created with only their small
+	// levels, the others are read a level per Update while RequestSize asks for them.
+	// Textures of the default pool don't stream, they ignore SetLOD.
+	void SetStreaming(bool streaming) { _streaming = streaming; }
+
+	// 2D and cube textures asked for from now on go to pool, D3DPOOL_MANAGED or
+	// D3DPOOL_DEFAULT, those still loading keep the pool they were asked for.
+	// The default pool keeps no copy of the levels in system memory, they are
+	// filled through staging textures. Its textures are lost with the device.
+	void SetPool(D3DPOOL pool);
+
+	// Called before IDirect3DDevice9::Reset, unbinds the textures of every stage and
+	// releases the textures of the default pool. The unused ones are evicted, the
+	// others are loaded again by OnResetDevice.
+	void OnLostDevice();
+	// Called after Reset, creates the lost textures again from the pack or
+	// queues their files, the handles show a placeholder until Update is done.
+	void OnResetDevice();
+
+	// Called by the device thread every frame, creates the textures read
+	// since the last call and resumes the coroutines waiting for them.
+	// Streaming textures get their next level and follow RequestSize with SetLOD.
+	void Update();
+
+	void   SetBudget(UINT64 budget);
+	UINT64 GetBudget() const { return _budget; }
+	UINT64 GetResidentBytes() const;
+	UINT64 GetResidentBytes(D3DPOOL pool) const;
+
+	// evicts the least recently used textures without handles until the budget holds
+	void Trim();
+	// evicts every texture without handles
+	void Purge();
+
+private:
+	friend class TextureHandle;
+
+	struct LoadJob
+	{
+		TextureEntry*            entry;
+		std::string              file;
+		d3d::TextureImage*       image;
+		HRESULT                  hr;
+		std::vector<std::string> faces; // the files of a cube map instead of file
+		std::string              cache;
+		bool                     stream; // reads level of the pack entry into data
+		UINT                     level;
+		std::vector<char>        data;
+	};
+
+	std::string GetKey(const char* file, TextureType type, UINT max_levels) const;
+	const TexturePackEntry* FindInPack(const char* file, TextureType type) const;
+	TextureEntry* AddEntry(const std::string& key, TextureType type, UINT max_levels);
+	TextureHandle QueueJob(LoadJob job);
+	IDirect3DBaseTexture9* GetPlaceholder(TextureType type);
+	void Complete(LoadJob& job);
+	void WorkerMain();
+	UINT GetStreamTail(TextureType type, UINT max_levels, D3DPOOL pool, UINT width, UINT height, UINT levels) const;
+	TextureStaging* GetStaging(D3DPOOL pool) const { return pool == D3DPOOL_DEFAULT ? _staging : nullptr; }
+	void StartStreaming(TextureEntry* entry, UINT width, UINT tail);
+	void Stream(TextureEntry* entry);
+	void CompleteLevel(LoadJob& job);
+	void Reload(TextureEntry* entry);
+
+	void AddRef(TextureEntry* entry);
+	void Release(TextureEntry* entry);
+	void Evict(TextureEntry* entry);
+
+	IDirect3DDevice9*                             _device;
+	const TexturePack*                            _pack;
+	IDirect3DBaseTexture9*                        _placeholder[TEXTURE_VOLUME + 1];
+	UINT64                                        _budget;
+	UINT64                                        _resident[D3DPOOL_SCRATCH + 1];
+	std::unordered_map<std::string, TextureEntry> _textures;
+	std::list<TextureEntry*>                      _unused; // most recently released first
+	bool                                          _streaming;
+	std::vector<TextureEntry*>                    _streamed;
+	D3DPOOL                                       _pool;    // of SetPool
+	TextureStaging*                               _staging; // fills the textures of the default pool
+
+	// the workers move jobs from _queue to _done
+	std::vector<std::thread>                      _workers;
+	std::mutex                                    _mutex;
+	std::condition_variable                       _wake;
+	std::deque<LoadJob>                           _queue;
+	std::vector<LoadJob>                          _done;
+	bool                                          _stop;
+};
+#endif //__texture_managerH__
@@ -0,0 +1,488 @@
+#include "texture_pack.h"
+#include "texture_staging.h"
+#include "d3d_utility.h"
+#include "lz4_block.h"
+
+#include <algorithm>
+#include <atomic>
+#include <filesystem>
+#include <string.h>
+#include <thread>
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#endif
+
+// decompressing is slower than copying, a thread pays off on less work than in d3d_utility
+#define DECOMPRESS_THREAD_MIN_BYTES (1024 * 1024)
+#define DECOMPRESS_MAX_THREADS      8
+
+// bytes of a block of block_dim x block_dim pixels, 0 for formats the packer doesn't write
+static uint32_t GetBlockSize(D3DFORMAT format, uint32_t* block_dim)
+{
+	*block_dim = 4;
+	switch (format)
+	{
+	case D3DFMT_DXT1: return 8;
+	case D3DFMT_DXT2: case D3DFMT_DXT3: case D3DFMT_DXT4: case D3DFMT_DXT5: return 16;
+	default: break;
+	}
+	*block_dim = 1;
+	switch (format)
+	{
+	case D3DFMT_A8: case D3DFMT_L8: return 1;
+	case D3DFMT_R5G6B5: case D3DFMT_X1R5G5B5: case D3DFMT_A1R5G5B5: case D3DFMT_A4R4G4B4: case D3DFMT_A8L8: return 2;
+	case D3DFMT_R8G8B8: return 3;
+	case D3DFMT_A8R8G8B8: case D3DFMT_X8R8G8B8: case D3DFMT_A8B8G8R8: case D3DFMT_X8B8G8R8: return 4;
+	default: return 0;
+	}
+}
+
+TexturePack::TexturePack()
+{
+	_data = nullptr;
+	_size = 0;
+	_levels = nullptr;
+	_chunks = nullptr;
+	_chunk_count = 0;
+#ifdef _WIN32
+	_file = INVALID_HANDLE_VALUE;
+	_mapping = nullptr;
+#endif
+}
+
+TexturePack::~TexturePack()
+{
+	Close();
+}
+
+bool TexturePack::Open(const char* path, const char* prefix)
+{
+	Close();
+
+#ifdef _WIN32
+	_file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ, nullptr, OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, nullptr);
+	if (_file == INVALID_HANDLE_VALUE)
+		return false;
+	LARGE_INTEGER size;
+	GetFileSizeEx(_file, &size);
+	_size = size.QuadPart;
+	_mapping = CreateFileMappingA(_file, nullptr, PAGE_READONLY, 0, 0, nullptr);
+	if (_mapping)
+		_data = static_cast<const char*>(MapViewOfFile(_mapping, FILE_MAP_READ, 0, 0, 0));
+#else
+	int fd = open(path, O_RDONLY);
+	if (fd < 0)
+		return false;
+	struct stat st;
+	if (!fstat(fd, &st) && st.st_size > 0)
+	{
+		void* data = mmap(nullptr, st.st_size, PROT_READ, MAP_SHARED, fd, 0);
+		if (data != MAP_FAILED)
+		{
+			_data = static_cast<const char*>(data);
+			_size = st.st_size;
+		}
+	}
+	// the mapping keeps the file
+	close(fd);
+#endif
+
+	const TexturePackHeader* header = reinterpret_cast<const TexturePackHeader*>(_data);
+	if (!_data || _size < sizeof(*header) || header->magic != TEXTURE_PACK_MAGIC
+		|| header->version != TEXTURE_PACK_VERSION || header->size != _size
+		|| header->entry_offset + sizeof(TexturePackEntry) * header->entry_count > _size
+		|| header->level_offset + sizeof(TexturePackLevel) * header->level_count > _size
+		|| header->chunk_offset + sizeof(TexturePackChunk) * header->chunk_count > _size)
+	{
+		Close();
+		return false;
+	}
+
+	const TexturePackEntry* entries = reinterpret_cast<const TexturePackEntry*>(_data + header->entry_offset);
+	_levels = reinterpret_cast<const TexturePackLevel*>(_data + header->level_offset);
+	_chunks = reinterpret_cast<const TexturePackChunk*>(_data + header->chunk_offset);
+	_chunk_count = header->chunk_count;
+	for (uint32_t i = 0; i < header->entry_count; ++i)
+	{
+		const TexturePackEntry& entry = entries[i];
+		// CreateTexture fills six faces of a cube and one of anything else
+		if (entry.type > TEXTURE_PACK_VOLUME || entry.faces != (entry.type == TEXTURE_PACK_CUBE ? 6u : 1u)
+			|| (entry.type != TEXTURE_PACK_VOLUME && entry.depth != 1)
+			|| !entry.width || !entry.height || !entry.depth || !entry.levels || entry.levels > 32
+			|| (uint64_t)entry.first_level + entry.faces * entry.levels > header->level_count
+			|| entry.offset + entry.size > _size)
+			continue;
+
+		bool valid = true;
+		for (uint32_t level = 0; level < entry.faces * entry.levels; ++level)
+			valid &= IsLevelValid(entry, level % entry.levels, _levels[entry.first_level + level]);
+		if (valid)
+			_entries.emplace(std::string(entry.name, strnlen(entry.name, sizeof(entry.name))), &entry);
+	}
+
+	_prefix = std::filesystem::path(prefix).lexically_normal().generic_string();
+	if (!_prefix.empty() && _prefix.back() != '/')
+		_prefix += '/';
+	return true;
+}
+
+void TexturePack::Close()
+{
+	_entries.clear();
+	_levels = nullptr;
+	_chunks = nullptr;
+	_chunk_count = 0;
+#ifdef _WIN32
+	if (_data)
+		UnmapViewOfFile(_data);
+	if (_mapping)
+		CloseHandle(_mapping);
+	if (_file != INVALID_HANDLE_VALUE)
+		CloseHandle(_file);
+	_mapping = nullptr;
+	_file = INVALID_HANDLE_VALUE;
+#else
+	if (_data)
+		munmap(const_cast<char*>(_data), _size);
+#endif
+	_data = nullptr;
+	_size = 0;
+}
+
+const TexturePackEntry* TexturePack::Find(const char* file) const
+{
+	const std::string name = std::filesystem::path(file).lexically_normal().generic_string();
+
+	if (name.compare(0, _prefix.size(), _prefix))
+		return nullptr;
+	auto it = _entries.find(name.substr(_prefix.size()));
+	return it != _entries.end() ? it->second : nullptr;
+}
+
+// the level has to have the size of mip of the entry, the copies trust its rows and pitches,
+// and its chunks have to cover its rows in order, so no two threads write the same rows
+bool TexturePack::IsLevelValid(const TexturePackEntry& entry, uint32_t mip, const TexturePackLevel& level) const
+{
+	const uint64_t end = entry.offset + entry.size;
+	uint32_t block_dim;
+	const uint32_t block_size = GetBlockSize(static_cast<D3DFORMAT>(entry.format), &block_dim);
+	const uint64_t width = std::max(entry.width >> mip, 1u);
+	const uint64_t height = std::max(entry.height >> mip, 1u);
+
+	if (!block_size
+		|| level.row_pitch != (width + block_dim - 1) / block_dim * block_size
+		|| level.rows != (height + block_dim - 1) / block_dim
+		|| (uint64_t)level.row_pitch * level.rows > level.slice_pitch
+		|| level.depth != std::max(entry.depth >> mip, 1u))
+		return false;
+
+	if (!level.chunk_count)
+		return level.offset + (uint64_t)level.slice_pitch * level.depth <= end;
+	if ((uint64_t)level.first_chunk + level.chunk_count > _chunk_count)
+		return false;
+
+	uint32_t row = 0;
+	for (uint32_t i = 0; i < level.chunk_count; ++i)
+	{
+		const TexturePackChunk& chunk = _chunks[level.first_chunk + i];
+		if (chunk.offset < entry.offset || chunk.offset + chunk.size > end || chunk.size > chunk.raw_size
+			|| chunk.first_row != row || !chunk.rows || row % level.rows + chunk.rows > level.rows
+			|| chunk.raw_size != (uint64_t)chunk.rows * level.row_pitch)
+			return false;
+		row += chunk.rows;
+	}
+	return row == level.rows * level.depth;
+}
+
+// copies a level by rows of blocks, the locked pitch may be wider than the rows in the pack
+void TexturePack::CopyLevel(const TexturePackLevel& level, void* dest, INT row_pitch, INT slice_pitch) const
+{
+	const char* src = _data + level.offset;
+
+	for (uint32_t z = 0; z < level.depth; ++z)
+	{
+		char* dest_slice = static_cast<char*>(dest) + z * slice_pitch;
+		const char* src_slice = src + (size_t)z * level.slice_pitch;
+
+		// a slice may be padded in the file past the rows the lock holds
+		if (row_pitch == (INT)level.row_pitch)
+		{
+			memcpy(dest_slice, src_slice, (size_t)level.row_pitch * level.rows);
+			continue;
+		}
+		for (uint32_t y = 0; y < level.rows; ++y)
+			memcpy(dest_slice + y * row_pitch, src_slice + y * level.row_pitch, level.row_pitch);
+	}
+}
+
+// a chunk goes straight to the locked rows when the pitches match, the
+// decompressor reads its matches back from there, fine for managed textures
+// which are locked in system memory
+bool TexturePack::CopyChunk(const LevelCopy& copy, const TexturePackChunk& chunk, std::vector<char>* scratch) const
+{
+	const TexturePackLevel& level = *copy.level;
+	const uint32_t z = chunk.first_row / level.rows;
+	const uint32_t y = chunk.first_row % level.rows;
+	char* dest = copy.dest + (size_t)z * copy.slice_pitch + (size_t)y * copy.row_pitch;
+	const char* src = _data + chunk.offset;
+
+	if (copy.row_pitch == (INT)level.row_pitch)
+	{
+		if (chunk.size == chunk.raw_size)
+		{
+			memcpy(dest, src, chunk.raw_size);
+			return true;
+		}
+		return lz4_decompress_block(src, chunk.size, dest, chunk.raw_size);
+	}
+
+	if (chunk.size != chunk.raw_size)
+	{
+		scratch->resize(chunk.raw_size);
+		if (!lz4_decompress_block(src, chunk.size, scratch->data(), chunk.raw_size))
+			return false;
+		src = scratch->data();
+	}
+	for (uint32_t row = 0; row < chunk.rows; ++row)
+		memcpy(dest + (size_t)row * copy.row_pitch, src + (size_t)row * level.row_pitch, level.row_pitch);
+	return true;
+}
+
+// fills the locked levels, their chunks are shared out to threads when there is enough to decompress
+HRESULT TexturePack::CopyLevels(const std::vector<LevelCopy>& copies) const
+{
+	struct Job
+	{
+		const LevelCopy*        copy;
+		const TexturePackChunk* chunk; // null for a raw level
+	};
+	std::vector<Job> jobs;
+	size_t bytes = 0;
+
+	for (const LevelCopy& copy : copies)
+	{
+		const TexturePackLevel& level = *copy.level;
+		if (!level.chunk_count)
+		{
+			jobs.push_back({ &copy, nullptr });
+			bytes += (size_t)level.slice_pitch * level.depth;
+			continue;
+		}
+		for (uint32_t i = 0; i < level.chunk_count; ++i)
+		{
+			jobs.push_back({ &copy, &_chunks[level.first_chunk + i] });
+			bytes += _chunks[level.first_chunk + i].raw_size;
+		}
+	}
+
+	std::atomic<size_t> next(0);
+	std::atomic<bool> ok(true);
+	auto work = [&]()
+	{
+		std::vector<char> scratch;
+		for (size_t i; (i = next++) < jobs.size();)
+		{
+			const Job& job = jobs[i];
+			if (!job.chunk)
+				CopyLevel(*job.copy->level, job.copy->dest, job.copy->row_pitch, job.copy->slice_pitch);
+			else if (!CopyChunk(*job.copy, *job.chunk, &scratch))
+				ok = false;
+		}
+	};
+
+	const size_t threads = std::min<size_t>({ bytes / DECOMPRESS_THREAD_MIN_BYTES,
+		std::max(std::thread::hardware_concurrency(), 1u), DECOMPRESS_MAX_THREADS, jobs.size() });
+	std::vector<std::thread> workers;
+	for (size_t i = 1; i < threads; ++i)
+		workers.emplace_back(work);
+	work();
+	for (auto& worker : workers)
+		worker.join();
+	return ok ? D3D_OK : E_FAIL;
+}
+
+HRESULT TexturePack::CreateTexture(IDirect3DDevice9* device, const TexturePackEntry* entry, UINT max_levels,
+	IDirect3DBaseTexture9** texture, UINT lod, TextureStaging* staging, bool* srgb) const
+{
+	const D3DFORMAT fmt = static_cast<D3DFORMAT>(entry->format);
+	const UINT levels = max_levels ? std::min<UINT>(max_levels, entry->levels) : entry->levels;
+	const TexturePackLevel* level_info = _levels + entry->first_level;
+	DWORD usage = 0;
+	HRESULT hr;
+
+	*texture = nullptr;
+	// SetLOD only clamps managed textures, the default pool needs every level filled
+	if (lod && staging && entry->type != TEXTURE_PACK_VOLUME)
+		return D3DERR_INVALIDCALL;
+#ifndef _WIN32
+	// start reading the pages in before the copies fault them in one by one
+	const size_t page = entry->offset & ~(size_t)(TEXTURE_PACK_ALIGN - 1);
+	madvise(const_cast<char*>(_data) + page, entry->offset + entry->size - page, MADV_WILLNEED);
+#endif
+
+	switch (entry->type)
+	{
+	case TEXTURE_PACK_CUBE:
+	{
+		usage = levels == 1 && max_levels != 1
+			&& d3d::IsTextureUsageSupported(device, D3DUSAGE_AUTOGENMIPMAP, D3DRTYPE_CUBETEXTURE, fmt) ? D3DUSAGE_AUTOGENMIPMAP : 0;
+		IDirect3DCubeTexture9* cube;
+		hr = staging ? staging->CreateCubeTexture(entry->width, levels, fmt, &cube)
+			: device->CreateCubeTexture(entry->width, usage ? 0 : levels, usage, fmt, D3DPOOL_MANAGED, &cube, nullptr);
+		if (FAILED(hr))
+			return hr;
+
+		// lock every level first so all of their chunks can be decompressed at once
+		std::vector<LevelCopy> copies;
+		D3DLOCKED_RECT rect;
+		for (UINT face = 0; face < 6 && SUCCEEDED(hr); ++face)
+		{
+			for (UINT level = lod; level < levels; ++level)
+			{
+				hr = cube->LockRect((D3DCUBEMAP_FACES)face, level, &rect, nullptr, 0);
+				if (FAILED(hr))
+					break;
+				copies.push_back({ &level_info[face * entry->levels + level], static_cast<char*>(rect.pBits), rect.Pitch, 0 });
+			}
+		}
+		if (SUCCEEDED(hr))
+			hr = CopyLevels(copies);
+		for (size_t i = 0; i < copies.size(); ++i)
+			cube->UnlockRect((D3DCUBEMAP_FACES)(i / (levels - lod)), lod + i % (levels - lod));
+		if (SUCCEEDED(hr) && usage && !staging)
+		{
+			cube->SetAutoGenFilterType(D3DTEXF_LINEAR);
+			cube->GenerateMipSubLevels();
+		}
+		*texture = cube;
+		break;
+	}
+	case TEXTURE_PACK_VOLUME:
+	{
+		// D3D9 can't generate the mips of volume textures, they have the levels of the pack
+		IDirect3DVolumeTexture9* volume;
+		hr = device->CreateVolumeTexture(entry->width, entry->height, entry->depth, levels, 0, fmt, D3DPOOL_MANAGED,
+			&volume, nullptr);
+		if (FAILED(hr))
+			return hr;
+
+		std::vector<LevelCopy> copies;
+		D3DLOCKED_BOX box;
+		for (UINT level = 0; level < levels; ++level)
+		{
+			hr = volume->LockBox(level, &box, nullptr, 0);
+			if (FAILED(hr))
+				break;
+			copies.push_back({ &level_info[level], static_cast<char*>(box.pBits), box.RowPitch, box.SlicePitch });
+		}
+		if (SUCCEEDED(hr))
+			hr = CopyLevels(copies);
+		for (size_t i = 0; i < copies.size(); ++i)
+			volume->UnlockBox(i);
+		*texture = volume;
+		break;
+	}
+	default:
+	{
+		usage = levels == 1 && max_levels != 1
+			&& d3d::IsTextureUsageSupported(device, D3DUSAGE_AUTOGENMIPMAP, D3DRTYPE_TEXTURE, fmt) ? D3DUSAGE_AUTOGENMIPMAP : 0;
+		IDirect3DTexture9* tex;
+		hr = staging ? staging->CreateTexture(entry->width, entry->height, levels, fmt, &tex)
+			: device->CreateTexture(entry->width, entry->height, usage ? 0 : levels, usage, fmt, D3DPOOL_MANAGED, &tex, nullptr);
+		if (FAILED(hr))
+			return hr;
+
+		std::vector<LevelCopy> copies;
+		D3DLOCKED_RECT rect;
+		for (UINT level = lod; level < levels; ++level)
+		{
+			hr = tex->LockRect(level, &rect, nullptr, 0);
+			if (FAILED(hr))
+				break;
+			copies.push_back({ &level_info[level], static_cast<char*>(rect.pBits), rect.Pitch, 0 });
+		}
+		if (SUCCEEDED(hr))
+			hr = CopyLevels(copies);
+		for (size_t i = 0; i < copies.size(); ++i)
+			tex->UnlockRect(lod + i);
+		if (SUCCEEDED(hr) && usage && !staging)
+		{
+			tex->SetAutoGenFilterType(D3DTEXF_LINEAR);
+			tex->GenerateMipSubLevels();
+		}
+		*texture = tex;
+		break;
+	}
+	}
+
+	// the levels went to a staging texture, it is copied to the default pool
+	if (SUCCEEDED(hr) && staging && entry->type != TEXTURE_PACK_VOLUME)
+		hr = staging->Upload(*texture, usage, texture);
+	if (FAILED(hr))
+	{
+		if (*texture)
+			(*texture)->Release();
+		*texture = nullptr;
+		return hr;
+	}
+	if (lod)
+		(*texture)->SetLOD(lod);
+
+	if (srgb)
+	{
+		const D3DRESOURCETYPE rtype = entry->type == TEXTURE_PACK_CUBE ? D3DRTYPE_CUBETEXTURE
+			: entry->type == TEXTURE_PACK_VOLUME ? D3DRTYPE_VOLUMETEXTURE : D3DRTYPE_TEXTURE;
+		*srgb = (entry->flags & TEXTURE_PACK_SRGB) && d3d::IsTextureUsageSupported(device, D3DUSAGE_QUERY_SRGBREAD, rtype, fmt);
+	}
+	return hr;
+}
+
+HRESULT TexturePack::ReadLevel(const TexturePackEntry* entry, UINT level, std::vector<char>* data) const
+{
+	std::vector<LevelCopy> copies;
+	size_t size = 0;
+
+	for (UINT face = 0; face < entry->faces; ++face)
+	{
+		const TexturePackLevel& rec = _levels[entry->first_level + face * entry->levels + level];
+		size += (size_t)rec.slice_pitch * rec.depth;
+	}
+	data->resize(size);
+
+	char* dest = data->data();
+	for (UINT face = 0; face < entry->faces; ++face)
+	{
+		const TexturePackLevel& rec = _levels[entry->first_level + face * entry->levels + level];
+		copies.push_back({ &rec, dest, (INT)rec.row_pitch, (INT)rec.slice_pitch });
+		dest += (size_t)rec.slice_pitch * rec.depth;
+	}
+	return CopyLevels(copies);
+}
+
+HRESULT TexturePack::WriteLevel(IDirect3DBaseTexture9* texture, const TexturePackEntry* entry, UINT level,
+	const std::vector<char>& data) const
+{
+	const bool cube = entry->type == TEXTURE_PACK_CUBE;
+	const char* src = data.data();
+	D3DLOCKED_RECT rect;
+	HRESULT hr = D3D_OK;
+
+	for (UINT face = 0; face < entry->faces && SUCCEEDED(hr); ++face)
+	{
+		const TexturePackLevel& rec = _levels[entry->first_level + face * entry->levels + level];
+		hr = cube ? static_cast<IDirect3DCubeTexture9*>(texture)->LockRect((D3DCUBEMAP_FACES)face, level, &rect, nullptr, 0)
+			: static_cast<IDirect3DTexture9*>(texture)->LockRect(level, &rect, nullptr, 0);
+		if (FAILED(hr))
+			break;
+		for (uint32_t y = 0; y < rec.rows; ++y)
+			memcpy(static_cast<char*>(rect.pBits) + y * rect.Pitch, src + y * rec.row_pitch, rec.row_pitch);
+		src += rec.slice_pitch;
+		hr = cube ? static_cast<IDirect3DCubeTexture9*>(texture)->UnlockRect((D3DCUBEMAP_FACES)face, level)
+			: static_cast<IDirect3DTexture9*>(texture)->UnlockRect(level);
+	}
+	return hr;
+}
@@ -0,0 +1,74 @@
+/*
+ * texture pack, maps a pack built by tools/texture_packer and creates its textures
+ */
+
+#ifndef __texture_packH__
+#define __texture_packH__
+
+#include "texture_pack_format.h"
+
+#include <d3d9.h>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+class TextureStaging;
+
+class TexturePack
+{
+public:
+	TexturePack();
+	~TexturePack();
+
+	// Maps the pack, it then holds the files that were below prefix
+	// (like "textures") when the pack was built.
+	bool Open(const char* path, const char* prefix);
+	void Close();
+
+	const TexturePackEntry* Find(const char* file) const;
+
+	// Creates the texture and copies its levels straight from the mapping, or
+	// decompresses their chunks on a few threads. A texture with a single level
+	// gets generated mips unless max_levels is 1.
+	// Levels above lod are left for WriteLevel, the texture is clamped to lod with SetLOD.
+	// With staging a 2D or cube texture goes to the default pool, filled through it,
+	// and lod has to be 0.
+	// srgb tells whether the texture is sampled with D3DSAMP_SRGBTEXTURE.
+	HRESULT CreateTexture(IDirect3DDevice9* device, const TexturePackEntry* entry, UINT max_levels,
+		IDirect3DBaseTexture9** texture, UINT lod = 0, TextureStaging* staging = nullptr, bool* srgb = nullptr) const;
+
+	// Reads a level of every face into data, rows at the pitch of the pack.
+	// It needs no device, the streaming threads read the levels with it.
+	HRESULT ReadLevel(const TexturePackEntry* entry, UINT level, std::vector<char>* data) const;
+	// copies a level read by ReadLevel to a 2D or cube texture of the entry
+	HRESULT WriteLevel(IDirect3DBaseTexture9* texture, const TexturePackEntry* entry, UINT level,
+		const std::vector<char>& data) const;
+
+private:
+	// a locked level
+	struct LevelCopy
+	{
+		const TexturePackLevel* level;
+		char*                   dest;
+		INT                     row_pitch;
+		INT                     slice_pitch;
+	};
+
+	bool IsLevelValid(const TexturePackEntry& entry, uint32_t mip, const TexturePackLevel& level) const;
+	void CopyLevel(const TexturePackLevel& level, void* dest, INT row_pitch, INT slice_pitch) const;
+	bool CopyChunk(const LevelCopy& copy, const TexturePackChunk& chunk, std::vector<char>* scratch) const;
+	HRESULT CopyLevels(const std::vector<LevelCopy>& copies) const;
+
+	const char*             _data;
+	size_t                  _size;
+	const TexturePackLevel* _levels;
+	const TexturePackChunk* _chunks;
+	uint32_t                _chunk_count;
+	std::string             _prefix;
+	std::unordered_map<std::string, const TexturePackEntry*> _entries;
+#ifdef _WIN32
+	HANDLE                  _file;
+	HANDLE                  _mapping;
+#endif
+};
+#endif //__texture_packH__
@@ -0,0 +1,83 @@
+/*
+ * texture pack layout, written by tools/texture_packer and mapped by TexturePack
+ *
+ * header | entries | levels | chunks | payloads
+ *
+ * The textures are parsed when the pack is built, an entry has the D3DFORMAT,
+ * the dimensions and a level record for each face and mip with the offset and
+ * pitch of its rows. Every texture payload starts on a 4 KiB boundary so its
+ * pages are only touched when it is uploaded.
+ *
+ * A level is either stored raw at its offset or, in packs built with
+ * --compress, as chunks of whole rows that are LZ4 blocks (lz4_block.h).
+ * The chunks don't depend on each other so they can be decompressed in
+ * parallel, each straight to its rows of the locked level.
+ */
+
+#ifndef __texture_pack_formatH__
+#define __texture_pack_formatH__
+
+#include <stdint.h>
+
+#define TEXTURE_PACK_MAGIC   0x4b415054 // "TPAK"
+#define TEXTURE_PACK_VERSION 2
+#define TEXTURE_PACK_ALIGN   4096
+#define TEXTURE_PACK_NAME    112
+
+#define TEXTURE_PACK_2D      0
+#define TEXTURE_PACK_CUBE    1
+#define TEXTURE_PACK_VOLUME  2
+
+#define TEXTURE_PACK_SRGB    0x1
+
+struct TexturePackHeader
+{
+	uint32_t magic;
+	uint32_t version;
+	uint32_t entry_count;
+	uint32_t level_count;
+	uint64_t entry_offset;
+	uint64_t level_offset;
+	uint64_t size;          // of the whole pack
+	uint32_t chunk_count;
+	uint32_t reserved;
+	uint64_t chunk_offset;
+};
+
+struct TexturePackEntry
+{
+	char     name[TEXTURE_PACK_NAME]; // path below the packed directory, with '/'
+	uint32_t format;                  // D3DFORMAT
+	uint32_t type;                    // TEXTURE_PACK_2D, _CUBE or _VOLUME
+	uint32_t flags;
+	uint32_t width;
+	uint32_t height;
+	uint32_t depth;
+	uint32_t levels;
+	uint32_t faces;
+	uint32_t first_level;             // levels of face f are at first_level + f * levels
+	uint32_t reserved;
+	uint64_t offset;                  // of the payload, TEXTURE_PACK_ALIGN aligned
+	uint64_t size;
+};
+
+struct TexturePackLevel
+{
+	uint64_t offset;                  // from the start of the pack
+	uint32_t row_pitch;               // bytes of a row of blocks
+	uint32_t rows;                    // rows of blocks in a slice
+	uint32_t slice_pitch;
+	uint32_t depth;
+	uint32_t first_chunk;
+	uint32_t chunk_count;             // 0 when the level is raw at offset
+};
+
+struct TexturePackChunk
+{
+	uint64_t offset;                  // from the start of the pack
+	uint32_t size;                    // equal to raw_size when the rows didn't compress
+	uint32_t raw_size;
+	uint32_t first_row;               // rows of a level count on through its slices,
+	uint32_t rows;                    // a chunk stays within one slice
+};
+#endif //__texture_pack_formatH__
@@ -0,0 +1,145 @@
+#include "texture_staging.h"
+
+#include <algorithm>
+
+// about the bytes of a staging texture, for its budget
+static UINT64 GetStagingBytes(D3DFORMAT format, UINT width, UINT height, UINT levels, UINT faces)
+{
+	UINT64 bytes = 0;
+
+	for (UINT level = 0; level < levels; ++level)
+	{
+		const UINT w = std::max(width >> level, 1u), h = std::max(height >> level, 1u);
+		switch (format)
+		{
+		case D3DFMT_DXT1:
+			bytes += UINT64((w + 3) / 4) * ((h + 3) / 4) * 8;
+			break;
+		case D3DFMT_DXT2:
+		case D3DFMT_DXT3:
+		case D3DFMT_DXT4:
+		case D3DFMT_DXT5:
+			bytes += UINT64((w + 3) / 4) * ((h + 3) / 4) * 16;
+			break;
+		default:
+			bytes += UINT64(w) * h * 4;
+			break;
+		}
+	}
+	return bytes * faces;
+}
+
+TextureStaging::TextureStaging(IDirect3DDevice9* device, UINT64 budget)
+{
+	_device = device;
+	_device->AddRef();
+	_budget = budget;
+	_bytes = 0;
+}
+
+TextureStaging::~TextureStaging()
+{
+	Purge();
+	_device->Release();
+}
+
+HRESULT TextureStaging::CreateTexture(UINT width, UINT height, UINT levels, D3DFORMAT format,
+	IDirect3DTexture9** staging)
+{
+	*staging = static_cast<IDirect3DTexture9*>(Lend(D3DRTYPE_TEXTURE, width, height, levels, format));
+	if (*staging)
+		return D3D_OK;
+	return _device->CreateTexture(width, height, levels, 0, format, D3DPOOL_SYSTEMMEM, staging, nullptr);
+}
+
+HRESULT TextureStaging::CreateCubeTexture(UINT size, UINT levels, D3DFORMAT format, IDirect3DCubeTexture9** staging)
+{
+	*staging = static_cast<IDirect3DCubeTexture9*>(Lend(D3DRTYPE_CUBETEXTURE, size, size, levels, format));
+	if (*staging)
+		return D3D_OK;
+	return _device->CreateCubeTexture(size, levels, 0, format, D3DPOOL_SYSTEMMEM, staging, nullptr);
+}
+
+HRESULT TextureStaging::Upload(IDirect3DBaseTexture9* staging, DWORD usage, IDirect3DBaseTexture9** texture)
+{
+	Staging kept = { staging, staging->GetType(), D3DFMT_UNKNOWN, 0, 0, staging->GetLevelCount(), 0 };
+	D3DSURFACE_DESC desc;
+	HRESULT hr;
+
+	*texture = nullptr;
+	if (kept.type == D3DRTYPE_CUBETEXTURE)
+	{
+		IDirect3DCubeTexture9* cube;
+		static_cast<IDirect3DCubeTexture9*>(staging)->GetLevelDesc(0, &desc);
+		hr = _device->CreateCubeTexture(desc.Width, usage & D3DUSAGE_AUTOGENMIPMAP ? 0 : kept.levels, usage,
+			desc.Format, D3DPOOL_DEFAULT, &cube, nullptr);
+		*texture = cube;
+	}
+	else
+	{
+		IDirect3DTexture9* tex;
+		static_cast<IDirect3DTexture9*>(staging)->GetLevelDesc(0, &desc);
+		hr = _device->CreateTexture(desc.Width, desc.Height, usage & D3DUSAGE_AUTOGENMIPMAP ? 0 : kept.levels, usage,
+			desc.Format, D3DPOOL_DEFAULT, &tex, nullptr);
+		*texture = tex;
+	}
+	if (SUCCEEDED(hr))
+		hr = _device->UpdateTexture(staging, *texture);
+	if (SUCCEEDED(hr) && (usage & D3DUSAGE_AUTOGENMIPMAP))
+	{
+		(*texture)->SetAutoGenFilterType(D3DTEXF_LINEAR);
+		(*texture)->GenerateMipSubLevels();
+	}
+	if (FAILED(hr) && *texture)
+	{
+		(*texture)->Release();
+		*texture = nullptr;
+	}
+
+	// the runtime is done with the staging texture once UpdateTexture returns,
+	// it is kept for the next texture of its size
+	kept.format = desc.Format;
+	kept.width = desc.Width;
+	kept.height = desc.Height;
+	kept.bytes = GetStagingBytes(desc.Format, desc.Width, desc.Height, kept.levels,
+		kept.type == D3DRTYPE_CUBETEXTURE ? 6 : 1);
+	_staging.push_back(kept);
+	_bytes += kept.bytes;
+	Trim();
+	return hr;
+}
+
+void TextureStaging::Purge()
+{
+	for (auto& staging : _staging)
+		staging.texture->Release();
+	_staging.clear();
+	_bytes = 0;
+}
+
+IDirect3DBaseTexture9* TextureStaging::Lend(D3DRESOURCETYPE type, UINT width, UINT height, UINT levels,
+	D3DFORMAT format)
+{
+	for (auto it = _staging.begin(); it != _staging.end(); ++it)
+	{
+		if (it->type == type && it->format == format && it->width == width && it->height == height
+			&& it->levels == levels)
+		{
+			IDirect3DBaseTexture9* texture = it->texture;
+			_bytes -= it->bytes;
+			_staging.erase(it);
+			return texture;
+		}
+	}
+	return nullptr;
+}
+
+void TextureStaging::Trim()
+{
+	while (!_staging.empty() && _bytes > _budget)
+	{
+		_staging.front().texture->Release();
+		_bytes -= _staging.front().bytes;
+		_staging.erase(_staging.begin());
+	}
+}
@@ -0,0 +1,58 @@
+/*
+ * texture staging, fills default pool textures through system memory textures it keeps for reuse
+ *
+ * Managed textures keep a copy of every level in system memory for as long as
+ * they live. Textures of the default pool don't, they are filled through a
+ * staging texture in D3DPOOL_SYSTEMMEM and UpdateTexture instead. The staging
+ * textures are lent again to the next textures of the same size and format.
+ */
+
+#ifndef __texture_stagingH__
+#define __texture_stagingH__
+
+#include <d3d9.h>
+#include <vector>
+
+class TextureStaging
+{
+public:
+	// budget is in bytes for the staging textures kept between uploads
+	TextureStaging(IDirect3DDevice9* device, UINT64 budget);
+	~TextureStaging();
+
+	// Lends a system memory texture to fill instead of a texture of the default pool,
+	// one kept from an earlier upload when it has the same size and format. The
+	// caller releases it if it is not uploaded.
+	HRESULT CreateTexture(UINT width, UINT height, UINT levels, D3DFORMAT format, IDirect3DTexture9** staging);
+	HRESULT CreateCubeTexture(UINT size, UINT levels, D3DFORMAT format, IDirect3DCubeTexture9** staging);
+
+	// Copies a filled staging texture to a new texture of the default pool and takes
+	// the staging texture back. With D3DUSAGE_AUTOGENMIPMAP in usage the staging
+	// texture has a single level, the texture generates the others.
+	HRESULT Upload(IDirect3DBaseTexture9* staging, DWORD usage, IDirect3DBaseTexture9** texture);
+
+	// releases the staging textures kept for reuse
+	void Purge();
+	UINT64 GetBytes() const { return _bytes; }
+
+private:
+	struct Staging
+	{
+		IDirect3DBaseTexture9* texture;
+		D3DRESOURCETYPE        type;
+		D3DFORMAT              format;
+		UINT                   width;
+		UINT                   height;
+		UINT                   levels;
+		UINT64                 bytes;
+	};
+
+	IDirect3DBaseTexture9* Lend(D3DRESOURCETYPE type, UINT width, UINT height, UINT levels, D3DFORMAT format);
+	void Trim();
+
+	IDirect3DDevice9*    _device;
+	UINT64               _budget;
+	UINT64               _bytes;
+	std::vector<Staging> _staging; // the ones not lent, least recently used first
+};
+#endif //__texture_stagingH__
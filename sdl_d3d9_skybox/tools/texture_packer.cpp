@@ -0,0 +1,432 @@
+// texture_packer [--compress] <textures dir> <pack file>
+//
+// Packs every DDS file below a directory into one texture pack, see
+// texture_pack_format.h. The DDS files are parsed here so the samples
+// only have to map the pack and copy the levels. With --compress the
+// levels are stored as LZ4 chunks of rows, for hosts that wait on the
+// disk more than on the CPU.
+
+#include "lz4_block.h"
+#include "texture_pack_format.h"
+
+#include <algorithm>
+#include <filesystem>
+#include <stdio.h>
+#include <string.h>
+#include <string>
+#include <vector>
+
+// rows of a level are grouped into chunks of about this size
+#define CHUNK_SIZE (64 * 1024)
+
+#define MAKE_FOURCC(a, b, c, d) ((uint32_t)(a) | ((uint32_t)(b) << 8) | ((uint32_t)(c) << 16) | ((uint32_t)(d) << 24))
+
+// D3DFORMAT values, the packer does not need the D3D9 headers
+#define FMT_R8G8B8   20
+#define FMT_A8R8G8B8 21
+#define FMT_X8R8G8B8 22
+#define FMT_R5G6B5   23
+#define FMT_X1R5G5B5 24
+#define FMT_A1R5G5B5 25
+#define FMT_A4R4G4B4 26
+#define FMT_A8       28
+#define FMT_A8B8G8R8 32
+#define FMT_X8B8G8R8 33
+#define FMT_L8       50
+#define FMT_A8L8     51
+#define FMT_DXT1     MAKE_FOURCC('D', 'X', 'T', '1')
+#define FMT_DXT2     MAKE_FOURCC('D', 'X', 'T', '2')
+#define FMT_DXT3     MAKE_FOURCC('D', 'X', 'T', '3')
+#define FMT_DXT4     MAKE_FOURCC('D', 'X', 'T', '4')
+#define FMT_DXT5     MAKE_FOURCC('D', 'X', 'T', '5')
+
+#define DDS_MAGIC         MAKE_FOURCC('D', 'D', 'S', ' ')
+#define DDS_FOURCC_DX10   MAKE_FOURCC('D', 'X', '1', '0')
+#define DDS_MIPMAPCOUNT   0x20000
+#define DDS_PF_ALPHA      0x1
+#define DDS_PF_ALPHA_ONLY 0x2
+#define DDS_PF_FOURCC     0x4
+#define DDS_PF_RGB        0x40
+#define DDS_PF_LUMINANCE  0x20000
+#define DDS_CAPS2_CUBEMAP 0x200
+#define DDS_CAPS2_VOLUME  0x200000
+#define DDS_DX10_CUBE     0x4
+
+struct dds_pixel_format
+{
+	uint32_t size;
+	uint32_t flags;
+	uint32_t fourcc;
+	uint32_t bpp;
+	uint32_t rmask;
+	uint32_t gmask;
+	uint32_t bmask;
+	uint32_t amask;
+};
+
+struct dds_header
+{
+	uint32_t size;
+	uint32_t flags;
+	uint32_t height;
+	uint32_t width;
+	uint32_t pitch_or_linear_size;
+	uint32_t depth;
+	uint32_t miplevels;
+	uint32_t reserved[11];
+	dds_pixel_format pixel_format;
+	uint32_t caps;
+	uint32_t caps2;
+	uint32_t caps3;
+	uint32_t caps4;
+	uint32_t reserved2;
+};
+
+struct dds_header_dx10
+{
+	uint32_t dxgi_format;
+	uint32_t resource_dimension;
+	uint32_t misc_flag;
+	uint32_t array_size;
+	uint32_t misc_flags2;
+};
+
+struct packed_texture
+{
+	TexturePackEntry              entry;
+	std::vector<TexturePackLevel> levels; // offsets from the payload until it is placed
+	std::vector<TexturePackChunk> chunks; // and indices from the first chunk of the texture
+	std::vector<char>             data;
+};
+
+static uint32_t get_rgb_format(const dds_pixel_format& pf)
+{
+	static const struct
+	{
+		uint32_t bpp, rmask, gmask, bmask, amask, format;
+	}
+	formats[] =
+	{
+		{ 32, 0xff0000, 0xff00, 0xff, 0xff000000, FMT_A8R8G8B8 },
+		{ 32, 0xff0000, 0xff00, 0xff, 0, FMT_X8R8G8B8 },
+		{ 32, 0xff, 0xff00, 0xff0000, 0xff000000, FMT_A8B8G8R8 },
+		{ 32, 0xff, 0xff00, 0xff0000, 0, FMT_X8B8G8R8 },
+		{ 24, 0xff0000, 0xff00, 0xff, 0, FMT_R8G8B8 },
+		{ 16, 0xf800, 0x7e0, 0x1f, 0, FMT_R5G6B5 },
+		{ 16, 0x7c00, 0x3e0, 0x1f, 0, FMT_X1R5G5B5 },
+		{ 16, 0x7c00, 0x3e0, 0x1f, 0x8000, FMT_A1R5G5B5 },
+		{ 16, 0xf00, 0xf0, 0xf, 0xf000, FMT_A4R4G4B4 },
+	};
+	const uint32_t amask = pf.flags & DDS_PF_ALPHA ? pf.amask : 0;
+
+	for (const auto& f : formats)
+	{
+		if (f.bpp == pf.bpp && f.rmask == pf.rmask && f.gmask == pf.gmask && f.bmask == pf.bmask && f.amask == amask)
+			return f.format;
+	}
+	return 0;
+}
+
+static uint32_t get_format(const dds_pixel_format& pf, const dds_header_dx10* dx10, uint32_t* flags)
+{
+	if (dx10)
+	{
+		switch (dx10->dxgi_format)
+		{
+		case 72:
+			*flags |= TEXTURE_PACK_SRGB; // BC1_UNORM_SRGB
+			[[fallthrough]];
+		case 70: case 71: return FMT_DXT1;
+		case 75:
+			*flags |= TEXTURE_PACK_SRGB; // BC2_UNORM_SRGB
+			[[fallthrough]];
+		case 73: case 74: return FMT_DXT3;
+		case 78:
+			*flags |= TEXTURE_PACK_SRGB; // BC3_UNORM_SRGB
+			[[fallthrough]];
+		case 76: case 77: return FMT_DXT5;
+		case 29:
+			*flags |= TEXTURE_PACK_SRGB; // R8G8B8A8_UNORM_SRGB
+			[[fallthrough]];
+		case 28: return FMT_A8B8G8R8;
+		case 91:
+			*flags |= TEXTURE_PACK_SRGB; // B8G8R8A8_UNORM_SRGB
+			[[fallthrough]];
+		case 87: return FMT_A8R8G8B8;
+		case 93:
+			*flags |= TEXTURE_PACK_SRGB; // B8G8R8X8_UNORM_SRGB
+			[[fallthrough]];
+		case 88: return FMT_X8R8G8B8;
+		case 85: return FMT_R5G6B5;
+		case 86: return FMT_A1R5G5B5;
+		case 65: return FMT_A8;
+		default: return 0;
+		}
+	}
+	if (pf.flags & DDS_PF_FOURCC)
+	{
+		switch (pf.fourcc)
+		{
+		case FMT_DXT1: case FMT_DXT2: case FMT_DXT3: case FMT_DXT4: case FMT_DXT5:
+			return pf.fourcc;
+		default:
+			return 0;
+		}
+	}
+	if (pf.flags & DDS_PF_RGB)
+		return get_rgb_format(pf);
+	if (pf.flags & DDS_PF_LUMINANCE)
+		return pf.bpp == 8 ? FMT_L8 : pf.bpp == 16 && (pf.flags & DDS_PF_ALPHA) ? FMT_A8L8 : 0;
+	if ((pf.flags & DDS_PF_ALPHA_ONLY) && pf.bpp == 8)
+		return FMT_A8;
+	return 0;
+}
+
+// bytes of a block and its size in pixels
+static uint32_t get_block_size(uint32_t format, uint32_t* block_dim)
+{
+	*block_dim = 4;
+	switch (format)
+	{
+	case FMT_DXT1: return 8;
+	case FMT_DXT2: case FMT_DXT3: case FMT_DXT4: case FMT_DXT5: return 16;
+	}
+	*block_dim = 1;
+	switch (format)
+	{
+	case FMT_A8: case FMT_L8: return 1;
+	case FMT_R8G8B8: return 3;
+	case FMT_A8R8G8B8: case FMT_X8R8G8B8: case FMT_A8B8G8R8: case FMT_X8B8G8R8: return 4;
+	default: return 2;
+	}
+}
+
+static bool pack_dds(const std::filesystem::path& path, const std::string& name, packed_texture* tex)
+{
+	FILE* file = fopen(path.string().c_str(), "rb");
+	if (!file)
+		return false;
+	std::vector<char> data;
+	fseek(file, 0, SEEK_END);
+	data.resize(ftell(file));
+	fseek(file, 0, SEEK_SET);
+	const bool read = fread(data.data(), 1, data.size(), file) == data.size();
+	fclose(file);
+
+	uint32_t magic;
+	dds_header header;
+	dds_header_dx10 dx10;
+	size_t offset = sizeof(magic) + sizeof(header);
+	if (!read || data.size() < offset)
+		return false;
+	memcpy(&magic, data.data(), sizeof(magic));
+	memcpy(&header, data.data() + sizeof(magic), sizeof(header));
+	if (magic != DDS_MAGIC)
+		return false;
+
+	const bool has_dx10 = (header.pixel_format.flags & DDS_PF_FOURCC) && header.pixel_format.fourcc == DDS_FOURCC_DX10;
+	if (has_dx10)
+	{
+		if (data.size() < offset + sizeof(dx10))
+			return false;
+		memcpy(&dx10, data.data() + offset, sizeof(dx10));
+		offset += sizeof(dx10);
+	}
+
+	TexturePackEntry& entry = tex->entry;
+	memset(&entry, 0, sizeof(entry));
+	if (name.size() >= sizeof(entry.name))
+		return false;
+	strcpy(entry.name, name.c_str());
+	entry.format = get_format(header.pixel_format, has_dx10 ? &dx10 : nullptr, &entry.flags);
+	if (!entry.format)
+		return false;
+	entry.width = header.width;
+	entry.height = header.height;
+	entry.depth = 1;
+	entry.levels = header.flags & DDS_MIPMAPCOUNT ? std::max(header.miplevels, 1u) : 1;
+	entry.faces = 1;
+	entry.type = TEXTURE_PACK_2D;
+	if ((header.caps2 & DDS_CAPS2_CUBEMAP) || (has_dx10 && (dx10.misc_flag & DDS_DX10_CUBE)))
+	{
+		// D3D9 has no partial cube maps
+		entry.type = TEXTURE_PACK_CUBE;
+		entry.faces = 6;
+	}
+	else if (header.caps2 & DDS_CAPS2_VOLUME)
+	{
+		entry.type = TEXTURE_PACK_VOLUME;
+		entry.depth = std::max(header.depth, 1u);
+	}
+
+	uint32_t block_dim;
+	const uint32_t block_size = get_block_size(entry.format, &block_dim);
+	size_t payload = 0;
+	for (uint32_t face = 0; face < entry.faces; ++face)
+	{
+		for (uint32_t level = 0; level < entry.levels; ++level)
+		{
+			const uint32_t width = std::max(entry.width >> level, 1u);
+			const uint32_t height = std::max(entry.height >> level, 1u);
+			TexturePackLevel rec = {};
+			rec.row_pitch = (width + block_dim - 1) / block_dim * block_size;
+			rec.rows = (height + block_dim - 1) / block_dim;
+			rec.slice_pitch = rec.row_pitch * rec.rows;
+			rec.depth = std::max(entry.depth >> level, 1u);
+			rec.offset = payload;
+			payload += (size_t)rec.slice_pitch * rec.depth;
+			tex->levels.push_back(rec);
+		}
+	}
+	if (data.size() < offset + payload)
+		return false;
+	tex->data.assign(data.begin() + offset, data.begin() + offset + payload);
+	entry.size = payload;
+	return true;
+}
+
+// replaces the raw levels by chunks, a chunk that doesn't get smaller stays raw
+static void compress_texture(packed_texture* tex)
+{
+	std::vector<char> data;
+	std::vector<char> block;
+
+	for (auto& rec : tex->levels)
+	{
+		const char* src = tex->data.data() + rec.offset;
+		const uint32_t chunk_rows = std::clamp<uint32_t>(CHUNK_SIZE / rec.row_pitch, 1, rec.rows);
+
+		rec.offset = data.size();
+		rec.first_chunk = tex->chunks.size();
+		for (uint32_t z = 0; z < rec.depth; ++z)
+		{
+			for (uint32_t y = 0; y < rec.rows; y += chunk_rows)
+			{
+				TexturePackChunk chunk;
+				chunk.first_row = z * rec.rows + y;
+				chunk.rows = std::min(chunk_rows, rec.rows - y);
+				chunk.raw_size = chunk.rows * rec.row_pitch;
+				chunk.offset = data.size();
+
+				const char* rows = src + (size_t)chunk.first_row * rec.row_pitch;
+				block.resize(LZ4_COMPRESS_BOUND(chunk.raw_size));
+				chunk.size = lz4_compress_block(rows, chunk.raw_size, block.data(), block.size());
+				if (chunk.size && chunk.size < chunk.raw_size)
+					data.insert(data.end(), block.data(), block.data() + chunk.size);
+				else
+				{
+					chunk.size = chunk.raw_size;
+					data.insert(data.end(), rows, rows + chunk.raw_size);
+				}
+				tex->chunks.push_back(chunk);
+			}
+		}
+		rec.chunk_count = tex->chunks.size() - rec.first_chunk;
+	}
+	tex->data.swap(data);
+	tex->entry.size = tex->data.size();
+}
+
+int main(int argc, char* argv[])
+{
+	const bool compress = argc == 4 && !strcmp(argv[1], "--compress");
+	if (argc != 3 && !compress)
+	{
+		fprintf(stderr, "usage: texture_packer [--compress] <textures dir> <pack file>\n");
+		return 1;
+	}
+	if (compress)
+		++argv;
+
+	const std::filesystem::path root = argv[1];
+	std::vector<std::filesystem::path> files;
+	for (const auto& item : std::filesystem::recursive_directory_iterator(root))
+	{
+		if (item.is_regular_file() && item.path().extension() == ".dds")
+			files.push_back(item.path());
+	}
+	std::sort(files.begin(), files.end());
+
+	std::vector<packed_texture> textures;
+	uint32_t level_count = 0;
+	uint32_t chunk_count = 0;
+	uint64_t raw_size = 0;
+	for (const auto& path : files)
+	{
+		packed_texture tex;
+		const std::string name = std::filesystem::relative(path, root).generic_string();
+		if (!pack_dds(path, name, &tex))
+		{
+			fprintf(stderr, "texture_packer: skipping %s, not a supported DDS file\n", name.c_str());
+			continue;
+		}
+		raw_size += tex.entry.size;
+		if (compress)
+			compress_texture(&tex);
+		for (auto& rec : tex.levels)
+			rec.first_chunk += chunk_count;
+		tex.entry.first_level = level_count;
+		level_count += tex.levels.size();
+		chunk_count += tex.chunks.size();
+		textures.push_back(std::move(tex));
+	}
+
+	TexturePackHeader header;
+	header.magic = TEXTURE_PACK_MAGIC;
+	header.version = TEXTURE_PACK_VERSION;
+	header.entry_count = textures.size();
+	header.level_count = level_count;
+	header.entry_offset = sizeof(header);
+	header.level_offset = header.entry_offset + sizeof(TexturePackEntry) * textures.size();
+	header.chunk_count = chunk_count;
+	header.reserved = 0;
+	header.chunk_offset = header.level_offset + sizeof(TexturePackLevel) * level_count;
+
+	// place the payloads after the tables
+	uint64_t offset = header.chunk_offset + sizeof(TexturePackChunk) * chunk_count;
+	for (auto& tex : textures)
+	{
+		offset = (offset + TEXTURE_PACK_ALIGN - 1) & ~(uint64_t)(TEXTURE_PACK_ALIGN - 1);
+		tex.entry.offset = offset;
+		for (auto& rec : tex.levels)
+			rec.offset += offset;
+		for (auto& chunk : tex.chunks)
+			chunk.offset += offset;
+		offset += tex.entry.size;
+	}
+	header.size = offset;
+
+	FILE* out = fopen(argv[2], "wb");
+	if (!out)
+	{
+		fprintf(stderr, "texture_packer: can't write %s\n", argv[2]);
+		return 1;
+	}
+	fwrite(&header, sizeof(header), 1, out);
+	for (const auto& tex : textures)
+		fwrite(&tex.entry, sizeof(tex.entry), 1, out);
+	for (const auto& tex : textures)
+		fwrite(tex.levels.data(), sizeof(TexturePackLevel), tex.levels.size(), out);
+	for (const auto& tex : textures)
+		fwrite(tex.chunks.data(), sizeof(TexturePackChunk), tex.chunks.size(), out);
+	for (const auto& tex : textures)
+	{
+		// pad up to the payload
+		static const char zero[TEXTURE_PACK_ALIGN] = {};
+		fwrite(zero, 1, tex.entry.offset - ftell(out), out);
+		fwrite(tex.data.data(), 1, tex.data.size(), out);
+	}
+	const bool ok = !ferror(out);
+	fclose(out);
+	if (!ok)
+	{
+		fprintf(stderr, "texture_packer: error writing %s\n", argv[2]);
+		return 1;
+	}
+
+	printf("texture_packer: %u textures, %llu bytes", header.entry_count, (unsigned long long)header.size);
+	if (compress)
+		printf(", %u chunks from %llu bytes of levels", chunk_count, (unsigned long long)raw_size);
+	printf("\n");
+	return 0;
+}
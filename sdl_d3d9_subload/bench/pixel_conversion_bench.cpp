@@ -0,0 +1,453 @@
+//-----------------------------------------------------------------------------
+// Headless benchmark for the pixel conversion engine
+//
+// pixel_conversion_bench [--check] [--scalar] [--serial] [--sizes 64,1024]
+//                        [--op convert] [--src A8R8G8B8] [--dst R5G6B5] [--max-mb 1024]
+//
+// Runs every supported pair of the format table through copy_pixels,
+// convert_argb_pixels, point_filter_argb_pixels, resample_argb_pixels with each
+// filter, compress_dxt_pixels and format_to_vec4/format_from_vec4, with tight and
+// padded pitches and with and without a color key, and prints MPix/s of the
+// destination and bytes read and written per TSC cycle. --scalar and --serial time
+// the reference code. --check compares the SIMD and threaded kernels against the
+// scalar, single threaded code instead and exits with 1 on the first difference.
+//-----------------------------------------------------------------------------
+
+#include <algorithm>
+#include <chrono>
+#include <string>
+#include <vector>
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "pixel_conversion.h"
+
+#ifdef ARGB_SIMD
+#ifdef _MSC_VER
+#include <intrin.h>
+#else
+#include <x86intrin.h>
+#endif
+#endif
+
+enum bench_op
+{
+    OP_COPY,
+    OP_CONVERT,
+    OP_POINT,
+    OP_LINEAR,
+    OP_TRIANGLE,
+    OP_BOX,
+    OP_KAISER,
+    OP_DXT,
+    OP_DXT_FAST,
+    OP_VEC4,
+    OP_COUNT
+};
+
+static const char *const op_names[OP_COUNT] =
+{
+    "copy", "convert", "point", "linear", "triangle", "box", "kaiser", "dxt", "dxt_fast", "vec4",
+};
+
+struct bench_case
+{
+    enum bench_op op;
+    const struct pixel_format_desc *src_format, *dst_format;
+    struct volume src_size, dst_size;
+    UINT src_pitch, dst_pitch;
+    BOOL padded;
+    D3DCOLOR color_key;
+};
+
+struct bench_options
+{
+    BOOL check;
+    DWORD features;
+    std::vector<UINT> sizes;
+    const char *op, *src, *dst;
+    unsigned long long max_bytes;
+};
+
+static PALETTEENTRY palette[256];
+static unsigned int seed = 1;
+
+static unsigned int rnd()
+{
+    seed = seed * 1103515245 + 12345;
+    return seed >> 8;
+}
+
+static const char *format_name(D3DFORMAT format)
+{
+#define FORMAT_NAME(f) case D3DFMT_##f: return #f;
+    switch (format)
+    {
+        FORMAT_NAME(R8G8B8) FORMAT_NAME(A8R8G8B8) FORMAT_NAME(X8R8G8B8) FORMAT_NAME(A8B8G8R8)
+        FORMAT_NAME(X8B8G8R8) FORMAT_NAME(R5G6B5) FORMAT_NAME(X1R5G5B5) FORMAT_NAME(A1R5G5B5)
+        FORMAT_NAME(R3G3B2) FORMAT_NAME(A8R3G3B2) FORMAT_NAME(A4R4G4B4) FORMAT_NAME(X4R4G4B4)
+        FORMAT_NAME(A2R10G10B10) FORMAT_NAME(A2B10G10R10) FORMAT_NAME(A16B16G16R16) FORMAT_NAME(G16R16)
+        FORMAT_NAME(A8) FORMAT_NAME(A8L8) FORMAT_NAME(A4L4) FORMAT_NAME(L8) FORMAT_NAME(L16)
+        FORMAT_NAME(DXT1) FORMAT_NAME(DXT2) FORMAT_NAME(DXT3) FORMAT_NAME(DXT4) FORMAT_NAME(DXT5)
+        FORMAT_NAME(R16F) FORMAT_NAME(G16R16F) FORMAT_NAME(A16B16G16R16F)
+        FORMAT_NAME(R32F) FORMAT_NAME(G32R32F) FORMAT_NAME(A32B32G32R32F) FORMAT_NAME(P8)
+        default: return "UNKNOWN";
+    }
+#undef FORMAT_NAME
+}
+
+static BOOL is_filtered(const char *filter, const char *name)
+{
+    return filter && strcmp(filter, name);
+}
+
+/* bytes of one row of blocks and the number of those rows */
+static UINT get_row_bytes(const struct pixel_format_desc *format, UINT width)
+{
+    return (width + format->block_width - 1) / format->block_width * format->block_byte_count;
+}
+
+static UINT get_row_count(const struct pixel_format_desc *format, UINT height)
+{
+    return (height + format->block_height - 1) / format->block_height;
+}
+
+/* Random pixels, float channels stay finite so the kernels can be compared bit by bit. */
+static void fill_source(const struct pixel_format_desc *format, BYTE *data, size_t size)
+{
+    size_t i;
+
+    if (format->type == FORMAT_ARGBF16)
+    {
+        for (i = 0; i + 2 <= size; i += 2)
+        {
+            WORD half = (rnd() % 16) << 10 | rnd() % 1024;
+            memcpy(data + i, &half, sizeof(half));
+        }
+    }
+    else if (format->type == FORMAT_ARGBF)
+    {
+        for (i = 0; i + 4 <= size; i += 4)
+        {
+            float value = (rnd() % 0x10000) / 32768.0f - 0.5f;
+            memcpy(data + i, &value, sizeof(value));
+        }
+    }
+    else
+    {
+        for (i = 0; i < size; ++i)
+            data[i] = (BYTE)rnd();
+    }
+}
+
+static void execute_case(const struct bench_case *c, BYTE *src, BYTE *dst)
+{
+    static const struct pixel_format_desc *argb_format = get_format_info(D3DFMT_A8R8G8B8);
+    struct conversion_plan plan, from_argb;
+    UINT x, y;
+
+    switch (c->op)
+    {
+        case OP_COPY:
+            copy_pixels(src, c->src_pitch, 0, dst, c->dst_pitch, 0, &c->src_size, c->src_format);
+            break;
+
+        case OP_CONVERT:
+        case OP_POINT:
+            init_conversion_plan(c->src_format, c->dst_format, c->color_key, palette, &plan);
+            if (c->op == OP_CONVERT)
+                convert_argb_pixels(src, c->src_pitch, 0, &c->src_size, dst, c->dst_pitch, 0, &c->dst_size, &plan);
+            else
+                point_filter_argb_pixels(src, c->src_pitch, 0, &c->src_size, dst, c->dst_pitch, 0, &c->dst_size, &plan);
+            break;
+
+        case OP_LINEAR:
+        case OP_TRIANGLE:
+        case OP_BOX:
+        case OP_KAISER:
+            init_conversion_plan(c->src_format, argb_format, c->color_key, palette, &plan);
+            init_conversion_plan(argb_format, c->dst_format, 0, NULL, &from_argb);
+            resample_argb_pixels(src, c->src_pitch, 0, &c->src_size, dst, c->dst_pitch, 0, &c->dst_size,
+                                 &plan, &from_argb, D3DX_FILTER_LINEAR + c->op - OP_LINEAR);
+            break;
+
+        case OP_DXT:
+        case OP_DXT_FAST:
+            compress_dxt_pixels((DWORD *)src, c->src_pitch / sizeof(DWORD), c->src_size.width, c->src_size.height,
+                                dst, c->dst_pitch, c->dst_format, c->op == OP_DXT_FAST);
+            break;
+
+        case OP_VEC4:
+            for (y = 0; y < c->src_size.height; ++y)
+            {
+                for (x = 0; x < c->src_size.width; ++x)
+                {
+                    struct vec4 color;
+
+                    format_to_vec4(c->src_format, src + y * c->src_pitch + x * c->src_format->bytes_per_pixel, &color);
+                    format_from_vec4(c->dst_format, &color, dst + y * c->dst_pitch + x * c->dst_format->bytes_per_pixel);
+                }
+            }
+            break;
+
+        default:
+            break;
+    }
+}
+
+/* Returns FALSE if the SIMD and threaded result differs from the reference. */
+static BOOL check_case(const struct bench_case *c, std::vector<BYTE> &src, size_t dst_bytes)
+{
+    std::vector<BYTE> source = src, reference(dst_bytes, 0xcd), result(dst_bytes, 0xcd);
+    size_t i;
+
+    set_conversion_features(0);
+    execute_case(c, source.data(), reference.data());
+    source = src;
+    set_conversion_features(CONVERSION_SIMD | CONVERSION_THREADS);
+    execute_case(c, source.data(), result.data());
+
+    if (reference == result)
+        return TRUE;
+    for (i = 0; reference[i] == result[i]; ++i);
+    printf("MISMATCH %s %s -> %s %ux%u %s key %#lx: byte %zu is %#x, reference %#x\n", op_names[c->op],
+           format_name(c->src_format->format), format_name(c->dst_format->format), c->src_size.width,
+           c->src_size.height, c->padded ? "padded" : "tight", (unsigned long)c->color_key, i, result[i], reference[i]);
+    return FALSE;
+}
+
+static void time_case(const struct bench_case *c, std::vector<BYTE> &src, size_t dst_bytes)
+{
+    std::vector<BYTE> dst(dst_bytes);
+    double best = 1e30, total = 0.0;
+    unsigned long long cycles = 0, bytes;
+    UINT reps = 0;
+
+    execute_case(c, src.data(), dst.data()); /* faults the pages in */
+    do
+    {
+        auto start = std::chrono::steady_clock::now();
+#ifdef ARGB_SIMD
+        unsigned long long tsc = __rdtsc();
+#endif
+        double seconds;
+
+        execute_case(c, src.data(), dst.data());
+        seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+        if (seconds < best)
+        {
+            best = seconds;
+#ifdef ARGB_SIMD
+            cycles = __rdtsc() - tsc;
+#endif
+        }
+        total += seconds;
+    } while (++reps < 10 && total < 0.1);
+
+    bytes = (unsigned long long)get_row_bytes(c->src_format, c->src_size.width) * get_row_count(c->src_format, c->src_size.height)
+            + (unsigned long long)get_row_bytes(c->dst_format, c->dst_size.width) * get_row_count(c->dst_format, c->dst_size.height);
+    printf("%-9s %-14s %-14s %5ux%-5u %-6s %-3s %10.1f MPix/s", op_names[c->op], format_name(c->src_format->format),
+           format_name(c->dst_format->format), c->src_size.width, c->src_size.height, c->padded ? "padded" : "tight",
+           c->color_key ? "key" : "-", (double)c->dst_size.width * c->dst_size.height / best / 1e6);
+    if (cycles)
+        printf(" %7.2f B/cycle\n", (double)bytes / cycles);
+    else
+        printf("       - B/cycle\n");
+}
+
+/* Runs or checks one case, FALSE on a mismatch. */
+static BOOL run_case(const struct bench_options *options, struct bench_case *c)
+{
+    UINT src_rows = get_row_count(c->src_format, c->src_size.height);
+    UINT dst_rows = get_row_count(c->dst_format, c->dst_size.height);
+    UINT pad = c->padded ? 256 : 0;
+    std::vector<BYTE> src;
+
+    c->src_pitch = get_row_bytes(c->src_format, c->src_size.width) + pad;
+    c->dst_pitch = get_row_bytes(c->dst_format, c->dst_size.width) + pad;
+    if (c->op == OP_DXT || c->op == OP_DXT_FAST) /* compress_dxt_pixels pads the source to whole blocks */
+    {
+        c->src_pitch = ((c->src_size.width + 3) & ~3u) * sizeof(DWORD) + pad;
+        src_rows = (c->src_size.height + 3) & ~3u;
+    }
+    if ((unsigned long long)c->src_pitch * src_rows + (unsigned long long)c->dst_pitch * dst_rows > options->max_bytes)
+        return TRUE;
+
+    src.resize((size_t)c->src_pitch * src_rows);
+    fill_source(c->src_format, src.data(), src.size());
+    if (c->color_key) /* the key is the first pixel, repeated along each row */
+    {
+        UINT bpp = c->src_format->bytes_per_pixel, x, y;
+        struct conversion_plan plan;
+        struct volume one = {1, 1, 1};
+
+        set_conversion_features(0);
+        init_conversion_plan(c->src_format, get_format_info(D3DFMT_A8R8G8B8), 0, palette, &plan);
+        convert_argb_pixels(src.data(), c->src_pitch, 0, &one, (BYTE *)&c->color_key, 4, 0, &one, &plan);
+        for (y = 0; y < src_rows; ++y)
+            for (x = 0; x < c->src_size.width; x += 7)
+                memcpy(src.data() + y * c->src_pitch + x * bpp, src.data(), bpp);
+    }
+
+    if (options->check)
+        return check_case(c, src, (size_t)c->dst_pitch * dst_rows);
+    set_conversion_features(options->features);
+    time_case(c, src, (size_t)c->dst_pitch * dst_rows);
+    return TRUE;
+}
+
+static BOOL is_op_supported(enum bench_op op, const struct pixel_format_desc *src, const struct pixel_format_desc *dst)
+{
+    switch (op)
+    {
+        case OP_COPY:
+        case OP_VEC4:
+            return src == dst && (op == OP_COPY || src->type != FORMAT_DXT);
+        case OP_CONVERT:
+        case OP_POINT:
+            return is_conversion_from_supported(src) && is_conversion_to_supported(dst) && dst->type != FORMAT_DXT;
+        case OP_DXT:
+        case OP_DXT_FAST:
+            return src->format == D3DFMT_A8R8G8B8 && dst->type == FORMAT_DXT;
+        default:
+            return is_resample_supported(src) && is_resample_supported(dst) && dst->type != FORMAT_DXT;
+    }
+}
+
+static BOOL run_cases(const struct bench_options *options)
+{
+    const struct pixel_format_desc *table;
+    UINT count, op, i, j, size, padded, key;
+    BOOL ok = TRUE;
+
+    table = get_format_table(&count);
+    for (op = 0; op < OP_COUNT; ++op)
+    {
+        if (is_filtered(options->op, op_names[op]) || (options->check && op == OP_VEC4))
+            continue;
+        for (i = 0; i < count; ++i)
+        {
+            for (j = 0; j < count; ++j)
+            {
+                if (!is_op_supported((enum bench_op)op, &table[i], &table[j])
+                    || is_filtered(options->src, format_name(table[i].format))
+                    || is_filtered(options->dst, format_name(table[j].format)))
+                    continue;
+
+                for (size = 0; size < options->sizes.size(); size += 2)
+                {
+                    for (padded = 0; padded < 2; ++padded)
+                    {
+                        /* the color key only matters where a plan is built */
+                        for (key = 0; key < (op == OP_CONVERT || op == OP_POINT || (op >= OP_LINEAR && op <= OP_KAISER)
+                                             ? 2u : 1u); ++key)
+                        {
+                            struct bench_case c = {(enum bench_op)op, &table[i], &table[j], {}, {}, 0, 0, (BOOL)padded, key};
+
+                            /* the largest check size is only there for the row band split */
+                            if (options->check && size + 2 == options->sizes.size() && (padded || key))
+                                continue;
+
+                            c.src_size.width = options->sizes[size];
+                            c.src_size.height = options->sizes[size + 1];
+                            c.src_size.depth = 1;
+                            c.dst_size = c.src_size;
+                            if (op == OP_POINT) /* a ratio that isn't a power of two */
+                            {
+                                c.dst_size.width = std::max(1u, c.src_size.width * 3 / 4);
+                                c.dst_size.height = std::max(1u, c.src_size.height * 3 / 4);
+                            }
+                            else if (op >= OP_LINEAR && op <= OP_KAISER) /* a mip level */
+                            {
+                                c.dst_size.width = std::max(1u, c.src_size.width / 2);
+                                c.dst_size.height = std::max(1u, c.src_size.height / 2);
+                            }
+                            if (!run_case(options, &c))
+                            {
+                                ok = FALSE;
+                                if (options->check)
+                                    return ok;
+                            }
+                        }
+                    }
+                }
+            }
+        }
+    }
+    return ok;
+}
+
+static void parse_sizes(const char *arg, std::vector<UINT> &sizes)
+{
+    sizes.clear();
+    while (*arg)
+    {
+        UINT size = strtoul(arg, (char **)&arg, 10);
+
+        sizes.push_back(size);
+        sizes.push_back(size);
+        if (*arg == ',')
+            ++arg;
+        else if (*arg)
+            break;
+    }
+}
+
+int main(int argc, char *argv[])
+{
+    struct bench_options options = {FALSE, CONVERSION_SIMD | CONVERSION_THREADS, {}, NULL, NULL, NULL, 1024ull << 20};
+    int i;
+
+    parse_sizes("64,256,1024,4096,8192", options.sizes);
+    for (i = 0; i < 256; ++i)
+    {
+        palette[i].peRed = rnd();
+        palette[i].peGreen = rnd();
+        palette[i].peBlue = rnd();
+        palette[i].peFlags = rnd();
+    }
+
+    for (i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+
+        if (arg == "--check")
+            options.check = TRUE;
+        else if (arg == "--scalar")
+            options.features &= ~CONVERSION_SIMD;
+        else if (arg == "--serial")
+            options.features &= ~CONVERSION_THREADS;
+        else if (arg == "--sizes" && i + 1 < argc)
+            parse_sizes(argv[++i], options.sizes);
+        else if (arg == "--op" && i + 1 < argc)
+            options.op = argv[++i];
+        else if (arg == "--src" && i + 1 < argc)
+            options.src = argv[++i];
+        else if (arg == "--dst" && i + 1 < argc)
+            options.dst = argv[++i];
+        else if (arg == "--max-mb" && i + 1 < argc)
+            options.max_bytes = strtoull(argv[++i], NULL, 10) << 20;
+        else
+        {
+            fprintf(stderr, "usage: %s [--check] [--scalar] [--serial] [--sizes 64,1024] [--op name]"
+                    " [--src format] [--dst format] [--max-mb n]\n", argv[0]);
+            return 2;
+        }
+    }
+
+    if (options.check)
+    {
+        /* odd sizes for the row tails, the last one is large enough for the row band workers */
+        options.sizes = {1, 1, 67, 45, 523, 517};
+        if (!run_cases(&options))
+            return 1;
+        printf("all kernels match the scalar reference\n");
+        return 0;
+    }
+
+    printf("%-9s %-14s %-14s %-11s %-6s %-3s %17s %15s\n", "op", "src", "dst", "size", "pitch", "key", "dst rate", "bandwidth");
+    run_cases(&options);
+    return 0;
+}
@@ -2,7 +2,12 @@
 // Control Keys: F1 - Toggle subloading
 //-----------------------------------------------------------------------------
 
+#include <algorithm>
+#include <array>
+#include <cmath>
+#include <mutex>
 #include <string>
+#include <vector>
 
 #include <d3d9.h>
 #include <SDL2/SDL.h>
@@ -16,7 +21,11 @@
 #include <d3dx9.h>
 #else
 #include <gli/gli.hpp>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #define LoadSurfaceFromSurfaceV2
+#include "pixel_conversion.h"
 #endif
 
 // D3DX9 functions
@@ -66,6 +75,18 @@ D3DMATRIX* MatrixTranslation(D3DMATRIX* pout, float x, float y, float z)
     return pout;
 }
 
+// one rect of a LoadSurfaceFromSubloads() batch, read from src_memory or from src_surface
+struct surface_subload
+{
+    const void *src_memory;
+    IDirect3DSurface9 *src_surface;
+    D3DFORMAT src_format;          // format and pitch of src_memory
+    UINT src_pitch;
+    const PALETTEENTRY *src_palette;
+    RECT src_rect;
+    RECT dst_rect;
+};
+
 #ifdef LoadSurfaceFromSurfaceV1
 
 static inline bool WinSetRect(LPRECT rect, int left, int top, int right, int bottom)
@@ -129,19 +150,6 @@ HRESULT LoadSurfaceFromSurface(IDirect3DSurface9* dst_surface,
 
 #define D3DX_DEFAULT         ((UINT)-1)
 
-// wine-8.2/include/d3dx9tex.h
-
-#define D3DX_FILTER_NONE                 0x00000001
-#define D3DX_FILTER_POINT                0x00000002
-#define D3DX_FILTER_LINEAR               0x00000003
-#define D3DX_FILTER_TRIANGLE             0x00000004
-#define D3DX_FILTER_BOX                  0x00000005
-#define D3DX_FILTER_MIRROR_U             0x00010000
-#define D3DX_FILTER_MIRROR_V             0x00020000
-#define D3DX_FILTER_MIRROR_W             0x00040000
-#define D3DX_FILTER_MIRROR               0x00070000
-#define D3DX_FILTER_DITHER               0x00080000
-
 // wine-8.2/include/winuser.h
 
 static inline BOOL SetRect(LPRECT rect, INT left, INT top, INT right, INT bottom)
@@ -154,655 +162,991 @@ static inline BOOL SetRect(LPRECT rect, INT left, INT top, INT right, INT bottom
     return TRUE;
 }
 
-// wine-8.2/dlls/d3dx9_36/d3dx9_private.h
+/************************************************************
+ * staging surface pool
+ *
+ * Temporary surfaces for surfaces that can't be locked directly are kept
+ * per (device, format, width, height, pool) and reused. Each slot issues
+ * a D3DQUERYTYPE_EVENT fence when it is released and is only handed out
+ * again once the GPU has passed it, otherwise another slot is created.
+ */
+#define STAGING_POOL_MAX_SLOTS 16
 
-struct vec4
+struct staging_surface_key
 {
-    float x, y, z, w;
+    IDirect3DDevice9 *device;
+    D3DFORMAT format;
+    UINT width, height;
+    D3DPOOL pool;           /* D3DPOOL_SYSTEMMEM for writes, D3DPOOL_DEFAULT render targets for reads */
 };
 
-struct volume
+struct staging_surface_slot
 {
-    UINT width;
-    UINT height;
-    UINT depth;
+    struct staging_surface_key key;
+    IDirect3DSurface9 *surface;
+    IDirect3DQuery9 *fence; /* NULL if the device has no event queries */
+    BOOL in_use;
+    ULONG last_use;
 };
 
-/* for internal use */
-enum format_type {
-    FORMAT_ARGB,   /* unsigned */
-    FORMAT_ARGBF16,/* float 16 */
-    FORMAT_ARGBF,  /* float */
-    FORMAT_DXT,
-    FORMAT_INDEX,
-    FORMAT_UNKNOWN
+struct staging_pool_stats
+{
+    ULONG hits, misses;
+    UINT slot_count;
 };
 
-struct pixel_format_desc {
-    D3DFORMAT format;
-    BYTE bits[4];
-    BYTE shift[4];
-    UINT bytes_per_pixel;
-    UINT block_width;
-    UINT block_height;
-    UINT block_byte_count;
-    enum format_type type;
-    void (*from_rgba)(const struct vec4 *src, struct vec4 *dst);
-    void (*to_rgba)(const struct vec4 *src, struct vec4 *dst, const PALETTEENTRY *palette);
+struct staging_surface_pool
+{
+    std::mutex mutex;
+    std::vector<struct staging_surface_slot> slots;
+    ULONG clock = 0;
+    ULONG hits = 0, misses = 0;
 };
 
-static inline BOOL is_conversion_from_supported(const struct pixel_format_desc *format)
+static staging_surface_pool &get_staging_surface_pool()
 {
-    if (format->type == FORMAT_ARGB || format->type == FORMAT_ARGBF16
-        || format->type == FORMAT_ARGBF || format->type == FORMAT_DXT)
-        return TRUE;
-    return !!format->to_rgba;
+    static staging_surface_pool pool;
+
+    return pool;
 }
 
-static inline BOOL is_conversion_to_supported(const struct pixel_format_desc *format)
+static inline BOOL is_same_staging_key(const struct staging_surface_key *a, const struct staging_surface_key *b)
 {
-    if (format->type == FORMAT_ARGB || format->type == FORMAT_ARGBF16
-        || format->type == FORMAT_ARGBF || format->type == FORMAT_DXT)
-        return TRUE;
-    return !!format->from_rgba;
+    return a->device == b->device && a->format == b->format && a->width == b->width
+           && a->height == b->height && a->pool == b->pool;
+}
+
+static BOOL is_staging_slot_idle(const struct staging_surface_slot *slot)
+{
+    /* S_FALSE means the GPU hasn't reached the fence yet */
+    return !slot->in_use && (!slot->fence || IDirect3DQuery9_GetData(slot->fence, NULL, 0, 0) != S_FALSE);
+}
+
+static void free_staging_slot(struct staging_surface_slot *slot)
+{
+    if (slot->fence)
+        IDirect3DQuery9_Release(slot->fence);
+    IDirect3DSurface9_Release(slot->surface);
 }
 
-// wine-8.2/dlls/d3dx9_36/util.c
+/* Drops the least recently used free slots above STAGING_POOL_MAX_SLOTS. */
+static void trim_staging_surface_pool(staging_surface_pool &pool)
+{
+    while (pool.slots.size() > STAGING_POOL_MAX_SLOTS)
+    {
+        auto oldest = pool.slots.end();
+
+        for (auto slot = pool.slots.begin(); slot != pool.slots.end(); ++slot)
+            if (!slot->in_use && (oldest == pool.slots.end() || slot->last_use < oldest->last_use))
+                oldest = slot;
+        if (oldest == pool.slots.end())
+            break;
+        free_staging_slot(&*oldest);
+        pool.slots.erase(oldest);
+    }
+}
 
-static void la_from_rgba(const struct vec4 *rgba, struct vec4 *la)
+static HRESULT acquire_staging_surface(IDirect3DDevice9 *device, D3DFORMAT format, UINT width, UINT height,
+                                       BOOL write, IDirect3DSurface9 **surface)
 {
-    la->x = rgba->x * 0.2125f + rgba->y * 0.7154f + rgba->z * 0.0721f;
-    la->w = rgba->w;
+    struct staging_surface_key key = {device, format, width, height, write ? D3DPOOL_SYSTEMMEM : D3DPOOL_DEFAULT};
+    staging_surface_pool &pool = get_staging_surface_pool();
+    struct staging_surface_slot new_slot;
+    HRESULT hr;
+
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+
+        for (auto &slot : pool.slots)
+        {
+            if (is_same_staging_key(&slot.key, &key) && is_staging_slot_idle(&slot))
+            {
+                slot.in_use = TRUE;
+                slot.last_use = ++pool.clock;
+                ++pool.hits;
+                *surface = slot.surface;
+                return D3D_OK;
+            }
+        }
+        ++pool.misses;
+    }
+
+    hr = write ? IDirect3DDevice9_CreateOffscreenPlainSurface(device, width, height,
+                                                              format, D3DPOOL_SYSTEMMEM, &new_slot.surface, NULL)
+               : IDirect3DDevice9_CreateRenderTarget(device, width, height,
+                                                     format, D3DMULTISAMPLE_NONE, 0, TRUE, &new_slot.surface, NULL);
+    if (FAILED(hr))
+        return hr;
+    if (FAILED(IDirect3DDevice9_CreateQuery(device, D3DQUERYTYPE_EVENT, &new_slot.fence)))
+        new_slot.fence = NULL;
+    new_slot.key = key;
+    new_slot.in_use = TRUE;
+
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    new_slot.last_use = ++pool.clock;
+    pool.slots.push_back(new_slot);
+    trim_staging_surface_pool(pool);
+    *surface = new_slot.surface;
+    return D3D_OK;
 }
 
-static void la_to_rgba(const struct vec4 *la, struct vec4 *rgba, const PALETTEENTRY *palette)
+/* Fences the last use of a surface from acquire_staging_surface() and returns it to the pool. */
+static void release_staging_surface(IDirect3DSurface9 *surface)
 {
-    rgba->x = la->x;
-    rgba->y = la->x;
-    rgba->z = la->x;
-    rgba->w = la->w;
+    staging_surface_pool &pool = get_staging_surface_pool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
+
+    for (auto &slot : pool.slots)
+    {
+        if (slot.surface == surface)
+        {
+            if (slot.fence)
+                IDirect3DQuery9_Issue(slot.fence, D3DISSUE_END);
+            slot.in_use = FALSE;
+            return;
+        }
+    }
+    IDirect3DSurface9_Release(surface);
 }
 
-static void index_to_rgba(const struct vec4 *index, struct vec4 *rgba, const PALETTEENTRY *palette)
+void get_staging_pool_stats(struct staging_pool_stats *stats)
 {
-    ULONG idx = (ULONG)(index->x * 255.0f + 0.5f);
+    staging_surface_pool &pool = get_staging_surface_pool();
+    std::lock_guard<std::mutex> lock(pool.mutex);
 
-    rgba->x = palette[idx].peRed / 255.0f;
-    rgba->y = palette[idx].peGreen / 255.0f;
-    rgba->z = palette[idx].peBlue / 255.0f;
-    rgba->w = palette[idx].peFlags / 255.0f; /* peFlags is the alpha component in DX8 and higher */
+    stats->hits = pool.hits;
+    stats->misses = pool.misses;
+    stats->slot_count = pool.slots.size();
 }
 
 /************************************************************
- * pixel format table providing info about number of bytes per pixel,
- * number of bits per channel and format type.
+ * deferred surface updates
  *
- * Call get_format_info to request information about a specific format.
+ * On devices that opt in with set_deferred_surface_updates(), writes to
+ * surfaces that can't be locked go to a full size staging surface per
+ * destination, and writes to managed textures are locked with
+ * D3DLOCK_NO_DIRTY_UPDATE. Both only record their rects, and
+ * flush_surface_updates() uploads each destination once per frame:
+ * with one UpdateSurface, or one AddDirtyRect on the managed texture.
+ * Other devices get their writes on unlock, as with D3DX.
  */
-static const struct pixel_format_desc formats[] =
-    {
-        /* format              bpc               shifts             bpp blocks   type            from_rgba     to_rgba */
-        {D3DFMT_R8G8B8,        { 0,  8,  8,  8}, { 0, 16,  8,  0},  3, 1, 1,  3, FORMAT_ARGB,    NULL,         NULL      },
-        {D3DFMT_A8R8G8B8,      { 8,  8,  8,  8}, {24, 16,  8,  0},  4, 1, 1,  4, FORMAT_ARGB,    NULL,         NULL      },
-        {D3DFMT_X8R8G8B8,      { 0,  8,  8,  8}, { 0, 16,  8,  0},  4, 1, 1,  4, FORMAT_ARGB,    NULL,         NULL      },
-        {D3DFMT_A8B8G8R8,      { 8,  8,  8,  8}, {24,  0,  8, 16},  4, 1, 1,  4, FORMAT_ARGB,    NULL,         NULL      },
-        {D3DFMT_X8B8G8R8,      { 0,  8,  8,  8}, { 0,  0,  8, 16},  4, 1, 1,  4, FORMAT_ARGB,    NULL,         NULL      },
-        {D3DFMT_R5G6B5,        { 0,  5,  6,  5}, { 0, 11,  5,  0},  2, 1, 1,  2, FORMAT_ARGB,    NULL,         NULL      },
-        {D3DFMT_X1R5G5B5,      { 0,  5,  5,  5}, { 0, 10,  5,  0},  2, 1, 1,  2, FORMAT_ARGB,    NULL,         NULL      },
-        {D3DFMT_A1R5G5B5,      { 1,  5,  5,  5}, {15, 10,  5,  0},  2, 1, 1,  2, FORMAT_ARGB,    NULL,         NULL      },
-        {D3DFMT_R3G3B2,        { 0,  3,  3,  2}, { 0,  5,  2,  0},  1, 1, 1,  1, FORMAT_ARGB,    NULL,         NULL      },
-        {D3DFMT_A8R3G3B2,      { 8,  3,  3,  2}, { 8,  5,  2,  0},  2, 1, 1,  2, FORMAT_ARGB,    NULL,         NULL      },
-        {D3DFMT_A4R4G4B4,      { 4,  4,  4,  4}, {12,  8,  4,  0},  2, 1, 1,  2, FORMAT_ARGB,    NULL,         NULL      },
-        {D3DFMT_X4R4G4B4,      { 0,  4,  4,  4}, { 0,  8,  4,  0},  2, 1, 1,  2, FORMAT_ARGB,    NULL,         NULL      },
-        {D3DFMT_A2R10G10B10,   { 2, 10, 10, 10}, {30, 20, 10,  0},  4, 1, 1,  4, FORMAT_ARGB,    NULL,         NULL      },
-        {D3DFMT_A2B10G10R10,   { 2, 10, 10, 10}, {30,  0, 10, 20},  4, 1, 1,  4, FORMAT_ARGB,    NULL,         NULL      },
-        {D3DFMT_A16B16G16R16,  {16, 16, 16, 16}, {48,  0, 16, 32},  8, 1, 1,  8, FORMAT_ARGB,    NULL,         NULL      },
-        {D3DFMT_G16R16,        { 0, 16, 16,  0}, { 0,  0, 16,  0},  4, 1, 1,  4, FORMAT_ARGB,    NULL,         NULL      },
-        {D3DFMT_A8,            { 8,  0,  0,  0}, { 0,  0,  0,  0},  1, 1, 1,  1, FORMAT_ARGB,    NULL,         NULL      },
-        {D3DFMT_A8L8,          { 8,  8,  0,  0}, { 8,  0,  0,  0},  2, 1, 1,  2, FORMAT_ARGB,    la_from_rgba, la_to_rgba},
-        {D3DFMT_A4L4,          { 4,  4,  0,  0}, { 4,  0,  0,  0},  1, 1, 1,  1, FORMAT_ARGB,    la_from_rgba, la_to_rgba},
-        {D3DFMT_L8,            { 0,  8,  0,  0}, { 0,  0,  0,  0},  1, 1, 1,  1, FORMAT_ARGB,    la_from_rgba, la_to_rgba},
-        {D3DFMT_L16,           { 0, 16,  0,  0}, { 0,  0,  0,  0},  2, 1, 1,  2, FORMAT_ARGB,    la_from_rgba, la_to_rgba},
-        {D3DFMT_DXT1,          { 0,  0,  0,  0}, { 0,  0,  0,  0},  1, 4, 4,  8, FORMAT_DXT,     NULL,         NULL      },
-        {D3DFMT_DXT2,          { 0,  0,  0,  0}, { 0,  0,  0,  0},  1, 4, 4, 16, FORMAT_DXT,     NULL,         NULL      },
-        {D3DFMT_DXT3,          { 0,  0,  0,  0}, { 0,  0,  0,  0},  1, 4, 4, 16, FORMAT_DXT,     NULL,         NULL      },
-        {D3DFMT_DXT4,          { 0,  0,  0,  0}, { 0,  0,  0,  0},  1, 4, 4, 16, FORMAT_DXT,     NULL,         NULL      },
-        {D3DFMT_DXT5,          { 0,  0,  0,  0}, { 0,  0,  0,  0},  1, 4, 4, 16, FORMAT_DXT,     NULL,         NULL      },
-        {D3DFMT_R16F,          { 0, 16,  0,  0}, { 0,  0,  0,  0},  2, 1, 1,  2, FORMAT_ARGBF16, NULL,         NULL      },
-        {D3DFMT_G16R16F,       { 0, 16, 16,  0}, { 0,  0, 16,  0},  4, 1, 1,  4, FORMAT_ARGBF16, NULL,         NULL      },
-        {D3DFMT_A16B16G16R16F, {16, 16, 16, 16}, {48,  0, 16, 32},  8, 1, 1,  8, FORMAT_ARGBF16, NULL,         NULL      },
-        {D3DFMT_R32F,          { 0, 32,  0,  0}, { 0,  0,  0,  0},  4, 1, 1,  4, FORMAT_ARGBF,   NULL,         NULL      },
-        {D3DFMT_G32R32F,       { 0, 32, 32,  0}, { 0,  0, 32,  0},  8, 1, 1,  8, FORMAT_ARGBF,   NULL,         NULL      },
-        {D3DFMT_A32B32G32R32F, {32, 32, 32, 32}, {96,  0, 32, 64}, 16, 1, 1, 16, FORMAT_ARGBF,   NULL,         NULL      },
-        {D3DFMT_P8,            { 8,  8,  8,  8}, { 0,  0,  0,  0},  1, 1, 1,  1, FORMAT_INDEX,   NULL,         index_to_rgba},
-        /* marks last element */
-        {D3DFMT_UNKNOWN,       { 0,  0,  0,  0}, { 0,  0,  0,  0},  0, 1, 1,  0, FORMAT_UNKNOWN, NULL,         NULL      },
-        };
+#define SURFACE_UPDATE_MAX_COVER_RECTS 32
 
-/************************************************************
- * get_format_info
- *
- * Returns information about the specified format.
- * If the format is unsupported, it's filled with the D3DFMT_UNKNOWN desc.
- *
- * PARAMS
- *   format [I] format whose description is queried
- *
- */
-const struct pixel_format_desc *get_format_info(D3DFORMAT format)
+struct surface_update
 {
-    unsigned int i = 0;
-    while(formats[i].format != format && formats[i].format != D3DFMT_UNKNOWN) i++;
-//    if (formats[i].format == D3DFMT_UNKNOWN)
-//        FIXME("Unknown format %#x (as FOURCC %s).\n", format, debugstr_an((const char *)&format, 4));
-    return &formats[i];
-}
+    IDirect3DDevice9 *device;
+    IDirect3DSurface9 *surface;  /* staged destination, holds a reference */
+    IDirect3DSurface9 *staging;  /* full size D3DPOOL_SYSTEMMEM surface from the staging pool */
+    IDirect3DTexture9 *texture;  /* managed texture instead of a staged surface, holds a reference */
+    std::vector<RECT> rects;     /* in level 0 coordinates for textures */
+    BOOL locked;
+};
 
-// wine-8.2/dlls/d3dx9_36/surface.c
+struct surface_update_list
+{
+    std::mutex mutex;
+    std::vector<struct surface_update> updates;
+    std::vector<IDirect3DDevice9 *> devices; /* the ones deferring their writes */
+};
 
-HRESULT lock_surface(IDirect3DSurface9 *surface, const RECT *surface_rect, D3DLOCKED_RECT *lock,
-                     IDirect3DSurface9 **temp_surface, BOOL write)
+static surface_update_list &get_surface_update_list()
 {
-    unsigned int width, height;
-    IDirect3DDevice9 *device;
-    D3DSURFACE_DESC desc;
-    DWORD lock_flag;
-    HRESULT hr;
+    static surface_update_list list;
 
-    lock_flag = write ? 0 : D3DLOCK_READONLY;
-    *temp_surface = NULL;
-    if (FAILED(hr = IDirect3DSurface9_LockRect(surface, lock, surface_rect, lock_flag)))
-    {
-        IDirect3DSurface9_GetDevice(surface, &device);
-        IDirect3DSurface9_GetDesc(surface, &desc);
+    return list;
+}
 
-        if (surface_rect)
-        {
-            width = surface_rect->right - surface_rect->left;
-            height = surface_rect->bottom - surface_rect->top;
-        }
-        else
-        {
-            width = desc.Width;
-            height = desc.Height;
-        }
+static inline BOOL is_rect_inside(const RECT *inner, const RECT *outer)
+{
+    return inner->left >= outer->left && inner->top >= outer->top
+           && inner->right <= outer->right && inner->bottom <= outer->bottom;
+}
 
-        hr = write ? IDirect3DDevice9_CreateOffscreenPlainSurface(device, width, height,
-                                                                  desc.Format, D3DPOOL_SYSTEMMEM, temp_surface, NULL)
-                   : IDirect3DDevice9_CreateRenderTarget(device, width, height,
-                                                         desc.Format, D3DMULTISAMPLE_NONE, 0, TRUE, temp_surface, NULL);
-        if (FAILED(hr))
-        {
-//            WARN("Failed to create temporary surface, surface %p, format %#x, "
-//                 "usage %#lx, pool %#x, write %#x, width %u, height %u.\n",
-//                 surface, desc.Format, desc.Usage, desc.Pool, write, width, height);
-            IDirect3DDevice9_Release(device);
-            return hr;
-        }
+static void add_update_rect(struct surface_update *update, const RECT *rect)
+{
+    for (auto &r : update->rects)
+        if (is_rect_inside(rect, &r))
+            return;
+    update->rects.push_back(*rect);
+}
 
-        if (write || SUCCEEDED(hr = IDirect3DDevice9_StretchRect(device, surface, surface_rect,
-                                                                 *temp_surface, NULL, D3DTEXF_NONE)))
-            hr = IDirect3DSurface9_LockRect(*temp_surface, lock, NULL, lock_flag);
+/* Bounding rect of the update rects, returns whether they cover all of it,
+ * so it can be uploaded at once without the staging contents in between. */
+static BOOL get_update_bounds(const std::vector<RECT> &rects, RECT *bounds)
+{
+    std::vector<LONG> xs, ys;
+    size_t i, j;
 
-        IDirect3DDevice9_Release(device);
-        if (FAILED(hr))
+    *bounds = rects[0];
+    for (auto &r : rects)
+    {
+        bounds->left = std::min(bounds->left, r.left);
+        bounds->top = std::min(bounds->top, r.top);
+        bounds->right = std::max(bounds->right, r.right);
+        bounds->bottom = std::max(bounds->bottom, r.bottom);
+        xs.push_back(r.left);
+        xs.push_back(r.right);
+        ys.push_back(r.top);
+        ys.push_back(r.bottom);
+    }
+    if (rects.size() == 1)
+        return TRUE;
+    if (rects.size() > SURFACE_UPDATE_MAX_COVER_RECTS)
+        return FALSE;
+
+    std::sort(xs.begin(), xs.end());
+    xs.erase(std::unique(xs.begin(), xs.end()), xs.end());
+    std::sort(ys.begin(), ys.end());
+    ys.erase(std::unique(ys.begin(), ys.end()), ys.end());
+    for (i = 0; i + 1 < xs.size(); ++i)
+        for (j = 0; j + 1 < ys.size(); ++j)
         {
-//            WARN("Failed to lock surface %p, write %#x, usage %#lx, pool %#x.\n",
-//                 surface, write, desc.Usage, desc.Pool);
-            IDirect3DSurface9_Release(*temp_surface);
-            *temp_surface = NULL;
-            return hr;
+            RECT cell = {xs[i], ys[j], xs[i + 1], ys[j + 1]};
+
+            if (std::none_of(rects.begin(), rects.end(), [&](const RECT &r) { return is_rect_inside(&cell, &r); }))
+                return FALSE;
         }
-//        TRACE("Created temporary surface %p.\n", surface);
-    }
-    return hr;
+    return TRUE;
 }
 
-HRESULT unlock_surface(IDirect3DSurface9 *surface, const RECT *surface_rect,
-                       IDirect3DSurface9 *temp_surface, BOOL update)
+static void flush_surface_update(struct surface_update *update)
 {
-    IDirect3DDevice9 *device;
-    POINT surface_point;
-    HRESULT hr;
+    RECT bounds;
 
-    if (!temp_surface)
+    if (update->texture)
     {
-        hr = IDirect3DSurface9_UnlockRect(surface);
-        return hr;
+        get_update_bounds(update->rects, &bounds);
+        IDirect3DTexture9_AddDirtyRect(update->texture, &bounds);
+        IDirect3DTexture9_Release(update->texture);
+        return;
     }
 
-    hr = IDirect3DSurface9_UnlockRect(temp_surface);
-    if (update)
+    if (!update->rects.empty() && get_update_bounds(update->rects, &bounds))
+        update->rects.assign(1, bounds);
+    for (auto &r : update->rects)
     {
-        if (surface_rect)
-        {
-            surface_point.x = surface_rect->left;
-            surface_point.y = surface_rect->top;
-        }
-        else
-        {
-            surface_point.x = 0;
-            surface_point.y = 0;
-        }
-        IDirect3DSurface9_GetDevice(surface, &device);
-//        if (FAILED(hr = IDirect3DDevice9_UpdateSurface(device, temp_surface, NULL, surface, &surface_point)))
-//            WARN("Updating surface failed, hr %#lx, surface %p, temp_surface %p.\n",
-//                 hr, surface, temp_surface);
-        IDirect3DDevice9_Release(device);
+        POINT point = {r.left, r.top};
+
+        IDirect3DDevice9_UpdateSurface(update->device, update->staging, &r, update->surface, &point);
+//        if (FAILED(hr = IDirect3DDevice9_UpdateSurface(update->device, update->staging, &r, update->surface, &point)))
+//            WARN("Updating surface failed, hr %#lx, surface %p, staging %p.\n", hr, update->surface, update->staging);
     }
-    IDirect3DSurface9_Release(temp_surface);
-    return hr;
+    release_staging_surface(update->staging);
+    IDirect3DSurface9_Release(update->surface);
 }
 
-/************************************************************
- * helper functions for D3DXLoadSurfaceFromMemory
- */
-struct argb_conversion_info
-{
-    const struct pixel_format_desc *srcformat;
-    const struct pixel_format_desc *destformat;
-    DWORD srcshift[4], destshift[4];
-    DWORD srcmask[4], destmask[4];
-    BOOL process_channel[4];
-    DWORD channelmask;
-};
-
-static void init_argb_conversion_info(const struct pixel_format_desc *srcformat, const struct pixel_format_desc *destformat, struct argb_conversion_info *info)
+static BOOL is_surface_update_deferred(IDirect3DSurface9 *surface)
 {
-    UINT i;
-    ZeroMemory(info->process_channel, 4 * sizeof(BOOL));
-    info->channelmask = 0;
+    surface_update_list &list = get_surface_update_list();
+    IDirect3DDevice9 *device;
+    BOOL deferred;
 
-    info->srcformat  =  srcformat;
-    info->destformat = destformat;
+    IDirect3DSurface9_GetDevice(surface, &device);
+    IDirect3DDevice9_Release(device);
+    std::lock_guard<std::mutex> lock(list.mutex);
+    deferred = std::find(list.devices.begin(), list.devices.end(), device) != list.devices.end();
+    return deferred;
+}
 
-    for(i = 0;i < 4;i++) {
-        /* srcshift is used to extract the _relevant_ components */
-        info->srcshift[i]  =  srcformat->shift[i] + std::max( srcformat->bits[i] - destformat->bits[i], 0);
+/* The dirty rect of a write to a level of a managed texture, in level 0 coordinates.
+ * Returns FALSE for other surfaces, the texture holds a reference otherwise. */
+static BOOL get_managed_update_rect(IDirect3DSurface9 *surface, const D3DSURFACE_DESC *desc, const RECT *surface_rect,
+                                    IDirect3DTexture9 **texture, RECT *rect)
+{
+    D3DSURFACE_DESC level0;
 
-        /* destshift is used to move the components to the correct position */
-        info->destshift[i] = destformat->shift[i] + std::max(destformat->bits[i] -  srcformat->bits[i], 0);
+    if (FAILED(IDirect3DSurface9_GetContainer(surface, IID_IDirect3DTexture9, (void **)texture)))
+    {
+        *texture = NULL;
+        return FALSE;
+    }
 
-        info->srcmask[i]  = ((1 <<  srcformat->bits[i]) - 1) <<  srcformat->shift[i];
-        info->destmask[i] = ((1 << destformat->bits[i]) - 1) << destformat->shift[i];
+    IDirect3DTexture9_GetLevelDesc(*texture, 0, &level0);
+    if (surface_rect)
+        *rect = *surface_rect;
+    else
+        SetRect(rect, 0, 0, desc->Width, desc->Height);
+    rect->right = rect->right == (LONG)desc->Width ? level0.Width : rect->right * (level0.Width / desc->Width);
+    rect->bottom = rect->bottom == (LONG)desc->Height ? level0.Height : rect->bottom * (level0.Height / desc->Height);
+    rect->left *= level0.Width / desc->Width;
+    rect->top *= level0.Height / desc->Height;
+    return TRUE;
+}
 
-        /* channelmask specifies bits which aren't used in the source format but in the destination one */
-        if(destformat->bits[i]) {
-            if(srcformat->bits[i]) info->process_channel[i] = TRUE;
-            else info->channelmask |= info->destmask[i];
+/* Records a write to a level of a managed texture once it is locked, takes the texture reference. */
+static void defer_managed_update(IDirect3DSurface9 *surface, IDirect3DTexture9 *texture, const RECT *rect)
+{
+    surface_update_list &list = get_surface_update_list();
+    std::lock_guard<std::mutex> lock(list.mutex);
+    for (auto &update : list.updates)
+    {
+        if (update.texture == texture)
+        {
+            add_update_rect(&update, rect);
+            IDirect3DTexture9_Release(texture);
+            return;
         }
     }
+    list.updates.push_back({NULL, NULL, NULL, texture, {*rect}, FALSE});
+    IDirect3DSurface9_GetDevice(surface, &list.updates.back().device);
+    IDirect3DDevice9_Release(list.updates.back().device);
 }
 
-/************************************************************
- * get_relevant_argb_components
- *
- * Extracts the relevant components from the source color and
- * drops the less significant bits if they aren't used by the destination format.
- */
-static void get_relevant_argb_components(const struct argb_conversion_info *info, const BYTE *col, DWORD *out)
+/* Locks the staging surface of a surface that can't be locked directly. */
+static HRESULT lock_deferred_surface(IDirect3DDevice9 *device, IDirect3DSurface9 *surface, const D3DSURFACE_DESC *desc,
+                                     const RECT *surface_rect, D3DLOCKED_RECT *lock, IDirect3DSurface9 **staging)
 {
-    unsigned int i, j;
-    unsigned int component, mask;
+    surface_update_list &list = get_surface_update_list();
+    std::lock_guard<std::mutex> guard(list.mutex);
+    struct surface_update *update = NULL;
+    HRESULT hr;
 
-    for (i = 0; i < 4; ++i)
+    for (auto &u : list.updates)
+        if (u.surface == surface)
+            update = &u;
+    if (!update)
     {
-        if (!info->process_channel[i])
-            continue;
+        IDirect3DSurface9 *new_staging;
 
-        component = 0;
-        mask = info->srcmask[i];
-        for (j = 0; j < 4 && mask; ++j)
-        {
-            if (info->srcshift[i] < j * 8)
-                component |= (col[j] & mask) << (j * 8 - info->srcshift[i]);
-            else
-                component |= (col[j] & mask) >> (info->srcshift[i] - j * 8);
-            mask >>= 8;
-        }
-        out[i] = component;
+        if (FAILED(hr = acquire_staging_surface(device, desc->Format, desc->Width, desc->Height, TRUE, &new_staging)))
+            return hr;
+        IDirect3DSurface9_AddRef(surface);
+        list.updates.push_back({device, surface, new_staging, NULL, {}, FALSE});
+        update = &list.updates.back();
     }
+    /* a nested lock of the same surface gets a temporary surface of its own */
+    if (update->locked)
+        return E_FAIL;
+    if (FAILED(hr = IDirect3DSurface9_LockRect(update->staging, lock, surface_rect, 0)))
+        return hr;
+    update->locked = TRUE;
+    *staging = update->staging;
+    return D3D_OK;
 }
 
-/************************************************************
- * make_argb_color
- *
- * Recombines the output of get_relevant_argb_components and converts
- * it to the destination format.
- */
-static DWORD make_argb_color(const struct argb_conversion_info *info, const DWORD *in)
+/* Records the written rects, returns FALSE if staging isn't the staging surface of a deferred update. */
+static BOOL unlock_deferred_surface(IDirect3DSurface9 *staging, const RECT *rects, UINT rect_count)
 {
+    surface_update_list &list = get_surface_update_list();
+    std::lock_guard<std::mutex> lock(list.mutex);
     UINT i;
-    DWORD val = 0;
-
-    for(i = 0;i < 4;i++) {
-        if(info->process_channel[i]) {
-            /* necessary to make sure that e.g. an X4R4G4B4 white maps to an R8G8B8 white instead of 0xf0f0f0 */
-            signed int shift;
-            for(shift = info->destshift[i]; shift > info->destformat->shift[i]; shift -= info->srcformat->bits[i]) val |= in[i] << shift;
-            val |= (in[i] >> (info->destformat->shift[i] - shift)) << info->destformat->shift[i];
-        }
+
+    for (auto &u : list.updates)
+    {
+        if (u.staging != staging)
+            continue;
+        for (i = 0; i < rect_count; ++i)
+            add_update_rect(&u, &rects[i]);
+        u.locked = FALSE;
+        return TRUE;
     }
-    val |= info->channelmask;   /* new channels are set to their maximal value */
-    return val;
+    return FALSE;
 }
 
-/* It doesn't work for components bigger than 32 bits (or somewhat smaller but unaligned). */
-void format_to_vec4(const struct pixel_format_desc *format, const BYTE *src, struct vec4 *dst)
+/* Uploads the pending writes to a surface before it is read, those to a level
+ * of a managed texture are recorded for the texture. */
+static void flush_pending_surface_update(IDirect3DSurface9 *surface)
 {
-    DWORD mask, tmp;
-    unsigned int c;
+    surface_update_list &list = get_surface_update_list();
+    IDirect3DTexture9 *texture;
+
+    if (FAILED(IDirect3DSurface9_GetContainer(surface, IID_IDirect3DTexture9, (void **)&texture)))
+        texture = NULL;
 
-    for (c = 0; c < 4; ++c)
     {
-        static const unsigned int component_offsets[4] = {3, 0, 1, 2};
-        float *dst_component = (float *)dst + component_offsets[c];
+        std::lock_guard<std::mutex> lock(list.mutex);
 
-        if (format->bits[c])
+        for (auto update = list.updates.begin(); update != list.updates.end(); ++update)
         {
-            mask = ~0u >> (32 - format->bits[c]);
-
-            memcpy(&tmp, src + format->shift[c] / 8,
-                   std::min(sizeof(DWORD), static_cast<ulong>((format->shift[c] % 8 + format->bits[c] + 7) / 8)));
-
-            if (format->type == FORMAT_ARGBF16)
+            if ((update->surface == surface || (texture && update->texture == texture)) && !update->locked)
             {
-//                WARN("Unimplemented for FORMAT_ARGBF16");
-//                *dst_component = float_16_to_32(tmp);
+                flush_surface_update(&*update);
+                list.updates.erase(update);
+                break;
             }
-            else if (format->type == FORMAT_ARGBF)
-                *dst_component = *(float *)&tmp;
-            else
-                *dst_component = (float)((tmp >> format->shift[c] % 8) & mask) / mask;
         }
-        else
-            *dst_component = 1.0f;
     }
+    if (texture)
+        IDirect3DTexture9_Release(texture);
 }
 
-/* It doesn't work for components bigger than 32 bits. */
-static void format_from_vec4(const struct pixel_format_desc *format, const struct vec4 *src, BYTE *dst)
+/************************************************************
+ * flush_surface_updates
+ *
+ * Uploads the writes recorded since the last call, once per surface.
+ * Call once per frame, before the updated textures are drawn.
+ */
+void flush_surface_updates(IDirect3DDevice9 *device)
 {
-    DWORD v, mask32;
-    unsigned int c, i;
+    surface_update_list &list = get_surface_update_list();
+    std::lock_guard<std::mutex> lock(list.mutex);
 
-    memset(dst, 0, format->bytes_per_pixel);
-
-    for (c = 0; c < 4; ++c)
+    for (auto update = list.updates.begin(); update != list.updates.end();)
     {
-        static const unsigned int component_offsets[4] = {3, 0, 1, 2};
-        const float src_component = *((const float *)src + component_offsets[c]);
-
-        if (!format->bits[c])
-            continue;
-
-        mask32 = ~0u >> (32 - format->bits[c]);
-
-        if (format->type == FORMAT_ARGBF16)
+        if (update->device == device && !update->locked)
         {
-//            WARN("Unimplemented for FORMAT_ARGBF16");
-//            v = float_32_to_16(src_component);
+            flush_surface_update(&*update);
+            update = list.updates.erase(update);
         }
-        else if (format->type == FORMAT_ARGBF)
-            v = *(DWORD *)&src_component;
         else
-            v = (DWORD)(src_component * ((1 << format->bits[c]) - 1) + 0.5f);
-
-        for (i = format->shift[c] / 8 * 8; i < format->shift[c] + format->bits[c]; i += 8)
-        {
-            BYTE mask, byte;
-
-            if (format->shift[c] > i)
-            {
-                mask = mask32 << (format->shift[c] - i);
-                byte = (v << (format->shift[c] - i)) & mask;
-            }
-            else
-            {
-                mask = mask32 >> (i - format->shift[c]);
-                byte = (v >> (i - format->shift[c])) & mask;
-            }
-            dst[i / 8] |= byte;
-        }
+            ++update;
     }
 }
 
 /************************************************************
- * copy_pixels
+ * set_deferred_surface_updates
  *
- * Copies the source buffer to the destination buffer.
- * Works for any pixel format.
- * The source and the destination must be block-aligned.
+ * With enable, writes to managed textures and to surfaces that can't be
+ * locked on the device wait for flush_surface_updates(). Turning it off
+ * uploads the waiting ones.
  */
-void copy_pixels(const BYTE *src, UINT src_row_pitch, UINT src_slice_pitch,
-                 BYTE *dst, UINT dst_row_pitch, UINT dst_slice_pitch, const struct volume *size,
-                 const struct pixel_format_desc *format)
+void set_deferred_surface_updates(IDirect3DDevice9 *device, BOOL enable)
 {
-    UINT row, slice;
-    BYTE *dst_addr;
-    const BYTE *src_addr;
-    UINT row_block_count = (size->width + format->block_width - 1) / format->block_width;
-    UINT row_count = (size->height + format->block_height - 1) / format->block_height;
+    surface_update_list &list = get_surface_update_list();
 
-    for (slice = 0; slice < size->depth; slice++)
     {
-        src_addr = src + slice * src_slice_pitch;
-        dst_addr = dst + slice * dst_slice_pitch;
+        std::lock_guard<std::mutex> lock(list.mutex);
+        auto found = std::find(list.devices.begin(), list.devices.end(), device);
 
-        for (row = 0; row < row_count; row++)
-        {
-            memcpy(dst_addr, src_addr, row_block_count * format->block_byte_count);
-            src_addr += src_row_pitch;
-            dst_addr += dst_row_pitch;
-        }
+        if (enable && found == list.devices.end())
+            list.devices.push_back(device);
+        else if (!enable && found != list.devices.end())
+            list.devices.erase(found);
     }
+    if (!enable)
+        flush_surface_updates(device);
 }
 
 /************************************************************
- * convert_argb_pixels
+ * surface copy capability cache
  *
- * Copies the source buffer to the destination buffer, performing
- * any necessary format conversion and color keying.
- * Pixels outsize the source rect are blacked out.
+ * Remembers per device which combinations of formats, pools and filter
+ * StretchRect and the render blit accept, so D3DXLoadSurfaceFromSurface
+ * doesn't retry a failing GPU path on every call. Entries are seeded from
+ * the StretchRect pool rules and CheckDeviceFormatConversion, then from
+ * the observed results.
  */
-void convert_argb_pixels(const BYTE *src, UINT src_row_pitch, UINT src_slice_pitch, const struct volume *src_size,
-                         const struct pixel_format_desc *src_format, BYTE *dst, UINT dst_row_pitch, UINT dst_slice_pitch,
-                         const struct volume *dst_size, const struct pixel_format_desc *dst_format, D3DCOLOR color_key,
-                         const PALETTEENTRY *palette)
+enum surface_copy_support
 {
-    struct argb_conversion_info conv_info, ck_conv_info;
-    const struct pixel_format_desc *ck_format = NULL;
-    DWORD channels[4];
-    UINT min_width, min_height, min_depth;
-    UINT x, y, z;
+    SURFACE_COPY_UNKNOWN,
+    SURFACE_COPY_OK,
+    SURFACE_COPY_FAILS,
+};
+
+struct surface_copy_key
+{
+    IDirect3DDevice9 *device;
+    D3DFORMAT src_format, dst_format;
+    D3DPOOL src_pool, dst_pool;
+    DWORD src_usage, dst_usage;
+    BOOL src_texture, dst_texture; /* texture levels rather than standalone surfaces */
+    D3DTEXTUREFILTERTYPE filter;
+};
 
-//    TRACE("src %p, src_row_pitch %u, src_slice_pitch %u, src_size %p, src_format %p, dst %p, "
-//          "dst_row_pitch %u, dst_slice_pitch %u, dst_size %p, dst_format %p, color_key 0x%08lx, palette %p.\n",
-//          src, src_row_pitch, src_slice_pitch, src_size, src_format, dst, dst_row_pitch, dst_slice_pitch, dst_size,
-//          dst_format, color_key, palette);
+struct surface_copy_caps
+{
+    struct surface_copy_key key;
+    enum surface_copy_support stretch_rect;
+    enum surface_copy_support render_blit;
+};
 
-    ZeroMemory(channels, sizeof(channels));
-    init_argb_conversion_info(src_format, dst_format, &conv_info);
+struct surface_copy_cache
+{
+    std::mutex mutex;
+    std::vector<struct surface_copy_caps> entries;
+};
 
-    min_width = std::min(src_size->width, dst_size->width);
-    min_height = std::min(src_size->height, dst_size->height);
-    min_depth = std::min(src_size->depth, dst_size->depth);
+static surface_copy_cache &get_surface_copy_cache()
+{
+    static surface_copy_cache cache;
 
-    if (color_key)
-    {
-        /* Color keys are always represented in D3DFMT_A8R8G8B8 format. */
-        ck_format = get_format_info(D3DFMT_A8R8G8B8);
-        init_argb_conversion_info(src_format, ck_format, &ck_conv_info);
-    }
+    return cache;
+}
 
-    for (z = 0; z < min_depth; z++) {
-        const BYTE *src_slice_ptr = src + z * src_slice_pitch;
-        BYTE *dst_slice_ptr = dst + z * dst_slice_pitch;
+static BOOL is_texture_level(IDirect3DSurface9 *surface)
+{
+    IDirect3DTexture9 *texture;
 
-        for (y = 0; y < min_height; y++) {
-            const BYTE *src_ptr = src_slice_ptr + y * src_row_pitch;
-            BYTE *dst_ptr = dst_slice_ptr + y * dst_row_pitch;
+    if (FAILED(IDirect3DSurface9_GetContainer(surface, IID_IDirect3DTexture9, (void **)&texture)))
+        return FALSE;
+    IDirect3DTexture9_Release(texture);
+    return TRUE;
+}
 
-            for (x = 0; x < min_width; x++) {
-                if (!src_format->to_rgba && !dst_format->from_rgba
-                    && src_format->type == dst_format->type
-                    && src_format->bytes_per_pixel <= 4 && dst_format->bytes_per_pixel <= 4)
-                {
-                    DWORD val;
+static void get_surface_copy_key(IDirect3DDevice9 *device, IDirect3DSurface9 *src_surface,
+                                 const D3DSURFACE_DESC *src_desc, IDirect3DSurface9 *dst_surface,
+                                 const D3DSURFACE_DESC *dst_desc, D3DTEXTUREFILTERTYPE filter,
+                                 struct surface_copy_key *key)
+{
+    key->device = device;
+    key->src_format = src_desc->Format;
+    key->dst_format = dst_desc->Format;
+    key->src_pool = src_desc->Pool;
+    key->dst_pool = dst_desc->Pool;
+    key->src_usage = src_desc->Usage & D3DUSAGE_RENDERTARGET;
+    key->dst_usage = dst_desc->Usage & D3DUSAGE_RENDERTARGET;
+    key->src_texture = is_texture_level(src_surface);
+    key->dst_texture = is_texture_level(dst_surface);
+    key->filter = filter;
+}
 
-                    get_relevant_argb_components(&conv_info, src_ptr, channels);
-                    val = make_argb_color(&conv_info, channels);
+/* What StretchRect is known to do with these surfaces, without calling it. */
+static enum surface_copy_support probe_stretch_rect(const struct surface_copy_key *key)
+{
+    D3DDEVICE_CREATION_PARAMETERS params;
+    IDirect3D9 *d3d;
+    D3DCAPS9 caps;
+    HRESULT hr;
 
-                    if (color_key)
-                    {
-                        DWORD ck_pixel;
+    /* DEFAULT surfaces only, texture levels only of render target textures,
+     * format conversion only into render targets */
+    if (key->src_pool != D3DPOOL_DEFAULT || key->dst_pool != D3DPOOL_DEFAULT
+        || (key->src_texture && !key->src_usage) || (key->dst_texture && !key->dst_usage)
+        || (!key->dst_usage && key->dst_format != key->src_format))
+        return SURFACE_COPY_FAILS;
+    if (key->filter != D3DTEXF_NONE)
+    {
+        IDirect3DDevice9_GetDeviceCaps(key->device, &caps);
+        if (!(caps.StretchRectFilterCaps & (key->filter == D3DTEXF_LINEAR ? D3DPTFILTERCAPS_MINFLINEAR
+                                                                         : D3DPTFILTERCAPS_MINFPOINT)))
+            return SURFACE_COPY_FAILS;
+    }
+    if (key->src_format == key->dst_format)
+        return SURFACE_COPY_UNKNOWN;
+
+    if (FAILED(IDirect3DDevice9_GetDirect3D(key->device, &d3d)))
+        return SURFACE_COPY_UNKNOWN;
+    IDirect3DDevice9_GetCreationParameters(key->device, &params);
+    hr = IDirect3D9_CheckDeviceFormatConversion(d3d, params.AdapterOrdinal, params.DeviceType,
+                                                key->src_format, key->dst_format);
+    IDirect3D9_Release(d3d);
+    return FAILED(hr) ? SURFACE_COPY_FAILS : SURFACE_COPY_UNKNOWN;
+}
 
-                        get_relevant_argb_components(&ck_conv_info, src_ptr, channels);
-                        ck_pixel = make_argb_color(&ck_conv_info, channels);
-                        if (ck_pixel == color_key)
-                            val &= ~conv_info.destmask[0];
-                    }
-                    memcpy(dst_ptr, &val, dst_format->bytes_per_pixel);
-                }
-                else
-                {
-                    struct vec4 color, tmp;
+static inline BOOL is_same_surface_copy_key(const struct surface_copy_key *a, const struct surface_copy_key *b)
+{
+    return a->device == b->device && a->src_format == b->src_format && a->dst_format == b->dst_format
+           && a->src_pool == b->src_pool && a->dst_pool == b->dst_pool && a->src_usage == b->src_usage
+           && a->dst_usage == b->dst_usage && a->src_texture == b->src_texture
+           && a->dst_texture == b->dst_texture && a->filter == b->filter;
+}
 
-                    format_to_vec4(src_format, src_ptr, &color);
-                    if (src_format->to_rgba)
-                        src_format->to_rgba(&color, &tmp, palette);
-                    else
-                        tmp = color;
+static struct surface_copy_caps get_surface_copy_caps(const struct surface_copy_key *key)
+{
+    surface_copy_cache &cache = get_surface_copy_cache();
+    struct surface_copy_caps caps = {*key};
 
-                    if (ck_format)
-                    {
-                        DWORD ck_pixel;
+    {
+        std::lock_guard<std::mutex> lock(cache.mutex);
 
-                        format_from_vec4(ck_format, &tmp, (BYTE *)&ck_pixel);
-                        if (ck_pixel == color_key)
-                            tmp.w = 0.0f;
-                    }
+        for (auto &entry : cache.entries)
+            if (is_same_surface_copy_key(&entry.key, key))
+                return entry;
+    }
 
-                    if (dst_format->from_rgba)
-                        dst_format->from_rgba(&tmp, &color);
-                    else
-                        color = tmp;
+    caps.stretch_rect = probe_stretch_rect(key);
+    caps.render_blit = SURFACE_COPY_UNKNOWN;
+    std::lock_guard<std::mutex> lock(cache.mutex);
+    cache.entries.push_back(caps);
+    return caps;
+}
 
-                    format_from_vec4(dst_format, &color, dst_ptr);
-                }
+/* Whether a failed copy means the combination isn't supported, rather than
+ * a transient failure like a lost device or a full pool. */
+static inline BOOL is_unsupported_surface_copy(HRESULT hr)
+{
+    return hr == D3DERR_INVALIDCALL || hr == D3DERR_NOTAVAILABLE || hr == E_NOTIMPL;
+}
 
-                src_ptr += src_format->bytes_per_pixel;
-                dst_ptr += dst_format->bytes_per_pixel;
-            }
+static void set_surface_copy_caps(const struct surface_copy_caps *caps)
+{
+    surface_copy_cache &cache = get_surface_copy_cache();
+    std::lock_guard<std::mutex> lock(cache.mutex);
 
-            if (src_size->width < dst_size->width) /* black out remaining pixels */
-                memset(dst_ptr, 0, dst_format->bytes_per_pixel * (dst_size->width - src_size->width));
+    for (auto &entry : cache.entries)
+    {
+        if (is_same_surface_copy_key(&entry.key, &caps->key))
+        {
+            entry = *caps;
+            return;
         }
-
-        if (src_size->height < dst_size->height) /* black out remaining pixels */
-            memset(dst + src_size->height * dst_row_pitch, 0, dst_row_pitch * (dst_size->height - src_size->height));
     }
-    if (src_size->depth < dst_size->depth) /* black out remaining pixels */
-        memset(dst + src_size->depth * dst_slice_pitch, 0, dst_slice_pitch * (dst_size->depth - src_size->depth));
+    cache.entries.push_back(*caps);
 }
 
-/************************************************************
- * point_filter_argb_pixels
- *
- * Copies the source buffer to the destination buffer, performing
- * any necessary format conversion, color keying and stretching
- * using a point filter.
- */
-void point_filter_argb_pixels(const BYTE *src, UINT src_row_pitch, UINT src_slice_pitch, const struct volume *src_size,
-                              const struct pixel_format_desc *src_format, BYTE *dst, UINT dst_row_pitch, UINT dst_slice_pitch,
-                              const struct volume *dst_size, const struct pixel_format_desc *dst_format, D3DCOLOR color_key,
-                              const PALETTEENTRY *palette)
+/* Frees the pooled surfaces of a device and drops its pending updates
+ * and cached capabilities, before it is reset or released. */
+void release_staging_surfaces(IDirect3DDevice9 *device)
 {
-    struct argb_conversion_info conv_info, ck_conv_info;
-    const struct pixel_format_desc *ck_format = NULL;
-    DWORD channels[4];
-    UINT x, y, z;
+    surface_copy_cache &cache = get_surface_copy_cache();
+    surface_update_list &list = get_surface_update_list();
+    staging_surface_pool &pool = get_staging_surface_pool();
 
-//    TRACE("src %p, src_row_pitch %u, src_slice_pitch %u, src_size %p, src_format %p, dst %p, "
-//          "dst_row_pitch %u, dst_slice_pitch %u, dst_size %p, dst_format %p, color_key 0x%08lx, palette %p.\n",
-//          src, src_row_pitch, src_slice_pitch, src_size, src_format, dst, dst_row_pitch, dst_slice_pitch, dst_size,
-//          dst_format, color_key, palette);
-
-    ZeroMemory(channels, sizeof(channels));
-    init_argb_conversion_info(src_format, dst_format, &conv_info);
-
-    if (color_key)
     {
-        /* Color keys are always represented in D3DFMT_A8R8G8B8 format. */
-        ck_format = get_format_info(D3DFMT_A8R8G8B8);
-        init_argb_conversion_info(src_format, ck_format, &ck_conv_info);
+        std::lock_guard<std::mutex> lock(cache.mutex);
+
+        cache.entries.erase(std::remove_if(cache.entries.begin(), cache.entries.end(),
+                                           [device](const struct surface_copy_caps &entry)
+                                           { return entry.key.device == device; }),
+                            cache.entries.end());
     }
 
-    for (z = 0; z < dst_size->depth; z++)
     {
-        BYTE *dst_slice_ptr = dst + z * dst_slice_pitch;
-        const BYTE *src_slice_ptr = src + src_slice_pitch * (z * src_size->depth / dst_size->depth);
+        std::lock_guard<std::mutex> lock(list.mutex);
 
-        for (y = 0; y < dst_size->height; y++)
+        list.devices.erase(std::remove(list.devices.begin(), list.devices.end(), device), list.devices.end());
+        for (auto update = list.updates.begin(); update != list.updates.end();)
         {
-            BYTE *dst_ptr = dst_slice_ptr + y * dst_row_pitch;
-            const BYTE *src_row_ptr = src_slice_ptr + src_row_pitch * (y * src_size->height / dst_size->height);
-
-            for (x = 0; x < dst_size->width; x++)
+            if (update->device == device)
             {
-                const BYTE *src_ptr = src_row_ptr + (x * src_size->width / dst_size->width) * src_format->bytes_per_pixel;
-
-                if (!src_format->to_rgba && !dst_format->from_rgba
-                    && src_format->type == dst_format->type
-                    && src_format->bytes_per_pixel <= 4 && dst_format->bytes_per_pixel <= 4)
-                {
-                    DWORD val;
-
-                    get_relevant_argb_components(&conv_info, src_ptr, channels);
-                    val = make_argb_color(&conv_info, channels);
-
-                    if (color_key)
-                    {
-                        DWORD ck_pixel;
-
-                        get_relevant_argb_components(&ck_conv_info, src_ptr, channels);
-                        ck_pixel = make_argb_color(&ck_conv_info, channels);
-                        if (ck_pixel == color_key)
-                            val &= ~conv_info.destmask[0];
-                    }
-                    memcpy(dst_ptr, &val, dst_format->bytes_per_pixel);
-                }
+                if (update->texture)
+                    IDirect3DTexture9_Release(update->texture);
                 else
-                {
-                    struct vec4 color, tmp;
-
-                    format_to_vec4(src_format, src_ptr, &color);
-                    if (src_format->to_rgba)
-                        src_format->to_rgba(&color, &tmp, palette);
-                    else
-                        tmp = color;
+                    IDirect3DSurface9_Release(update->surface);
+                update = list.updates.erase(update);
+            }
+            else
+                ++update;
+        }
+    }
 
-                    if (ck_format)
-                    {
-                        DWORD ck_pixel;
+    std::lock_guard<std::mutex> lock(pool.mutex);
+    for (auto slot = pool.slots.begin(); slot != pool.slots.end();)
+    {
+        if (slot->key.device == device)
+        {
+            free_staging_slot(&*slot);
+            slot = pool.slots.erase(slot);
+        }
+        else
+            ++slot;
+    }
+}
 
-                        format_from_vec4(ck_format, &tmp, (BYTE *)&ck_pixel);
-                        if (ck_pixel == color_key)
-                            tmp.w = 0.0f;
-                    }
+// wine-8.2/dlls/d3dx9_36/surface.c
 
-                    if (dst_format->from_rgba)
-                        dst_format->from_rgba(&tmp, &color);
-                    else
-                        color = tmp;
+HRESULT lock_surface(IDirect3DSurface9 *surface, const RECT *surface_rect, D3DLOCKED_RECT *lock,
+                     IDirect3DSurface9 **temp_surface, BOOL write)
+{
+    IDirect3DTexture9 *managed_texture = NULL;
+    unsigned int width, height;
+    IDirect3DDevice9 *device;
+    D3DSURFACE_DESC desc;
+    RECT managed_rect;
+    DWORD lock_flag;
+    BOOL deferred;
+    HRESULT hr;
 
-                    format_from_vec4(dst_format, &color, dst_ptr);
-                }
+    lock_flag = write ? 0 : D3DLOCK_READONLY;
+    *temp_surface = NULL;
+    IDirect3DSurface9_GetDesc(surface, &desc);
+    deferred = write && is_surface_update_deferred(surface);
+    /* flush_surface_updates() adds the dirty rect */
+    if (deferred && desc.Pool == D3DPOOL_MANAGED
+        && get_managed_update_rect(surface, &desc, surface_rect, &managed_texture, &managed_rect))
+        lock_flag |= D3DLOCK_NO_DIRTY_UPDATE;
+    if (SUCCEEDED(hr = IDirect3DSurface9_LockRect(surface, lock, surface_rect, lock_flag)))
+    {
+        if (managed_texture)
+            defer_managed_update(surface, managed_texture, &managed_rect);
+    }
+    else
+    {
+        if (managed_texture)
+            IDirect3DTexture9_Release(managed_texture);
+        lock_flag &= ~D3DLOCK_NO_DIRTY_UPDATE;
+        IDirect3DSurface9_GetDevice(surface, &device);
+
+        if (deferred && SUCCEEDED(hr = lock_deferred_surface(device, surface, &desc, surface_rect, lock, temp_surface)))
+        {
+            IDirect3DDevice9_Release(device);
+            return hr;
+        }
+        if (!write)
+            flush_pending_surface_update(surface);
+
+        if (surface_rect)
+        {
+            width = surface_rect->right - surface_rect->left;
+            height = surface_rect->bottom - surface_rect->top;
+        }
+        else
+        {
+            width = desc.Width;
+            height = desc.Height;
+        }
+
+        hr = acquire_staging_surface(device, desc.Format, width, height, write, temp_surface);
+        if (FAILED(hr))
+        {
+//            WARN("Failed to create temporary surface, surface %p, format %#x, "
+//                 "usage %#lx, pool %#x, write %#x, width %u, height %u.\n",
+//                 surface, desc.Format, desc.Usage, desc.Pool, write, width, height);
+            IDirect3DDevice9_Release(device);
+            return hr;
+        }
+
+        if (write || SUCCEEDED(hr = IDirect3DDevice9_StretchRect(device, surface, surface_rect,
+                                                                 *temp_surface, NULL, D3DTEXF_NONE)))
+            hr = IDirect3DSurface9_LockRect(*temp_surface, lock, NULL, lock_flag);
+
+        IDirect3DDevice9_Release(device);
+        if (FAILED(hr))
+        {
+//            WARN("Failed to lock surface %p, write %#x, usage %#lx, pool %#x.\n",
+//                 surface, write, desc.Usage, desc.Pool);
+            release_staging_surface(*temp_surface);
+            *temp_surface = NULL;
+            return hr;
+        }
+//        TRACE("Created temporary surface %p.\n", surface);
+    }
+    return hr;
+}
+
+HRESULT unlock_surface(IDirect3DSurface9 *surface, const RECT *surface_rect,
+                       IDirect3DSurface9 *temp_surface, BOOL update)
+{
+    IDirect3DDevice9 *device;
+    POINT surface_point;
+    D3DSURFACE_DESC desc;
+    RECT rect;
+    HRESULT hr;
+
+    if (!temp_surface)
+    {
+        hr = IDirect3DSurface9_UnlockRect(surface);
+        return hr;
+    }
+
+    hr = IDirect3DSurface9_UnlockRect(temp_surface);
+    if (surface_rect)
+        rect = *surface_rect;
+    else
+    {
+        IDirect3DSurface9_GetDesc(surface, &desc);
+        SetRect(&rect, 0, 0, desc.Width, desc.Height);
+    }
+    if (unlock_deferred_surface(temp_surface, &rect, update ? 1 : 0))
+        return hr;
+    if (update)
+    {
+        surface_point.x = rect.left;
+        surface_point.y = rect.top;
+        IDirect3DSurface9_GetDevice(surface, &device);
+        hr = IDirect3DDevice9_UpdateSurface(device, temp_surface, NULL, surface, &surface_point);
+//        if (FAILED(hr))
+//            WARN("Updating surface failed, hr %#lx, surface %p, temp_surface %p.\n",
+//                 hr, surface, temp_surface);
+        IDirect3DDevice9_Release(device);
+    }
+    release_staging_surface(temp_surface);
+    return hr;
+}
+
+/* unlock_surface for a lock covering several written rects, only those are uploaded. */
+static HRESULT unlock_surface_rects(IDirect3DSurface9 *surface, const RECT *surface_rect,
+                                    IDirect3DSurface9 *temp_surface, const RECT *rects, UINT rect_count)
+{
+    IDirect3DDevice9 *device;
+    HRESULT hr;
+    UINT i;
+
+    if (!temp_surface)
+    {
+        hr = IDirect3DSurface9_UnlockRect(surface);
+        return hr;
+    }
+
+    hr = IDirect3DSurface9_UnlockRect(temp_surface);
+    if (unlock_deferred_surface(temp_surface, rects, rect_count))
+        return hr;
+
+    IDirect3DSurface9_GetDevice(surface, &device);
+    for (i = 0; i < rect_count && SUCCEEDED(hr); ++i)
+    {
+        POINT point = {rects[i].left, rects[i].top};
+        RECT src_rect;
+
+        /* the temporary surface only covers surface_rect */
+        SetRect(&src_rect, rects[i].left - surface_rect->left, rects[i].top - surface_rect->top,
+                rects[i].right - surface_rect->left, rects[i].bottom - surface_rect->top);
+        hr = IDirect3DDevice9_UpdateSurface(device, temp_surface, &src_rect, surface, &point);
+    }
+    IDirect3DDevice9_Release(device);
+    release_staging_surface(temp_surface);
+    return hr;
+}
+
+/* rect grown to whole blocks of format, clamped to the surface */
+static void get_block_aligned_rect(const RECT *rect, const struct pixel_format_desc *format,
+                                   const D3DSURFACE_DESC *desc, RECT *aligned)
+{
+    *aligned = *rect;
+    if (aligned->left & (format->block_width - 1))
+        aligned->left = aligned->left & ~(format->block_width - 1);
+    if (aligned->top & (format->block_height - 1))
+        aligned->top = aligned->top & ~(format->block_height - 1);
+    if (aligned->right & (format->block_width - 1) && aligned->right != (LONG)desc->Width)
+        aligned->right = std::min((aligned->right + format->block_width - 1)
+                                  & ~(format->block_width - 1), desc->Width);
+    if (aligned->bottom & (format->block_height - 1) && aligned->bottom != (LONG)desc->Height)
+        aligned->bottom = std::min((aligned->bottom + format->block_height - 1)
+                                   & ~(format->block_height - 1), desc->Height);
+}
+
+/************************************************************
+ * load_locked_rect
+ *
+ * The part of D3DXLoadSurfaceFromMemory after the destination is locked.
+ * dst_memory points at the top left of dst_rect grown to whole blocks,
+ * the arguments have already been validated.
+ */
+static HRESULT load_locked_rect(BYTE *dst_memory, UINT dst_memory_pitch, const D3DSURFACE_DESC *surfdesc,
+                                const RECT *dst_rect, const void *src_memory, D3DFORMAT src_format, UINT src_pitch,
+                                const PALETTEENTRY *src_palette, const RECT *src_rect, DWORD filter, D3DCOLOR color_key)
+{
+    const struct pixel_format_desc *srcformatdesc = get_format_info(src_format);
+    const struct pixel_format_desc *destformatdesc = get_format_info(surfdesc->Format);
+    struct volume src_size, dst_size, dst_size_aligned;
+    RECT dst_rect_aligned;
+    HRESULT hr = D3D_OK;
+
+    src_size.width = src_rect->right - src_rect->left;
+    src_size.height = src_rect->bottom - src_rect->top;
+    src_size.depth = 1;
 
-                dst_ptr += dst_format->bytes_per_pixel;
+    get_block_aligned_rect(dst_rect, destformatdesc, surfdesc, &dst_rect_aligned);
+    dst_size.width = dst_rect->right - dst_rect->left;
+    dst_size.height = dst_rect->bottom - dst_rect->top;
+    dst_size.depth = 1;
+    dst_size_aligned.width = dst_rect_aligned.right - dst_rect_aligned.left;
+    dst_size_aligned.height = dst_rect_aligned.bottom - dst_rect_aligned.top;
+    dst_size_aligned.depth = 1;
+
+    src_memory = (BYTE *)src_memory + src_rect->top / srcformatdesc->block_height * src_pitch
+                 + src_rect->left / srcformatdesc->block_width * srcformatdesc->block_byte_count;
+
+    if (src_format == surfdesc->Format
+        && dst_size.width == src_size.width
+        && dst_size.height == src_size.height
+        && color_key == 0
+        && !is_srgb_conversion(filter)
+        && !(src_rect->left & (srcformatdesc->block_width - 1))
+        && !(src_rect->top & (srcformatdesc->block_height - 1))
+        && !(dst_rect->left & (destformatdesc->block_width - 1))
+        && !(dst_rect->top & (destformatdesc->block_height - 1)))
+    {
+//        TRACE("Simple copy.\n");
+        copy_pixels(static_cast<const BYTE*>(src_memory), src_pitch, 0, dst_memory, dst_memory_pitch, 0,
+                    &src_size, srcformatdesc);
+    }
+    else /* Stretching or format conversion. */
+    {
+        const struct pixel_format_desc *argb_format = get_format_info(D3DFMT_A8R8G8B8);
+        const struct pixel_format_desc *dst_format;
+        struct conversion_plan plan;
+        BYTE *dst_uncompressed = NULL;
+        BOOL resample;
+        unsigned int dst_pitch;
+        BYTE *dst_mem;
+
+        if (!is_conversion_from_supported(srcformatdesc)
+            || !is_conversion_to_supported(destformatdesc))
+        {
+//            FIXME("Unsupported format conversion %#x -> %#x.\n", src_format, surfdesc->Format);
+            return E_NOTIMPL;
+        }
+
+        if (destformatdesc->type == FORMAT_DXT)
+        {
+            UINT width = (dst_size_aligned.width + 3) & ~3u, height = (dst_size_aligned.height + 3) & ~3u;
+
+            dst_pitch = width * sizeof(DWORD);
+            if (!(dst_uncompressed = (BYTE *)malloc(dst_pitch * height)))
+                return E_OUTOFMEMORY;
+            /* blocks only partly covered by dst_rect keep their other pixels */
+            if (dst_size.width != dst_size_aligned.width || dst_size.height != dst_size_aligned.height)
+            {
+                dxt_decode_func decode = get_dxt_decode_func(surfdesc->Format);
+                UINT i;
+
+                for (i = 0; i < height / 4; ++i)
+                    decode(dst_memory + i * dst_memory_pitch,
+                           (DWORD *)(dst_uncompressed + i * 4 * dst_pitch), width, width / 4);
             }
+            dst_mem = dst_uncompressed + (dst_rect->top - dst_rect_aligned.top) * dst_pitch
+                      + (dst_rect->left - dst_rect_aligned.left) * sizeof(DWORD);
+            dst_format = argb_format;
+        }
+        else
+        {
+            dst_mem = dst_memory;
+            dst_pitch = dst_memory_pitch;
+            dst_format = destformatdesc;
+        }
+
+        resample = ((filter & 0xf) == D3DX_FILTER_LINEAR || (filter & 0xf) == D3DX_FILTER_TRIANGLE
+                    || (filter & 0xf) == D3DX_FILTER_BOX || (filter & 0xf) == D3DX_FILTER_KAISER)
+                   && is_resample_supported(srcformatdesc) && is_resample_supported(dst_format);
+        if ((filter & 0xf) == D3DX_FILTER_NONE
+            || (dst_size.width == src_size.width && dst_size.height == src_size.height))
+            resample = FALSE;
+        /* sRGB transfers without filtering are point sampled by the resampler, cropping ignores them */
+        if (!resample && is_srgb_conversion(filter) && is_resample_supported(srcformatdesc)
+            && is_resample_supported(dst_format) && ((filter & 0xf) != D3DX_FILTER_NONE
+                || (dst_size.width == src_size.width && dst_size.height == src_size.height)))
+        {
+            resample = TRUE;
+            filter = (filter & ~0xfu) | D3DX_FILTER_POINT;
+        }
+
+        init_conversion_plan(srcformatdesc, resample ? argb_format : dst_format, color_key, src_palette, &plan);
+        /* DXT source rects don't have to start on a block boundary */
+        plan.block_x = src_rect->left & (srcformatdesc->block_width - 1);
+        plan.block_y = src_rect->top & (srcformatdesc->block_height - 1);
+
+        if (resample)
+        {
+            struct conversion_plan from_argb;
+
+            init_conversion_plan(argb_format, dst_format, 0, NULL, &from_argb);
+            hr = resample_argb_pixels(static_cast<const BYTE*>(src_memory), src_pitch, 0, &src_size,
+                                      dst_mem, dst_pitch, 0, &dst_size, &plan, &from_argb, filter);
+        }
+        else if ((filter & 0xf) == D3DX_FILTER_NONE
+            || (dst_size.width == src_size.width && dst_size.height == src_size.height))
+        {
+            hr = convert_argb_pixels(static_cast<const BYTE*>(src_memory), src_pitch, 0, &src_size,
+                                     dst_mem, dst_pitch, 0, &dst_size, &plan);
+        }
+        else
+        {
+//            if ((filter & 0xf) != D3DX_FILTER_POINT)
+//                FIXME("Unhandled filter %#lx.\n", filter);
+
+            /* Formats with wider channels than A8R8G8B8 are point filtered. */
+            hr = point_filter_argb_pixels(static_cast<const BYTE*>(src_memory), src_pitch, 0, &src_size,
+                                          dst_mem, dst_pitch, 0, &dst_size, &plan);
+        }
+
+        if (FAILED(hr))
+        {
+            free(dst_uncompressed);
+            return hr;
+        }
+
+        if (dst_uncompressed)
+        {
+            compress_dxt_pixels((DWORD *)dst_uncompressed, dst_pitch / sizeof(DWORD),
+                                dst_size_aligned.width, dst_size_aligned.height,
+                                dst_memory, dst_memory_pitch, destformatdesc,
+                                !!(filter & D3DX_FILTER_DXT_FAST));
+            free(dst_uncompressed);
         }
     }
+
+    return hr;
 }
 
 /************************************************************
@@ -843,7 +1187,6 @@ HRESULT D3DXLoadSurfaceFromMemory(IDirect3DSurface9 *dst_surface,
                                          DWORD filter, D3DCOLOR color_key)
 {
     const struct pixel_format_desc *srcformatdesc, *destformatdesc;
-    struct volume src_size, dst_size, dst_size_aligned;
     RECT dst_rect_temp, dst_rect_aligned;
     IDirect3DSurface9 *surface;
     D3DSURFACE_DESC surfdesc;
@@ -875,10 +1218,6 @@ HRESULT D3DXLoadSurfaceFromMemory(IDirect3DSurface9 *dst_surface,
         return E_NOTIMPL;
     }
 
-    src_size.width = src_rect->right - src_rect->left;
-    src_size.height = src_rect->bottom - src_rect->top;
-    src_size.depth = 1;
-
     IDirect3DSurface9_GetDesc(dst_surface, &surfdesc);
     destformatdesc = get_format_info(surfdesc.Format);
     if (!dst_rect)
@@ -905,257 +1244,1349 @@ HRESULT D3DXLoadSurfaceFromMemory(IDirect3DSurface9 *dst_surface,
         }
     }
 
-    dst_rect_aligned = *dst_rect;
-    if (dst_rect_aligned.left & (destformatdesc->block_width - 1))
-        dst_rect_aligned.left = dst_rect_aligned.left & ~(destformatdesc->block_width - 1);
-    if (dst_rect_aligned.top & (destformatdesc->block_height - 1))
-        dst_rect_aligned.top = dst_rect_aligned.top & ~(destformatdesc->block_height - 1);
-    if (dst_rect_aligned.right & (destformatdesc->block_width - 1) && dst_rect_aligned.right != surfdesc.Width)
-        dst_rect_aligned.right = std::min((dst_rect_aligned.right + destformatdesc->block_width - 1)
-                                         & ~(destformatdesc->block_width - 1), surfdesc.Width);
-    if (dst_rect_aligned.bottom & (destformatdesc->block_height - 1) && dst_rect_aligned.bottom != surfdesc.Height)
-        dst_rect_aligned.bottom = std::min((dst_rect_aligned.bottom + destformatdesc->block_height - 1)
-                                          & ~(destformatdesc->block_height - 1), surfdesc.Height);
-
-    dst_size.width = dst_rect->right - dst_rect->left;
-    dst_size.height = dst_rect->bottom - dst_rect->top;
-    dst_size.depth = 1;
-    dst_size_aligned.width = dst_rect_aligned.right - dst_rect_aligned.left;
-    dst_size_aligned.height = dst_rect_aligned.bottom - dst_rect_aligned.top;
-    dst_size_aligned.depth = 1;
-
     if (filter == D3DX_DEFAULT)
         filter = D3DX_FILTER_TRIANGLE | D3DX_FILTER_DITHER;
 
+    get_block_aligned_rect(dst_rect, destformatdesc, &surfdesc, &dst_rect_aligned);
     if (FAILED(hr = lock_surface(dst_surface, &dst_rect_aligned, &lockrect, &surface, TRUE)))
         return hr;
 
-    src_memory = (BYTE *)src_memory + src_rect->top / srcformatdesc->block_height * src_pitch
-                 + src_rect->left / srcformatdesc->block_width * srcformatdesc->block_byte_count;
+    if (FAILED(hr = load_locked_rect(static_cast<BYTE*>(lockrect.pBits), lockrect.Pitch, &surfdesc, dst_rect,
+                                     src_memory, src_format, src_pitch, src_palette, src_rect, filter, color_key)))
+    {
+        unlock_surface(dst_surface, &dst_rect_aligned, surface, FALSE);
+        return hr;
+    }
 
-    if (src_format == surfdesc.Format
-        && dst_size.width == src_size.width
-        && dst_size.height == src_size.height
-        && color_key == 0
-        && !(src_rect->left & (srcformatdesc->block_width - 1))
-        && !(src_rect->top & (srcformatdesc->block_height - 1))
-        && !(dst_rect->left & (destformatdesc->block_width - 1))
-        && !(dst_rect->top & (destformatdesc->block_height - 1)))
+    return unlock_surface(dst_surface, &dst_rect_aligned, surface, TRUE);
+}
+
+/************************************************************
+ * render_blit_surface
+ *
+ * Copies src_rect of a texture level to dst_rect of a render target by
+ * drawing a textured quad, for the copies StretchRect rejects, e.g. from
+ * managed or non render target textures. The device state is restored.
+ */
+static HRESULT render_blit_surface(IDirect3DDevice9 *device, IDirect3DSurface9 *src_surface,
+                                   const D3DSURFACE_DESC *src_desc, const RECT *src_rect,
+                                   IDirect3DSurface9 *dst_surface, const D3DSURFACE_DESC *dst_desc,
+                                   const RECT *dst_rect, D3DTEXTUREFILTERTYPE filter)
+{
+    struct
     {
-//        TRACE("Simple copy.\n");
-        copy_pixels(static_cast<const BYTE*>(src_memory), src_pitch, 0, static_cast<BYTE*>(lockrect.pBits), lockrect.Pitch, 0,
-                    &src_size, srcformatdesc);
+        float x, y, z, rhw;
+        float u, v;
+    } quad[4];
+    IDirect3DSurface9 *render_target, *level;
+    IDirect3DStateBlock9 *state;
+    IDirect3DTexture9 *texture;
+    DWORD level_index, level_count;
+    BOOL in_scene;
+    HRESULT hr;
+    UINT i;
+
+    if (!(dst_desc->Usage & D3DUSAGE_RENDERTARGET) || dst_desc->Pool != D3DPOOL_DEFAULT
+        || src_desc->Pool == D3DPOOL_SYSTEMMEM || src_desc->Pool == D3DPOOL_SCRATCH)
+        return E_NOTIMPL;
+    if (FAILED(IDirect3DSurface9_GetContainer(src_surface, IID_IDirect3DTexture9, (void **)&texture)))
+        return E_NOTIMPL;
+
+    level_count = IDirect3DTexture9_GetLevelCount(texture);
+    for (level_index = 0; level_index < level_count; ++level_index)
+    {
+        if (FAILED(IDirect3DTexture9_GetSurfaceLevel(texture, level_index, &level)))
+            continue;
+        IDirect3DSurface9_Release(level);
+        if (level == src_surface)
+            break;
     }
-    else /* Stretching or format conversion. */
+
+    if (FAILED(hr = IDirect3DDevice9_CreateStateBlock(device, D3DSBT_ALL, &state)))
     {
-        const struct pixel_format_desc *dst_format;
-        BYTE *dst_uncompressed = NULL;
-        unsigned int dst_pitch;
-        BYTE *dst_mem;
+        IDirect3DTexture9_Release(texture);
+        return hr;
+    }
+    if (FAILED(hr = IDirect3DDevice9_GetRenderTarget(device, 0, &render_target)))
+    {
+        IDirect3DStateBlock9_Release(state);
+        IDirect3DTexture9_Release(texture);
+        return hr;
+    }
 
-        if (!is_conversion_from_supported(srcformatdesc)
-            || !is_conversion_to_supported(destformatdesc))
-        {
-//            FIXME("Unsupported format conversion %#x -> %#x.\n", src_format, surfdesc.Format);
-            unlock_surface(dst_surface, &dst_rect_aligned, surface, FALSE);
-            return E_NOTIMPL;
-        }
+    /* pixel centers of dst_rect sample the texel centers of src_rect */
+    for (i = 0; i < 4; ++i)
+    {
+        quad[i].x = (i & 1 ? dst_rect->right : dst_rect->left) - 0.5f;
+        quad[i].y = (i & 2 ? dst_rect->bottom : dst_rect->top) - 0.5f;
+        quad[i].z = 0.0f;
+        quad[i].rhw = 1.0f;
+        quad[i].u = (float)(i & 1 ? src_rect->right : src_rect->left) / src_desc->Width;
+        quad[i].v = (float)(i & 2 ? src_rect->bottom : src_rect->top) / src_desc->Height;
+    }
+
+    if (SUCCEEDED(hr = IDirect3DDevice9_SetRenderTarget(device, 0, dst_surface)))
+    {
+        IDirect3DDevice9_SetVertexShader(device, NULL);
+        IDirect3DDevice9_SetPixelShader(device, NULL);
+        IDirect3DDevice9_SetFVF(device, D3DFVF_XYZRHW | D3DFVF_TEX1);
+        IDirect3DDevice9_SetRenderState(device, D3DRS_ZENABLE, D3DZB_FALSE);
+        IDirect3DDevice9_SetRenderState(device, D3DRS_STENCILENABLE, FALSE);
+        IDirect3DDevice9_SetRenderState(device, D3DRS_ALPHABLENDENABLE, FALSE);
+        IDirect3DDevice9_SetRenderState(device, D3DRS_ALPHATESTENABLE, FALSE);
+        IDirect3DDevice9_SetRenderState(device, D3DRS_SCISSORTESTENABLE, FALSE);
+        IDirect3DDevice9_SetRenderState(device, D3DRS_SRGBWRITEENABLE, FALSE);
+        IDirect3DDevice9_SetRenderState(device, D3DRS_CULLMODE, D3DCULL_NONE);
+        IDirect3DDevice9_SetRenderState(device, D3DRS_LIGHTING, FALSE);
+        IDirect3DDevice9_SetRenderState(device, D3DRS_FOGENABLE, FALSE);
+        IDirect3DDevice9_SetRenderState(device, D3DRS_COLORWRITEENABLE, 0xf);
+        IDirect3DDevice9_SetTextureStageState(device, 0, D3DTSS_COLOROP, D3DTOP_SELECTARG1);
+        IDirect3DDevice9_SetTextureStageState(device, 0, D3DTSS_COLORARG1, D3DTA_TEXTURE);
+        IDirect3DDevice9_SetTextureStageState(device, 0, D3DTSS_ALPHAOP, D3DTOP_SELECTARG1);
+        IDirect3DDevice9_SetTextureStageState(device, 0, D3DTSS_ALPHAARG1, D3DTA_TEXTURE);
+        IDirect3DDevice9_SetTextureStageState(device, 0, D3DTSS_TEXCOORDINDEX, 0);
+        IDirect3DDevice9_SetTextureStageState(device, 0, D3DTSS_TEXTURETRANSFORMFLAGS, D3DTTFF_DISABLE);
+        IDirect3DDevice9_SetTextureStageState(device, 1, D3DTSS_COLOROP, D3DTOP_DISABLE);
+        IDirect3DDevice9_SetTexture(device, 0, (IDirect3DBaseTexture9 *)texture);
+        IDirect3DDevice9_SetSamplerState(device, 0, D3DSAMP_ADDRESSU, D3DTADDRESS_CLAMP);
+        IDirect3DDevice9_SetSamplerState(device, 0, D3DSAMP_ADDRESSV, D3DTADDRESS_CLAMP);
+        IDirect3DDevice9_SetSamplerState(device, 0, D3DSAMP_MAGFILTER,
+                                         filter == D3DTEXF_LINEAR ? D3DTEXF_LINEAR : D3DTEXF_POINT);
+        IDirect3DDevice9_SetSamplerState(device, 0, D3DSAMP_MINFILTER,
+                                         filter == D3DTEXF_LINEAR ? D3DTEXF_LINEAR : D3DTEXF_POINT);
+        IDirect3DDevice9_SetSamplerState(device, 0, D3DSAMP_MIPFILTER, D3DTEXF_NONE);
+        IDirect3DDevice9_SetSamplerState(device, 0, D3DSAMP_MAXMIPLEVEL, level_index);
+        IDirect3DDevice9_SetSamplerState(device, 0, D3DSAMP_SRGBTEXTURE, FALSE);
+
+        /* the caller may already be inside a scene */
+        in_scene = FAILED(IDirect3DDevice9_BeginScene(device));
+        hr = IDirect3DDevice9_DrawPrimitiveUP(device, D3DPT_TRIANGLESTRIP, 2, quad, sizeof(quad[0]));
+        if (!in_scene)
+            IDirect3DDevice9_EndScene(device);
+
+        IDirect3DDevice9_SetTexture(device, 0, NULL);
+        IDirect3DDevice9_SetRenderTarget(device, 0, render_target);
+    }
+
+    /* after SetRenderTarget, which resets the viewport */
+    IDirect3DStateBlock9_Apply(state);
+    IDirect3DStateBlock9_Release(state);
+    IDirect3DSurface9_Release(render_target);
+    IDirect3DTexture9_Release(texture);
+    return hr;
+}
+
+/************************************************************
+ * D3DXLoadSurfaceFromSurface
+ *
+ * Copies the contents from one surface to another, performing any required
+ * format conversion, resizing or filtering.
+ *
+ * PARAMS
+ *   pDestSurface [I] pointer to the destination surface
+ *   pDestPalette [I] palette to use
+ *   pDestRect    [I] to be filled area of the surface
+ *   pSrcSurface  [I] pointer to the source surface
+ *   pSrcPalette  [I] palette used for the source surface
+ *   pSrcRect     [I] area of the source data to load
+ *   dwFilter     [I] filter to apply on resizing
+ *   Colorkey     [I] any ARGB value or 0 to disable color-keying
+ *
+ * RETURNS
+ *   Success: D3D_OK
+ *   Failure: D3DERR_INVALIDCALL, if pDestSurface or pSrcSurface is NULL
+ *            D3DXERR_INVALIDDATA, if one of the surfaces is not lockable
+ *
+ */
+HRESULT D3DXLoadSurfaceFromSurface(IDirect3DSurface9 *dst_surface,
+                                          const PALETTEENTRY *dst_palette, const RECT *dst_rect, IDirect3DSurface9 *src_surface,
+                                          const PALETTEENTRY *src_palette, const RECT *src_rect, DWORD filter, D3DCOLOR color_key)
+{
+    const struct pixel_format_desc *src_format_desc, *dst_format_desc;
+    D3DSURFACE_DESC src_desc, dst_desc;
+    struct volume src_size, dst_size;
+    struct surface_copy_caps copy_caps;
+    struct surface_copy_key copy_key;
+    IDirect3DSurface9 *temp_surface;
+    D3DTEXTUREFILTERTYPE d3d_filter;
+    IDirect3DDevice9 *device;
+    D3DLOCKED_RECT lock;
+    RECT dst_rect_temp;
+    HRESULT hr;
+    RECT s;
+
+//    TRACE("dst_surface %p, dst_palette %p, dst_rect %s, src_surface %p, "
+//          "src_palette %p, src_rect %s, filter %#lx, color_key 0x%08lx.\n",
+//          dst_surface, dst_palette, wine_dbgstr_rect(dst_rect), src_surface,
+//          src_palette, wine_dbgstr_rect(src_rect), filter, color_key);
+
+    if (!dst_surface || !src_surface)
+        return D3DERR_INVALIDCALL;
+
+    IDirect3DSurface9_GetDesc(src_surface, &src_desc);
+    src_format_desc = get_format_info(src_desc.Format);
+    if (!src_rect)
+    {
+        SetRect(&s, 0, 0, src_desc.Width, src_desc.Height);
+        src_rect = &s;
+    }
+    else if (src_rect->left == src_rect->right || src_rect->top == src_rect->bottom)
+    {
+//        WARN("Empty src_rect specified.\n");
+        return filter == D3DX_FILTER_NONE ? D3D_OK : E_FAIL;
+    }
+    else if (src_rect->left > src_rect->right || src_rect->right > src_desc.Width
+             || src_rect->left < 0 || src_rect->left > src_desc.Width
+             || src_rect->top > src_rect->bottom || src_rect->bottom > src_desc.Height
+             || src_rect->top < 0 || src_rect->top > src_desc.Height)
+    {
+//        WARN("Invalid src_rect specified.\n");
+        return D3DERR_INVALIDCALL;
+    }
+
+    src_size.width = src_rect->right - src_rect->left;
+    src_size.height = src_rect->bottom - src_rect->top;
+    src_size.depth = 1;
+
+    IDirect3DSurface9_GetDesc(dst_surface, &dst_desc);
+    dst_format_desc = get_format_info(dst_desc.Format);
+    if (!dst_rect)
+    {
+        SetRect(&dst_rect_temp, 0, 0, dst_desc.Width, dst_desc.Height);
+        dst_rect = &dst_rect_temp;
+    }
+    else if (dst_rect->left == dst_rect->right || dst_rect->top == dst_rect->bottom)
+    {
+//        WARN("Empty dst_rect specified.\n");
+        return filter == D3DX_FILTER_NONE ? D3D_OK : E_FAIL;
+    }
+    else if (dst_rect->left > dst_rect->right || dst_rect->right > dst_desc.Width
+             || dst_rect->left < 0 || dst_rect->left > dst_desc.Width
+             || dst_rect->top > dst_rect->bottom || dst_rect->bottom > dst_desc.Height
+             || dst_rect->top < 0 || dst_rect->top > dst_desc.Height)
+    {
+//        WARN("Invalid dst_rect specified.\n");
+        return D3DERR_INVALIDCALL;
+    }
+
+    dst_size.width = dst_rect->right - dst_rect->left;
+    dst_size.height = dst_rect->bottom - dst_rect->top;
+    dst_size.depth = 1;
+
+    if (!dst_palette && !src_palette && !color_key && !is_srgb_conversion(filter))
+    {
+        if (src_desc.Format == dst_desc.Format
+            && dst_size.width == src_size.width
+            && dst_size.height == src_size.height
+            && color_key == 0
+            && !(src_rect->left & (src_format_desc->block_width - 1))
+            && !(src_rect->top & (src_format_desc->block_height - 1))
+            && !(dst_rect->left & (dst_format_desc->block_width - 1))
+            && !(dst_rect->top & (dst_format_desc->block_height - 1)))
+        {
+            d3d_filter = D3DTEXF_NONE;
+        }
+        else
+        {
+            switch (filter)
+            {
+            case D3DX_FILTER_NONE:
+                d3d_filter = D3DTEXF_NONE;
+                break;
+
+            case D3DX_FILTER_POINT:
+                d3d_filter = D3DTEXF_POINT;
+                break;
+
+            case D3DX_FILTER_LINEAR:
+                d3d_filter = D3DTEXF_LINEAR;
+                break;
+
+            default:
+                d3d_filter = D3DTEXF_FORCE_DWORD;
+                break;
+            }
+        }
+
+        if (d3d_filter != D3DTEXF_FORCE_DWORD)
+        {
+            IDirect3DSurface9_GetDevice(src_surface, &device);
+            get_surface_copy_key(device, src_surface, &src_desc, dst_surface, &dst_desc, d3d_filter, &copy_key);
+            copy_caps = get_surface_copy_caps(&copy_key);
+
+            /* the GPU copy reads what was written to src and must not be overwritten by
+             * an older write to dst uploaded later */
+            if (copy_caps.stretch_rect != SURFACE_COPY_FAILS || copy_caps.render_blit != SURFACE_COPY_FAILS)
+            {
+                flush_pending_surface_update(src_surface);
+                flush_pending_surface_update(dst_surface);
+            }
+
+            hr = E_FAIL;
+            if (copy_caps.stretch_rect != SURFACE_COPY_FAILS)
+            {
+                hr = IDirect3DDevice9_StretchRect(device, src_surface, src_rect, dst_surface, dst_rect, d3d_filter);
+                if (copy_caps.stretch_rect == SURFACE_COPY_UNKNOWN && (SUCCEEDED(hr) || is_unsupported_surface_copy(hr)))
+                {
+                    copy_caps.stretch_rect = SUCCEEDED(hr) ? SURFACE_COPY_OK : SURFACE_COPY_FAILS;
+                    set_surface_copy_caps(&copy_caps);
+                }
+            }
+            if (FAILED(hr) && copy_caps.render_blit != SURFACE_COPY_FAILS)
+            {
+                hr = render_blit_surface(device, src_surface, &src_desc, src_rect,
+                                         dst_surface, &dst_desc, dst_rect, d3d_filter);
+                if (copy_caps.render_blit == SURFACE_COPY_UNKNOWN && (SUCCEEDED(hr) || is_unsupported_surface_copy(hr)))
+                {
+                    copy_caps.render_blit = SUCCEEDED(hr) ? SURFACE_COPY_OK : SURFACE_COPY_FAILS;
+                    set_surface_copy_caps(&copy_caps);
+                }
+            }
+            IDirect3DDevice9_Release(device);
+            if (SUCCEEDED(hr))
+                return D3D_OK;
+        }
+    }
+
+    if (FAILED(lock_surface(src_surface, NULL, &lock, &temp_surface, FALSE)))
+        return D3DERR_INVALIDCALL; // D3DXERR_INVALIDDATA;
+
+    hr = D3DXLoadSurfaceFromMemory(dst_surface, dst_palette, dst_rect, lock.pBits,
+                                   src_desc.Format, lock.Pitch, src_palette, src_rect, filter, color_key);
+
+    if (FAILED(unlock_surface(src_surface, NULL, temp_surface, FALSE)))
+        return D3DERR_INVALIDCALL; // D3DXERR_INVALIDDATA;
+
+    return hr;
+}
+
+// wine-8.2/dlls/d3dx9_36/texture.c
+
+static HRESULT get_surface(D3DRESOURCETYPE type, struct IDirect3DBaseTexture9 *tex,
+                           int face, UINT level, struct IDirect3DSurface9 **surf)
+{
+    switch (type)
+    {
+        case D3DRTYPE_TEXTURE:
+            return IDirect3DTexture9_GetSurfaceLevel((IDirect3DTexture9*) tex, level, surf);
+        case D3DRTYPE_CUBETEXTURE:
+            return IDirect3DCubeTexture9_GetCubeMapSurface((IDirect3DCubeTexture9*) tex, (D3DCUBEMAP_FACES)face, level, surf);
+        default:
+//            ERR("Unexpected texture type\n");
+            return E_NOTIMPL;
+    }
+}
+
+static inline BOOL is_pow2(UINT num)
+{
+    return !(num & (num - 1));
+}
+
+/* Fills the levels below src_level of one face, each from the one above. */
+static HRESULT filter_texture_face(D3DRESOURCETYPE type, IDirect3DBaseTexture9 *texture, int face,
+                                   const PALETTEENTRY *palette, UINT src_level, UINT level_count, DWORD filter)
+{
+    IDirect3DSurface9 *topsurf, *mipsurf;
+    HRESULT hr = D3D_OK;
+    UINT level;
+
+    if (FAILED(get_surface(type, texture, face, src_level, &topsurf)))
+        return D3DERR_INVALIDCALL;
+
+    for (level = src_level + 1; level < level_count; ++level)
+    {
+        if (FAILED(get_surface(type, texture, face, level, &mipsurf)))
+            break;
+        hr = D3DXLoadSurfaceFromSurface(mipsurf, palette, NULL, topsurf, palette, NULL, filter, 0);
+        IDirect3DSurface9_Release(topsurf);
+        topsurf = mipsurf;
+
+        if (FAILED(hr))
+            break;
+    }
+
+    IDirect3DSurface9_Release(topsurf);
+    return hr;
+}
+
+/************************************************************
+ * D3DXFilterTexture
+ *
+ * Builds the mip chain below src_level. D3DX_FILTER_KAISER is accepted
+ * besides the D3DX filters. For textures created with
+ * D3DUSAGE_AUTOGENMIPMAP the device generates the levels instead. The
+ * faces are filtered one after the other on the calling thread, since
+ * they lock surfaces of a device that may not be multithreaded; each
+ * level uses the row bands of the 2:1 box and the conversions.
+ */
+HRESULT D3DXFilterTexture(IDirect3DBaseTexture9 *texture,
+                          const PALETTEENTRY *palette,
+                          UINT src_level,
+                          DWORD filter)
+{
+    UINT level_count;
+    HRESULT hr;
+    D3DRESOURCETYPE type;
+
+//    TRACE("texture %p, palette %p, src_level %u, filter %#lx.\n", texture, palette, src_level, filter);
+
+    if (!texture)
+        return D3DERR_INVALIDCALL;
+
+    if ((filter & 0xFFFF) > D3DX_FILTER_KAISER && filter != D3DX_DEFAULT)
+        return D3DERR_INVALIDCALL;
+
+    level_count = IDirect3DBaseTexture9_GetLevelCount(texture);
+    if (src_level == D3DX_DEFAULT)
+        src_level = 0;
+    else if (src_level >= level_count)
+        return D3DERR_INVALIDCALL;
+
+    switch (type = IDirect3DBaseTexture9_GetType(texture))
+    {
+        case D3DRTYPE_TEXTURE:
+        case D3DRTYPE_CUBETEXTURE:
+        {
+            D3DSURFACE_DESC desc;
+            int i, numfaces;
+
+            if (type == D3DRTYPE_TEXTURE)
+            {
+                numfaces = 1;
+                IDirect3DTexture9_GetLevelDesc((IDirect3DTexture9*) texture, src_level, &desc);
+            }
+            else
+            {
+                numfaces = 6;
+                IDirect3DCubeTexture9_GetLevelDesc((IDirect3DCubeTexture9*) texture, src_level, &desc);
+            }
+
+            if (desc.Usage & D3DUSAGE_AUTOGENMIPMAP)
+            {
+                IDirect3DBaseTexture9_GenerateMipSubLevels(texture);
+                return D3D_OK;
+            }
+
+            if (filter == D3DX_DEFAULT)
+            {
+                if (is_pow2(desc.Width) && is_pow2(desc.Height))
+                    filter = D3DX_FILTER_BOX;
+                else
+                    filter = D3DX_FILTER_BOX | D3DX_FILTER_DITHER;
+            }
+
+            for (i = 0; i < numfaces; i++)
+            {
+                if (FAILED(hr = filter_texture_face(type, texture, i, palette, src_level, level_count, filter)))
+                    return hr;
+            }
+
+            return D3D_OK;
+        }
+
+        default:
+//            FIXME("Volume textures are not supported.\n");
+            return E_NOTIMPL;
+    }
+}
+
+/************************************************************
+ * load_surface_subloads
+ *
+ * Loads a batch of rects into one surface, e.g. glyphs or sprites into an
+ * atlas. The destination is locked once over the bounding rect of the batch
+ * and only the written rects are uploaded, each source surface is locked
+ * once. Rects whose block aligned destinations don't overlap are loaded in
+ * parallel, otherwise the batch is loaded in order.
+ */
+struct subload_source
+{
+    IDirect3DSurface9 *surface;
+    IDirect3DSurface9 *temp_surface;
+    D3DSURFACE_DESC desc;
+    D3DLOCKED_RECT lock;
+};
+
+static HRESULT load_surface_subloads(IDirect3DSurface9 *dst_surface, const struct surface_subload *subloads,
+                                     UINT count, DWORD filter, D3DCOLOR color_key)
+{
+    const struct pixel_format_desc *destformatdesc;
+    std::vector<struct subload_source> sources;
+    std::vector<UINT> source_index(count, ~0u);
+    std::vector<HRESULT> results(count, D3D_OK);
+    std::vector<RECT> aligned_rects;
+    std::vector<UINT> loads;
+    IDirect3DSurface9 *surface;
+    D3DSURFACE_DESC surfdesc;
+    D3DLOCKED_RECT lockrect;
+    unsigned long long dst_bytes = 0;
+    BOOL overlap = FALSE;
+    RECT bounds = {0};
+    HRESULT hr = D3D_OK;
+    UINT i, j;
+
+    if (!dst_surface || (count && !subloads))
+        return D3DERR_INVALIDCALL;
+
+    IDirect3DSurface9_GetDesc(dst_surface, &surfdesc);
+    destformatdesc = get_format_info(surfdesc.Format);
+    if (destformatdesc->type == FORMAT_UNKNOWN)
+        return E_NOTIMPL;
+
+    for (i = 0; i < count; ++i)
+    {
+        const struct surface_subload *subload = &subloads[i];
+        const RECT *dst_rect = &subload->dst_rect, *src_rect = &subload->src_rect;
+
+        if (!subload->src_memory == !subload->src_surface || subload->src_surface == dst_surface)
+            return D3DERR_INVALIDCALL;
+        if (dst_rect->left > dst_rect->right || dst_rect->right > (LONG)surfdesc.Width
+            || dst_rect->top > dst_rect->bottom || dst_rect->bottom > (LONG)surfdesc.Height
+            || dst_rect->left < 0 || dst_rect->top < 0)
+        {
+//            WARN("Invalid dst_rect specified.\n");
+            return D3DERR_INVALIDCALL;
+        }
+        /* empty destinations are skipped, as in D3DXLoadSurfaceFromMemory */
+        if (dst_rect->left == dst_rect->right || dst_rect->top == dst_rect->bottom)
+            continue;
+        if (src_rect->left >= src_rect->right || src_rect->top >= src_rect->bottom)
+            return E_FAIL;
+
+        if (subload->src_surface)
+        {
+            for (j = 0; j < sources.size() && sources[j].surface != subload->src_surface; ++j)
+                ;
+            if (j == sources.size())
+            {
+                struct subload_source source = {subload->src_surface};
+
+                IDirect3DSurface9_GetDesc(source.surface, &source.desc);
+                sources.push_back(source);
+            }
+            if (src_rect->left < 0 || src_rect->right > (LONG)sources[j].desc.Width
+                || src_rect->top < 0 || src_rect->bottom > (LONG)sources[j].desc.Height)
+            {
+//                WARN("Invalid src_rect specified.\n");
+                return D3DERR_INVALIDCALL;
+            }
+            source_index[i] = j;
+        }
+        else if (subload->src_format == D3DFMT_UNKNOWN)
+            return E_FAIL;
+        if (get_format_info(subload->src_surface ? sources[j].desc.Format : subload->src_format)->type
+            == FORMAT_UNKNOWN)
+        {
+//            FIXME("Unsupported format.\n");
+            return E_NOTIMPL;
+        }
+
+        loads.push_back(i);
+        aligned_rects.emplace_back();
+        get_block_aligned_rect(dst_rect, destformatdesc, &surfdesc, &aligned_rects.back());
+        dst_bytes += (unsigned long long)(dst_rect->right - dst_rect->left) * (dst_rect->bottom - dst_rect->top) * 4;
+    }
+    if (loads.empty())
+        return D3D_OK;
+
+    bounds = aligned_rects[0];
+    for (i = 1; i < aligned_rects.size(); ++i)
+    {
+        bounds.left = std::min(bounds.left, aligned_rects[i].left);
+        bounds.top = std::min(bounds.top, aligned_rects[i].top);
+        bounds.right = std::max(bounds.right, aligned_rects[i].right);
+        bounds.bottom = std::max(bounds.bottom, aligned_rects[i].bottom);
+        for (j = 0; j < i && !overlap; ++j)
+            overlap = aligned_rects[i].left < aligned_rects[j].right && aligned_rects[j].left < aligned_rects[i].right
+                      && aligned_rects[i].top < aligned_rects[j].bottom && aligned_rects[j].top < aligned_rects[i].bottom;
+    }
+
+    if (filter == D3DX_DEFAULT)
+        filter = D3DX_FILTER_TRIANGLE | D3DX_FILTER_DITHER;
+
+    for (i = 0; i < sources.size(); ++i)
+    {
+        if (FAILED(lock_surface(sources[i].surface, NULL, &sources[i].lock, &sources[i].temp_surface, FALSE)))
+        {
+            while (i--)
+                unlock_surface(sources[i].surface, NULL, sources[i].temp_surface, FALSE);
+            return D3DERR_INVALIDCALL; // D3DXERR_INVALIDDATA;
+        }
+    }
+
+    if (SUCCEEDED(hr = lock_surface(dst_surface, &bounds, &lockrect, &surface, TRUE)))
+    {
+        auto load = [&](UINT load_index)
+        {
+            const struct surface_subload *subload = &subloads[loads[load_index]];
+            const RECT *aligned = &aligned_rects[load_index];
+            BYTE *dst_memory = static_cast<BYTE*>(lockrect.pBits)
+                               + (aligned->top - bounds.top) / destformatdesc->block_height * lockrect.Pitch
+                               + (aligned->left - bounds.left) / destformatdesc->block_width * destformatdesc->block_byte_count;
+
+            if (subload->src_surface)
+            {
+                const struct subload_source *source = &sources[source_index[loads[load_index]]];
+
+                results[load_index] = load_locked_rect(dst_memory, lockrect.Pitch, &surfdesc, &subload->dst_rect,
+                                                       source->lock.pBits, source->desc.Format, source->lock.Pitch,
+                                                       subload->src_palette, &subload->src_rect, filter, color_key);
+            }
+            else
+            {
+                results[load_index] = load_locked_rect(dst_memory, lockrect.Pitch, &surfdesc, &subload->dst_rect,
+                                                       subload->src_memory, subload->src_format, subload->src_pitch,
+                                                       subload->src_palette, &subload->src_rect, filter, color_key);
+            }
+        };
+
+        if (overlap)
+        {
+            for (i = 0; i < loads.size(); ++i)
+                load(i);
+        }
+        else
+        {
+            /* one rect per row, the bands of a rect run serially inside */
+            run_row_bands(loads.size(), (UINT)std::min<unsigned long long>(dst_bytes / loads.size(), 0x7fffffff),
+                          [&](UINT first_row, UINT last_row, UINT worker)
+            {
+                for (UINT r = first_row; r < last_row; ++r)
+                    load(r);
+            });
+        }
+
+        for (i = 0; i < loads.size() && SUCCEEDED(hr); ++i)
+            hr = results[i];
+
+        if (SUCCEEDED(hr))
+            hr = unlock_surface_rects(dst_surface, &bounds, surface, aligned_rects.data(), aligned_rects.size());
+        else
+            unlock_surface_rects(dst_surface, &bounds, surface, NULL, 0);
+    }
+
+    for (i = 0; i < sources.size(); ++i)
+        unlock_surface(sources[i].surface, NULL, sources[i].temp_surface, FALSE);
+
+    return hr;
+}
+
+/************************************************************
+ * DDS file regions
+ *
+ * wine-8.2/dlls/d3dx9_36/surface.c parses the whole file in memory, here
+ * only the header is read and the block rows of a region are read with
+ * pread, so loading a sprite out of a large file touches just its rows.
+ */
+
+#define DDS_MIPMAPCOUNT 0x20000
+
+#define DDS_CAPS2_VOLUME 0x200000
+
+#define DDS_PF_ALPHA 0x1
+#define DDS_PF_ALPHA_ONLY 0x2
+#define DDS_PF_FOURCC 0x4
+#define DDS_PF_INDEXED 0x20
+#define DDS_PF_RGB 0x40
+#define DDS_PF_LUMINANCE 0x20000
+
+#define DDS_MAGIC 0x20534444 /* "DDS " */
+#define DDS_FOURCC_DX10 0x30315844 /* "DX10" */
+
+struct dds_pixel_format
+{
+    DWORD size;
+    DWORD flags;
+    DWORD fourcc;
+    DWORD bpp;
+    DWORD rmask;
+    DWORD gmask;
+    DWORD bmask;
+    DWORD amask;
+};
+
+struct dds_header
+{
+    DWORD signature;
+    DWORD size;
+    DWORD flags;
+    DWORD height;
+    DWORD width;
+    DWORD pitch_or_linear_size;
+    DWORD depth;
+    DWORD miplevels;
+    DWORD reserved[11];
+    struct dds_pixel_format pixel_format;
+    DWORD caps;
+    DWORD caps2;
+    DWORD caps3;
+    DWORD caps4;
+    DWORD reserved2;
+};
+
+struct dds_header_dx10
+{
+    DWORD dxgi_format;
+    DWORD resource_dimension;
+    DWORD misc_flags;
+    DWORD array_size;
+    DWORD misc_flags2;
+};
+
+/* where the pixels of a DDS file start and how its first face is laid out */
+struct dds_file_info
+{
+    D3DFORMAT format;
+    UINT width;
+    UINT height;
+    UINT miplevels;
+    UINT data_offset;
+    PALETTEENTRY palette[256];
+};
+
+static D3DFORMAT dds_fourcc_to_d3dformat(DWORD fourcc)
+{
+    unsigned int i;
+    static const DWORD known_fourcc[] = {
+        D3DFMT_DXT1,
+        D3DFMT_DXT2,
+        D3DFMT_DXT3,
+        D3DFMT_DXT4,
+        D3DFMT_DXT5,
+        D3DFMT_R16F,
+        D3DFMT_G16R16F,
+        D3DFMT_A16B16G16R16F,
+        D3DFMT_R32F,
+        D3DFMT_G32R32F,
+        D3DFMT_A32B32G32R32F,
+    };
+
+    for (i = 0; i < sizeof(known_fourcc) / sizeof(known_fourcc[0]); i++)
+    {
+        if (known_fourcc[i] == fourcc)
+            return (D3DFORMAT)fourcc;
+    }
+
+//    WARN("Unknown FourCC %#lx\n", fourcc);
+    return D3DFMT_UNKNOWN;
+}
+
+static const struct
+{
+    DWORD bpp;
+    DWORD rmask;
+    DWORD gmask;
+    DWORD bmask;
+    DWORD amask;
+    D3DFORMAT format;
+} rgb_pixel_formats[] =
+{
+    { 8, 0xe0, 0x1c, 0x03, 0, D3DFMT_R3G3B2 },
+    { 16, 0xf800, 0x07e0, 0x001f, 0x0000, D3DFMT_R5G6B5 },
+    { 16, 0x7c00, 0x03e0, 0x001f, 0x8000, D3DFMT_A1R5G5B5 },
+    { 16, 0x7c00, 0x03e0, 0x001f, 0x0000, D3DFMT_X1R5G5B5 },
+    { 16, 0x0f00, 0x00f0, 0x000f, 0xf000, D3DFMT_A4R4G4B4 },
+    { 16, 0x0f00, 0x00f0, 0x000f, 0x0000, D3DFMT_X4R4G4B4 },
+    { 16, 0x00e0, 0x001c, 0x0003, 0xff00, D3DFMT_A8R3G3B2 },
+    { 24, 0xff0000, 0x00ff00, 0x0000ff, 0x000000, D3DFMT_R8G8B8 },
+    { 32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0xff000000, D3DFMT_A8R8G8B8 },
+    { 32, 0x00ff0000, 0x0000ff00, 0x000000ff, 0x00000000, D3DFMT_X8R8G8B8 },
+    { 32, 0x000003ff, 0x000ffc00, 0x3ff00000, 0xc0000000, D3DFMT_A2B10G10R10 },
+    { 32, 0x3ff00000, 0x000ffc00, 0x000003ff, 0xc0000000, D3DFMT_A2R10G10B10 },
+    { 32, 0x0000ffff, 0xffff0000, 0x00000000, 0x00000000, D3DFMT_G16R16 },
+    { 32, 0x000000ff, 0x0000ff00, 0x00ff0000, 0xff000000, D3DFMT_A8B8G8R8 },
+    { 32, 0x000000ff, 0x0000ff00, 0x00ff0000, 0x00000000, D3DFMT_X8B8G8R8 },
+};
+
+static D3DFORMAT dds_rgb_to_d3dformat(const struct dds_pixel_format *pixel_format)
+{
+    unsigned int i;
+
+    for (i = 0; i < sizeof(rgb_pixel_formats) / sizeof(rgb_pixel_formats[0]); i++)
+    {
+        if (rgb_pixel_formats[i].bpp == pixel_format->bpp
+            && rgb_pixel_formats[i].rmask == pixel_format->rmask
+            && rgb_pixel_formats[i].gmask == pixel_format->gmask
+            && rgb_pixel_formats[i].bmask == pixel_format->bmask)
+        {
+            if ((pixel_format->flags & DDS_PF_ALPHA) && rgb_pixel_formats[i].amask == pixel_format->amask)
+                return rgb_pixel_formats[i].format;
+            if (rgb_pixel_formats[i].amask == 0)
+                return rgb_pixel_formats[i].format;
+        }
+    }
+
+//    WARN("Unknown RGB pixel format (%#lx, %#lx, %#lx, %#lx)\n",
+//            pixel_format->rmask, pixel_format->gmask, pixel_format->bmask, pixel_format->amask);
+    return D3DFMT_UNKNOWN;
+}
+
+static D3DFORMAT dds_luminance_to_d3dformat(const struct dds_pixel_format *pixel_format)
+{
+    if (pixel_format->bpp == 8)
+    {
+        if (pixel_format->rmask == 0xff)
+            return D3DFMT_L8;
+        if ((pixel_format->flags & DDS_PF_ALPHA) && pixel_format->rmask == 0x0f && pixel_format->amask == 0xf0)
+            return D3DFMT_A4L4;
+    }
+    if (pixel_format->bpp == 16)
+    {
+        if (pixel_format->rmask == 0xffff)
+            return D3DFMT_L16;
+        if ((pixel_format->flags & DDS_PF_ALPHA) && pixel_format->rmask == 0x00ff && pixel_format->amask == 0xff00)
+            return D3DFMT_A8L8;
+    }
+
+//    WARN("Unknown luminance pixel format (bpp %lu, l %#lx, a %#lx)\n",
+//            pixel_format->bpp, pixel_format->rmask, pixel_format->amask);
+    return D3DFMT_UNKNOWN;
+}
+
+static D3DFORMAT dds_alpha_to_d3dformat(const struct dds_pixel_format *pixel_format)
+{
+    if (pixel_format->bpp == 8 && pixel_format->amask == 0xff)
+        return D3DFMT_A8;
+
+//    WARN("Unknown alpha pixel format (bpp %lu, a %#lx)\n", pixel_format->bpp, pixel_format->rmask);
+    return D3DFMT_UNKNOWN;
+}
+
+static D3DFORMAT dds_indexed_to_d3dformat(const struct dds_pixel_format *pixel_format)
+{
+    if (pixel_format->bpp == 8)
+        return D3DFMT_P8;
+
+//    WARN("Unknown indexed pixel format (bpp %lu).\n", pixel_format->bpp);
+    return D3DFMT_UNKNOWN;
+}
+
+static D3DFORMAT dds_pixel_format_to_d3dformat(const struct dds_pixel_format *pixel_format)
+{
+//    TRACE("pixel_format: size %lu, flags %#lx, fourcc %#lx, bpp %lu.\n", pixel_format->size,
+//            pixel_format->flags, pixel_format->fourcc, pixel_format->bpp);
+//    TRACE("rmask %#lx, gmask %#lx, bmask %#lx, amask %#lx.\n", pixel_format->rmask, pixel_format->gmask,
+//            pixel_format->bmask, pixel_format->amask);
+
+    if (pixel_format->flags & DDS_PF_FOURCC)
+        return dds_fourcc_to_d3dformat(pixel_format->fourcc);
+    if (pixel_format->flags & DDS_PF_INDEXED)
+        return dds_indexed_to_d3dformat(pixel_format);
+    if (pixel_format->flags & DDS_PF_LUMINANCE)
+        return dds_luminance_to_d3dformat(pixel_format);
+    if (pixel_format->flags & DDS_PF_RGB)
+        return dds_rgb_to_d3dformat(pixel_format);
+    if (pixel_format->flags & DDS_PF_ALPHA_ONLY)
+        return dds_alpha_to_d3dformat(pixel_format);
+
+//    WARN("Unknown pixel format (flags %#lx, fourcc %#lx, bpp %lu, r %#lx, g %#lx, b %#lx, a %#lx)\n",
+//            pixel_format->flags, pixel_format->fourcc, pixel_format->bpp,
+//            pixel_format->rmask, pixel_format->gmask, pixel_format->bmask, pixel_format->amask);
+    return D3DFMT_UNKNOWN;
+}
+
+/* the DXGI formats gli writes with a DX10 header that D3D9 has a format for */
+static D3DFORMAT dds_dxgi_to_d3dformat(DWORD dxgi_format)
+{
+    switch (dxgi_format)
+    {
+        case 2:  return D3DFMT_A32B32G32R32F; /* R32G32B32A32_FLOAT */
+        case 10: return D3DFMT_A16B16G16R16F; /* R16G16B16A16_FLOAT */
+        case 11: return D3DFMT_A16B16G16R16;  /* R16G16B16A16_UNORM */
+        case 16: return D3DFMT_G32R32F;       /* R32G32_FLOAT */
+        case 24: return D3DFMT_A2B10G10R10;   /* R10G10B10A2_UNORM */
+        case 28:                              /* R8G8B8A8_UNORM */
+        case 29: return D3DFMT_A8B8G8R8;      /* R8G8B8A8_UNORM_SRGB */
+        case 34: return D3DFMT_G16R16F;       /* R16G16_FLOAT */
+        case 35: return D3DFMT_G16R16;        /* R16G16_UNORM */
+        case 41: return D3DFMT_R32F;          /* R32_FLOAT */
+        case 54: return D3DFMT_R16F;          /* R16_FLOAT */
+        case 56: return D3DFMT_L16;           /* R16_UNORM */
+        case 61: return D3DFMT_L8;            /* R8_UNORM */
+        case 65: return D3DFMT_A8;            /* A8_UNORM */
+        case 71:                              /* BC1_UNORM */
+        case 72: return D3DFMT_DXT1;          /* BC1_UNORM_SRGB */
+        case 74:                              /* BC2_UNORM */
+        case 75: return D3DFMT_DXT3;          /* BC2_UNORM_SRGB */
+        case 77:                              /* BC3_UNORM */
+        case 78: return D3DFMT_DXT5;          /* BC3_UNORM_SRGB */
+        case 85: return D3DFMT_R5G6B5;        /* B5G6R5_UNORM */
+        case 86: return D3DFMT_A1R5G5B5;      /* B5G5R5A1_UNORM */
+        case 87:                              /* B8G8R8A8_UNORM */
+        case 91: return D3DFMT_A8R8G8B8;      /* B8G8R8A8_UNORM_SRGB */
+        case 88:                              /* B8G8R8X8_UNORM */
+        case 93: return D3DFMT_X8R8G8B8;      /* B8G8R8X8_UNORM_SRGB */
+        case 115: return D3DFMT_A4R4G4B4;     /* B4G4R4A4_UNORM */
+        default:
+//            WARN("Unknown DXGI format %lu.\n", dxgi_format);
+            return D3DFMT_UNKNOWN;
+    }
+}
+
+static HRESULT calculate_dds_surface_size(D3DFORMAT format, UINT width, UINT height,
+    UINT *pitch, UINT *size)
+{
+    const struct pixel_format_desc *format_desc = get_format_info(format);
+    if (format_desc->type == FORMAT_UNKNOWN)
+        return E_NOTIMPL;
+
+    if (format_desc->block_width != 1 || format_desc->block_height != 1)
+    {
+        *pitch = format_desc->block_byte_count
+            * std::max(1u, (width + format_desc->block_width - 1) / format_desc->block_width);
+        *size = *pitch
+            * std::max(1u, (height + format_desc->block_height - 1) / format_desc->block_height);
+    }
+    else
+    {
+        *pitch = width * format_desc->bytes_per_pixel;
+        *size = *pitch * height;
+    }
+
+    return D3D_OK;
+}
+
+/* reads size bytes at offset, FALSE on errors and short files */
+static BOOL read_file_region(int fd, void *buffer, size_t size, off_t offset)
+{
+    BYTE *dst = static_cast<BYTE*>(buffer);
+
+    while (size)
+    {
+        ssize_t count = pread(fd, dst, size, offset);
+
+        if (count < 0 && errno == EINTR)
+            continue;
+        if (count <= 0)
+            return FALSE;
+        dst += count;
+        size -= count;
+        offset += count;
+    }
+    return TRUE;
+}
+
+static HRESULT read_dds_file_info(int fd, struct dds_file_info *info)
+{
+    struct dds_header header;
+    struct dds_header_dx10 header_dx10;
+
+    if (!read_file_region(fd, &header, sizeof(header), 0)
+        || header.signature != DDS_MAGIC || header.size != sizeof(header) - sizeof(header.signature)
+        || header.pixel_format.size != sizeof(header.pixel_format))
+        return D3DERR_INVALIDCALL; // D3DXERR_INVALIDDATA;
+
+    info->data_offset = sizeof(header);
+    if ((header.pixel_format.flags & DDS_PF_FOURCC) && header.pixel_format.fourcc == DDS_FOURCC_DX10)
+    {
+        if (!read_file_region(fd, &header_dx10, sizeof(header_dx10), sizeof(header)))
+            return D3DERR_INVALIDCALL; // D3DXERR_INVALIDDATA;
+        /* 4 is D3D10_RESOURCE_DIMENSION_TEXTURE3D */
+        if (header_dx10.resource_dimension == 4)
+            return E_NOTIMPL;
+        info->format = dds_dxgi_to_d3dformat(header_dx10.dxgi_format);
+        info->data_offset += sizeof(header_dx10);
+    }
+    else
+    {
+        if (header.caps2 & DDS_CAPS2_VOLUME)
+            return E_NOTIMPL;
+        info->format = dds_pixel_format_to_d3dformat(&header.pixel_format);
+    }
+    if (info->format == D3DFMT_UNKNOWN || get_format_info(info->format)->type == FORMAT_UNKNOWN)
+        return E_NOTIMPL;
+
+    info->width = header.width;
+    info->height = header.height;
+    info->miplevels = (header.flags & DDS_MIPMAPCOUNT) && header.miplevels ? header.miplevels : 1;
+    if (!info->width || !info->height)
+        return D3DERR_INVALIDCALL; // D3DXERR_INVALIDDATA;
+
+    if (info->format == D3DFMT_P8)
+    {
+        if (!read_file_region(fd, info->palette, sizeof(info->palette), info->data_offset))
+            return D3DERR_INVALIDCALL; // D3DXERR_INVALIDDATA;
+        info->data_offset += sizeof(info->palette);
+    }
+    return D3D_OK;
+}
+
+/* size and pitch of a level of the first face and where it starts in the file */
+static void get_dds_level_layout(const struct dds_file_info *info, UINT level, UINT *width, UINT *height,
+                                 UINT *pitch, unsigned long long *offset)
+{
+    UINT size, i;
+
+    *offset = info->data_offset;
+    for (i = 0; i < level; ++i)
+    {
+        calculate_dds_surface_size(info->format, std::max(1u, info->width >> i), std::max(1u, info->height >> i),
+                                   pitch, &size);
+        *offset += size;
+    }
+    *width = std::max(1u, info->width >> level);
+    *height = std::max(1u, info->height >> level);
+    calculate_dds_surface_size(info->format, *width, *height, pitch, &size);
+}
 
-        if (srcformatdesc->type == FORMAT_DXT || destformatdesc->type == FORMAT_DXT)
-        {
-//            WARN("Src/Dst FORMAT_DXT unsupported\n");
-            return E_NOTIMPL;
-        }
-        else
-        {
-            dst_mem = static_cast<BYTE*>(lockrect.pBits);
-            dst_pitch = lockrect.Pitch;
-            dst_format = destformatdesc;
-        }
+/* bytes of band needed to read rect with read_dds_rect */
+static size_t get_dds_rect_band_size(const struct dds_file_info *info, const RECT *rect)
+{
+    const struct pixel_format_desc *format = get_format_info(info->format);
+    UINT rows = (rect->bottom + format->block_height - 1) / format->block_height - rect->top / format->block_height;
+    UINT columns = (rect->right + format->block_width - 1) / format->block_width - rect->left / format->block_width;
 
-        if ((filter & 0xf) == D3DX_FILTER_NONE)
-        {
-            convert_argb_pixels(static_cast<const BYTE*>(src_memory), src_pitch, 0, &src_size, srcformatdesc,
-                                dst_mem, dst_pitch, 0, &dst_size, dst_format, color_key, src_palette);
-        }
-        else /* if ((filter & 0xf) == D3DX_FILTER_POINT) */
-        {
-//            if ((filter & 0xf) != D3DX_FILTER_POINT)
-//                FIXME("Unhandled filter %#lx.\n", filter);
+    return (size_t)rows * columns * format->block_byte_count;
+}
 
-            /* Always apply a point filter until D3DX_FILTER_LINEAR,
-             * D3DX_FILTER_TRIANGLE and D3DX_FILTER_BOX are implemented. */
-            point_filter_argb_pixels(static_cast<const BYTE*>(src_memory), src_pitch, 0, &src_size, srcformatdesc,
-                                     dst_mem, dst_pitch, 0, &dst_size, dst_format, color_key, src_palette);
-        }
+/* Reads the block rows of rect of a level into band, each row clipped to the block columns of rect.
+ * band_rect is rect relative to the band. Returns FALSE on read errors. */
+static BOOL read_dds_rect(int fd, const struct dds_file_info *info, UINT level, const RECT *rect,
+                         BYTE *band, UINT *span, RECT *band_rect)
+{
+    const struct pixel_format_desc *format = get_format_info(info->format);
+    UINT first_row = rect->top / format->block_height;
+    UINT last_row = (rect->bottom + format->block_height - 1) / format->block_height;
+    UINT first_column = rect->left / format->block_width;
+    UINT width, height, pitch, i;
+    unsigned long long offset;
+    BOOL read;
+
+    get_dds_level_layout(info, level, &width, &height, &pitch, &offset);
+    *span = ((rect->right + format->block_width - 1) / format->block_width - first_column) * format->block_byte_count;
+    offset += (unsigned long long)first_row * pitch + first_column * format->block_byte_count;
+
+    if (*span == pitch)
+    {
+        read = read_file_region(fd, band, (size_t)*span * (last_row - first_row), offset);
+    }
+    else
+    {
+        for (i = 0, read = TRUE; read && i < last_row - first_row; ++i)
+            read = read_file_region(fd, band + (size_t)i * *span, *span, offset + (unsigned long long)i * pitch);
     }
 
-    return unlock_surface(dst_surface, &dst_rect_aligned, surface, TRUE);
+    SetRect(band_rect, rect->left - first_column * format->block_width,
+            rect->top - first_row * format->block_height,
+            rect->right - first_column * format->block_width,
+            rect->bottom - first_row * format->block_height);
+    return read;
 }
 
 /************************************************************
- * D3DXLoadSurfaceFromSurface
- *
- * Copies the contents from one surface to another, performing any required
- * format conversion, resizing or filtering.
- *
- * PARAMS
- *   pDestSurface [I] pointer to the destination surface
- *   pDestPalette [I] palette to use
- *   pDestRect    [I] to be filled area of the surface
- *   pSrcSurface  [I] pointer to the source surface
- *   pSrcPalette  [I] palette used for the source surface
- *   pSrcRect     [I] area of the source data to load
- *   dwFilter     [I] filter to apply on resizing
- *   Colorkey     [I] any ARGB value or 0 to disable color-keying
- *
- * RETURNS
- *   Success: D3D_OK
- *   Failure: D3DERR_INVALIDCALL, if pDestSurface or pSrcSurface is NULL
- *            D3DXERR_INVALIDDATA, if one of the surfaces is not lockable
+ * load_surface_from_file_region
  *
+ * Loads src_rect of mip level of the first face of a DDS file into
+ * dst_rect. Only the block rows covering src_rect are read, each row
+ * clipped to the block columns of src_rect, and converted straight into
+ * the locked destination by D3DXLoadSurfaceFromMemory.
  */
-HRESULT D3DXLoadSurfaceFromSurface(IDirect3DSurface9 *dst_surface,
-                                          const PALETTEENTRY *dst_palette, const RECT *dst_rect, IDirect3DSurface9 *src_surface,
-                                          const PALETTEENTRY *src_palette, const RECT *src_rect, DWORD filter, D3DCOLOR color_key)
+static HRESULT load_surface_from_file_region(IDirect3DSurface9 *dst_surface, const PALETTEENTRY *dst_palette,
+                                             const RECT *dst_rect, const char *src_file, const RECT *src_rect,
+                                             UINT level, DWORD filter, D3DCOLOR color_key)
 {
-    const struct pixel_format_desc *src_format_desc, *dst_format_desc;
-    D3DSURFACE_DESC src_desc, dst_desc;
-    struct volume src_size, dst_size;
-    IDirect3DSurface9 *temp_surface;
-    D3DTEXTUREFILTERTYPE d3d_filter;
-    IDirect3DDevice9 *device;
-    D3DLOCKED_RECT lock;
-    RECT dst_rect_temp;
+    struct dds_file_info info;
+    UINT width, height, pitch, span;
+    unsigned long long offset;
+    RECT rect, band_rect;
+    BYTE *band;
     HRESULT hr;
-    RECT s;
+    BOOL read;
+    int fd;
 
-//    TRACE("dst_surface %p, dst_palette %p, dst_rect %s, src_surface %p, "
-//          "src_palette %p, src_rect %s, filter %#lx, color_key 0x%08lx.\n",
-//          dst_surface, dst_palette, wine_dbgstr_rect(dst_rect), src_surface,
-//          src_palette, wine_dbgstr_rect(src_rect), filter, color_key);
+    if (!dst_surface || !src_file)
+        return D3DERR_INVALIDCALL;
 
-    if (!dst_surface || !src_surface)
+    if ((fd = open(src_file, O_RDONLY)) < 0)
+        return D3DERR_INVALIDCALL; // D3DXERR_INVALIDDATA;
+    if (FAILED(hr = read_dds_file_info(fd, &info)))
+    {
+        close(fd);
+        return hr;
+    }
+    if (level >= info.miplevels)
+    {
+        close(fd);
         return D3DERR_INVALIDCALL;
+    }
 
-    IDirect3DSurface9_GetDesc(src_surface, &src_desc);
-    src_format_desc = get_format_info(src_desc.Format);
+    get_dds_level_layout(&info, level, &width, &height, &pitch, &offset);
     if (!src_rect)
     {
-        SetRect(&s, 0, 0, src_desc.Width, src_desc.Height);
-        src_rect = &s;
+        SetRect(&rect, 0, 0, width, height);
+        src_rect = &rect;
     }
-    else if (src_rect->left == src_rect->right || src_rect->top == src_rect->bottom)
+    if (src_rect->left < 0 || src_rect->top < 0 || src_rect->right > (LONG)width
+        || src_rect->bottom > (LONG)height)
     {
-//        WARN("Empty src_rect specified.\n");
-        return filter == D3DX_FILTER_NONE ? D3D_OK : E_FAIL;
+        close(fd);
+        return D3DERR_INVALIDCALL;
     }
-    else if (src_rect->left > src_rect->right || src_rect->right > src_desc.Width
-             || src_rect->left < 0 || src_rect->left > src_desc.Width
-             || src_rect->top > src_rect->bottom || src_rect->bottom > src_desc.Height
-             || src_rect->top < 0 || src_rect->top > src_desc.Height)
+    if (src_rect->left >= src_rect->right || src_rect->top >= src_rect->bottom)
     {
-//        WARN("Invalid src_rect specified.\n");
-        return D3DERR_INVALIDCALL;
+        close(fd);
+        return E_FAIL;
     }
 
-    src_size.width = src_rect->right - src_rect->left;
-    src_size.height = src_rect->bottom - src_rect->top;
-    src_size.depth = 1;
-
-    IDirect3DSurface9_GetDesc(dst_surface, &dst_desc);
-    dst_format_desc = get_format_info(dst_desc.Format);
-    if (!dst_rect)
+    if (!(band = (BYTE *)malloc(get_dds_rect_band_size(&info, src_rect))))
     {
-        SetRect(&dst_rect_temp, 0, 0, dst_desc.Width, dst_desc.Height);
-        dst_rect = &dst_rect_temp;
+        close(fd);
+        return E_OUTOFMEMORY;
     }
-    else if (dst_rect->left == dst_rect->right || dst_rect->top == dst_rect->bottom)
+    read = read_dds_rect(fd, &info, level, src_rect, band, &span, &band_rect);
+    close(fd);
+
+    if (!read)
     {
-//        WARN("Empty dst_rect specified.\n");
-        return filter == D3DX_FILTER_NONE ? D3D_OK : E_FAIL;
+        free(band);
+        return D3DERR_INVALIDCALL; // D3DXERR_INVALIDDATA;
     }
-    else if (dst_rect->left > dst_rect->right || dst_rect->right > dst_desc.Width
-             || dst_rect->left < 0 || dst_rect->left > dst_desc.Width
-             || dst_rect->top > dst_rect->bottom || dst_rect->bottom > dst_desc.Height
-             || dst_rect->top < 0 || dst_rect->top > dst_desc.Height)
-    {
-//        WARN("Invalid dst_rect specified.\n");
+
+    hr = D3DXLoadSurfaceFromMemory(dst_surface, dst_palette, dst_rect, band, info.format, span,
+                                   info.format == D3DFMT_P8 ? info.palette : NULL, &band_rect, filter, color_key);
+    free(band);
+    return hr;
+}
+
+/************************************************************
+ * load_texture_from_file_bands
+ *
+ * Creates a texture with the size, format and levels of a DDS file and
+ * streams each level into it in bands of band_rows rows: a band is read,
+ * then converted into the locked band of the level before the next one is
+ * read. Only one band is held in memory, whatever the size of the image.
+ * Textures that can't be locked are written through system memory surfaces
+ * of one band from the staging pool, each uploaded with UpdateSurface as
+ * soon as it is converted. The deferred updates of lock_surface would keep
+ * a staging surface of the size of every level until the next flush.
+ * Cube maps and arrays load their first face.
+ */
+#define FILE_BAND_DEFAULT_BYTES (1 << 20)
+
+static HRESULT load_texture_from_file_bands(IDirect3DDevice9 *device, const char *src_file, UINT band_rows,
+                                            DWORD usage, D3DPOOL pool, IDirect3DTexture9 **texture)
+{
+    const struct pixel_format_desc *format;
+    struct dds_file_info info;
+    UINT width, height, pitch, span, level, y;
+    unsigned long long offset;
+    IDirect3DSurface9 *surface, *staging;
+    RECT rect, band_rect, staging_rect;
+    BYTE *band = NULL;
+    BOOL staged;
+    HRESULT hr;
+    int fd;
+
+    if (!device || !src_file || !texture)
         return D3DERR_INVALIDCALL;
+
+    if ((fd = open(src_file, O_RDONLY)) < 0)
+        return D3DERR_INVALIDCALL; // D3DXERR_INVALIDDATA;
+    if (FAILED(hr = read_dds_file_info(fd, &info)))
+    {
+        close(fd);
+        return hr;
     }
 
-    dst_size.width = dst_rect->right - dst_rect->left;
-    dst_size.height = dst_rect->bottom - dst_rect->top;
-    dst_size.depth = 1;
+    format = get_format_info(info.format);
+    get_dds_level_layout(&info, 0, &width, &height, &pitch, &offset);
+    if (!band_rows)
+        band_rows = std::max(1u, FILE_BAND_DEFAULT_BYTES / pitch * format->block_height);
+    band_rows = (std::min(band_rows, height) + format->block_height - 1) / format->block_height * format->block_height;
 
-    if (!dst_palette && !src_palette && !color_key)
+    if (FAILED(hr = device->CreateTexture(info.width, info.height, info.miplevels, usage, info.format, pool,
+                                          texture, nullptr)))
     {
-        if (src_desc.Format == dst_desc.Format
-            && dst_size.width == src_size.width
-            && dst_size.height == src_size.height
-            && color_key == 0
-            && !(src_rect->left & (src_format_desc->block_width - 1))
-            && !(src_rect->top & (src_format_desc->block_height - 1))
-            && !(dst_rect->left & (dst_format_desc->block_width - 1))
-            && !(dst_rect->top & (dst_format_desc->block_height - 1)))
-        {
-            d3d_filter = D3DTEXF_NONE;
-        }
-        else
-        {
-            switch (filter)
-            {
-            case D3DX_FILTER_NONE:
-                d3d_filter = D3DTEXF_NONE;
-                break;
+        close(fd);
+        return hr;
+    }
+    staged = pool == D3DPOOL_DEFAULT && !(usage & D3DUSAGE_DYNAMIC);
 
-            case D3DX_FILTER_POINT:
-                d3d_filter = D3DTEXF_POINT;
-                break;
+    /* the top level has the widest rows */
+    if (!(band = (BYTE *)malloc((size_t)pitch * (band_rows / format->block_height))))
+        hr = E_OUTOFMEMORY;
 
-            case D3DX_FILTER_LINEAR:
-                d3d_filter = D3DTEXF_LINEAR;
-                break;
+    for (level = 0; SUCCEEDED(hr) && level < info.miplevels; ++level)
+    {
+        get_dds_level_layout(&info, level, &width, &height, &pitch, &offset);
+        if (FAILED(hr = (*texture)->GetSurfaceLevel(level, &surface)))
+            break;
 
-            default:
-                d3d_filter = D3DTEXF_FORCE_DWORD;
-                break;
+        for (y = 0; SUCCEEDED(hr) && y < height; y += band_rows)
+        {
+            SetRect(&rect, 0, y, width, std::min(y + band_rows, height));
+            if (!read_dds_rect(fd, &info, level, &rect, band, &span, &band_rect))
+                hr = D3DERR_INVALIDCALL; // D3DXERR_INVALIDDATA;
+            else if (!staged)
+                hr = D3DXLoadSurfaceFromMemory(surface, NULL, &rect, band, info.format, span,
+                                               info.format == D3DFMT_P8 ? info.palette : NULL, &band_rect,
+                                               D3DX_FILTER_NONE, 0);
+            /* a staging surface of the size of the band, so its rect is whole blocks or reaches its edges */
+            else if (SUCCEEDED(hr = acquire_staging_surface(device, info.format, width, rect.bottom - rect.top,
+                                                            TRUE, &staging)))
+            {
+                POINT point = {0, rect.top};
+
+                SetRect(&staging_rect, 0, 0, width, rect.bottom - rect.top);
+                hr = D3DXLoadSurfaceFromMemory(staging, NULL, &staging_rect, band, info.format, span,
+                                               info.format == D3DFMT_P8 ? info.palette : NULL, &band_rect,
+                                               D3DX_FILTER_NONE, 0);
+                if (SUCCEEDED(hr))
+                    hr = IDirect3DDevice9_UpdateSurface(device, staging, NULL, surface, &point);
+                release_staging_surface(staging);
             }
         }
+        surface->Release();
+    }
 
-        if (d3d_filter != D3DTEXF_FORCE_DWORD)
-        {
-            IDirect3DSurface9_GetDevice(src_surface, &device);
-            hr = IDirect3DDevice9_StretchRect(device, src_surface, src_rect, dst_surface, dst_rect, d3d_filter);
-            IDirect3DDevice9_Release(device);
-            if (SUCCEEDED(hr))
-                return D3D_OK;
-        }
+    free(band);
+    close(fd);
+    if (FAILED(hr))
+    {
+        (*texture)->Release();
+        *texture = NULL;
     }
+    return hr;
+}
 
-    if (FAILED(lock_surface(src_surface, NULL, &lock, &temp_surface, FALSE)))
-        return D3DERR_INVALIDCALL; // D3DXERR_INVALIDDATA;
+#endif
 
-    hr = D3DXLoadSurfaceFromMemory(dst_surface, dst_palette, dst_rect, lock.pBits,
-                                   src_desc.Format, lock.Pitch, src_palette, src_rect, filter, color_key);
+// custom D3DX9 functions
 
-    if (FAILED(unlock_surface(src_surface, NULL, temp_surface, FALSE)))
-        return D3DERR_INVALIDCALL; // D3DXERR_INVALIDDATA;
+// Loads count rects into dst_surface with one lock of the destination, see load_surface_subloads.
+HRESULT LoadSurfaceFromSubloads(
+    IDirect3DSurface9* dst_surface,
+    const PALETTEENTRY* dst_palette,
+    const struct surface_subload* subloads,
+    UINT count,
+    DWORD filter,
+    D3DCOLOR color_key)
+{
+#ifdef UseD3DX9
+    if (!dst_surface || (count && !subloads))
+        return D3DERR_INVALIDCALL;
+
+    for (UINT i = 0; i < count; ++i)
+    {
+        const struct surface_subload* subload = &subloads[i];
+        HRESULT hr = subload->src_surface
+            ? D3DXLoadSurfaceFromSurface(dst_surface, dst_palette, &subload->dst_rect, subload->src_surface,
+                                         subload->src_palette, &subload->src_rect, filter, color_key)
+            : D3DXLoadSurfaceFromMemory(dst_surface, dst_palette, &subload->dst_rect, subload->src_memory,
+                                        subload->src_format, subload->src_pitch, subload->src_palette,
+                                        &subload->src_rect, filter, color_key);
+        if (FAILED(hr))
+            return hr;
+    }
+    return D3D_OK;
+#else
+    return load_surface_subloads(dst_surface, subloads, count, filter, color_key);
+#endif
+}
+
+// Loads src_rect of mip level of a DDS file into dst_rect without loading the whole file,
+// see load_surface_from_file_region. A NULL src_rect is the whole level.
+HRESULT LoadSurfaceFromFileRegion(
+    IDirect3DSurface9* dst_surface,
+    const PALETTEENTRY* dst_palette,
+    const RECT* dst_rect,
+    const char* srcfile,
+    const RECT* src_rect,
+    UINT level,
+    DWORD filter,
+    D3DCOLOR color_key)
+{
+#ifdef UseD3DX9
+    if (!level)
+        return D3DXLoadSurfaceFromFile(dst_surface, dst_palette, dst_rect, srcfile, src_rect, filter, color_key, nullptr);
 
+    // D3DX only reads the top level of a file into a surface
+    IDirect3DDevice9* device;
+    IDirect3DTexture9* texture;
+    IDirect3DSurface9* surface;
+    HRESULT hr;
+
+    if (!dst_surface || FAILED(hr = dst_surface->GetDevice(&device)))
+        return D3DERR_INVALIDCALL;
+    hr = D3DXCreateTextureFromFileEx(device, srcfile, D3DX_DEFAULT, D3DX_DEFAULT, D3DX_FROM_FILE, 0,
+                                     D3DFMT_UNKNOWN, D3DPOOL_SYSTEMMEM, D3DX_FILTER_NONE, D3DX_FILTER_NONE, 0,
+                                     nullptr, nullptr, &texture);
+    device->Release();
+    if (FAILED(hr))
+        return hr;
+    if (SUCCEEDED(hr = texture->GetSurfaceLevel(level, &surface)))
+    {
+        hr = D3DXLoadSurfaceFromSurface(dst_surface, dst_palette, dst_rect, surface, nullptr, src_rect, filter, color_key);
+        surface->Release();
+    }
+    texture->Release();
     return hr;
+#else
+    return load_surface_from_file_region(dst_surface, dst_palette, dst_rect, srcfile, src_rect, level, filter, color_key);
+#endif
 }
 
+// Creates a texture from a DDS file with all the levels in the file, reading and converting
+// band_rows rows at a time so memory use doesn't grow with the image, see
+// load_texture_from_file_bands. band_rows 0 picks bands of about 1MB.
+HRESULT CreateTextureFromFileBands(
+    IDirect3DDevice9* device,
+    const char* srcfile,
+    UINT band_rows,
+    DWORD usage,
+    D3DPOOL pool,
+    IDirect3DTexture9** texture)
+{
+#ifdef UseD3DX9
+    // D3DX loads the whole file
+    return D3DXCreateTextureFromFileEx(device, srcfile, D3DX_DEFAULT_NONPOW2, D3DX_DEFAULT_NONPOW2, D3DX_FROM_FILE,
+                                       usage, D3DFMT_FROM_FILE, pool, D3DX_FILTER_NONE, D3DX_FILTER_NONE, 0,
+                                       nullptr, nullptr, texture);
+#else
+    return load_texture_from_file_bands(device, srcfile, band_rows, usage, pool, texture);
 #endif
+}
 
-// custom D3DX9 functions
+#ifndef UseD3DX9
+// usage is D3DUSAGE_AUTOGENMIPMAP or one of the D3DUSAGE_QUERY flags
+static bool IsTextureUsageSupported(IDirect3DDevice9* device, DWORD usage, D3DFORMAT fmt)
+{
+    IDirect3D9* d3d;
+    D3DDEVICE_CREATION_PARAMETERS params;
+    D3DDISPLAYMODE mode;
 
-HRESULT CreateTextureFromFile(
+    if (FAILED(device->GetDirect3D(&d3d)))
+        return false;
+    device->GetCreationParameters(&params);
+    device->GetDisplayMode(0, &mode);
+    // D3DOK_NOAUTOGEN means the format works but its mips are not generated
+    HRESULT hr = d3d->CheckDeviceFormat(params.AdapterOrdinal, params.DeviceType, mode.Format,
+                                        usage, D3DRTYPE_TEXTURE, fmt);
+    d3d->Release();
+    return hr == D3D_OK;
+}
+#endif
+
+// Subset of D3DXCreateTextureFromFileEx. mip_levels 0 or D3DX_DEFAULT builds the whole chain,
+// with D3DUSAGE_AUTOGENMIPMAP in usage the device generates it where the format allows,
+// otherwise the levels stored in the file are used and D3DXFilterTexture builds the rest
+// with mip_filter. D3D9 has no sRGB formats: sRGB files are filtered in linear light and
+// srgb tells whether the texture is to be read through D3DSAMP_SRGBTEXTURE where it is bound.
+HRESULT CreateTextureFromFileEx(
     IDirect3DDevice9* device,
     const char* srcfile,
-    IDirect3DTexture9** texture)
+    UINT mip_levels,
+    DWORD usage,
+    DWORD mip_filter,
+    IDirect3DTexture9** texture,
+    bool* srgb = nullptr)
 {
 #ifdef UseD3DX9
-    return D3DXCreateTextureFromFile(device, srcfile, texture);
+    if (srgb)
+        *srgb = false;
+    return D3DXCreateTextureFromFileEx(device, srcfile, D3DX_DEFAULT, D3DX_DEFAULT, mip_levels, usage,
+                                       D3DFMT_UNKNOWN, D3DPOOL_MANAGED, D3DX_DEFAULT, mip_filter, 0,
+                                       nullptr, nullptr, texture);
 #else
 
     gli::texture tex = gli::load(srcfile);
@@ -1163,28 +2594,73 @@ HRESULT CreateTextureFromFile(
     gli::dx DX;
     D3DFORMAT fmt = static_cast<D3DFORMAT>(DX.translate(tex.format()).D3DFormat);
 
-    HRESULT hr = device->CreateTexture(dimensions.x, dimensions.y, 1, 0, fmt, D3DPOOL_MANAGED, texture, nullptr);
+    if ((usage & D3DUSAGE_AUTOGENMIPMAP) && !IsTextureUsageSupported(device, D3DUSAGE_AUTOGENMIPMAP, fmt))
+        usage &= ~D3DUSAGE_AUTOGENMIPMAP;
+    if (mip_levels == D3DX_DEFAULT || (usage & D3DUSAGE_AUTOGENMIPMAP))
+        mip_levels = 0;
+
+    HRESULT hr = device->CreateTexture(dimensions.x, dimensions.y, mip_levels, usage, fmt, D3DPOOL_MANAGED, texture, nullptr);
     if (FAILED(hr))
     {
         SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "LockRect failed", nullptr);
         return hr;
     }
 
-    D3DLOCKED_RECT rect;
-    hr = (*texture)->LockRect(0, &rect, 0, D3DLOCK_DISCARD);
-    if (FAILED(hr))
+    // the levels stored in the file are uploaded, the ones below them are filtered from the last
+    const struct pixel_format_desc* format = get_format_info(fmt);
+    const UINT file_levels = (usage & D3DUSAGE_AUTOGENMIPMAP)
+        ? 1 : std::min(static_cast<UINT>(tex.levels()), (*texture)->GetLevelCount());
+    for (UINT level = 0; level < file_levels; ++level)
     {
-        SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "LockRect failed", nullptr);
-        return hr;
+        const auto extent = tex.extent(level);
+        struct volume size = {static_cast<UINT>(extent.x), static_cast<UINT>(extent.y), 1};
+        D3DLOCKED_RECT rect;
+
+        hr = (*texture)->LockRect(level, &rect, 0, D3DLOCK_DISCARD);
+        if (FAILED(hr))
+        {
+            SDL_ShowSimpleMessageBox(SDL_MESSAGEBOX_ERROR, "Error", "LockRect failed", nullptr);
+            return hr;
+        }
+        // the locked pitch may be wider than the rows in the file
+        copy_pixels(static_cast<const BYTE*>(tex.data(0, 0, level)),
+                    (size.width + format->block_width - 1) / format->block_width * format->block_byte_count, 0,
+                    static_cast<BYTE*>(rect.pBits), rect.Pitch, 0, &size, format);
+        hr = (*texture)->UnlockRect(level);
+        if (FAILED(hr))
+            return hr;
     }
-    char* dest = static_cast<char*>(rect.pBits);
-    memcpy(dest, tex.data(), tex.size());
-    hr = (*texture)->UnlockRect(0);
+
+    const bool file_srgb = gli::is_srgb(tex.format());
+    if (srgb)
+        *srgb = file_srgb && IsTextureUsageSupported(device, D3DUSAGE_QUERY_SRGBREAD, fmt);
+    if (file_srgb)
+        mip_filter = (mip_filter == D3DX_DEFAULT ? D3DX_FILTER_BOX : mip_filter) | D3DX_FILTER_SRGB;
+
+    if (usage & D3DUSAGE_AUTOGENMIPMAP)
+        (*texture)->SetAutoGenFilterType((mip_filter & 0xf) == D3DX_FILTER_POINT ? D3DTEXF_POINT : D3DTEXF_LINEAR);
+    if ((usage & D3DUSAGE_AUTOGENMIPMAP) || (*texture)->GetLevelCount() > file_levels)
+        hr = D3DXFilterTexture(*texture, nullptr, file_levels - 1, mip_filter);
 
     return hr;
 #endif
 }
 
+HRESULT CreateTextureFromFile(
+    IDirect3DDevice9* device,
+    const char* srcfile,
+    IDirect3DTexture9** texture,
+    bool* srgb = nullptr)
+{
+#ifdef UseD3DX9
+    if (srgb)
+        *srgb = false;
+    return D3DXCreateTextureFromFile(device, srcfile, texture);
+#else
+    return CreateTextureFromFileEx(device, srcfile, D3DX_DEFAULT, 0, D3DX_DEFAULT, texture, srgb);
+#endif
+}
+
 //-----------------------------------------------------------------------------
 // GLOBALS
 //-----------------------------------------------------------------------------
@@ -1210,6 +2686,8 @@ Vertex g_quadVertices[] =
 
 bool g_bAlterTexture = true;
 bool g_bDoSubload    = true;
+bool g_bBandLoad     = false;
+bool g_bTextureSRGB  = false;
 
 //-----------------------------------------------------------------------------
 // PROTOTYPES
@@ -1249,6 +2727,9 @@ int main(int argc, char* argv[])
         return 0;
     }
 
+#ifdef LoadSurfaceFromSurfaceV2
+    struct staging_pool_stats shown = {};
+#endif
     bool running = true;
     while (running)
     {
@@ -1266,8 +2747,29 @@ int main(int argc, char* argv[])
                 g_bDoSubload = !g_bDoSubload;
                 g_bAlterTexture = true;
             }
+            // reloads the texture through the banded loader into the default pool, or back
+            if (SDL_KEYDOWN == ev.type && SDL_SCANCODE_F2 == ev.key.keysym.scancode)
+            {
+                g_bBandLoad = !g_bBandLoad;
+                g_bDoSubload = false;
+                g_bAlterTexture = true;
+            }
         }
         ShowPrimitive();
+
+#ifdef LoadSurfaceFromSurfaceV2
+        // the title shows how often the subloads found a staging surface to reuse
+        struct staging_pool_stats stats;
+        get_staging_pool_stats(&stats);
+        if (stats.hits != shown.hits || stats.misses != shown.misses || stats.slot_count != shown.slot_count)
+        {
+            char title[128];
+            SDL_snprintf(title, sizeof(title), "Hello Texture! - staging hits %lu, misses %lu, surfaces %u",
+                         (unsigned long)stats.hits, (unsigned long)stats.misses, stats.slot_count);
+            SDL_SetWindowTitle(Window, title);
+            shown = stats;
+        }
+#endif
     }
 
     //Cleaning up everything.
@@ -1386,6 +2888,11 @@ bool Setup(int Width, int Height)
     memcpy(pVertices, g_quadVertices, sizeof(g_quadVertices));
     g_pVertexBuffer->Unlock();
 
+#ifdef LoadSurfaceFromSurfaceV2
+    // the subloads are uploaded once a frame by flush_surface_updates
+    set_deferred_surface_updates(g_pd3dDevice, TRUE);
+#endif
+
 #ifdef UseD3DX9
     D3DXMATRIX matProj;
     D3DXMatrixPerspectiveFovLH(&matProj, D3DXToRadian(45.0f),
@@ -1404,39 +2911,43 @@ bool Setup(int Width, int Height)
 
 void LoadTexture()
 {
-    CreateTextureFromFile(g_pd3dDevice, "textures/chess4.dds", &g_pTexture);
+    // the subload wrote into the old texture, F1 brings back a clean copy
+    if(g_pTexture != nullptr)
+        g_pTexture->Release();
+    g_pTexture = nullptr;
+    g_bTextureSRGB = false;
+    if (g_bBandLoad)
+        CreateTextureFromFileBands(g_pd3dDevice, "textures/chess4.dds", 32, 0, D3DPOOL_DEFAULT, &g_pTexture);
+    else
+        CreateTextureFromFile(g_pd3dDevice, "textures/chess4.dds", &g_pTexture, &g_bTextureSRGB);
 
     g_pd3dDevice->SetSamplerState(0, D3DSAMP_MINFILTER, D3DTEXF_LINEAR);
     g_pd3dDevice->SetSamplerState(0, D3DSAMP_MAGFILTER, D3DTEXF_LINEAR);
+    g_pd3dDevice->SetSamplerState(0, D3DSAMP_MIPFILTER, D3DTEXF_LINEAR);
 }
 
 void LoadSubTexture()
 {
-    LPDIRECT3DTEXTURE9 pSubTexture  = nullptr;
     LPDIRECT3DSURFACE9 pDestSurface = nullptr;
-    LPDIRECT3DSURFACE9 pSrcSurface  = nullptr;
-
-    CreateTextureFromFile(g_pd3dDevice, "textures/cursor.dds", &pSubTexture);
 
     g_pTexture->GetSurfaceLevel( 0, &pDestSurface );
-    pSubTexture->GetSurfaceLevel( 0, &pSrcSurface );
 
     RECT srcRect[]  = {  0,  0, 64, 64 };
     RECT destRect[] = { 32, 32, 96, 96 };
 
+    // reads only the block rows of srcRect, no texture is created for the cursor
 #ifdef UseD3DX9
-    D3DXLoadSurfaceFromSurface( pDestSurface, nullptr, destRect,
-                                pSrcSurface,  nullptr, srcRect,
-                                D3DX_DEFAULT, 0);
+    LoadSurfaceFromFileRegion(pDestSurface, nullptr, destRect, "textures/cursor.dds", srcRect, 0,
+                              D3DX_DEFAULT, 0);
 #else
-    D3DXLoadSurfaceFromSurface(pDestSurface, nullptr, destRect,
-                               pSrcSurface,  nullptr, srcRect,
-                               D3DX_DEFAULT, 0);
+    LoadSurfaceFromFileRegion(pDestSurface, nullptr, destRect, "textures/cursor.dds", srcRect, 0,
+                              D3DX_FILTER_TRIANGLE | D3DX_FILTER_DXT_FAST, 0);
 #endif
+    // the lower levels still hold the old texture, the banded one is in the default pool and can't be read back
+    if (!g_bBandLoad)
+        D3DXFilterTexture(g_pTexture, nullptr, 0, D3DX_DEFAULT);
 
-    pSrcSurface->Release();
     pDestSurface->Release();
-    pSubTexture->Release();
 }
 
 void Cleanup()
@@ -1447,6 +2958,11 @@ void Cleanup()
     if(g_pVertexBuffer != nullptr)
         g_pVertexBuffer->Release();
 
+#ifdef LoadSurfaceFromSurfaceV2
+    if(g_pd3dDevice != nullptr)
+        release_staging_surfaces(g_pd3dDevice);
+#endif
+
     if(g_pd3dDevice != nullptr)
         g_pd3dDevice->Release();
 }
@@ -1475,8 +2991,13 @@ void ShowPrimitive()
         g_bAlterTexture = false;
     }
 
+#ifdef LoadSurfaceFromSurfaceV2
+    flush_surface_updates(g_pd3dDevice);
+#endif
+
     g_pd3dDevice->BeginScene();
 
+    g_pd3dDevice->SetSamplerState( 0, D3DSAMP_SRGBTEXTURE, g_bTextureSRGB );
     g_pd3dDevice->SetTexture( 0, g_pTexture );
     g_pd3dDevice->SetStreamSource( 0, g_pVertexBuffer, 0, sizeof(Vertex) );
     g_pd3dDevice->SetFVF( D3DFVF_CUSTOMVERTEX );
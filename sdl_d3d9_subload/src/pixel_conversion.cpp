@@ -0,0 +1,2737 @@
+// wine-8.2/dlls/d3dx9_36/util.c, surface.c
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <utility>
+#include <vector>
+
+#include <stdlib.h>
+#include <string.h>
+
+#include <SDL2/SDL.h>
+
+#include "pixel_conversion.h"
+
+#ifdef ARGB_SIMD
+#include <immintrin.h>
+#if defined(__GNUC__) || defined(__clang__)
+#define ARGB_TARGET_AVX2 __attribute__((target("avx2")))
+#define ARGB_TARGET_F16C __attribute__((target("f16c")))
+#define ARGB_TARGET_SSSE3 __attribute__((target("ssse3")))
+#else
+#define ARGB_TARGET_AVX2
+#define ARGB_TARGET_F16C
+#define ARGB_TARGET_SSSE3
+#endif
+#endif
+
+static void la_from_rgba(const struct vec4 *rgba, struct vec4 *la)
+{
+    la->x = rgba->x * 0.2125f + rgba->y * 0.7154f + rgba->z * 0.0721f;
+    la->w = rgba->w;
+}
+
+static void la_to_rgba(const struct vec4 *la, struct vec4 *rgba, const PALETTEENTRY *palette)
+{
+    rgba->x = la->x;
+    rgba->y = la->x;
+    rgba->z = la->x;
+    rgba->w = la->w;
+}
+
+static void index_to_rgba(const struct vec4 *index, struct vec4 *rgba, const PALETTEENTRY *palette)
+{
+    ULONG idx = (ULONG)(index->x * 255.0f + 0.5f);
+
+    rgba->x = palette[idx].peRed / 255.0f;
+    rgba->y = palette[idx].peGreen / 255.0f;
+    rgba->z = palette[idx].peBlue / 255.0f;
+    rgba->w = palette[idx].peFlags / 255.0f; /* peFlags is the alpha component in DX8 and higher */
+}
+
+/************************************************************
+ * pixel format table providing info about number of bytes per pixel,
+ * number of bits per channel and format type.
+ *
+ * Call get_format_info to request information about a specific format.
+ */
+static constexpr struct pixel_format_desc formats[] =
+    {
+        /* format              bpc               shifts             bpp blocks   type            from_rgba     to_rgba */
+        {D3DFMT_R8G8B8,        { 0,  8,  8,  8}, { 0, 16,  8,  0},  3, 1, 1,  3, FORMAT_ARGB,    NULL,         NULL      },
+        {D3DFMT_A8R8G8B8,      { 8,  8,  8,  8}, {24, 16,  8,  0},  4, 1, 1,  4, FORMAT_ARGB,    NULL,         NULL      },
+        {D3DFMT_X8R8G8B8,      { 0,  8,  8,  8}, { 0, 16,  8,  0},  4, 1, 1,  4, FORMAT_ARGB,    NULL,         NULL      },
+        {D3DFMT_A8B8G8R8,      { 8,  8,  8,  8}, {24,  0,  8, 16},  4, 1, 1,  4, FORMAT_ARGB,    NULL,         NULL      },
+        {D3DFMT_X8B8G8R8,      { 0,  8,  8,  8}, { 0,  0,  8, 16},  4, 1, 1,  4, FORMAT_ARGB,    NULL,         NULL      },
+        {D3DFMT_R5G6B5,        { 0,  5,  6,  5}, { 0, 11,  5,  0},  2, 1, 1,  2, FORMAT_ARGB,    NULL,         NULL      },
+        {D3DFMT_X1R5G5B5,      { 0,  5,  5,  5}, { 0, 10,  5,  0},  2, 1, 1,  2, FORMAT_ARGB,    NULL,         NULL      },
+        {D3DFMT_A1R5G5B5,      { 1,  5,  5,  5}, {15, 10,  5,  0},  2, 1, 1,  2, FORMAT_ARGB,    NULL,         NULL      },
+        {D3DFMT_R3G3B2,        { 0,  3,  3,  2}, { 0,  5,  2,  0},  1, 1, 1,  1, FORMAT_ARGB,    NULL,         NULL      },
+        {D3DFMT_A8R3G3B2,      { 8,  3,  3,  2}, { 8,  5,  2,  0},  2, 1, 1,  2, FORMAT_ARGB,    NULL,         NULL      },
+        {D3DFMT_A4R4G4B4,      { 4,  4,  4,  4}, {12,  8,  4,  0},  2, 1, 1,  2, FORMAT_ARGB,    NULL,         NULL      },
+        {D3DFMT_X4R4G4B4,      { 0,  4,  4,  4}, { 0,  8,  4,  0},  2, 1, 1,  2, FORMAT_ARGB,    NULL,         NULL      },
+        {D3DFMT_A2R10G10B10,   { 2, 10, 10, 10}, {30, 20, 10,  0},  4, 1, 1,  4, FORMAT_ARGB,    NULL,         NULL      },
+        {D3DFMT_A2B10G10R10,   { 2, 10, 10, 10}, {30,  0, 10, 20},  4, 1, 1,  4, FORMAT_ARGB,    NULL,         NULL      },
+        {D3DFMT_A16B16G16R16,  {16, 16, 16, 16}, {48,  0, 16, 32},  8, 1, 1,  8, FORMAT_ARGB,    NULL,         NULL      },
+        {D3DFMT_G16R16,        { 0, 16, 16,  0}, { 0,  0, 16,  0},  4, 1, 1,  4, FORMAT_ARGB,    NULL,         NULL      },
+        {D3DFMT_A8,            { 8,  0,  0,  0}, { 0,  0,  0,  0},  1, 1, 1,  1, FORMAT_ARGB,    NULL,         NULL      },
+        {D3DFMT_A8L8,          { 8,  8,  0,  0}, { 8,  0,  0,  0},  2, 1, 1,  2, FORMAT_ARGB,    la_from_rgba, la_to_rgba},
+        {D3DFMT_A4L4,          { 4,  4,  0,  0}, { 4,  0,  0,  0},  1, 1, 1,  1, FORMAT_ARGB,    la_from_rgba, la_to_rgba},
+        {D3DFMT_L8,            { 0,  8,  0,  0}, { 0,  0,  0,  0},  1, 1, 1,  1, FORMAT_ARGB,    la_from_rgba, la_to_rgba},
+        {D3DFMT_L16,           { 0, 16,  0,  0}, { 0,  0,  0,  0},  2, 1, 1,  2, FORMAT_ARGB,    la_from_rgba, la_to_rgba},
+        {D3DFMT_DXT1,          { 0,  0,  0,  0}, { 0,  0,  0,  0},  1, 4, 4,  8, FORMAT_DXT,     NULL,         NULL      },
+        {D3DFMT_DXT2,          { 0,  0,  0,  0}, { 0,  0,  0,  0},  1, 4, 4, 16, FORMAT_DXT,     NULL,         NULL      },
+        {D3DFMT_DXT3,          { 0,  0,  0,  0}, { 0,  0,  0,  0},  1, 4, 4, 16, FORMAT_DXT,     NULL,         NULL      },
+        {D3DFMT_DXT4,          { 0,  0,  0,  0}, { 0,  0,  0,  0},  1, 4, 4, 16, FORMAT_DXT,     NULL,         NULL      },
+        {D3DFMT_DXT5,          { 0,  0,  0,  0}, { 0,  0,  0,  0},  1, 4, 4, 16, FORMAT_DXT,     NULL,         NULL      },
+        {D3DFMT_R16F,          { 0, 16,  0,  0}, { 0,  0,  0,  0},  2, 1, 1,  2, FORMAT_ARGBF16, NULL,         NULL      },
+        {D3DFMT_G16R16F,       { 0, 16, 16,  0}, { 0,  0, 16,  0},  4, 1, 1,  4, FORMAT_ARGBF16, NULL,         NULL      },
+        {D3DFMT_A16B16G16R16F, {16, 16, 16, 16}, {48,  0, 16, 32},  8, 1, 1,  8, FORMAT_ARGBF16, NULL,         NULL      },
+        {D3DFMT_R32F,          { 0, 32,  0,  0}, { 0,  0,  0,  0},  4, 1, 1,  4, FORMAT_ARGBF,   NULL,         NULL      },
+        {D3DFMT_G32R32F,       { 0, 32, 32,  0}, { 0,  0, 32,  0},  8, 1, 1,  8, FORMAT_ARGBF,   NULL,         NULL      },
+        {D3DFMT_A32B32G32R32F, {32, 32, 32, 32}, {96,  0, 32, 64}, 16, 1, 1, 16, FORMAT_ARGBF,   NULL,         NULL      },
+        {D3DFMT_P8,            { 8,  8,  8,  8}, { 0,  0,  0,  0},  1, 1, 1,  1, FORMAT_INDEX,   NULL,         index_to_rgba},
+        /* marks last element */
+        {D3DFMT_UNKNOWN,       { 0,  0,  0,  0}, { 0,  0,  0,  0},  0, 1, 1,  0, FORMAT_UNKNOWN, NULL,         NULL      },
+        };
+
+static constexpr UINT format_count = sizeof(formats) / sizeof(*formats);
+
+/* Maps the plain D3DFMT values to their index in the format table, FOURCC formats are looked up separately. */
+static constexpr std::array<BYTE, 128> make_format_index_table()
+{
+    std::array<BYTE, 128> table{};
+    UINT i;
+
+    for (i = 0; i < table.size(); ++i)
+        table[i] = format_count - 1;
+    for (i = 0; i < format_count - 1; ++i)
+        if ((UINT)formats[i].format < table.size())
+            table[formats[i].format] = i;
+    return table;
+}
+
+static constexpr std::array<BYTE, 128> format_index_table = make_format_index_table();
+
+/************************************************************
+ * get_format_info
+ *
+ * Returns information about the specified format.
+ * If the format is unsupported, it's filled with the D3DFMT_UNKNOWN desc.
+ *
+ * PARAMS
+ *   format [I] format whose description is queried
+ *
+ */
+const struct pixel_format_desc *get_format_info(D3DFORMAT format)
+{
+    unsigned int i = 0;
+
+    if ((UINT)format < format_index_table.size())
+        return &formats[format_index_table[format]];
+
+    /* only the DXTn FOURCC codes are left */
+    while(formats[i].format != format && formats[i].format != D3DFMT_UNKNOWN) i++;
+//    if (formats[i].format == D3DFMT_UNKNOWN)
+//        FIXME("Unknown format %#x (as FOURCC %s).\n", format, debugstr_an((const char *)&format, 4));
+    return &formats[i];
+}
+
+const struct pixel_format_desc *get_format_table(UINT *count)
+{
+    *count = format_count - 1;
+    return formats;
+}
+
+/************************************************************
+ * conversion features
+ *
+ * The SIMD kernels and the row band workers can be switched off, which
+ * leaves the scalar code on the calling thread as the reference for
+ * benchmarks and equality checks. Plans pick their kernels when they
+ * are initialized.
+ */
+static std::atomic<DWORD> conversion_features{CONVERSION_SIMD | CONVERSION_THREADS};
+
+void set_conversion_features(DWORD features)
+{
+    conversion_features = features;
+}
+
+static inline BOOL use_simd()
+{
+    return !!(conversion_features & CONVERSION_SIMD);
+}
+
+/************************************************************
+ * helper functions for D3DXLoadSurfaceFromMemory
+ */
+static constexpr UINT find_format_index(D3DFORMAT format)
+{
+    UINT i = 0;
+    while (formats[i].format != format && formats[i].format != D3DFMT_UNKNOWN) i++;
+    return i;
+}
+
+/* Formats which are converted with masks and shifts instead of going through struct vec4. */
+static constexpr BOOL is_argb_plan_supported(const struct pixel_format_desc &src, const struct pixel_format_desc &dst)
+{
+    return src.type == dst.type && (src.type == FORMAT_ARGB || src.type == FORMAT_ARGBF16 || src.type == FORMAT_ARGBF)
+           && !src.to_rgba && !dst.from_rgba && src.bytes_per_pixel <= 4 && dst.bytes_per_pixel <= 4;
+}
+
+/************************************************************
+ * scale_argb_channel
+ *
+ * Drops the less significant bits if the destination channel is narrower,
+ * otherwise replicates them so that e.g. an X4R4G4B4 white maps to an
+ * R8G8B8 white instead of 0xf0f0f0.
+ */
+template<UINT src_bits, UINT dst_bits>
+static inline DWORD scale_argb_channel(DWORD c)
+{
+    if constexpr (dst_bits <= src_bits)
+        return c >> (src_bits - dst_bits);
+    else
+    {
+        DWORD val = 0;
+        int shift;
+
+        for (shift = dst_bits - src_bits; shift > 0; shift -= src_bits) val |= c << shift;
+        return val | (c >> -shift);
+    }
+}
+
+template<UINT src_index, UINT dst_index, UINT c>
+static inline DWORD convert_argb_channel(DWORD pixel)
+{
+    constexpr UINT src_bits = formats[src_index].bits[c], dst_bits = formats[dst_index].bits[c];
+    constexpr UINT src_shift = formats[src_index].shift[c], dst_shift = formats[dst_index].shift[c];
+
+    if constexpr (!dst_bits)
+        return 0;
+    else if constexpr (!src_bits) /* new channels are set to their maximal value */
+        return (~0u >> (32 - dst_bits)) << dst_shift;
+    else
+        return scale_argb_channel<src_bits, dst_bits>((pixel >> src_shift) & (~0u >> (32 - src_bits))) << dst_shift;
+}
+
+template<UINT src_index, UINT dst_index>
+static inline DWORD make_argb_color(DWORD pixel)
+{
+    return convert_argb_channel<src_index, dst_index, 0>(pixel) | convert_argb_channel<src_index, dst_index, 1>(pixel)
+           | convert_argb_channel<src_index, dst_index, 2>(pixel) | convert_argb_channel<src_index, dst_index, 3>(pixel);
+}
+
+/************************************************************
+ * convert_argb_plan_row
+ *
+ * Row converter for one format pair, all masks and shifts are folded in
+ * at compile time. Color keys are always represented in D3DFMT_A8R8G8B8
+ * format, a color_key of 0 disables keying.
+ */
+template<UINT src_index, UINT dst_index>
+static void convert_argb_plan_row(const BYTE *src, BYTE *dst, UINT width, D3DCOLOR color_key)
+{
+    constexpr UINT ck_index = find_format_index(D3DFMT_A8R8G8B8);
+    constexpr UINT src_bpp = formats[src_index].bytes_per_pixel, dst_bpp = formats[dst_index].bytes_per_pixel;
+    constexpr DWORD dst_alpha_mask = formats[dst_index].bits[0]
+                                     ? (~0u >> (32 - formats[dst_index].bits[0])) << formats[dst_index].shift[0] : 0;
+    const DWORD key_mask = color_key ? dst_alpha_mask : 0;
+    UINT x;
+
+    for (x = 0; x < width; ++x)
+    {
+        DWORD pixel = 0, val;
+
+        memcpy(&pixel, src + x * src_bpp, src_bpp);
+        val = make_argb_color<src_index, dst_index>(pixel);
+        if constexpr (dst_alpha_mask != 0)
+            val &= ~(key_mask & (0u - (make_argb_color<src_index, ck_index>(pixel) == color_key)));
+        memcpy(dst + x * dst_bpp, &val, dst_bpp);
+    }
+}
+
+template<UINT src_index, UINT dst_index>
+static constexpr argb_plan_func get_argb_plan_func()
+{
+    if constexpr (is_argb_plan_supported(formats[src_index], formats[dst_index]))
+        return convert_argb_plan_row<src_index, dst_index>;
+    else
+        return NULL;
+}
+
+template<UINT src_index, UINT dst_index>
+struct argb_plan_selector
+{
+    static constexpr argb_plan_func value = get_argb_plan_func<src_index, dst_index>();
+};
+
+/* Builds a table of selector<src_index, dst_index>::value, indexed by the positions
+ * of the source and destination formats in the format table. */
+template<typename func_type, template<UINT, UINT> class selector, UINT src_index, UINT... dst_index>
+static constexpr std::array<func_type, format_count> make_format_pair_row(std::integer_sequence<UINT, dst_index...>)
+{
+    return {selector<src_index, dst_index>::value...};
+}
+
+template<typename func_type, template<UINT, UINT> class selector, UINT... src_index>
+static constexpr std::array<std::array<func_type, format_count>, format_count>
+make_format_pair_table(std::integer_sequence<UINT, src_index...>)
+{
+    return {make_format_pair_row<func_type, selector, src_index>(std::make_integer_sequence<UINT, format_count>())...};
+}
+
+static constexpr auto argb_plan_table =
+    make_format_pair_table<argb_plan_func, argb_plan_selector>(std::make_integer_sequence<UINT, format_count>());
+
+/************************************************************
+ * half float conversion tables
+ *
+ * float_16_to_32 uses the mantissa/exponent/offset tables, float_32_to_16
+ * picks the half exponent and mantissa shift by the float sign and exponent
+ * and rounds to nearest even, which gives the same results as F16C.
+ */
+struct half_to_float_tables
+{
+    DWORD mantissa[2048];
+    DWORD exponent[64];
+    WORD offset[64];
+};
+
+static constexpr struct half_to_float_tables make_half_to_float_tables()
+{
+    struct half_to_float_tables t{};
+    UINT i;
+
+    for (i = 1; i < 1024; ++i)
+    {
+        /* denormals are normalized */
+        DWORD m = i << 13, e = 0;
+
+        while (!(m & 0x00800000))
+        {
+            e -= 0x00800000;
+            m <<= 1;
+        }
+        t.mantissa[i] = (m & ~0x00800000u) | (e + 0x38800000);
+    }
+    for (i = 1024; i < 2048; ++i)
+        t.mantissa[i] = 0x38000000 + ((i - 1024) << 13);
+
+    for (i = 1; i < 31; ++i)
+    {
+        t.exponent[i] = i << 23;
+        t.exponent[i + 32] = 0x80000000 | (i << 23);
+    }
+    t.exponent[31] = 0x47800000;
+    t.exponent[32] = 0x80000000;
+    t.exponent[63] = 0xc7800000;
+
+    for (i = 0; i < 64; ++i)
+        t.offset[i] = (i & 31) ? 1024 : 0;
+    return t;
+}
+
+struct float_to_half_tables
+{
+    WORD base[512];
+    BYTE shift[512];
+};
+
+static constexpr struct float_to_half_tables make_float_to_half_tables()
+{
+    struct float_to_half_tables t{};
+    UINT i;
+
+    for (i = 0; i < 256; ++i)
+    {
+        int e = (int)i - 127;
+        WORD base;
+        BYTE shift;
+
+        /* the implicit mantissa bit is shifted in as well, so normals subtract it from the exponent */
+        if (e < -25 || e > 15)
+        {
+            base = e > 15 ? 0x7c00 : 0;
+            shift = 31;
+        }
+        else if (e < -14)
+        {
+            base = 0;
+            shift = -e - 1;
+        }
+        else
+        {
+            base = (e + 14) << 10;
+            shift = 13;
+        }
+        t.base[i] = base;
+        t.base[i | 0x100] = base | 0x8000;
+        t.shift[i] = t.shift[i | 0x100] = shift;
+    }
+    return t;
+}
+
+static constexpr struct half_to_float_tables half_to_float = make_half_to_float_tables();
+static constexpr struct float_to_half_tables float_to_half = make_float_to_half_tables();
+
+static inline float float_16_to_32(WORD in)
+{
+    DWORD bits = half_to_float.mantissa[half_to_float.offset[in >> 10] + (in & 0x3ff)] + half_to_float.exponent[in >> 10];
+    float out;
+
+    if ((in & 0x7c00) == 0x7c00 && (in & 0x3ff)) /* NaNs come out quiet */
+        bits |= 0x00400000;
+    memcpy(&out, &bits, sizeof(out));
+    return out;
+}
+
+static inline WORD float_32_to_16(float in)
+{
+    DWORD bits, mantissa, rem, half;
+    UINT index, shift;
+    WORD out;
+
+    memcpy(&bits, &in, sizeof(bits));
+    if ((bits & 0x7fffffff) > 0x7f800000)
+        return ((bits >> 16) & 0x8000) | 0x7e00 | ((bits >> 13) & 0x3ff);
+
+    index = bits >> 23;
+    shift = float_to_half.shift[index];
+    mantissa = (bits & 0x007fffff) | 0x00800000;
+    out = float_to_half.base[index] + (mantissa >> shift);
+
+    rem = mantissa & ((1u << shift) - 1);
+    half = 1u << (shift - 1);
+    if (rem > half || (rem == half && (out & 1)))
+        ++out;
+    return out;
+}
+
+/* It doesn't work for components bigger than 32 bits (or somewhat smaller but unaligned). */
+void format_to_vec4(const struct pixel_format_desc *format, const BYTE *src, struct vec4 *dst)
+{
+    DWORD mask, tmp;
+    unsigned int c;
+
+    for (c = 0; c < 4; ++c)
+    {
+        static const unsigned int component_offsets[4] = {3, 0, 1, 2};
+        float *dst_component = (float *)dst + component_offsets[c];
+
+        if (format->bits[c])
+        {
+            mask = ~0u >> (32 - format->bits[c]);
+
+            memcpy(&tmp, src + format->shift[c] / 8,
+                   std::min(sizeof(DWORD), static_cast<ulong>((format->shift[c] % 8 + format->bits[c] + 7) / 8)));
+
+            if (format->type == FORMAT_ARGBF16)
+                *dst_component = float_16_to_32(tmp & mask);
+            else if (format->type == FORMAT_ARGBF)
+                *dst_component = *(float *)&tmp;
+            else
+                *dst_component = (float)((tmp >> format->shift[c] % 8) & mask) / mask;
+        }
+        else
+            *dst_component = 1.0f;
+    }
+}
+
+/* It doesn't work for components bigger than 32 bits. */
+void format_from_vec4(const struct pixel_format_desc *format, const struct vec4 *src, BYTE *dst)
+{
+    DWORD v, mask32;
+    unsigned int c, i;
+
+    memset(dst, 0, format->bytes_per_pixel);
+
+    for (c = 0; c < 4; ++c)
+    {
+        static const unsigned int component_offsets[4] = {3, 0, 1, 2};
+        const float src_component = *((const float *)src + component_offsets[c]);
+
+        if (!format->bits[c])
+            continue;
+
+        mask32 = ~0u >> (32 - format->bits[c]);
+
+        if (format->type == FORMAT_ARGBF16)
+            v = float_32_to_16(src_component);
+        else if (format->type == FORMAT_ARGBF)
+            v = *(DWORD *)&src_component;
+        else
+            v = (DWORD)(src_component * ((1 << format->bits[c]) - 1) + 0.5f);
+
+        for (i = format->shift[c] / 8 * 8; i < format->shift[c] + format->bits[c]; i += 8)
+        {
+            BYTE mask, byte;
+
+            if (format->shift[c] > i)
+            {
+                mask = mask32 << (format->shift[c] - i);
+                byte = (v << (format->shift[c] - i)) & mask;
+            }
+            else
+            {
+                mask = mask32 >> (i - format->shift[c]);
+                byte = (v >> (i - format->shift[c])) & mask;
+            }
+            dst[i / 8] |= byte;
+        }
+    }
+}
+
+/************************************************************
+ * SIMD row kernels for convert_argb_pixels
+ *
+ * Pixels are unpacked to A8R8G8B8 lanes, color keyed and packed to the
+ * destination format. init_argb_simd_info only accepts format pairs whose
+ * result is identical to the scalar path, so a row can be finished by
+ * the scalar loop without visible seams.
+ */
+#ifdef ARGB_SIMD
+
+
+
+/* Expands a channel to 8 bits as (c * mul) >> rshift, replicating the bits like make_argb_color. */
+static void get_argb_expand_factors(UINT bits, DWORD *mul, DWORD *rshift)
+{
+    UINT total = bits;
+
+    *mul = 1;
+    while (total < 8)
+    {
+        *mul |= *mul << bits;
+        total += bits;
+    }
+    *rshift = total - 8;
+}
+
+/* Reduces an 8 bit channel to bits as (c * mul) >> rshift. */
+static void get_argb_reduce_factors(UINT bits, DWORD *mul, DWORD *rshift)
+{
+    UINT total = 8;
+
+    *mul = 1;
+    while (total < bits)
+    {
+        *mul |= *mul << 8;
+        total += 8;
+    }
+    *rshift = total - bits;
+}
+
+static BOOL init_argb_simd_info(const struct pixel_format_desc *src_format, const struct pixel_format_desc *dst_format,
+                                D3DCOLOR color_key, const PALETTEENTRY *palette, struct argb_simd_info *info)
+{
+    static const DWORD argb_pos[4] = {24, 16, 8, 0};
+    BOOL vec4_path = src_format->to_rgba || dst_format->from_rgba || src_format->type != dst_format->type;
+    unsigned int i, n;
+
+    if (src_format->bytes_per_pixel == 3 || src_format->bytes_per_pixel > 4
+        || dst_format->bytes_per_pixel == 3 || dst_format->bytes_per_pixel > 4)
+        return FALSE;
+    if ((src_format->type != FORMAT_ARGB && src_format->type != FORMAT_INDEX) || dst_format->type != FORMAT_ARGB)
+        return FALSE;
+
+    info->src_luminance = src_format->to_rgba == la_to_rgba;
+    info->src_index = src_format->type == FORMAT_INDEX;
+    info->dst_luminance = dst_format->from_rgba == la_from_rgba;
+    if ((src_format->to_rgba && !info->src_luminance && !info->src_index)
+        || (dst_format->from_rgba && !info->dst_luminance)
+        || (info->src_index && (!palette || src_format->to_rgba != index_to_rgba)))
+        return FALSE;
+
+    for (i = 0; i < 4; ++i)
+    {
+        /* The vec4 path rounds instead of truncating, which only matches for 8 bit channels.
+         * Going through 8 bits is lossy when both sides are wider than that. */
+        if (vec4_path)
+        {
+            if ((src_format->bits[i] && src_format->bits[i] != 8) || (dst_format->bits[i] && dst_format->bits[i] != 8))
+                return FALSE;
+        }
+        else if (src_format->bits[i] > 16 || dst_format->bits[i] > 16
+                 || (src_format->bits[i] && dst_format->bits[i] > 8 && src_format->bits[i] != 8))
+            return FALSE;
+    }
+
+    info->src_count = 0;
+    info->dst_count = 0;
+    info->src_fill = 0;
+    for (i = 0; i < 4; ++i)
+    {
+        if (info->src_index)
+            ;
+        else if (src_format->bits[i])
+        {
+            n = info->src_count++;
+            info->src_shift[n] = src_format->shift[i];
+            info->src_mask[n] = ~0u >> (32 - src_format->bits[i]);
+            info->src_pos[n] = argb_pos[i];
+            get_argb_expand_factors(src_format->bits[i], &info->src_mul[n], &info->src_rshift[n]);
+        }
+        else if (!info->src_luminance || i < 2) /* luminance is replicated to green and blue */
+            info->src_fill |= 0xffu << argb_pos[i];
+
+        if (dst_format->bits[i] && !(info->dst_luminance && i == 1))
+        {
+            n = info->dst_count++;
+            info->dst_pos[n] = argb_pos[i];
+            info->dst_shift[n] = dst_format->shift[i];
+            get_argb_reduce_factors(dst_format->bits[i], &info->dst_mul[n], &info->dst_rshift[n]);
+        }
+    }
+    info->dst_luminance_shift = dst_format->shift[1];
+    info->color_key = color_key;
+
+    if (info->src_index)
+    {
+        for (i = 0; i < 256; ++i)
+            info->palette[i] = ((DWORD)palette[i].peFlags << 24) | ((DWORD)palette[i].peRed << 16)
+                               | ((DWORD)palette[i].peGreen << 8) | palette[i].peBlue;
+    }
+    return TRUE;
+}
+
+template<UINT src_bpp, UINT dst_bpp>
+static UINT convert_argb_row_sse2(const BYTE *src, BYTE *dst, UINT width, const struct argb_simd_info *info)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i byte_mask = _mm_set1_epi32(0xff);
+    const __m128i alpha_mask = _mm_set1_epi32(0xff000000);
+    const __m128i fill = _mm_set1_epi32(info->src_fill);
+    const __m128i key = _mm_set1_epi32(info->color_key);
+    const __m128 scale = _mm_set1_ps(255.0f);
+    __m128i src_shift[4], src_mask[4], src_mul[4], src_rshift[4], src_pos[4];
+    __m128i dst_pos[4], dst_mul[4], dst_rshift[4], dst_shift[4];
+    const __m128i lum_shift = _mm_cvtsi32_si128(info->dst_luminance_shift);
+    UINT c, x;
+
+    for (c = 0; c < info->src_count; ++c)
+    {
+        src_shift[c] = _mm_cvtsi32_si128(info->src_shift[c]);
+        src_mask[c] = _mm_set1_epi32(info->src_mask[c]);
+        src_mul[c] = _mm_set1_epi32(info->src_mul[c]);
+        src_rshift[c] = _mm_cvtsi32_si128(info->src_rshift[c]);
+        src_pos[c] = _mm_cvtsi32_si128(info->src_pos[c]);
+    }
+    for (c = 0; c < info->dst_count; ++c)
+    {
+        dst_pos[c] = _mm_cvtsi32_si128(info->dst_pos[c]);
+        dst_mul[c] = _mm_set1_epi32(info->dst_mul[c]);
+        dst_rshift[c] = _mm_cvtsi32_si128(info->dst_rshift[c]);
+        dst_shift[c] = _mm_cvtsi32_si128(info->dst_shift[c]);
+    }
+
+    for (x = 0; x + 4 <= width; x += 4)
+    {
+        __m128i p, argb, out;
+
+        if (src_bpp == 1)
+        {
+            int v;
+
+            memcpy(&v, src + x, 4);
+            p = _mm_unpacklo_epi16(_mm_unpacklo_epi8(_mm_cvtsi32_si128(v), zero), zero);
+        }
+        else if (src_bpp == 2)
+            p = _mm_unpacklo_epi16(_mm_loadl_epi64((const __m128i *)(src + x * 2)), zero);
+        else
+            p = _mm_loadu_si128((const __m128i *)(src + x * 4));
+
+        if (info->src_index)
+        {
+            argb = _mm_setr_epi32(info->palette[src[x]], info->palette[src[x + 1]],
+                                  info->palette[src[x + 2]], info->palette[src[x + 3]]);
+        }
+        else
+        {
+            argb = fill;
+            for (c = 0; c < info->src_count; ++c)
+            {
+                /* products stay below 2^16, so the 16 bit multiply is exact for 32 bit lanes */
+                __m128i v = _mm_and_si128(_mm_srl_epi32(p, src_shift[c]), src_mask[c]);
+                v = _mm_srl_epi32(_mm_mullo_epi16(v, src_mul[c]), src_rshift[c]);
+                argb = _mm_or_si128(argb, _mm_sll_epi32(v, src_pos[c]));
+            }
+            if (info->src_luminance)
+            {
+                __m128i l = _mm_and_si128(_mm_srli_epi32(argb, 16), byte_mask);
+                argb = _mm_or_si128(argb, _mm_or_si128(_mm_slli_epi32(l, 8), l));
+            }
+        }
+
+        if (info->color_key)
+            argb = _mm_andnot_si128(_mm_and_si128(_mm_cmpeq_epi32(argb, key), alpha_mask), argb);
+
+        out = zero;
+        for (c = 0; c < info->dst_count; ++c)
+        {
+            __m128i v = _mm_and_si128(_mm_srl_epi32(argb, dst_pos[c]), byte_mask);
+            v = _mm_srl_epi32(_mm_mullo_epi16(v, dst_mul[c]), dst_rshift[c]);
+            out = _mm_or_si128(out, _mm_sll_epi32(v, dst_shift[c]));
+        }
+        if (info->dst_luminance)
+        {
+            /* same operations and order as format_to_vec4, la_from_rgba and format_from_vec4 */
+            __m128 r = _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(argb, 16), byte_mask)), scale);
+            __m128 g = _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(_mm_srli_epi32(argb, 8), byte_mask)), scale);
+            __m128 b = _mm_div_ps(_mm_cvtepi32_ps(_mm_and_si128(argb, byte_mask)), scale);
+            __m128 l = _mm_add_ps(_mm_add_ps(_mm_mul_ps(r, _mm_set1_ps(0.2125f)), _mm_mul_ps(g, _mm_set1_ps(0.7154f))),
+                                  _mm_mul_ps(b, _mm_set1_ps(0.0721f)));
+            l = _mm_add_ps(_mm_mul_ps(l, scale), _mm_set1_ps(0.5f));
+            out = _mm_or_si128(out, _mm_sll_epi32(_mm_and_si128(_mm_cvttps_epi32(l), byte_mask), lum_shift));
+        }
+
+        if (dst_bpp == 1)
+        {
+            int v = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(out, zero), zero));
+
+            memcpy(dst + x, &v, 4);
+        }
+        else if (dst_bpp == 2)
+        {
+            /* sign extend so that the signed saturation keeps all 16 bits */
+            out = _mm_srai_epi32(_mm_slli_epi32(out, 16), 16);
+            _mm_storel_epi64((__m128i *)(dst + x * 2), _mm_packs_epi32(out, zero));
+        }
+        else
+            _mm_storeu_si128((__m128i *)(dst + x * 4), out);
+    }
+    return x;
+}
+
+template<UINT src_bpp, UINT dst_bpp>
+ARGB_TARGET_AVX2 static UINT convert_argb_row_avx2(const BYTE *src, BYTE *dst, UINT width, const struct argb_simd_info *info)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i byte_mask = _mm256_set1_epi32(0xff);
+    const __m256i alpha_mask = _mm256_set1_epi32(0xff000000);
+    const __m256i fill = _mm256_set1_epi32(info->src_fill);
+    const __m256i key = _mm256_set1_epi32(info->color_key);
+    const __m256 scale = _mm256_set1_ps(255.0f);
+    __m128i src_shift[4], src_rshift[4], src_pos[4], dst_pos[4], dst_rshift[4], dst_shift[4];
+    __m256i src_mask[4], src_mul[4], dst_mul[4];
+    const __m128i lum_shift = _mm_cvtsi32_si128(info->dst_luminance_shift);
+    UINT c, x;
+
+    for (c = 0; c < info->src_count; ++c)
+    {
+        src_shift[c] = _mm_cvtsi32_si128(info->src_shift[c]);
+        src_mask[c] = _mm256_set1_epi32(info->src_mask[c]);
+        src_mul[c] = _mm256_set1_epi32(info->src_mul[c]);
+        src_rshift[c] = _mm_cvtsi32_si128(info->src_rshift[c]);
+        src_pos[c] = _mm_cvtsi32_si128(info->src_pos[c]);
+    }
+    for (c = 0; c < info->dst_count; ++c)
+    {
+        dst_pos[c] = _mm_cvtsi32_si128(info->dst_pos[c]);
+        dst_mul[c] = _mm256_set1_epi32(info->dst_mul[c]);
+        dst_rshift[c] = _mm_cvtsi32_si128(info->dst_rshift[c]);
+        dst_shift[c] = _mm_cvtsi32_si128(info->dst_shift[c]);
+    }
+
+    for (x = 0; x + 8 <= width; x += 8)
+    {
+        __m256i p, argb, out;
+
+        if (src_bpp == 1)
+            p = _mm256_cvtepu8_epi32(_mm_loadl_epi64((const __m128i *)(src + x)));
+        else if (src_bpp == 2)
+            p = _mm256_cvtepu16_epi32(_mm_loadu_si128((const __m128i *)(src + x * 2)));
+        else
+            p = _mm256_loadu_si256((const __m256i *)(src + x * 4));
+
+        if (info->src_index)
+            argb = _mm256_i32gather_epi32((const int *)info->palette, p, 4);
+        else
+        {
+            argb = fill;
+            for (c = 0; c < info->src_count; ++c)
+            {
+                __m256i v = _mm256_and_si256(_mm256_srl_epi32(p, src_shift[c]), src_mask[c]);
+                v = _mm256_srl_epi32(_mm256_mullo_epi16(v, src_mul[c]), src_rshift[c]);
+                argb = _mm256_or_si256(argb, _mm256_sll_epi32(v, src_pos[c]));
+            }
+            if (info->src_luminance)
+            {
+                __m256i l = _mm256_and_si256(_mm256_srli_epi32(argb, 16), byte_mask);
+                argb = _mm256_or_si256(argb, _mm256_or_si256(_mm256_slli_epi32(l, 8), l));
+            }
+        }
+
+        if (info->color_key)
+            argb = _mm256_andnot_si256(_mm256_and_si256(_mm256_cmpeq_epi32(argb, key), alpha_mask), argb);
+
+        out = zero;
+        for (c = 0; c < info->dst_count; ++c)
+        {
+            __m256i v = _mm256_and_si256(_mm256_srl_epi32(argb, dst_pos[c]), byte_mask);
+            v = _mm256_srl_epi32(_mm256_mullo_epi16(v, dst_mul[c]), dst_rshift[c]);
+            out = _mm256_or_si256(out, _mm256_sll_epi32(v, dst_shift[c]));
+        }
+        if (info->dst_luminance)
+        {
+            __m256 r = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(argb, 16), byte_mask)), scale);
+            __m256 g = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(_mm256_srli_epi32(argb, 8), byte_mask)), scale);
+            __m256 b = _mm256_div_ps(_mm256_cvtepi32_ps(_mm256_and_si256(argb, byte_mask)), scale);
+            __m256 l = _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(r, _mm256_set1_ps(0.2125f)),
+                                                   _mm256_mul_ps(g, _mm256_set1_ps(0.7154f))),
+                                     _mm256_mul_ps(b, _mm256_set1_ps(0.0721f)));
+            l = _mm256_add_ps(_mm256_mul_ps(l, scale), _mm256_set1_ps(0.5f));
+            out = _mm256_or_si256(out, _mm256_sll_epi32(_mm256_and_si256(_mm256_cvttps_epi32(l), byte_mask), lum_shift));
+        }
+
+        if (dst_bpp == 4)
+            _mm256_storeu_si256((__m256i *)(dst + x * 4), out);
+        else
+        {
+            __m128i words = _mm_packus_epi32(_mm256_castsi256_si128(out), _mm256_extracti128_si256(out, 1));
+
+            if (dst_bpp == 2)
+                _mm_storeu_si128((__m128i *)(dst + x * 2), words);
+            else
+                _mm_storel_epi64((__m128i *)(dst + x), _mm_packus_epi16(words, words));
+        }
+    }
+    return x;
+}
+
+/* Indexed by bytes_per_pixel >> 1, i.e. 1, 2 and 4 bytes. */
+static const argb_row_func argb_row_funcs_sse2[3][3] =
+{
+    {convert_argb_row_sse2<1, 1>, convert_argb_row_sse2<1, 2>, convert_argb_row_sse2<1, 4>},
+    {convert_argb_row_sse2<2, 1>, convert_argb_row_sse2<2, 2>, convert_argb_row_sse2<2, 4>},
+    {convert_argb_row_sse2<4, 1>, convert_argb_row_sse2<4, 2>, convert_argb_row_sse2<4, 4>},
+};
+
+static const argb_row_func argb_row_funcs_avx2[3][3] =
+{
+    {convert_argb_row_avx2<1, 1>, convert_argb_row_avx2<1, 2>, convert_argb_row_avx2<1, 4>},
+    {convert_argb_row_avx2<2, 1>, convert_argb_row_avx2<2, 2>, convert_argb_row_avx2<2, 4>},
+    {convert_argb_row_avx2<4, 1>, convert_argb_row_avx2<4, 2>, convert_argb_row_avx2<4, 4>},
+};
+
+/* Picks the widest kernel the running CPU supports, NULL means scalar only. */
+static argb_row_func get_argb_row_func(UINT src_bpp, UINT dst_bpp)
+{
+    static const BOOL has_avx2 = SDL_HasAVX2();
+    static const BOOL has_sse2 = SDL_HasSSE2();
+
+    if (!use_simd())
+        return NULL;
+    if (has_avx2)
+        return argb_row_funcs_avx2[src_bpp >> 1][dst_bpp >> 1];
+    if (has_sse2)
+        return argb_row_funcs_sse2[src_bpp >> 1][dst_bpp >> 1];
+    return NULL;
+}
+
+/************************************************************
+ * F16C row kernels for the float formats
+ *
+ * Used for FORMAT_ARGBF16 and FORMAT_ARGBF pairs which would otherwise go
+ * through struct vec4 pixel by pixel. The float formats all store red first,
+ * so a pixel maps to the first lanes of a vector and missing channels are
+ * set to 1.0f like format_to_vec4 does. Conversions round to nearest even
+ * like float_32_to_16.
+ */
+template<UINT src_index, UINT dst_index>
+ARGB_TARGET_F16C static UINT convert_float_row_f16c(const BYTE *src, BYTE *dst, UINT width, const struct argb_simd_info *info)
+{
+    constexpr UINT src_bpp = formats[src_index].bytes_per_pixel, dst_bpp = formats[dst_index].bytes_per_pixel;
+    constexpr BOOL src_half = formats[src_index].type == FORMAT_ARGBF16, dst_half = formats[dst_index].type == FORMAT_ARGBF16;
+    constexpr UINT src_channels = src_bpp / (src_half ? 2 : 4), dst_channels = dst_bpp / (dst_half ? 2 : 4);
+    UINT x;
+
+    if constexpr (src_channels == dst_channels)
+    {
+        /* the row is one stream of channels, 8 at a time */
+        UINT count = width * src_channels, i;
+
+        for (i = 0; i + 8 <= count; i += 8)
+        {
+            __m256 v;
+
+            if constexpr (src_half)
+                v = _mm256_cvtph_ps(_mm_loadu_si128((const __m128i *)(src + i * 2)));
+            else
+                v = _mm256_loadu_ps((const float *)(src + i * 4));
+
+            if constexpr (dst_half)
+                _mm_storeu_si128((__m128i *)(dst + i * 2), _mm256_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+            else
+                _mm256_storeu_ps((float *)(dst + i * 4), v);
+        }
+        return i / src_channels;
+    }
+    else
+    {
+        constexpr int fill = 0xf & (0xf << src_channels);
+        const __m128 one = _mm_set1_ps(1.0f);
+
+        for (x = 0; x < width; ++x)
+        {
+            __m128 v;
+
+            if constexpr (src_half)
+            {
+                unsigned long long bits = 0;
+
+                memcpy(&bits, src + x * src_bpp, src_bpp);
+                v = _mm_cvtph_ps(_mm_loadl_epi64((const __m128i *)&bits));
+            }
+            else
+            {
+                float f[4] = {0.0f, 0.0f, 0.0f, 0.0f};
+
+                memcpy(f, src + x * src_bpp, src_bpp);
+                v = _mm_loadu_ps(f);
+            }
+            if constexpr (fill != 0)
+                v = _mm_blend_ps(v, one, fill);
+
+            if constexpr (dst_half)
+            {
+                unsigned long long bits;
+
+                _mm_storel_epi64((__m128i *)&bits, _mm_cvtps_ph(v, _MM_FROUND_TO_NEAREST_INT));
+                memcpy(dst + x * dst_bpp, &bits, dst_bpp);
+            }
+            else
+            {
+                float f[4];
+
+                _mm_storeu_ps(f, v);
+                memcpy(dst + x * dst_bpp, f, dst_bpp);
+            }
+        }
+        return width;
+    }
+}
+
+static constexpr BOOL is_float_format(const struct pixel_format_desc &format)
+{
+    return format.type == FORMAT_ARGBF16 || format.type == FORMAT_ARGBF;
+}
+
+template<UINT src_index, UINT dst_index>
+struct float_row_selector
+{
+    static constexpr argb_row_func get()
+    {
+        if constexpr (is_float_format(formats[src_index]) && is_float_format(formats[dst_index]))
+            return convert_float_row_f16c<src_index, dst_index>;
+        else
+            return NULL;
+    }
+
+    static constexpr argb_row_func value = get();
+};
+
+static constexpr auto float_row_funcs_f16c =
+    make_format_pair_table<argb_row_func, float_row_selector>(std::make_integer_sequence<UINT, format_count>());
+
+/* NULL unless both formats are float ones and the CPU has F16C. */
+static argb_row_func get_float_row_func(const struct pixel_format_desc *src_format, const struct pixel_format_desc *dst_format)
+{
+#if defined(__GNUC__) || defined(__clang__)
+    static const BOOL has_f16c = SDL_HasAVX() && __builtin_cpu_supports("f16c");
+#else
+    static const BOOL has_f16c = SDL_HasAVX2(); /* every AVX2 CPU has F16C */
+#endif
+
+    return has_f16c && use_simd() ? float_row_funcs_f16c[src_format - formats][dst_format - formats] : NULL;
+}
+
+#endif /* ARGB_SIMD */
+
+/************************************************************
+ * DXT decoding
+ *
+ * Compressed sources are decoded one row of blocks at a time into four
+ * A8R8G8B8 rows, which are then converted like any other source row.
+ * DXT2 and DXT4 store premultiplied colors, which are divided by alpha.
+ */
+static inline DWORD expand_r5g6b5(WORD c)
+{
+    DWORD r = (c >> 11) & 0x1f, g = (c >> 5) & 0x3f, b = c & 0x1f;
+
+    return ((r << 3 | r >> 2) << 16) | ((g << 2 | g >> 4) << 8) | (b << 3 | b >> 2);
+}
+
+static inline DWORD mix_argb(DWORD a, DWORD b, UINT wa, UINT wb, UINT div)
+{
+    DWORD out = 0;
+    UINT c;
+
+    for (c = 0; c < 32; c += 8)
+        out |= ((((a >> c) & 0xff) * wa + ((b >> c) & 0xff) * wb) / div) << c;
+    return out;
+}
+
+/* 4 color palette of a color block. The 3 color mode with transparent black only exists in DXT1. */
+static void get_dxt_color_palette(const BYTE *block, BOOL dxt1, DWORD palette[4])
+{
+    WORD c0 = block[0] | block[1] << 8, c1 = block[2] | block[3] << 8;
+    DWORD alpha = dxt1 ? 0xff000000 : 0;
+
+    palette[0] = expand_r5g6b5(c0) | alpha;
+    palette[1] = expand_r5g6b5(c1) | alpha;
+    if (c0 > c1 || !dxt1)
+    {
+        palette[2] = mix_argb(palette[0], palette[1], 2, 1, 3);
+        palette[3] = mix_argb(palette[0], palette[1], 1, 2, 3);
+    }
+    else
+    {
+        palette[2] = mix_argb(palette[0], palette[1], 1, 1, 2);
+        palette[3] = 0;
+    }
+}
+
+static void get_dxt5_alpha_palette(const BYTE *block, BYTE palette[8])
+{
+    UINT i;
+
+    palette[0] = block[0];
+    palette[1] = block[1];
+    if (block[0] > block[1])
+    {
+        for (i = 1; i < 7; ++i)
+            palette[i + 1] = ((7 - i) * block[0] + i * block[1]) / 7;
+    }
+    else
+    {
+        for (i = 1; i < 5; ++i)
+            palette[i + 1] = ((5 - i) * block[0] + i * block[1]) / 5;
+        palette[6] = 0;
+        palette[7] = 0xff;
+    }
+}
+
+/* Alpha of the 16 pixels of a DXT2-DXT5 block, in row major order. */
+template<BOOL interpolated>
+static inline void get_dxt_alpha(const BYTE *block, BYTE alpha[16])
+{
+    UINT i;
+
+    if constexpr (interpolated)
+    {
+        unsigned long long bits = 0;
+        BYTE palette[8];
+
+        get_dxt5_alpha_palette(block, palette);
+        memcpy(&bits, block + 2, 6);
+        for (i = 0; i < 16; ++i)
+            alpha[i] = palette[(bits >> (i * 3)) & 7];
+    }
+    else
+    {
+        for (i = 0; i < 16; ++i)
+            alpha[i] = ((block[i / 2] >> (i & 1) * 4) & 0xf) * 0x11;
+    }
+}
+
+static void unpremultiply_argb_row(DWORD *row, UINT width)
+{
+    UINT x, c;
+
+    for (x = 0; x < width; ++x)
+    {
+        DWORD a = row[x] >> 24, out = row[x] & 0xff000000;
+
+        if (!a)
+            continue;
+        for (c = 0; c < 24; c += 8)
+            out |= std::min((((row[x] >> c) & 0xff) * 255 + a / 2) / a, 255u) << c;
+        row[x] = out;
+    }
+}
+
+/* dxt is 1 for DXT1, 3 for DXT2/DXT3 and 5 for DXT4/DXT5. */
+template<UINT dxt, BOOL premultiplied>
+static void decode_dxt_blocks(const BYTE *blocks, DWORD *dst, UINT pitch, UINT block_count)
+{
+    constexpr UINT block_size = dxt == 1 ? 8 : 16;
+    UINT b, x, y;
+
+    for (b = 0; b < block_count; ++b)
+    {
+        const BYTE *block = blocks + b * block_size;
+        const BYTE *color = block + block_size - 8;
+        DWORD palette[4];
+        BYTE alpha[16];
+
+        get_dxt_color_palette(color, dxt == 1, palette);
+        if constexpr (dxt != 1)
+            get_dxt_alpha<dxt == 5>(block, alpha);
+
+        for (y = 0; y < 4; ++y)
+            for (x = 0; x < 4; ++x)
+            {
+                DWORD pixel = palette[(color[4 + y] >> (x * 2)) & 3];
+
+                if constexpr (dxt != 1)
+                    pixel |= (DWORD)alpha[y * 4 + x] << 24;
+                dst[y * pitch + b * 4 + x] = pixel;
+            }
+    }
+    if constexpr (premultiplied)
+        for (y = 0; y < 4; ++y)
+            unpremultiply_argb_row(dst + y * pitch, block_count * 4);
+}
+
+#ifdef ARGB_SIMD
+
+/* pshufb controls picking the 4 byte palette entries selected by one row of color indices. */
+static constexpr std::array<std::array<BYTE, 16>, 256> make_dxt_color_shuffles()
+{
+    std::array<std::array<BYTE, 16>, 256> table{};
+    UINT i, x, c;
+
+    for (i = 0; i < 256; ++i)
+        for (x = 0; x < 4; ++x)
+            for (c = 0; c < 4; ++c)
+                table[i][x * 4 + c] = ((i >> (x * 2)) & 3) * 4 + c;
+    return table;
+}
+
+alignas(16) static constexpr std::array<std::array<BYTE, 16>, 256> dxt_color_shuffles = make_dxt_color_shuffles();
+
+template<UINT dxt, BOOL premultiplied>
+ARGB_TARGET_SSSE3 static void decode_dxt_blocks_ssse3(const BYTE *blocks, DWORD *dst, UINT pitch, UINT block_count)
+{
+    constexpr UINT block_size = dxt == 1 ? 8 : 16;
+    const __m128i alpha_shuffle = _mm_setr_epi8(-1, -1, -1, 0, -1, -1, -1, 1, -1, -1, -1, 2, -1, -1, -1, 3);
+    UINT b, y;
+
+    for (b = 0; b < block_count; ++b)
+    {
+        const BYTE *block = blocks + b * block_size;
+        const BYTE *color = block + block_size - 8;
+        DWORD palette[4];
+        __m128i colors;
+        BYTE alpha[16];
+
+        get_dxt_color_palette(color, dxt == 1, palette);
+        colors = _mm_loadu_si128((const __m128i *)palette);
+        if constexpr (dxt != 1)
+            get_dxt_alpha<dxt == 5>(block, alpha);
+
+        for (y = 0; y < 4; ++y)
+        {
+            __m128i row = _mm_shuffle_epi8(colors, _mm_load_si128((const __m128i *)dxt_color_shuffles[color[4 + y]].data()));
+
+            if constexpr (dxt != 1)
+            {
+                int a;
+
+                memcpy(&a, alpha + y * 4, sizeof(a));
+                row = _mm_or_si128(row, _mm_shuffle_epi8(_mm_cvtsi32_si128(a), alpha_shuffle));
+            }
+            _mm_storeu_si128((__m128i *)(dst + y * pitch + b * 4), row);
+        }
+    }
+    if constexpr (premultiplied)
+        for (y = 0; y < 4; ++y)
+            unpremultiply_argb_row(dst + y * pitch, block_count * 4);
+}
+
+#endif /* ARGB_SIMD */
+
+dxt_decode_func get_dxt_decode_func(D3DFORMAT format)
+{
+#ifdef ARGB_SIMD
+    static const BOOL has_ssse3 = SDL_HasSSE41(); /* SDL has no SSSE3 check, SSE4.1 implies it */
+
+    if (has_ssse3 && use_simd())
+    {
+        switch (format)
+        {
+            case D3DFMT_DXT1: return decode_dxt_blocks_ssse3<1, FALSE>;
+            case D3DFMT_DXT2: return decode_dxt_blocks_ssse3<3, TRUE>;
+            case D3DFMT_DXT3: return decode_dxt_blocks_ssse3<3, FALSE>;
+            case D3DFMT_DXT4: return decode_dxt_blocks_ssse3<5, TRUE>;
+            case D3DFMT_DXT5: return decode_dxt_blocks_ssse3<5, FALSE>;
+            default: return NULL;
+        }
+    }
+#endif
+    switch (format)
+    {
+        case D3DFMT_DXT1: return decode_dxt_blocks<1, FALSE>;
+        case D3DFMT_DXT2: return decode_dxt_blocks<3, TRUE>;
+        case D3DFMT_DXT3: return decode_dxt_blocks<3, FALSE>;
+        case D3DFMT_DXT4: return decode_dxt_blocks<5, TRUE>;
+        case D3DFMT_DXT5: return decode_dxt_blocks<5, FALSE>;
+        default: return NULL;
+    }
+}
+
+/************************************************************
+ * DXT encoding
+ *
+ * Blocks are compressed from four A8R8G8B8 rows. Colors are range fitted
+ * along the principal axis of the block. Unless D3DX_FILTER_DXT_FAST is
+ * set, a cluster fit, which tries every ordered split of the pixels over
+ * the palette entries, is tried as well and the endpoints with the lower
+ * error are kept.
+ */
+typedef void (*dxt_encode_func)(const DWORD *src, UINT pitch, BYTE *blocks, UINT block_count);
+
+#define DXT_CLUSTER_FIT_ITERATIONS 8
+
+struct dxt_color_set
+{
+    float points[16][3];
+    UINT count;
+    BOOL transparent; /* DXT1 block with pixels that need the transparent palette entry */
+};
+
+static void init_dxt_color_set(struct dxt_color_set *set, const DWORD pixels[16], BOOL dxt1)
+{
+    UINT i;
+
+    set->count = 0;
+    set->transparent = FALSE;
+    for (i = 0; i < 16; ++i)
+    {
+        if (dxt1 && pixels[i] < 0x80000000)
+        {
+            set->transparent = TRUE;
+            continue;
+        }
+        set->points[set->count][0] = (pixels[i] >> 16) & 0xff;
+        set->points[set->count][1] = (pixels[i] >> 8) & 0xff;
+        set->points[set->count][2] = pixels[i] & 0xff;
+        ++set->count;
+    }
+}
+
+static inline WORD quantize_r5g6b5(const float c[3])
+{
+    return (WORD)((UINT)(std::clamp(c[0], 0.0f, 255.0f) * 31.0f / 255.0f + 0.5f) << 11
+                  | (UINT)(std::clamp(c[1], 0.0f, 255.0f) * 63.0f / 255.0f + 0.5f) << 5
+                  | (UINT)(std::clamp(c[2], 0.0f, 255.0f) * 31.0f / 255.0f + 0.5f));
+}
+
+static inline void snap_r5g6b5(float c[3])
+{
+    DWORD color = expand_r5g6b5(quantize_r5g6b5(c));
+
+    c[0] = (color >> 16) & 0xff;
+    c[1] = (color >> 8) & 0xff;
+    c[2] = color & 0xff;
+}
+
+/* Principal axis of the block colors, by power iteration on their covariance. */
+static void get_dxt_color_axis(const struct dxt_color_set *set, float axis[3])
+{
+    float mean[3] = {0.0f, 0.0f, 0.0f}, cov[3][3] = {}, v[3], m;
+    UINT i, j, k;
+
+    for (i = 0; i < set->count; ++i)
+        for (j = 0; j < 3; ++j)
+            mean[j] += set->points[i][j] / set->count;
+    for (i = 0; i < set->count; ++i)
+        for (j = 0; j < 3; ++j)
+            for (k = 0; k < 3; ++k)
+                cov[j][k] += (set->points[i][j] - mean[j]) * (set->points[i][k] - mean[k]);
+
+    /* start from the row with the largest variance, (1, 1, 1) can be orthogonal to the axis */
+    k = cov[1][1] > cov[0][0] ? 1 : 0;
+    if (cov[2][2] > cov[k][k])
+        k = 2;
+    if (cov[k][k] <= 0.0f)
+    {
+        axis[0] = axis[1] = axis[2] = 1.0f;
+        return;
+    }
+    memcpy(axis, cov[k], sizeof(cov[k]));
+    for (i = 0; i < 8; ++i)
+    {
+        for (j = 0; j < 3; ++j)
+            v[j] = cov[j][0] * axis[0] + cov[j][1] * axis[1] + cov[j][2] * axis[2];
+        m = std::max({fabsf(v[0]), fabsf(v[1]), fabsf(v[2])});
+        if (m <= 0.0f)
+            break;
+        for (j = 0; j < 3; ++j)
+            axis[j] = v[j] / m;
+    }
+}
+
+static inline float dot_dxt_color(const float a[3], const float b[3])
+{
+    return a[0] * b[0] + a[1] * b[1] + a[2] * b[2];
+}
+
+/* Endpoints at the outermost colors along the axis. */
+static void range_fit_dxt_colors(const struct dxt_color_set *set, const float axis[3], float start[3], float end[3])
+{
+    float d, min_d, max_d;
+    UINT i, min_i = 0, max_i = 0;
+
+    min_d = max_d = dot_dxt_color(set->points[0], axis);
+    for (i = 1; i < set->count; ++i)
+    {
+        d = dot_dxt_color(set->points[i], axis);
+        if (d < min_d)
+        {
+            min_d = d;
+            min_i = i;
+        }
+        if (d > max_d)
+        {
+            max_d = d;
+            max_i = i;
+        }
+    }
+    memcpy(start, set->points[min_i], sizeof(set->points[0]));
+    memcpy(end, set->points[max_i], sizeof(set->points[0]));
+}
+
+/* Least squares endpoints for every ordered split of the colors over the 3 or 4
+ * palette entries, reordering along the best endpoints until that stops helping.
+ * Returns FALSE if no split has a solution. */
+static BOOL cluster_fit_dxt_colors(const struct dxt_color_set *set, const float initial_axis[3], BOOL three_color,
+                                   float start[3], float end[3])
+{
+    const float w1 = three_color ? 1.0f / 2.0f : 2.0f / 3.0f, w2 = three_color ? 0.0f : 1.0f / 3.0f;
+    float axis[3], dots[16], sums[17][3], best_error = 0.0f;
+    UINT n = set->count, i, j, k, c, iteration;
+    BYTE order[16], last_order[16];
+    BOOL found = FALSE;
+
+    memcpy(axis, initial_axis, sizeof(axis));
+    for (iteration = 0; iteration < DXT_CLUSTER_FIT_ITERATIONS; ++iteration)
+    {
+        BOOL improved = FALSE;
+
+        for (i = 0; i < n; ++i)
+        {
+            dots[i] = dot_dxt_color(set->points[i], axis);
+            order[i] = i;
+        }
+        std::sort(order, order + n, [&](BYTE a, BYTE b) { return dots[a] < dots[b]; });
+        if (iteration && !memcmp(order, last_order, n))
+            break;
+        memcpy(last_order, order, n);
+        for (c = 0; c < 3; ++c)
+            sums[0][c] = 0.0f;
+        for (i = 0; i < n; ++i)
+            for (c = 0; c < 3; ++c)
+                sums[i + 1][c] = sums[i][c] + set->points[order[i]][c];
+
+        /* colors [0, i) get weight 1 for a, [i, j) w1, [j, k) w2 and [k, n) 0 */
+        for (i = 0; i <= n; ++i)
+            for (j = i; j <= n; ++j)
+                for (k = j; k <= (three_color ? j : n); ++k)
+                {
+                    float alpha2 = i + w1 * w1 * (j - i) + w2 * w2 * (k - j);
+                    float beta2 = (1.0f - w1) * (1.0f - w1) * (j - i) + (1.0f - w2) * (1.0f - w2) * (k - j) + (n - k);
+                    float alphabeta = w1 * (1.0f - w1) * (j - i) + w2 * (1.0f - w2) * (k - j);
+                    float det = alpha2 * beta2 - alphabeta * alphabeta;
+                    float a[3], b[3], alphax[3], betax[3], error = 0.0f;
+
+                    if (det < 1e-4f)
+                        continue;
+                    for (c = 0; c < 3; ++c)
+                    {
+                        alphax[c] = sums[i][c] + w1 * (sums[j][c] - sums[i][c]) + w2 * (sums[k][c] - sums[j][c]);
+                        betax[c] = sums[n][c] - alphax[c];
+                        a[c] = (alphax[c] * beta2 - betax[c] * alphabeta) / det;
+                        b[c] = (betax[c] * alpha2 - alphax[c] * alphabeta) / det;
+                    }
+                    /* snapping to the grid can only make the least squares error worse */
+                    for (c = 0; c < 3; ++c)
+                        error += a[c] * a[c] * alpha2 + b[c] * b[c] * beta2
+                                 + 2.0f * (a[c] * b[c] * alphabeta - a[c] * alphax[c] - b[c] * betax[c]);
+                    if (found && error >= best_error)
+                        continue;
+                    snap_r5g6b5(a);
+                    snap_r5g6b5(b);
+                    error = 0.0f;
+                    for (c = 0; c < 3; ++c)
+                        error += a[c] * a[c] * alpha2 + b[c] * b[c] * beta2
+                                 + 2.0f * (a[c] * b[c] * alphabeta - a[c] * alphax[c] - b[c] * betax[c]);
+                    if (!found || error < best_error)
+                    {
+                        memcpy(start, a, sizeof(a));
+                        memcpy(end, b, sizeof(b));
+                        best_error = error;
+                        found = improved = TRUE;
+                    }
+                }
+
+        if (!improved)
+            break;
+        for (c = 0; c < 3; ++c)
+            axis[c] = end[c] - start[c];
+        if (!axis[0] && !axis[1] && !axis[2])
+            break;
+    }
+    return found;
+}
+
+/* Writes the endpoints and the closest palette entry of each pixel, returns the squared error. */
+static UINT encode_dxt_color_endpoints(const DWORD pixels[16], BOOL dxt1, const float start[3], const float end[3],
+                                      BOOL three_color, BYTE *block)
+{
+    WORD c0 = quantize_r5g6b5(start), c1 = quantize_r5g6b5(end);
+    UINT i, j, c, entries, error = 0;
+    DWORD palette[4], indices = 0;
+
+    if (three_color ? c0 > c1 : c0 < c1)
+        std::swap(c0, c1);
+    block[0] = c0 & 0xff;
+    block[1] = c0 >> 8;
+    block[2] = c1 & 0xff;
+    block[3] = c1 >> 8;
+    get_dxt_color_palette(block, dxt1, palette);
+    entries = dxt1 && c0 <= c1 ? 3 : 4;
+
+    for (i = 0; i < 16; ++i)
+    {
+        UINT best = 3, best_error = ~0u;
+
+        if (dxt1 && pixels[i] < 0x80000000)
+        {
+            indices |= 3u << (i * 2);
+            continue;
+        }
+        for (j = 0; j < entries; ++j)
+        {
+            UINT e = 0;
+
+            for (c = 0; c < 24; c += 8)
+            {
+                int d = (int)((pixels[i] >> c) & 0xff) - (int)((palette[j] >> c) & 0xff);
+
+                e += d * d;
+            }
+            if (e < best_error)
+            {
+                best = j;
+                best_error = e;
+            }
+        }
+        indices |= best << (i * 2);
+        error += best_error;
+    }
+    for (i = 0; i < 4; ++i)
+        block[4 + i] = indices >> (i * 8);
+    return error;
+}
+
+static void encode_dxt_color_block(const DWORD pixels[16], BOOL dxt1, BOOL fast, BYTE *block)
+{
+    UINT error, candidate_error;
+    struct dxt_color_set set;
+    float axis[3], start[3], end[3];
+    BYTE candidate[8];
+
+    init_dxt_color_set(&set, pixels, dxt1);
+    if (!set.count)
+    {
+        /* black endpoints in 3 color mode, every pixel transparent */
+        memset(block, 0, 4);
+        memset(block + 4, 0xff, 4);
+        return;
+    }
+    get_dxt_color_axis(&set, axis);
+    range_fit_dxt_colors(&set, axis, start, end);
+    error = encode_dxt_color_endpoints(pixels, dxt1, start, end, set.transparent, block);
+    if (fast || !error)
+        return;
+
+    if (!set.transparent && cluster_fit_dxt_colors(&set, axis, FALSE, start, end)
+        && (candidate_error = encode_dxt_color_endpoints(pixels, dxt1, start, end, FALSE, candidate)) < error)
+    {
+        memcpy(block, candidate, sizeof(candidate));
+        error = candidate_error;
+    }
+    /* DXT1 can also trade the fourth color for the midpoint */
+    if (dxt1 && cluster_fit_dxt_colors(&set, axis, TRUE, start, end)
+        && encode_dxt_color_endpoints(pixels, dxt1, start, end, TRUE, candidate) < error)
+        memcpy(block, candidate, sizeof(candidate));
+}
+
+static void encode_dxt3_alpha_block(const BYTE alpha[16], BYTE *block)
+{
+    UINT i;
+
+    for (i = 0; i < 8; ++i)
+        block[i] = (alpha[i * 2] * 15 + 127) / 255 | ((alpha[i * 2 + 1] * 15 + 127) / 255) << 4;
+}
+
+/* Writes the endpoints and the closest palette entry of each pixel, returns the squared error. */
+static UINT encode_dxt5_alpha_endpoints(const BYTE alpha[16], BYTE a0, BYTE a1, BYTE *block)
+{
+    unsigned long long bits = 0;
+    UINT i, j, error = 0;
+    BYTE palette[8];
+
+    block[0] = a0;
+    block[1] = a1;
+    get_dxt5_alpha_palette(block, palette);
+    for (i = 0; i < 16; ++i)
+    {
+        UINT best = 0, best_error = ~0u;
+
+        for (j = 0; j < 8; ++j)
+        {
+            UINT e = (alpha[i] - palette[j]) * (alpha[i] - palette[j]);
+
+            if (e < best_error)
+            {
+                best = j;
+                best_error = e;
+            }
+        }
+        bits |= (unsigned long long)best << (i * 3);
+        error += best_error;
+    }
+    for (i = 0; i < 6; ++i)
+        block[2 + i] = bits >> (i * 8);
+    return error;
+}
+
+/* The 8 entry mode spans min to max, the 6 entry mode spans the values
+ * between 0 and 255 and has exact 0 and 255 entries. */
+static void encode_dxt5_alpha_block(const BYTE alpha[16], BOOL fast, BYTE *block)
+{
+    BYTE min = 0xff, max = 0, inner_min = 0xff, inner_max = 0, candidate[8];
+    UINT i, error;
+
+    for (i = 0; i < 16; ++i)
+    {
+        min = std::min(min, alpha[i]);
+        max = std::max(max, alpha[i]);
+        if (alpha[i] && alpha[i] != 0xff)
+        {
+            inner_min = std::min(inner_min, alpha[i]);
+            inner_max = std::max(inner_max, alpha[i]);
+        }
+    }
+    error = encode_dxt5_alpha_endpoints(alpha, max, min, block);
+    if (fast || !error || inner_min > inner_max)
+        return;
+    if (encode_dxt5_alpha_endpoints(alpha, inner_min, inner_max, candidate) < error)
+        memcpy(block, candidate, sizeof(candidate));
+}
+
+static inline DWORD premultiply_argb(DWORD pixel)
+{
+    DWORD a = pixel >> 24, out = pixel & 0xff000000;
+    UINT c;
+
+    for (c = 0; c < 24; c += 8)
+        out |= ((((pixel >> c) & 0xff) * a + 127) / 255) << c;
+    return out;
+}
+
+/* dxt is 1 for DXT1, 3 for DXT2/DXT3 and 5 for DXT4/DXT5. */
+template<UINT dxt, BOOL premultiplied, BOOL fast>
+static void encode_dxt_blocks(const DWORD *src, UINT pitch, BYTE *blocks, UINT block_count)
+{
+    constexpr UINT block_size = dxt == 1 ? 8 : 16;
+    UINT b, i;
+
+    for (b = 0; b < block_count; ++b)
+    {
+        BYTE *block = blocks + b * block_size;
+        DWORD pixels[16];
+        BYTE alpha[16];
+
+        for (i = 0; i < 16; ++i)
+        {
+            pixels[i] = src[i / 4 * pitch + b * 4 + i % 4];
+            if constexpr (premultiplied)
+                pixels[i] = premultiply_argb(pixels[i]);
+            alpha[i] = pixels[i] >> 24;
+        }
+        if constexpr (dxt == 3)
+            encode_dxt3_alpha_block(alpha, block);
+        else if constexpr (dxt == 5)
+            encode_dxt5_alpha_block(alpha, fast, block);
+        encode_dxt_color_block(pixels, dxt == 1, fast, block + block_size - 8);
+    }
+}
+
+static dxt_encode_func get_dxt_encode_func(D3DFORMAT format, BOOL fast)
+{
+    switch (format)
+    {
+        case D3DFMT_DXT1: return fast ? encode_dxt_blocks<1, FALSE, TRUE> : encode_dxt_blocks<1, FALSE, FALSE>;
+        case D3DFMT_DXT2: return fast ? encode_dxt_blocks<3, TRUE, TRUE> : encode_dxt_blocks<3, TRUE, FALSE>;
+        case D3DFMT_DXT3: return fast ? encode_dxt_blocks<3, FALSE, TRUE> : encode_dxt_blocks<3, FALSE, FALSE>;
+        case D3DFMT_DXT4: return fast ? encode_dxt_blocks<5, TRUE, TRUE> : encode_dxt_blocks<5, TRUE, FALSE>;
+        case D3DFMT_DXT5: return fast ? encode_dxt_blocks<5, FALSE, TRUE> : encode_dxt_blocks<5, FALSE, FALSE>;
+        default: return NULL;
+    }
+}
+
+/************************************************************
+ * conversion plans
+ *
+ * Everything that depends on the format pair is resolved once per
+ * load call, so the row loops below don't look at the formats again.
+ */
+void init_conversion_plan(const struct pixel_format_desc *src_format, const struct pixel_format_desc *dst_format,
+                          D3DCOLOR color_key, const PALETTEENTRY *palette, struct conversion_plan *plan)
+{
+    plan->block_format = NULL;
+    plan->decode = NULL;
+    plan->block_x = plan->block_y = 0;
+    if (src_format->type == FORMAT_DXT)
+    {
+        plan->block_format = src_format;
+        plan->decode = get_dxt_decode_func(src_format->format);
+        src_format = &formats[find_format_index(D3DFMT_A8R8G8B8)];
+    }
+    plan->src_format = src_format;
+    plan->dst_format = dst_format;
+    plan->color_key = color_key;
+    plan->palette = palette;
+    plan->argb_row = argb_plan_table[src_format - formats][dst_format - formats];
+#ifdef ARGB_SIMD
+    plan->simd_row = NULL;
+    if (init_argb_simd_info(src_format, dst_format, color_key, palette, &plan->simd_info))
+        plan->simd_row = get_argb_row_func(src_format->bytes_per_pixel, dst_format->bytes_per_pixel);
+    else if (!plan->argb_row && !color_key)
+        plan->simd_row = get_float_row_func(src_format, dst_format);
+#endif
+}
+
+static void convert_vec4_row(const struct conversion_plan *plan, const BYTE *src, BYTE *dst, UINT width)
+{
+    static const struct pixel_format_desc *ck_format = &formats[find_format_index(D3DFMT_A8R8G8B8)];
+    const struct pixel_format_desc *src_format = plan->src_format, *dst_format = plan->dst_format;
+    UINT x;
+
+    for (x = 0; x < width; x++)
+    {
+        struct vec4 color, tmp;
+
+        format_to_vec4(src_format, src, &color);
+        if (src_format->to_rgba)
+            src_format->to_rgba(&color, &tmp, plan->palette);
+        else
+            tmp = color;
+
+        if (plan->color_key)
+        {
+            DWORD ck_pixel;
+
+            format_from_vec4(ck_format, &tmp, (BYTE *)&ck_pixel);
+            if (ck_pixel == plan->color_key)
+                tmp.w = 0.0f;
+        }
+
+        if (dst_format->from_rgba)
+            dst_format->from_rgba(&tmp, &color);
+        else
+            color = tmp;
+
+        format_from_vec4(dst_format, &color, dst);
+
+        src += src_format->bytes_per_pixel;
+        dst += dst_format->bytes_per_pixel;
+    }
+}
+
+/* Converts width contiguous pixels, the SIMD kernel handles whole vectors and the plan the rest. */
+static inline void convert_plan_row(const struct conversion_plan *plan, const BYTE *src, BYTE *dst, UINT width)
+{
+    UINT x = 0;
+
+#ifdef ARGB_SIMD
+    if (plan->simd_row)
+        x = plan->simd_row(src, dst, width, &plan->simd_info);
+#endif
+    src += x * plan->src_format->bytes_per_pixel;
+    dst += x * plan->dst_format->bytes_per_pixel;
+    if (plan->argb_row)
+        plan->argb_row(src, dst, width - x, plan->color_key);
+    else
+        convert_vec4_row(plan, src, dst, width - x);
+}
+
+/************************************************************
+ * source rows
+ *
+ * Hands out source rows in plan->src_format. Compressed rows are decoded
+ * into a strip of four rows per worker, which is reused while the
+ * following rows fall into the same row of blocks.
+ */
+struct source_rows
+{
+    const struct conversion_plan *plan;
+    UINT pitch;                /* pixels per decoded row */
+    DWORD *strips;
+    const BYTE **strip_blocks; /* row of blocks held by each worker's strip */
+};
+
+static HRESULT init_source_rows(struct source_rows *rows, const struct conversion_plan *plan, UINT width, UINT worker_count)
+{
+    UINT i;
+
+    rows->plan = plan;
+    rows->strips = NULL;
+    if (!plan->decode)
+        return D3D_OK;
+
+    rows->pitch = (plan->block_x + width + 3) & ~3u;
+    if (!(rows->strips = (DWORD *)malloc(worker_count * (4 * rows->pitch * sizeof(*rows->strips)
+                                                          + sizeof(*rows->strip_blocks)))))
+        return E_OUTOFMEMORY;
+    rows->strip_blocks = (const BYTE **)(rows->strips + worker_count * 4 * rows->pitch);
+    for (i = 0; i < worker_count; ++i)
+        rows->strip_blocks[i] = NULL;
+    return D3D_OK;
+}
+
+static inline const BYTE *get_source_row(struct source_rows *rows, const BYTE *slice, UINT row_pitch, UINT y, UINT worker)
+{
+    const struct conversion_plan *plan = rows->plan;
+    const BYTE *blocks;
+    DWORD *strip;
+
+    if (!plan->decode)
+        return slice + y * row_pitch;
+
+    y += plan->block_y;
+    blocks = slice + y / 4 * row_pitch;
+    strip = rows->strips + worker * 4 * rows->pitch;
+    if (rows->strip_blocks[worker] != blocks)
+    {
+        plan->decode(blocks, strip, rows->pitch, rows->pitch / 4);
+        rows->strip_blocks[worker] = blocks;
+    }
+    return (const BYTE *)(strip + (y & 3) * rows->pitch + plan->block_x);
+}
+
+static void free_source_rows(struct source_rows *rows)
+{
+    free(rows->strips);
+}
+
+/* Copies the point sampled source pixels of one row next to each other. */
+template<UINT bpp>
+static void gather_pixels(const BYTE *src, BYTE *dst, const UINT *offsets, UINT width)
+{
+    UINT x;
+
+    for (x = 0; x < width; x++)
+        memcpy(dst + x * bpp, src + offsets[x], bpp);
+}
+
+/************************************************************
+ * row band worker pool
+ *
+ * Large conversions are split into bands of whole rows which the calling
+ * thread and the pool workers take in turns. Every row is written by
+ * exactly one band with the same code as the serial path, so the output
+ * doesn't depend on the number of threads.
+ */
+#define ROW_BAND_BYTES       (256 * 1024) /* about half of a typical L2 */
+#define ROW_BAND_SERIAL_MAX  (1024 * 1024)
+#define ROW_BAND_MAX_WORKERS 15
+
+static thread_local BOOL in_row_band; /* nested jobs run serially, the pool is busy with the outer one */
+
+struct row_band_pool
+{
+    std::mutex submit_mutex; /* one job at a time */
+    std::mutex mutex;
+    std::condition_variable wake, done;
+    std::vector<std::thread> threads;
+    const row_band_func *func = NULL;
+    UINT row_count = 0, band_rows = 0, band_count = 0;
+    std::atomic<UINT> next_band{0};
+    UINT busy = 0;
+    ULONG generation = 0;
+    BOOL quit = FALSE;
+
+    row_band_pool()
+    {
+        int count = std::min(SDL_GetCPUCount() - 1, ROW_BAND_MAX_WORKERS);
+        int i;
+
+        for (i = 0; i < count; ++i)
+            threads.emplace_back(&row_band_pool::worker_main, this, i + 1);
+    }
+
+    ~row_band_pool()
+    {
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            quit = TRUE;
+        }
+        wake.notify_all();
+        for (auto &thread : threads)
+            thread.join();
+    }
+
+    void process_bands(UINT worker)
+    {
+        BOOL nested = in_row_band;
+        UINT band;
+
+        in_row_band = TRUE;
+        while ((band = next_band++) < band_count)
+            (*func)(band * band_rows, std::min((band + 1) * band_rows, row_count), worker);
+        in_row_band = nested;
+    }
+
+    void worker_main(UINT worker)
+    {
+        std::unique_lock<std::mutex> lock(mutex);
+        ULONG seen = 0;
+
+        for (;;)
+        {
+            wake.wait(lock, [&] { return quit || generation != seen; });
+            if (quit)
+                return;
+            seen = generation;
+
+            lock.unlock();
+            process_bands(worker);
+            lock.lock();
+            if (!--busy)
+                done.notify_all();
+        }
+    }
+};
+
+static row_band_pool &get_row_band_pool()
+{
+    static row_band_pool pool;
+
+    return pool;
+}
+
+/* Number of distinct worker indices passed to a row_band_func, for per worker scratch buffers. */
+UINT get_row_band_worker_count()
+{
+    return get_row_band_pool().threads.size() + 1;
+}
+
+/************************************************************
+ * run_row_bands
+ *
+ * Calls func for consecutive ranges covering rows [0, row_count).
+ * Jobs of less than ROW_BAND_SERIAL_MAX bytes, jobs started from inside
+ * a band and all jobs without CONVERSION_THREADS run serially on the
+ * calling thread as a single range.
+ */
+void run_row_bands(UINT row_count, UINT row_bytes, const row_band_func &func)
+{
+    row_band_pool &pool = get_row_band_pool();
+
+    if (pool.threads.empty() || in_row_band || !(conversion_features & CONVERSION_THREADS)
+        || (unsigned long long)row_count * row_bytes <= ROW_BAND_SERIAL_MAX)
+    {
+        func(0, row_count, 0);
+        return;
+    }
+
+    std::lock_guard<std::mutex> submit(pool.submit_mutex);
+    {
+        std::lock_guard<std::mutex> lock(pool.mutex);
+        pool.func = &func;
+        pool.row_count = row_count;
+        pool.band_rows = std::max(1u, ROW_BAND_BYTES / std::max(row_bytes, 1u));
+        pool.band_count = (row_count + pool.band_rows - 1) / pool.band_rows;
+        pool.next_band = 0;
+        pool.busy = pool.threads.size();
+        ++pool.generation;
+    }
+    pool.wake.notify_all();
+    pool.process_bands(0);
+
+    std::unique_lock<std::mutex> lock(pool.mutex);
+    pool.done.wait(lock, [&] { return !pool.busy; });
+    pool.func = NULL;
+}
+
+/************************************************************
+ * streaming row copies
+ *
+ * Uploads are written once and read by the GPU, not the CPU. Above
+ * COPY_STREAM_MIN_BYTES the rows are written with non-temporal stores, so
+ * they go to memory (or a write combined mapping) without evicting the
+ * cache. Each band ends with a store fence, the rows are then visible to
+ * whoever unlocks the surface.
+ */
+#define COPY_STREAM_MIN_BYTES (256 * 1024)
+
+#ifdef ARGB_SIMD
+static void copy_row_stream(BYTE *dst, const BYTE *src, UINT size)
+{
+    UINT head = std::min(size, (UINT)(-(uintptr_t)dst & 15));
+
+    memcpy(dst, src, head);
+    dst += head;
+    src += head;
+    size -= head;
+    for (; size >= 64; size -= 64, src += 64, dst += 64)
+    {
+        __m128i a = _mm_loadu_si128((const __m128i *)src);
+        __m128i b = _mm_loadu_si128((const __m128i *)(src + 16));
+        __m128i c = _mm_loadu_si128((const __m128i *)(src + 32));
+        __m128i d = _mm_loadu_si128((const __m128i *)(src + 48));
+
+        _mm_stream_si128((__m128i *)dst, a);
+        _mm_stream_si128((__m128i *)(dst + 16), b);
+        _mm_stream_si128((__m128i *)(dst + 32), c);
+        _mm_stream_si128((__m128i *)(dst + 48), d);
+    }
+    for (; size >= 16; size -= 16, src += 16, dst += 16)
+        _mm_stream_si128((__m128i *)dst, _mm_loadu_si128((const __m128i *)src));
+    memcpy(dst, src, size);
+}
+#endif /* ARGB_SIMD */
+
+/************************************************************
+ * copy_pixels
+ *
+ * Copies the source buffer to the destination buffer.
+ * Works for any pixel format.
+ * The source and the destination must be block-aligned.
+ */
+void copy_pixels(const BYTE *src, UINT src_row_pitch, UINT src_slice_pitch,
+                 BYTE *dst, UINT dst_row_pitch, UINT dst_slice_pitch, const struct volume *size,
+                 const struct pixel_format_desc *format)
+{
+    UINT row_block_count = (size->width + format->block_width - 1) / format->block_width;
+    UINT row_count = (size->height + format->block_height - 1) / format->block_height;
+    UINT row_bytes = row_block_count * format->block_byte_count;
+#ifdef ARGB_SIMD
+    BOOL stream = use_simd() && (unsigned long long)size->depth * row_count * row_bytes >= COPY_STREAM_MIN_BYTES;
+#endif
+
+    run_row_bands(size->depth * row_count, row_bytes, [&](UINT first_row, UINT last_row, UINT worker)
+    {
+        UINT i;
+
+        for (i = first_row; i < last_row; i++)
+        {
+            UINT slice = i / row_count, row = i % row_count;
+            BYTE *dst_row = dst + slice * dst_slice_pitch + row * dst_row_pitch;
+            const BYTE *src_row = src + slice * src_slice_pitch + row * src_row_pitch;
+
+#ifdef ARGB_SIMD
+            if (stream)
+            {
+                copy_row_stream(dst_row, src_row, row_bytes);
+                continue;
+            }
+#endif
+            memcpy(dst_row, src_row, row_bytes);
+        }
+#ifdef ARGB_SIMD
+        if (stream)
+            _mm_sfence();
+#endif
+    });
+}
+
+/************************************************************
+ * convert_argb_pixels
+ *
+ * Copies the source buffer to the destination buffer, performing
+ * any necessary format conversion and color keying.
+ * Pixels outsize the source rect are blacked out.
+ */
+HRESULT convert_argb_pixels(const BYTE *src, UINT src_row_pitch, UINT src_slice_pitch, const struct volume *src_size,
+                            BYTE *dst, UINT dst_row_pitch, UINT dst_slice_pitch, const struct volume *dst_size,
+                            const struct conversion_plan *plan)
+{
+    UINT dst_bpp = plan->dst_format->bytes_per_pixel;
+    UINT min_width, min_height, min_depth;
+    struct source_rows rows;
+    HRESULT hr;
+
+//    TRACE("src %p, src_row_pitch %u, src_slice_pitch %u, src_size %p, dst %p, "
+//          "dst_row_pitch %u, dst_slice_pitch %u, dst_size %p, plan %p.\n",
+//          src, src_row_pitch, src_slice_pitch, src_size, dst, dst_row_pitch, dst_slice_pitch, dst_size, plan);
+
+    min_width = std::min(src_size->width, dst_size->width);
+    min_height = std::min(src_size->height, dst_size->height);
+    min_depth = std::min(src_size->depth, dst_size->depth);
+
+    if (FAILED(hr = init_source_rows(&rows, plan, min_width, get_row_band_worker_count())))
+        return hr;
+
+    run_row_bands(min_depth * min_height, dst_size->width * dst_bpp, [&](UINT first_row, UINT last_row, UINT worker)
+    {
+        UINT i;
+
+        for (i = first_row; i < last_row; i++)
+        {
+            UINT z = i / min_height, y = i % min_height;
+            const BYTE *src_ptr = get_source_row(&rows, src + z * src_slice_pitch, src_row_pitch, y, worker);
+            BYTE *dst_ptr = dst + z * dst_slice_pitch + y * dst_row_pitch;
+
+            convert_plan_row(plan, src_ptr, dst_ptr, min_width);
+
+            if (src_size->width < dst_size->width) /* black out remaining pixels */
+                memset(dst_ptr + min_width * dst_bpp, 0, dst_bpp * (dst_size->width - src_size->width));
+        }
+    });
+
+    if (min_depth && src_size->height < dst_size->height) /* black out remaining pixels */
+        memset(dst + src_size->height * dst_row_pitch, 0, dst_row_pitch * (dst_size->height - src_size->height));
+    if (src_size->depth < dst_size->depth) /* black out remaining pixels */
+        memset(dst + src_size->depth * dst_slice_pitch, 0, dst_slice_pitch * (dst_size->depth - src_size->depth));
+
+    free_source_rows(&rows);
+    return D3D_OK;
+}
+
+/************************************************************
+ * point_filter_argb_pixels
+ *
+ * Copies the source buffer to the destination buffer, performing
+ * any necessary format conversion, color keying and stretching
+ * using a point filter.
+ */
+HRESULT point_filter_argb_pixels(const BYTE *src, UINT src_row_pitch, UINT src_slice_pitch, const struct volume *src_size,
+                                 BYTE *dst, UINT dst_row_pitch, UINT dst_slice_pitch, const struct volume *dst_size,
+                                 const struct conversion_plan *plan)
+{
+    UINT src_bpp = plan->src_format->bytes_per_pixel;
+    UINT worker_count = get_row_band_worker_count();
+    struct source_rows source;
+    UINT *offsets;
+    BYTE *rows;
+    HRESULT hr;
+    UINT x;
+
+//    TRACE("src %p, src_row_pitch %u, src_slice_pitch %u, src_size %p, dst %p, "
+//          "dst_row_pitch %u, dst_slice_pitch %u, dst_size %p, plan %p.\n",
+//          src, src_row_pitch, src_slice_pitch, src_size, dst, dst_row_pitch, dst_slice_pitch, dst_size, plan);
+
+    if (!dst_size->width || !dst_size->height || !dst_size->depth)
+        return D3D_OK;
+
+    /* source byte offsets of the sampled columns, followed by one gathered source row per worker */
+    if (!(offsets = (UINT *)malloc(dst_size->width * (sizeof(*offsets) + src_bpp * worker_count))))
+        return E_OUTOFMEMORY;
+    rows = (BYTE *)(offsets + dst_size->width);
+    if (FAILED(hr = init_source_rows(&source, plan, src_size->width, worker_count)))
+    {
+        free(offsets);
+        return hr;
+    }
+
+    for (x = 0; x < dst_size->width; x++)
+        offsets[x] = (x * src_size->width / dst_size->width) * src_bpp;
+
+    run_row_bands(dst_size->depth * dst_size->height, dst_size->width * plan->dst_format->bytes_per_pixel,
+                  [&](UINT first_row, UINT last_row, UINT worker)
+    {
+        BYTE *row = rows + worker * dst_size->width * src_bpp;
+        UINT i;
+
+        for (i = first_row; i < last_row; i++)
+        {
+            UINT z = i / dst_size->height, y = i % dst_size->height;
+            BYTE *dst_ptr = dst + z * dst_slice_pitch + y * dst_row_pitch;
+            const BYTE *src_row_ptr = get_source_row(&source, src + src_slice_pitch * (z * src_size->depth / dst_size->depth),
+                                                     src_row_pitch, y * src_size->height / dst_size->height, worker);
+
+            switch (src_bpp)
+            {
+                case 1: gather_pixels<1>(src_row_ptr, row, offsets, dst_size->width); break;
+                case 2: gather_pixels<2>(src_row_ptr, row, offsets, dst_size->width); break;
+                case 3: gather_pixels<3>(src_row_ptr, row, offsets, dst_size->width); break;
+                case 4: gather_pixels<4>(src_row_ptr, row, offsets, dst_size->width); break;
+                case 8: gather_pixels<8>(src_row_ptr, row, offsets, dst_size->width); break;
+                default: gather_pixels<16>(src_row_ptr, row, offsets, dst_size->width); break;
+            }
+            convert_plan_row(plan, row, dst_ptr, dst_size->width);
+        }
+    });
+
+    free_source_rows(&source);
+    free(offsets);
+    return D3D_OK;
+}
+
+/************************************************************
+ * compress_dxt_pixels
+ *
+ * Compresses width x height A8R8G8B8 pixels into DXT blocks. src_pitch
+ * is in pixels and the source buffer has to be padded to whole blocks,
+ * the padding is filled by repeating the last column and row.
+ */
+void compress_dxt_pixels(DWORD *src, UINT src_pitch, UINT width, UINT height,
+                         BYTE *dst, UINT dst_pitch, const struct pixel_format_desc *format, BOOL fast)
+{
+    dxt_encode_func encode = get_dxt_encode_func(format->format, fast);
+    UINT block_width = (width + 3) / 4, block_rows = (height + 3) / 4;
+    UINT x, y;
+
+    for (y = 0; y < height; ++y)
+        for (x = width; x < block_width * 4; ++x)
+            src[y * src_pitch + x] = src[y * src_pitch + width - 1];
+    for (y = height; y < block_rows * 4; ++y)
+        memcpy(src + y * src_pitch, src + (height - 1) * src_pitch, block_width * 4 * sizeof(*src));
+
+    /* the row cost stands for the encoding work, which is far more than the bytes touched */
+    run_row_bands(block_rows, block_width * (fast ? 1024 : 16384), [&](UINT first_row, UINT last_row, UINT worker)
+    {
+        UINT i;
+
+        for (i = first_row; i < last_row; ++i)
+            encode(src + i * 4 * src_pitch, src_pitch, dst + i * dst_pitch, block_width);
+    });
+}
+
+/************************************************************
+ * sRGB transfer
+ *
+ * With D3DX_FILTER_SRGB_IN or D3DX_FILTER_SRGB_OUT the resampler works on
+ * linear light. Channels are decoded through a 256 entry table into 15 bit
+ * linear values, which are encoded back through a 4096 entry table indexed
+ * by their top 12 bits. The side without the flag uses tables that only
+ * rescale, alpha is never converted.
+ */
+#define SRGB_ENCODE_SHIFT 3
+
+struct srgb_tables
+{
+    WORD decode[2][256];   /* [srgb] channel to linear, 0 - 255 << 7 */
+    BYTE encode[2][0x8000 >> SRGB_ENCODE_SHIFT]; /* [srgb] linear >> SRGB_ENCODE_SHIFT to channel */
+};
+
+struct srgb_transfer
+{
+    const WORD *decode;
+    const BYTE *encode;
+};
+
+static const struct srgb_tables &get_srgb_tables()
+{
+    static const struct srgb_tables tables = []()
+    {
+        struct srgb_tables t;
+        UINT i;
+
+        for (i = 0; i < 256; ++i)
+        {
+            float c = i / 255.0f;
+
+            c = c <= 0.04045f ? c / 12.92f : powf((c + 0.055f) / 1.055f, 2.4f);
+            t.decode[0][i] = i << 7;
+            t.decode[1][i] = (WORD)floorf(c * (255 << 7) + 0.5f);
+        }
+        /* each entry stands for the center of the values it is indexed by */
+        for (i = 0; i < sizeof(t.encode[0]); ++i)
+        {
+            UINT v = (i << SRGB_ENCODE_SHIFT) + (1 << (SRGB_ENCODE_SHIFT - 1));
+            float c = std::min((float)v / (255 << 7), 1.0f);
+
+            c = c <= 0.0031308f ? c * 12.92f : 1.055f * powf(c, 1.0f / 2.4f) - 0.055f;
+            t.encode[0][i] = std::min((v + (1 << 6)) >> 7, 255u);
+            t.encode[1][i] = (BYTE)floorf(c * 255.0f + 0.5f);
+        }
+        return t;
+    }();
+
+    return tables;
+}
+
+static BOOL get_srgb_transfer(DWORD filter, struct srgb_transfer *transfer)
+{
+    if (!(filter & D3DX_FILTER_SRGB))
+        return FALSE;
+    transfer->decode = get_srgb_tables().decode[!!(filter & D3DX_FILTER_SRGB_IN)];
+    transfer->encode = get_srgb_tables().encode[!!(filter & D3DX_FILTER_SRGB_OUT)];
+    return TRUE;
+}
+
+/************************************************************
+ * resampling for D3DX_FILTER_LINEAR, D3DX_FILTER_TRIANGLE, D3DX_FILTER_BOX
+ * and D3DX_FILTER_KAISER
+ *
+ * Source rows are converted to A8R8G8B8 and filtered horizontally into
+ * rows of 16 bit channels with 7 fractional bits, which are kept in a
+ * small cache. Each destination row then combines the cached rows it
+ * needs and is converted to the destination format. Weights have 14
+ * fractional bits and are computed once per call for each axis. The
+ * negative lobes of the Kaiser filter are clamped after each pass.
+ */
+#define RESAMPLE_WEIGHT_BITS 14
+
+#define KAISER_WIDTH 3.0f /* lobes on each side */
+#define KAISER_ALPHA 4.0f
+
+struct resample_axis
+{
+    UINT taps;      /* taps per destination pixel, even */
+    UINT *index;    /* [dst_size][taps] source pixel indices */
+    short *weight;  /* [dst_size][taps] weights, each set sums to 1 << RESAMPLE_WEIGHT_BITS */
+};
+
+static inline int resample_source_index(int i, int size, BOOL mirror)
+{
+    if (mirror)
+    {
+        while (i < 0 || i >= size)
+            i = i < 0 ? -i - 1 : 2 * size - i - 1;
+        return i;
+    }
+    return std::clamp(i, 0, size - 1);
+}
+
+static float bessel_i0(float x)
+{
+    float sum = 1.0f, term = 1.0f;
+    int k;
+
+    for (k = 1; k < 16; ++k)
+    {
+        term *= (x / (2 * k)) * (x / (2 * k));
+        sum += term;
+    }
+    return sum;
+}
+
+/* t is the distance from the center in units of the radius */
+static float get_kaiser_weight(float t)
+{
+    float x = t * KAISER_WIDTH * (float)M_PI;
+
+    if (fabsf(t) >= 1.0f)
+        return 0.0f;
+    return (x == 0.0f ? 1.0f : sinf(x) / x) * bessel_i0(KAISER_ALPHA * sqrtf(1.0f - t * t)) / bessel_i0(KAISER_ALPHA);
+}
+
+/* Weight of source pixel i for a destination pixel centered at center. */
+static float get_resample_weight(DWORD filter, int i, float center, float radius)
+{
+    float d;
+
+    if (filter == D3DX_FILTER_BOX) /* coverage of the pixel by the box */
+        return std::max(0.0f, std::min(i + 1.0f, center + radius) - std::max((float)i, center - radius));
+    if (filter == D3DX_FILTER_KAISER)
+        return get_kaiser_weight((i + 0.5f - center) / radius);
+
+    d = fabsf(i + 0.5f - center) / radius;
+    return std::max(0.0f, 1.0f - d);
+}
+
+static HRESULT init_resample_axis(struct resample_axis *axis, UINT src_size, UINT dst_size, DWORD filter, BOOL mirror)
+{
+    float scale = (float)src_size / dst_size, radius, *w;
+    UINT x, t, count, best;
+    int first, last;
+
+    if (filter == D3DX_FILTER_LINEAR)
+        radius = 1.0f;
+    else if (filter == D3DX_FILTER_TRIANGLE)
+        radius = std::max(scale, 1.0f);
+    else if (filter == D3DX_FILTER_KAISER)
+        radius = std::max(scale, 1.0f) * KAISER_WIDTH;
+    else
+        radius = std::max(scale, 1.0f) * 0.5f;
+
+    /* the widest footprint, without the pixels with a zero weight on either end */
+    axis->taps = filter == D3DX_FILTER_POINT ? 1 : 0;
+    for (x = 0; x < dst_size && filter != D3DX_FILTER_POINT; ++x)
+    {
+        float center = (x + 0.5f) * scale;
+
+        for (first = (int)floorf(center - radius - 0.5f); get_resample_weight(filter, first, center, radius) == 0.0f; ++first);
+        for (last = (int)ceilf(center + radius); get_resample_weight(filter, last, center, radius) == 0.0f; --last);
+        axis->taps = std::max(axis->taps, (UINT)(last - first + 1));
+    }
+    axis->taps = (axis->taps + 1) & ~1u;
+
+    axis->index = (UINT *)malloc(dst_size * axis->taps * (sizeof(*axis->index) + sizeof(*axis->weight))
+                                 + axis->taps * sizeof(*w));
+    if (!axis->index)
+        return E_OUTOFMEMORY;
+    w = (float *)(axis->index + dst_size * axis->taps);
+    axis->weight = (short *)(w + axis->taps);
+
+    for (x = 0; x < dst_size; ++x)
+    {
+        UINT *index = axis->index + x * axis->taps;
+        short *weight = axis->weight + x * axis->taps;
+        float center = (x + 0.5f) * scale, sum = 0.0f;
+        int total = 0;
+
+        if (filter == D3DX_FILTER_POINT) /* the pixel point_filter_argb_pixels takes */
+        {
+            first = last = x * src_size / dst_size;
+            sum = w[0] = 1.0f;
+        }
+        else
+        {
+            for (first = (int)floorf(center - radius - 0.5f); get_resample_weight(filter, first, center, radius) == 0.0f; ++first);
+            for (last = (int)ceilf(center + radius); get_resample_weight(filter, last, center, radius) == 0.0f; --last);
+            for (t = 0; t < (UINT)(last - first + 1); ++t)
+                sum += w[t] = get_resample_weight(filter, first + t, center, radius);
+        }
+        count = last - first + 1;
+
+        best = 0;
+        for (t = 0; t < count; ++t)
+        {
+            index[t] = resample_source_index(first + t, src_size, mirror);
+            weight[t] = (short)floorf(w[t] / sum * (1 << RESAMPLE_WEIGHT_BITS) + 0.5f);
+            total += weight[t];
+            if (weight[t] > weight[best])
+                best = t;
+        }
+        /* rounding leftovers go to the largest weight */
+        weight[best] += (1 << RESAMPLE_WEIGHT_BITS) - total;
+
+        /* padding repeats the last pixel, which keeps the vertical taps in the row cache */
+        for (; t < axis->taps; ++t)
+        {
+            index[t] = index[count - 1];
+            weight[t] = 0;
+        }
+    }
+    return D3D_OK;
+}
+
+/* Filters one A8R8G8B8 row into four 16 bit channels per pixel, with 7 fractional bits. */
+static void resample_row_h(const DWORD *src, WORD *dst, UINT width, const struct resample_axis *axis)
+{
+    UINT x, t, c;
+
+    for (x = 0; x < width; ++x)
+    {
+        const UINT *index = axis->index + x * axis->taps;
+        const short *weight = axis->weight + x * axis->taps;
+
+        for (c = 0; c < 4; ++c)
+        {
+            int sum = 1 << 6;
+
+            for (t = 0; t < axis->taps; ++t)
+                sum += (int)((src[index[t]] >> (c * 8)) & 0xff) * weight[t];
+            dst[x * 4 + c] = std::clamp(sum >> 7, 0, 0x7fff);
+        }
+    }
+}
+
+/* Combines the rows of one destination row into A8R8G8B8 pixels. */
+static void resample_row_v(const WORD *const *rows, const short *weight, UINT taps, DWORD *dst, UINT width)
+{
+    UINT i, t;
+
+    for (i = 0; i < width * 4; ++i)
+    {
+        int sum = 1 << 20;
+
+        for (t = 0; t < taps; ++t)
+            sum += rows[t][i] * weight[t];
+        ((BYTE *)dst)[i] = std::clamp(sum >> 21, 0, 255);
+    }
+}
+
+/* The sRGB versions keep linear values in the rows, the table lookups stay scalar. */
+static void resample_row_h_srgb(const DWORD *src, WORD *dst, UINT width, const struct resample_axis *axis,
+                                const struct srgb_transfer *transfer)
+{
+    UINT x, t, c;
+
+    for (x = 0; x < width; ++x)
+    {
+        const UINT *index = axis->index + x * axis->taps;
+        const short *weight = axis->weight + x * axis->taps;
+
+        for (c = 0; c < 4; ++c)
+        {
+            int sum = 1 << 13;
+
+            for (t = 0; t < axis->taps; ++t)
+            {
+                BYTE v = (src[index[t]] >> (c * 8)) & 0xff;
+
+                sum += (c == 3 ? v << 7 : transfer->decode[v]) * weight[t];
+            }
+            dst[x * 4 + c] = std::clamp(sum >> 14, 0, 0x7fff);
+        }
+    }
+}
+
+static void resample_row_v_srgb(const WORD *const *rows, const short *weight, UINT taps, DWORD *dst, UINT width,
+                                const struct srgb_transfer *transfer)
+{
+    UINT i, t;
+
+    for (i = 0; i < width * 4; ++i)
+    {
+        int sum = 0;
+
+        for (t = 0; t < taps; ++t)
+            sum += rows[t][i] * weight[t];
+        if ((i & 3) == 3)
+            ((BYTE *)dst)[i] = std::clamp((sum + (1 << 20)) >> 21, 0, 255);
+        else
+            ((BYTE *)dst)[i] = transfer->encode[std::clamp((sum + (1 << 13)) >> 14, 0, 0x7fff) >> SRGB_ENCODE_SHIFT];
+    }
+}
+
+#ifdef ARGB_SIMD
+
+/* The SSE2 versions pair up taps for pmaddwd, the results are identical. */
+static void resample_row_h_sse2(const DWORD *src, WORD *dst, UINT width, const struct resample_axis *axis)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi32(1 << 6);
+    UINT x, t;
+
+    for (x = 0; x < width; ++x)
+    {
+        const UINT *index = axis->index + x * axis->taps;
+        const short *weight = axis->weight + x * axis->taps;
+        __m128i sum = round;
+
+        for (t = 0; t < axis->taps; t += 2)
+        {
+            __m128i p = _mm_unpacklo_epi8(_mm_cvtsi32_si128(src[index[t]]), _mm_cvtsi32_si128(src[index[t + 1]]));
+            int w;
+
+            memcpy(&w, weight + t, sizeof(w));
+            sum = _mm_add_epi32(sum, _mm_madd_epi16(_mm_unpacklo_epi8(p, zero), _mm_set1_epi32(w)));
+        }
+        sum = _mm_srai_epi32(sum, 7);
+        sum = _mm_max_epi16(_mm_packs_epi32(sum, sum), zero);
+        _mm_storel_epi64((__m128i *)(dst + x * 4), sum);
+    }
+}
+
+static void resample_row_v_sse2(const WORD *const *rows, const short *weight, UINT taps, DWORD *dst, UINT width)
+{
+    const __m128i round = _mm_set1_epi32(1 << 20);
+    UINT i, t, count = width * 4;
+
+    for (i = 0; i + 8 <= count; i += 8)
+    {
+        __m128i lo = round, hi = round;
+
+        for (t = 0; t < taps; t += 2)
+        {
+            __m128i a = _mm_loadu_si128((const __m128i *)(rows[t] + i));
+            __m128i b = _mm_loadu_si128((const __m128i *)(rows[t + 1] + i));
+            __m128i w;
+            int pair;
+
+            memcpy(&pair, weight + t, sizeof(pair));
+            w = _mm_set1_epi32(pair);
+            lo = _mm_add_epi32(lo, _mm_madd_epi16(_mm_unpacklo_epi16(a, b), w));
+            hi = _mm_add_epi32(hi, _mm_madd_epi16(_mm_unpackhi_epi16(a, b), w));
+        }
+        lo = _mm_packs_epi32(_mm_srai_epi32(lo, 21), _mm_srai_epi32(hi, 21));
+        _mm_storel_epi64((__m128i *)((BYTE *)dst + i), _mm_packus_epi16(lo, lo));
+    }
+    for (; i < count; ++i)
+    {
+        int sum = 1 << 20;
+
+        for (t = 0; t < taps; ++t)
+            sum += rows[t][i] * weight[t];
+        ((BYTE *)dst)[i] = std::clamp(sum >> 21, 0, 255);
+    }
+}
+
+#endif /* ARGB_SIMD */
+
+/************************************************************
+ * 2:1 box reduction
+ *
+ * The common case of mip generation: each destination pixel is the
+ * rounded average of a 2x2 block. The result is identical to the
+ * separable D3DX_FILTER_BOX resampling, also with an sRGB transfer.
+ * Rows are done in bands.
+ */
+static void downsample_box_row(const DWORD *a, const DWORD *b, DWORD *dst, UINT width)
+{
+    UINT x, c;
+
+    for (x = 0; x < width; ++x)
+    {
+        DWORD pixel = 0;
+
+        for (c = 0; c < 32; c += 8)
+        {
+            DWORD sum = ((a[2 * x] >> c) & 0xff) + ((a[2 * x + 1] >> c) & 0xff)
+                        + ((b[2 * x] >> c) & 0xff) + ((b[2 * x + 1] >> c) & 0xff);
+
+            pixel |= ((sum + 2) >> 2) << c;
+        }
+        dst[x] = pixel;
+    }
+}
+
+/* Averages linear values, rounded the way the two resampling passes do. */
+static void downsample_box_row_srgb(const DWORD *a, const DWORD *b, DWORD *dst, UINT width,
+                                    const struct srgb_transfer *transfer)
+{
+    const WORD *decode = transfer->decode;
+    UINT x, c;
+
+    for (x = 0; x < width; ++x)
+    {
+        DWORD pixel = (((a[2 * x] >> 24) + (a[2 * x + 1] >> 24) + (b[2 * x] >> 24) + (b[2 * x + 1] >> 24) + 2) >> 2) << 24;
+
+        for (c = 0; c < 24; c += 8)
+        {
+            UINT top = (decode[(a[2 * x] >> c) & 0xff] + decode[(a[2 * x + 1] >> c) & 0xff] + 1) >> 1;
+            UINT bottom = (decode[(b[2 * x] >> c) & 0xff] + decode[(b[2 * x + 1] >> c) & 0xff] + 1) >> 1;
+
+            pixel |= (DWORD)transfer->encode[((top + bottom + 1) >> 1) >> SRGB_ENCODE_SHIFT] << c;
+        }
+        dst[x] = pixel;
+    }
+}
+
+#ifdef ARGB_SIMD
+
+static void downsample_box_row_sse2(const DWORD *a, const DWORD *b, DWORD *dst, UINT width)
+{
+    const __m128i zero = _mm_setzero_si128();
+    const __m128i round = _mm_set1_epi16(2);
+    UINT x;
+
+    for (x = 0; x + 2 <= width; x += 2)
+    {
+        __m128i pa = _mm_loadu_si128((const __m128i *)(a + 2 * x));
+        __m128i pb = _mm_loadu_si128((const __m128i *)(b + 2 * x));
+        __m128i lo = _mm_add_epi16(_mm_unpacklo_epi8(pa, zero), _mm_unpacklo_epi8(pb, zero));
+        __m128i hi = _mm_add_epi16(_mm_unpackhi_epi8(pa, zero), _mm_unpackhi_epi8(pb, zero));
+        __m128i sum = _mm_add_epi16(_mm_unpacklo_epi64(lo, hi), _mm_unpackhi_epi64(lo, hi));
+
+        sum = _mm_srli_epi16(_mm_add_epi16(sum, round), 2);
+        _mm_storel_epi64((__m128i *)(dst + x), _mm_packus_epi16(sum, sum));
+    }
+    downsample_box_row(a + 2 * x, b + 2 * x, dst + x, width - x);
+}
+
+#endif /* ARGB_SIMD */
+
+static inline BOOL is_box_reduction(UINT src_size, UINT dst_size)
+{
+    return src_size == dst_size * 2 || (src_size == 1 && dst_size == 1);
+}
+
+static HRESULT downsample_box_argb_pixels(const BYTE *src, UINT src_row_pitch, UINT src_slice_pitch,
+                                          const struct volume *src_size, BYTE *dst, UINT dst_row_pitch,
+                                          UINT dst_slice_pitch, const struct volume *dst_size,
+                                          const struct conversion_plan *to_argb,
+                                          const struct conversion_plan *from_argb,
+                                          const struct srgb_transfer *transfer)
+{
+    void (*box_row)(const DWORD *a, const DWORD *b, DWORD *dst, UINT width) = downsample_box_row;
+    UINT worker_count = get_row_band_worker_count();
+    UINT worker_stride = 2 * (src_size->width + 1) + dst_size->width;
+    struct source_rows source;
+    DWORD *buffer;
+    HRESULT hr;
+    UINT z;
+
+#ifdef ARGB_SIMD
+    static const BOOL has_sse2 = SDL_HasSSE2();
+
+    if (has_sse2 && use_simd())
+        box_row = downsample_box_row_sse2;
+#endif
+
+    if (FAILED(hr = init_source_rows(&source, to_argb, src_size->width, worker_count)))
+        return hr;
+    /* two source rows, padded to two pixels, and a destination row per worker */
+    if (!(buffer = (DWORD *)malloc(worker_count * worker_stride * sizeof(*buffer))))
+    {
+        free_source_rows(&source);
+        return E_OUTOFMEMORY;
+    }
+
+    for (z = 0; z < dst_size->depth; z++)
+    {
+        BYTE *dst_slice_ptr = dst + z * dst_slice_pitch;
+        const BYTE *src_slice_ptr = src + src_slice_pitch * (z * src_size->depth / dst_size->depth);
+
+        run_row_bands(dst_size->height, dst_size->width * 4 * 5, [&](UINT first_row, UINT last_row, UINT worker)
+        {
+            DWORD *row_a = buffer + worker * worker_stride;
+            DWORD *row_b = row_a + src_size->width + 1, *dst_argb = row_b + src_size->width + 1;
+            UINT y;
+
+            for (y = first_row; y < last_row; ++y)
+            {
+                /* a decoded DXT strip is reused, so each row is converted before the next is fetched */
+                convert_plan_row(to_argb, get_source_row(&source, src_slice_ptr, src_row_pitch, 2 * y, worker),
+                                 (BYTE *)row_a, src_size->width);
+                convert_plan_row(to_argb, get_source_row(&source, src_slice_ptr, src_row_pitch,
+                                                         std::min(2 * y + 1, src_size->height - 1), worker),
+                                 (BYTE *)row_b, src_size->width);
+                row_a[src_size->width] = row_a[src_size->width - 1];
+                row_b[src_size->width] = row_b[src_size->width - 1];
+                if (transfer)
+                    downsample_box_row_srgb(row_a, row_b, dst_argb, dst_size->width, transfer);
+                else
+                    box_row(row_a, row_b, dst_argb, dst_size->width);
+                convert_plan_row(from_argb, (const BYTE *)dst_argb, dst_slice_ptr + y * dst_row_pitch, dst_size->width);
+            }
+        });
+    }
+
+    free_source_rows(&source);
+    free(buffer);
+    return D3D_OK;
+}
+
+/************************************************************
+ * resample_argb_pixels
+ *
+ * Copies the source buffer to the destination buffer, performing
+ * any necessary format conversion, color keying and stretching
+ * using a linear, triangle, box or Kaiser filter, or point sampling
+ * for sRGB transfers. to_argb converts the source format to
+ * D3DFMT_A8R8G8B8, from_argb converts that to the destination
+ * format. Slices are point sampled.
+ */
+HRESULT resample_argb_pixels(const BYTE *src, UINT src_row_pitch, UINT src_slice_pitch, const struct volume *src_size,
+                             BYTE *dst, UINT dst_row_pitch, UINT dst_slice_pitch, const struct volume *dst_size,
+                             const struct conversion_plan *to_argb, const struct conversion_plan *from_argb, DWORD filter)
+{
+    void (*row_h)(const DWORD *src, WORD *dst, UINT width, const struct resample_axis *axis) = resample_row_h;
+    void (*row_v)(const WORD *const *rows, const short *weight, UINT taps, DWORD *dst, UINT width) = resample_row_v;
+    struct resample_axis axis_x, axis_y;
+    struct srgb_transfer transfer;
+    UINT row_stride, y, z, t;
+    BOOL srgb;
+    const WORD **rows;
+    DWORD *src_argb, *dst_argb;
+    WORD *cache;
+    struct source_rows source;
+    int *cached;
+    void *buffer;
+    HRESULT hr;
+
+//    TRACE("src %p, src_row_pitch %u, src_slice_pitch %u, src_size %p, dst %p, dst_row_pitch %u, "
+//          "dst_slice_pitch %u, dst_size %p, to_argb %p, from_argb %p, filter %#lx.\n",
+//          src, src_row_pitch, src_slice_pitch, src_size, dst, dst_row_pitch, dst_slice_pitch, dst_size,
+//          to_argb, from_argb, filter);
+
+#ifdef ARGB_SIMD
+    static const BOOL has_sse2 = SDL_HasSSE2();
+
+    if (has_sse2 && use_simd())
+    {
+        row_h = resample_row_h_sse2;
+        row_v = resample_row_v_sse2;
+    }
+#endif
+
+    srgb = get_srgb_transfer(filter, &transfer);
+
+    if ((filter & 0xf) == D3DX_FILTER_BOX && is_box_reduction(src_size->width, dst_size->width)
+        && is_box_reduction(src_size->height, dst_size->height))
+        return downsample_box_argb_pixels(src, src_row_pitch, src_slice_pitch, src_size,
+                                          dst, dst_row_pitch, dst_slice_pitch, dst_size, to_argb, from_argb,
+                                          srgb ? &transfer : NULL);
+
+    if (FAILED(hr = init_source_rows(&source, to_argb, src_size->width, 1)))
+        return hr;
+    if (FAILED(hr = init_resample_axis(&axis_x, src_size->width, dst_size->width,
+                                       filter & 0xf, !!(filter & D3DX_FILTER_MIRROR_U))))
+    {
+        free_source_rows(&source);
+        return hr;
+    }
+    /* square loads share the weights */
+    if (src_size->width == src_size->height && dst_size->width == dst_size->height
+        && !(filter & D3DX_FILTER_MIRROR_U) == !(filter & D3DX_FILTER_MIRROR_V))
+        axis_y = axis_x;
+    else if (FAILED(hr = init_resample_axis(&axis_y, src_size->height, dst_size->height,
+                                            filter & 0xf, !!(filter & D3DX_FILTER_MIRROR_V))))
+    {
+        free(axis_x.index);
+        free_source_rows(&source);
+        return hr;
+    }
+
+    /* cached rows go into slot index % taps, the rows of one destination row never collide */
+    row_stride = (dst_size->width * 4 + 7) & ~7u;
+    buffer = malloc(axis_y.taps * (sizeof(*rows) + row_stride * sizeof(*cache) + sizeof(*cached))
+                    + (src_size->width + dst_size->width) * sizeof(DWORD));
+    if (!buffer)
+    {
+        if (axis_y.index != axis_x.index)
+            free(axis_y.index);
+        free(axis_x.index);
+        free_source_rows(&source);
+        return E_OUTOFMEMORY;
+    }
+    rows = (const WORD **)buffer;
+    cache = (WORD *)(rows + axis_y.taps);
+    src_argb = (DWORD *)(cache + axis_y.taps * row_stride);
+    dst_argb = src_argb + src_size->width;
+    cached = (int *)(dst_argb + dst_size->width);
+
+    for (z = 0; z < dst_size->depth; z++)
+    {
+        BYTE *dst_slice_ptr = dst + z * dst_slice_pitch;
+        const BYTE *src_slice_ptr = src + src_slice_pitch * (z * src_size->depth / dst_size->depth);
+
+        for (t = 0; t < axis_y.taps; ++t)
+            cached[t] = -1;
+
+        for (y = 0; y < dst_size->height; y++)
+        {
+            const UINT *index = axis_y.index + y * axis_y.taps;
+
+            for (t = 0; t < axis_y.taps; ++t)
+            {
+                UINT slot = index[t] % axis_y.taps;
+                WORD *row = cache + slot * row_stride;
+
+                if (cached[slot] != (int)index[t])
+                {
+                    convert_plan_row(to_argb, get_source_row(&source, src_slice_ptr, src_row_pitch, index[t], 0),
+                                     (BYTE *)src_argb, src_size->width);
+                    if (srgb)
+                        resample_row_h_srgb(src_argb, row, dst_size->width, &axis_x, &transfer);
+                    else
+                        row_h(src_argb, row, dst_size->width, &axis_x);
+                    cached[slot] = index[t];
+                }
+                rows[t] = row;
+            }
+            if (srgb)
+                resample_row_v_srgb(rows, axis_y.weight + y * axis_y.taps, axis_y.taps, dst_argb, dst_size->width,
+                                    &transfer);
+            else
+                row_v(rows, axis_y.weight + y * axis_y.taps, axis_y.taps, dst_argb, dst_size->width);
+            convert_plan_row(from_argb, (const BYTE *)dst_argb, dst_slice_ptr + y * dst_row_pitch, dst_size->width);
+        }
+    }
+
+    free_source_rows(&source);
+    free(buffer);
+    if (axis_y.index != axis_x.index)
+        free(axis_y.index);
+    free(axis_x.index);
+    return D3D_OK;
+}
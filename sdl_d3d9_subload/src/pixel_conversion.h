@@ -0,0 +1,186 @@
+/*
+ * pixel format conversion
+ *
+ * The format table, the conversions, the DXT codecs, the resampler and the
+ * row band worker pool behind the D3DX9 surface loaders. Everything works
+ * on memory, so it can be used and measured without a device.
+ */
+
+#ifndef __pixel_conversion__
+#define __pixel_conversion__
+
+#include <functional>
+
+#include <d3d9.h>
+
+#if defined(__x86_64__) || defined(_M_X64) || defined(__i386__) || defined(_M_IX86)
+#define ARGB_SIMD
+#endif
+
+// wine-8.2/include/d3dx9tex.h
+
+#define D3DX_FILTER_NONE                 0x00000001
+#define D3DX_FILTER_POINT                0x00000002
+#define D3DX_FILTER_LINEAR               0x00000003
+#define D3DX_FILTER_TRIANGLE             0x00000004
+#define D3DX_FILTER_BOX                  0x00000005
+#define D3DX_FILTER_MIRROR_U             0x00010000
+#define D3DX_FILTER_MIRROR_V             0x00020000
+#define D3DX_FILTER_MIRROR_W             0x00040000
+#define D3DX_FILTER_MIRROR               0x00070000
+#define D3DX_FILTER_DITHER               0x00080000
+#define D3DX_FILTER_SRGB_IN              0x00200000
+#define D3DX_FILTER_SRGB_OUT             0x00400000
+#define D3DX_FILTER_SRGB                 0x00600000
+
+/* Not a D3DX flag: compress DXT destinations with the range fit only,
+ * for surfaces that are updated every frame. */
+#define D3DX_FILTER_DXT_FAST             0x00800000
+
+/* Not a D3DX filter: Kaiser windowed sinc, sharper than the box for mip chains. */
+#define D3DX_FILTER_KAISER               0x00000006
+
+// wine-8.2/dlls/d3dx9_36/d3dx9_private.h
+
+struct vec4
+{
+    float x, y, z, w;
+};
+
+struct volume
+{
+    UINT width;
+    UINT height;
+    UINT depth;
+};
+
+/* for internal use */
+enum format_type {
+    FORMAT_ARGB,   /* unsigned */
+    FORMAT_ARGBF16,/* float 16 */
+    FORMAT_ARGBF,  /* float */
+    FORMAT_DXT,
+    FORMAT_INDEX,
+    FORMAT_UNKNOWN
+};
+
+struct pixel_format_desc {
+    D3DFORMAT format;
+    BYTE bits[4];
+    BYTE shift[4];
+    UINT bytes_per_pixel;
+    UINT block_width;
+    UINT block_height;
+    UINT block_byte_count;
+    enum format_type type;
+    void (*from_rgba)(const struct vec4 *src, struct vec4 *dst);
+    void (*to_rgba)(const struct vec4 *src, struct vec4 *dst, const PALETTEENTRY *palette);
+};
+
+static inline BOOL is_conversion_from_supported(const struct pixel_format_desc *format)
+{
+    if (format->type == FORMAT_ARGB || format->type == FORMAT_ARGBF16
+        || format->type == FORMAT_ARGBF || format->type == FORMAT_DXT)
+        return TRUE;
+    return !!format->to_rgba;
+}
+
+static inline BOOL is_conversion_to_supported(const struct pixel_format_desc *format)
+{
+    if (format->type == FORMAT_ARGB || format->type == FORMAT_ARGBF16
+        || format->type == FORMAT_ARGBF || format->type == FORMAT_DXT)
+        return TRUE;
+    return !!format->from_rgba;
+}
+
+/* for set_conversion_features */
+#define CONVERSION_SIMD    0x00000001 /* SSE2, SSSE3, AVX2 and F16C kernels */
+#define CONVERSION_THREADS 0x00000002 /* row band workers */
+
+typedef void (*argb_plan_func)(const BYTE *src, BYTE *dst, UINT width, D3DCOLOR color_key);
+
+#ifdef ARGB_SIMD
+struct argb_simd_info
+{
+    UINT src_count, dst_count; /* channels to unpack/pack, missing ones are skipped */
+    DWORD src_shift[4], src_mask[4], src_mul[4], src_rshift[4], src_pos[4];
+    DWORD dst_pos[4], dst_mul[4], dst_rshift[4], dst_shift[4];
+    DWORD src_fill;            /* A8R8G8B8 bits of the channels the source lacks */
+    DWORD dst_luminance_shift;
+    BOOL src_luminance, src_index, dst_luminance;
+    D3DCOLOR color_key;
+    DWORD palette[256];        /* P8 palette converted to A8R8G8B8 */
+};
+
+typedef UINT (*argb_row_func)(const BYTE *src, BYTE *dst, UINT width, const struct argb_simd_info *info);
+#endif
+
+typedef void (*dxt_decode_func)(const BYTE *blocks, DWORD *dst, UINT pitch, UINT block_count);
+
+/* Everything that depends on the format pair, resolved once per load call. */
+struct conversion_plan
+{
+    const struct pixel_format_desc *src_format, *dst_format;
+    const struct pixel_format_desc *block_format; /* DXT source, its rows are decoded to src_format */
+    dxt_decode_func decode;
+    UINT block_x, block_y;     /* offset of the source rect inside its first block */
+    D3DCOLOR color_key;
+    const PALETTEENTRY *palette;
+    argb_plan_func argb_row;   /* NULL if the pair has to go through struct vec4 */
+#ifdef ARGB_SIMD
+    argb_row_func simd_row;    /* ARGB or F16C kernel, NULL if there is none for the pair */
+    struct argb_simd_info simd_info;
+#endif
+};
+
+typedef std::function<void(UINT first_row, UINT last_row, UINT worker)> row_band_func;
+
+static inline BOOL is_resample_supported(const struct pixel_format_desc *format)
+{
+    unsigned int c;
+
+    if (format->type == FORMAT_DXT) /* decoded to A8R8G8B8 */
+        return TRUE;
+    if (format->type != FORMAT_ARGB && format->type != FORMAT_INDEX)
+        return FALSE;
+    for (c = 0; c < 4; ++c)
+        if (format->bits[c] > 8)
+            return FALSE;
+    return TRUE;
+}
+
+/* the pixels change even without filtering */
+static inline BOOL is_srgb_conversion(DWORD filter)
+{
+    return !(filter & D3DX_FILTER_SRGB_IN) != !(filter & D3DX_FILTER_SRGB_OUT);
+}
+
+const struct pixel_format_desc *get_format_info(D3DFORMAT format);
+const struct pixel_format_desc *get_format_table(UINT *count);
+void set_conversion_features(DWORD features);
+
+void format_to_vec4(const struct pixel_format_desc *format, const BYTE *src, struct vec4 *dst);
+void format_from_vec4(const struct pixel_format_desc *format, const struct vec4 *src, BYTE *dst);
+void init_conversion_plan(const struct pixel_format_desc *src_format, const struct pixel_format_desc *dst_format,
+                          D3DCOLOR color_key, const PALETTEENTRY *palette, struct conversion_plan *plan);
+dxt_decode_func get_dxt_decode_func(D3DFORMAT format);
+
+UINT get_row_band_worker_count();
+void run_row_bands(UINT row_count, UINT row_bytes, const row_band_func &func);
+
+void copy_pixels(const BYTE *src, UINT src_row_pitch, UINT src_slice_pitch,
+                 BYTE *dst, UINT dst_row_pitch, UINT dst_slice_pitch, const struct volume *size,
+                 const struct pixel_format_desc *format);
+HRESULT convert_argb_pixels(const BYTE *src, UINT src_row_pitch, UINT src_slice_pitch, const struct volume *src_size,
+                            BYTE *dst, UINT dst_row_pitch, UINT dst_slice_pitch, const struct volume *dst_size,
+                            const struct conversion_plan *plan);
+HRESULT point_filter_argb_pixels(const BYTE *src, UINT src_row_pitch, UINT src_slice_pitch, const struct volume *src_size,
+                                 BYTE *dst, UINT dst_row_pitch, UINT dst_slice_pitch, const struct volume *dst_size,
+                                 const struct conversion_plan *plan);
+HRESULT resample_argb_pixels(const BYTE *src, UINT src_row_pitch, UINT src_slice_pitch, const struct volume *src_size,
+                             BYTE *dst, UINT dst_row_pitch, UINT dst_slice_pitch, const struct volume *dst_size,
+                             const struct conversion_plan *to_argb, const struct conversion_plan *from_argb, DWORD filter);
+void compress_dxt_pixels(DWORD *src, UINT src_pitch, UINT width, UINT height,
+                         BYTE *dst, UINT dst_pitch, const struct pixel_format_desc *format, BOOL fast);
+
+#endif // __pixel_conversion__